@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+const char* const archiveColumnNames[ARCHIVE_COLUMNS] = {
+        "timestamp",
+        "tariff",
+        "meter_delivered_t1",
+        "meter_delivered_t2",
+        "meter_injected_t1",
+        "meter_injected_t2",
+        "sum_power_delivered",
+        "sum_power_injected",
+        "power_p1_delivered",
+        "power_p2_delivered",
+        "power_p3_delivered",
+        "power_p1_injected",
+        "power_p2_injected",
+        "power_p3_injected",
+        "voltage_p1",
+        "voltage_p2",
+        "voltage_p3",
+        "current_p1",
+        "current_p2",
+        "current_p3",
+        "gas_volume",
+};
+
+// Worst case varint is 5 bytes (32 bit zig-zag deltas never need more).
+#define VARINT_MAX 5
+
+struct ArchiveWriter {
+    FILE* fp;
+    uint32_t rows;
+    uint32_t values[ARCHIVE_COLUMNS][ARCHIVE_BLOCK_ROWS];
+    uint8_t present[ARCHIVE_COLUMNS][ARCHIVE_BLOCK_ROWS / 8];
+    uint8_t buffer[ARCHIVE_COLUMNS * (ARCHIVE_BLOCK_ROWS / 8 + ARCHIVE_BLOCK_ROWS * VARINT_MAX)];
+};
+
+static inline uint32_t zigzag(const int32_t v) {
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static inline int32_t unzigzag(const uint32_t v) {
+    return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+static inline uint8_t* putVarint(uint8_t* out, uint32_t v) {
+    while (v >= 0x80) {
+        *out++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *out++ = v;
+    return out;
+}
+
+/**
+ * @return The byte after the varint, NULL if it runs past end or is longer than 5 bytes.
+ */
+static inline const uint8_t* getVarint(const uint8_t* in, const uint8_t* const end, uint32_t* v) {
+    uint32_t result = 0;
+    uint8_t shift = 0;
+    uint8_t b;
+    do {
+        if (in == end || shift > 28) return NULL;
+        b = *in++;
+        result |= (uint32_t) (b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *v = result;
+    return in;
+}
+
+/**
+ * Check the header of an existing archive, and find the end of its last complete block.
+ * @return false if it's not an archive of this version.
+ */
+static bool archiveEnd(const int fd, const uint64_t size, uint64_t* const end) {
+    ArchiveFileHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != ARCHIVE_MAGIC
+        || header.version != ARCHIVE_VERSION || header.columns != ARCHIVE_COLUMNS) return false;
+
+    // The same checks as archiveNextBlock: the reader stops at the first block that fails them.
+    uint64_t offset = sizeof(ArchiveFileHeader);
+    ArchiveBlockHeader block;
+    while (offset + sizeof(block) <= size && pread(fd, &block, sizeof(block), offset) == sizeof(block)) {
+        if (block.magic != ARCHIVE_BLOCK_MAGIC || block.rows > ARCHIVE_BLOCK_ROWS) break;
+        if (offset + sizeof(block) + block.size > size) break;
+        offset += sizeof(block) + block.size;
+    }
+    *end = offset;
+    return true;
+}
+
+ArchiveWriter* archiveOpenWriter(const char* const path) {
+    ArchiveWriter* writer = calloc(1, sizeof(ArchiveWriter));
+    if (writer == NULL) return NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        free(writer);
+        return NULL;
+    }
+    uint64_t end = 0;
+    if (st.st_size != 0 && (!archiveEnd(fd, st.st_size, &end)
+                            || (end != (uint64_t) st.st_size && ftruncate(fd, end) != 0))) {
+        close(fd);
+        free(writer);
+        return NULL;
+    }
+    writer->fp = fdopen(fd, "ab");
+    if (writer->fp == NULL) {
+        close(fd);
+        free(writer);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        ArchiveFileHeader header = {
+                .magic = ARCHIVE_MAGIC,
+                .version = ARCHIVE_VERSION,
+                .columns = ARCHIVE_COLUMNS,
+        };
+        if (fwrite(&header, sizeof(header), 1, writer->fp) != 1) {
+            fclose(writer->fp);
+            free(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+static bool flushBlock(ArchiveWriter* const writer) {
+    if (writer->rows == 0) return true;
+
+    ArchiveBlockHeader header = {
+            .magic = ARCHIVE_BLOCK_MAGIC,
+            .rows = writer->rows,
+    };
+    const uint32_t bitmapSize = (writer->rows + 7) / 8;
+    uint8_t* out = writer->buffer;
+
+    for (uint8_t c = 0; c < ARCHIVE_COLUMNS; c++) {
+        ArchiveColumnHeader* column = &header.columns[c];
+        uint8_t* start = out;
+        column->offset = start - writer->buffer;
+        column->min = UINT32_MAX;
+        column->max = 0;
+
+        memcpy(out, writer->present[c], bitmapSize);
+        out += bitmapSize;
+
+        // Deltas wrap around (uint32_t), they are only reinterpreted as signed for the zig-zag.
+        uint32_t previous = 0;
+        uint32_t previousDelta = 0;
+        for (uint32_t row = 0; row < writer->rows; row++) {
+            if (!(writer->present[c][row / 8] & (1 << (row % 8)))) continue;
+            uint32_t value = writer->values[c][row];
+            uint32_t delta = value - previous;
+            if (c == ARCHIVE_TIMESTAMP && column->count != 0) {
+                // 1 Hz data: delta is nearly always the same, so the delta of that is nearly always 0.
+                out = putVarint(out, zigzag((int32_t) (delta - previousDelta)));
+            } else {
+                out = putVarint(out, zigzag((int32_t) delta));
+            }
+            previous = value;
+            previousDelta = column->count == 0 ? 0 : delta;
+            column->count++;
+            if (value < column->min) column->min = value;
+            if (value > column->max) column->max = value;
+        }
+        column->size = out - start;
+    }
+    header.size = out - writer->buffer;
+
+    writer->rows = 0;
+    memset(writer->present, 0, sizeof(writer->present));
+
+    if (fwrite(&header, sizeof(header), 1, writer->fp) != 1) return false;
+    if (fwrite(writer->buffer, 1, header.size, writer->fp) != header.size) return false;
+    return true;
+}
+
+bool archiveAppend(ArchiveWriter* const writer, const Packet* const p) {
+    const uint32_t row = writer->rows;
+    for (uint8_t c = 0; c < FIELD_COUNT; c++) {
+        if (packetField(p, c, &writer->values[c][row])) {
+            writer->present[c][row / 8] |= 1 << (row % 8);
+        }
+    }
+    if (p->gas_volume != 0xFFFFFFFF) {
+        writer->values[ARCHIVE_GAS_VOLUME][row] = p->gas_volume;
+        writer->present[ARCHIVE_GAS_VOLUME][row / 8] |= 1 << (row % 8);
+    }
+    writer->rows++;
+    if (writer->rows == ARCHIVE_BLOCK_ROWS) return flushBlock(writer);
+    return true;
+}
+
+bool archiveCloseWriter(ArchiveWriter* const writer) {
+    bool ok = flushBlock(writer);
+    ok = fclose(writer->fp) == 0 && ok;
+    free(writer);
+    return ok;
+}
+
+bool archiveOpenReader(ArchiveReader* const reader, const char* const path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ArchiveFileHeader)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    const ArchiveFileHeader* header = data;
+    if (header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION || header->columns != ARCHIVE_COLUMNS) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    reader->data = data;
+    reader->size = st.st_size;
+    return true;
+}
+
+void archiveCloseReader(ArchiveReader* const reader) {
+    munmap((void*) reader->data, reader->size);
+    reader->data = NULL;
+    reader->size = 0;
+}
+
+const ArchiveBlockHeader* archiveNextBlock(const ArchiveReader* const reader, size_t* const offset) {
+    if (*offset == 0) *offset = sizeof(ArchiveFileHeader);
+    if (*offset + sizeof(ArchiveBlockHeader) > reader->size) return NULL;
+
+    const ArchiveBlockHeader* block = (const ArchiveBlockHeader*) (reader->data + *offset);
+    if (block->magic != ARCHIVE_BLOCK_MAGIC || block->rows > ARCHIVE_BLOCK_ROWS) return NULL;
+    if (*offset + sizeof(ArchiveBlockHeader) + block->size > reader->size) return NULL;
+
+    *offset += sizeof(ArchiveBlockHeader) + block->size;
+    return block;
+}
+
+int32_t archiveDecodeColumn(const ArchiveBlockHeader* const block, const uint8_t column, uint32_t* const values) {
+    if (column >= ARCHIVE_COLUMNS || block->rows > ARCHIVE_BLOCK_ROWS) return -1;
+    const ArchiveColumnHeader* header = &block->columns[column];
+    const uint32_t bitmapSize = (block->rows + 7) / 8;
+    if ((uint64_t) header->offset + header->size > block->size || header->size < bitmapSize) return -1;
+    const uint8_t* bitmap = (const uint8_t*) (block + 1) + header->offset;
+    const uint8_t* in = bitmap + bitmapSize;
+    const uint8_t* end = bitmap + header->size;
+
+    // As in flushBlock: the sums wrap around, a corrupt block can't overflow a signed int.
+    uint32_t previous = 0;
+    uint32_t previousDelta = 0;
+    uint32_t count = 0;
+    for (uint32_t row = 0; row < block->rows; row++) {
+        if (!(bitmap[row / 8] & (1 << (row % 8)))) {
+            values[row] = 0xFFFFFFFF;
+            continue;
+        }
+        uint32_t v;
+        in = getVarint(in, end, &v);
+        if (in == NULL) return -1;
+        uint32_t delta = (uint32_t) unzigzag(v);
+        if (column == ARCHIVE_TIMESTAMP && count != 0) {
+            delta += previousDelta;
+        }
+        previous += delta;
+        previousDelta = count == 0 ? 0 : delta;
+        values[row] = previous;
+        count++;
+    }
+    return count == header->count ? (int32_t) count : -1;
+}
+
+int archiveColumn(const char* const name) {
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+        if (strcmp(archiveColumnNames[c], name) == 0) return c;
+    }
+    return -1;
+}
@@ -0,0 +1,118 @@
+#ifndef FIRMWARE_ARCHIVE_H
+#define FIRMWARE_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+/**
+ * Append-only columnar archive of decoded telegrams. Host only.
+ *
+ * File layout (all little endian):
+ *  ArchiveFileHeader
+ *  Blocks, each:
+ *   ArchiveBlockHeader
+ *   For every column, at ArchiveColumnHeader.offset (relative to the end of the block header):
+ *    presence bitmap, (rows + 7) / 8 bytes, bit i = row i has a value.
+ *    zig-zag varint deltas of the present values.
+ *    For ARCHIVE_TIMESTAMP the deltas are delta-of-delta.
+ *
+ * Every column can be read without touching the others, and the min/max in the block header lets
+ * queries skip entire blocks.
+ */
+
+#define ARCHIVE_MAGIC 0x31413150 // "P1A1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BLOCK_MAGIC 0x314B4C42 // "BLK1"
+#define ARCHIVE_BLOCK_ROWS 4096
+
+/**
+ * Columns are the packet fields, plus the gas volume.
+ */
+#define ARCHIVE_TIMESTAMP FIELD_TIMESTAMP
+#define ARCHIVE_GAS_VOLUME FIELD_COUNT
+#define ARCHIVE_COLUMNS (FIELD_COUNT + 1)
+
+extern const char* const archiveColumnNames[ARCHIVE_COLUMNS];
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t columns;
+} ArchiveFileHeader;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t count; // Nr of present values
+    uint32_t min;
+    uint32_t max;
+} ArchiveColumnHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t size; // Payload size, excluding this header.
+    uint32_t reserved;
+    ArchiveColumnHeader columns[ARCHIVE_COLUMNS];
+} ArchiveBlockHeader;
+
+typedef struct ArchiveWriter ArchiveWriter;
+
+/**
+ * Open an archive for appending, create it if it does not exist yet.
+ * An existing file must have the same magic, version and columns. A partial block at the end (the writer crashed
+ * while flushing) is cut off, so the new blocks follow the last complete one.
+ * @return NULL on error, or if the file is not an archive of this version.
+ */
+ArchiveWriter* archiveOpenWriter(const char* path);
+
+/**
+ * Append one telegram. Fields that are all 0xFF are stored as not present.
+ * @return false on write error.
+ */
+bool archiveAppend(ArchiveWriter* writer, const Packet* p);
+
+/**
+ * Flush the last (partial) block and close.
+ * @return false on write error.
+ */
+bool archiveCloseWriter(ArchiveWriter* writer);
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+} ArchiveReader;
+
+/**
+ * Memory map an archive.
+ * @return false on error or if the file is not an archive.
+ */
+bool archiveOpenReader(ArchiveReader* reader, const char* path);
+
+void archiveCloseReader(ArchiveReader* reader);
+
+/**
+ * Iterate over the blocks. Start with *offset = 0.
+ * @return The next block, or NULL at the end (or if the file is truncated, or the block has too many rows).
+ */
+const ArchiveBlockHeader* archiveNextBlock(const ArchiveReader* reader, size_t* offset);
+
+/**
+ * Decode a single column of a block. Offsets, sizes and varints are checked against the block.
+ * @param block The block.
+ * @param column Column index.
+ * @param values Output, block->rows slots. Rows without a value are set to 0xFFFFFFFF.
+ * @return the nr of rows that had a value, -1 if the column is corrupt (values is then partly filled).
+ */
+int32_t archiveDecodeColumn(const ArchiveBlockHeader* block, uint8_t column, uint32_t* values);
+
+/**
+ * Find a column by name.
+ * @return column index or -1.
+ */
+int archiveColumn(const char* name);
+
+#endif //FIRMWARE_ARCHIVE_H
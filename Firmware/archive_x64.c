@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "crc.h"
+#include "archive.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Decode a raw capture and append every telegram with a timestamp to the archive.
+ * Telegrams with a CRC mismatch are skipped, unless keepBadCrc.
+ */
+static void convert(const char *in, const char *out, const bool keepBadCrc) {
+    FILE *fp = fopen(in, "r");
+    if (fp == NULL) error("Failed to open capture.");
+    ArchiveWriter *writer = archiveOpenWriter(out);
+    if (writer == NULL) error("Failed to open archive.");
+
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    uint16_t crc = 0;
+    uint32_t telegrams = 0, badCrc = 0, kept = 0;
+
+    resetPacket();
+    while ((read = getline(&line, &len, fp)) != -1) {
+        if (line[0] == '/') {
+            resetPacket();
+            crc = 0;
+        }
+        crc = crc16(crc, line, line[0] != '!' ? read : 1);
+        parseLine(read, line);
+        if (line[0] == '!') {
+            bool crcOk = strtol(line + 1, NULL, 16) == crc;
+            if (!crcOk) badCrc++;
+            if (packet.timestamp != 0xFFFFFFFF && (crcOk || keepBadCrc)) {
+                if (!archiveAppend(writer, &packet)) error("Failed to write archive.");
+                telegrams++;
+                if (!crcOk) kept++;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (!archiveCloseWriter(writer)) error("Failed to write archive.");
+    printf("Appended %u telegrams (%u with CRC mismatch), skipped %u with CRC mismatch.\n", telegrams, kept, badCrc - kept);
+}
+
+static void info(const char *path) {
+    ArchiveReader reader;
+    if (!archiveOpenReader(&reader, path)) error("Failed to open archive.");
+
+    uint64_t rows = 0, blocks = 0;
+    uint64_t bytes[ARCHIVE_COLUMNS] = {0};
+    size_t offset = 0;
+    const ArchiveBlockHeader *block;
+    while ((block = archiveNextBlock(&reader, &offset)) != NULL) {
+        blocks++;
+        rows += block->rows;
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++) bytes[c] += block->columns[c].size;
+    }
+    printf("%zu bytes, %lu blocks, %lu rows, %.1f bytes/row\n", reader.size, blocks, rows, rows ? (double) reader.size / rows : 0);
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+        printf("  %-20s %10lu bytes\n", archiveColumnNames[c], bytes[c]);
+    }
+    archiveCloseReader(&reader);
+}
+
+/**
+ * Count/min/max/sum of a single column, without decoding any of the others.
+ */
+static void scan(const char *path, const char *name) {
+    int column = archiveColumn(name);
+    if (column < 0) error("Unknown column.");
+    ArchiveReader reader;
+    if (!archiveOpenReader(&reader, path)) error("Failed to open archive.");
+
+    static uint32_t values[ARCHIVE_BLOCK_ROWS];
+    uint64_t count = 0, sum = 0;
+    uint32_t min = UINT32_MAX, max = 0;
+    size_t offset = 0;
+    const ArchiveBlockHeader *block;
+    double start = now();
+    while ((block = archiveNextBlock(&reader, &offset)) != NULL) {
+        if (block->columns[column].count == 0) continue;
+        if (archiveDecodeColumn(block, column, values) < 0) error("Corrupt archive.");
+        for (uint32_t row = 0; row < block->rows; row++) {
+            if (values[row] == 0xFFFFFFFF) continue;
+            count++;
+            sum += values[row];
+            if (values[row] < min) min = values[row];
+            if (values[row] > max) max = values[row];
+        }
+    }
+    double elapsed = now() - start;
+    printf("%s: count=%lu min=%u max=%u mean=%.3f (%.3f s, %.1f Mrows/s)\n", name, count, min, max,
+           count ? (double) sum / count : 0, elapsed, count / elapsed / 1e6);
+    archiveCloseReader(&reader);
+}
+
+int main(int argc, char **argv) {
+    if ((argc == 4 || (argc == 5 && strcmp(argv[4], "-k") == 0)) && strcmp(argv[1], "convert") == 0) {
+        convert(argv[2], argv[3], argc == 5);
+    } else if (argc == 3 && strcmp(argv[1], "info") == 0) {
+        info(argv[2]);
+    } else if (argc == 4 && strcmp(argv[1], "scan") == 0) {
+        scan(argv[2], argv[3]);
+    } else {
+        error("Usage: archive_x64 convert <capture.txt> <archive.p1a> [-k keep telegrams with a CRC mismatch]\n"
+              "       archive_x64 info <archive.p1a>\n"
+              "       archive_x64 scan <archive.p1a> <column>");
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "crc.h"
+
+/**
+ * Host benchmark of the parser, the CRC variants and the full decode of a capture.
+ * Prints one JSON object per line, so results can be kept and compared between versions.
+ */
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    const char *name;
+    char *data;
+    size_t size;
+} Input;
+
+typedef uint16_t (*CrcFunction)(uint16_t crc, const char *buf, int len);
+
+static const struct {
+    const char *name;
+    CrcFunction function;
+} crcVariants[] = {
+        {"crc16",       crc16},
+        {"crc16Nibble", crc16Nibble},
+        {"crc16Table",  crc16Table},
+};
+
+static double minTime = 0.5;
+static volatile uint32_t sink;
+
+static bool readFile(const char *path, Input *input) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    fseek(fp, 0, SEEK_END);
+    input->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    input->data = malloc(input->size + 1);
+    bool ok = input->data != NULL && fread(input->data, 1, input->size, fp) == input->size;
+    fclose(fp);
+    const char *slash = strrchr(path, '/');
+    input->name = slash ? slash + 1 : path;
+    return ok;
+}
+
+/**
+ * A 3 phase eMUCs meter with a gas meter, like extra/p1_simulator.py synth, with a valid CRC.
+ * Power changes every telegram, so the line cache only helps for the lines that also don't change on a real meter.
+ */
+static void synthCapture(Input *input, unsigned telegrams) {
+    size_t capacity = (size_t) telegrams * 1024;
+    char *out = malloc(capacity);
+    if (out == NULL) error("Out of memory.");
+    size_t size = 0;
+    uint32_t seed = 1;
+    int32_t phases[3] = {300, 200, 100};
+    double registers[2] = {2784374, 350978};
+    struct tm tm = {.tm_year = 121, .tm_mon = 3, .tm_mday = 25, .tm_hour = 17, .tm_isdst = -1};
+    time_t t = mktime(&tm);
+
+    for (unsigned n = 0; n < telegrams; n++, t++) {
+        int32_t delivered = 0, injected = 0;
+        for (int i = 0; i < 3; i++) {
+            seed = seed * 1103515245 + 12345;
+            phases[i] += (int32_t) ((seed >> 16) % 61) - 30 + (200 - phases[i]) / 20;
+            if (phases[i] > 0) delivered += phases[i]; else injected -= phases[i];
+        }
+        registers[0] += delivered / 3600.0;
+        registers[1] += injected / 3600.0;
+        // The gas meter reports every 5 minutes.
+        char stamp[16], gasStamp[16];
+        time_t gasTime = t - t % 300;
+        struct tm *local = localtime(&t);
+        strftime(stamp, sizeof(stamp), "%y%m%d%H%M%S", local);
+        strcat(stamp, local->tm_isdst > 0 ? "S" : "W");
+        local = localtime(&gasTime);
+        strftime(gasStamp, sizeof(gasStamp), "%y%m%d%H%M%S", local);
+        strcat(gasStamp, local->tm_isdst > 0 ? "S" : "W");
+
+        char *start = out + size;
+        int len = snprintf(start, capacity - size,
+                           "/FLU5\\253770234_A\r\n\r\n"
+                           "0-0:96.1.4(50215)\r\n"
+                           "0-0:96.1.1(3153414731313030303936313936)\r\n"
+                           "0-0:1.0.0(%s)\r\n"
+                           "1-0:1.8.1(%010.3f*kWh)\r\n"
+                           "1-0:1.8.2(003270.063*kWh)\r\n"
+                           "1-0:2.8.1(%010.3f*kWh)\r\n"
+                           "1-0:2.8.2(000158.131*kWh)\r\n"
+                           "0-0:96.14.0(0001)\r\n"
+                           "1-0:1.7.0(%06.3f*kW)\r\n"
+                           "1-0:2.7.0(%06.3f*kW)\r\n"
+                           "1-0:21.7.0(%06.3f*kW)\r\n"
+                           "1-0:41.7.0(%06.3f*kW)\r\n"
+                           "1-0:61.7.0(%06.3f*kW)\r\n"
+                           "1-0:22.7.0(%06.3f*kW)\r\n"
+                           "1-0:42.7.0(%06.3f*kW)\r\n"
+                           "1-0:62.7.0(%06.3f*kW)\r\n"
+                           "1-0:32.7.0(%05.1f*V)\r\n"
+                           "1-0:52.7.0(%05.1f*V)\r\n"
+                           "1-0:72.7.0(%05.1f*V)\r\n"
+                           "1-0:31.7.0(%06.2f*A)\r\n"
+                           "1-0:51.7.0(%06.2f*A)\r\n"
+                           "1-0:71.7.0(%06.2f*A)\r\n"
+                           "0-0:96.3.10(1)\r\n"
+                           "0-0:17.0.0(999.9*kW)\r\n"
+                           "1-0:31.4.0(999*A)\r\n"
+                           "0-0:96.13.0()\r\n"
+                           "0-1:24.1.0(003)\r\n"
+                           "0-1:96.1.1(37464C4F32313139303333373333)\r\n"
+                           "0-1:24.4.0(1)\r\n"
+                           "0-1:24.2.3(%s)(01234.567*m3)\r\n"
+                           "!",
+                           stamp, registers[0] / 1000, registers[1] / 1000, delivered / 1000.0, injected / 1000.0,
+                           (phases[0] > 0 ? phases[0] : 0) / 1000.0, (phases[1] > 0 ? phases[1] : 0) / 1000.0,
+                           (phases[2] > 0 ? phases[2] : 0) / 1000.0, (phases[0] < 0 ? -phases[0] : 0) / 1000.0,
+                           (phases[1] < 0 ? -phases[1] : 0) / 1000.0, (phases[2] < 0 ? -phases[2] : 0) / 1000.0,
+                           230 - phases[0] / 1000.0, 230 - phases[1] / 1000.0, 230 - phases[2] / 1000.0,
+                           abs(phases[0]) / 230.0, abs(phases[1]) / 230.0, abs(phases[2]) / 230.0, gasStamp);
+        size += len;
+        size += snprintf(out + size, capacity - size, "%04X\r\n", crc16(0, start, len));
+    }
+    input->name = "synthetic";
+    input->data = out;
+    input->size = size;
+}
+
+static inline const char *nextLine(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl + 1;
+}
+
+/**
+ * parseLine on every line, as the firmware calls it.
+ */
+static void benchParse(const Input *input) {
+    Packet p;
+    MBusSlot mbus[MBUS_CHANNELS];
+    ParserContext ctx;
+    initParser(&ctx, &p, mbus);
+    const char *end = input->data + input->size;
+
+    uint64_t lines = 0, matched = 0;
+    double start = now(), elapsed;
+    do {
+        for (const char *line = input->data, *next; line < end; line = next) {
+            next = nextLine(line, end);
+            if (*line == '/') resetParser(&ctx);
+            matched += parseLineWith(&ctx, next - line, line);
+            lines++;
+        }
+        sink += p.timestamp;
+    } while ((elapsed = now() - start) < minTime);
+
+    printf("{\"bench\": \"parseLine\", \"input\": \"%s\", \"lines\": %lu, \"matched\": %lu, \"ns_per_line\": %.2f}\n",
+           input->name, lines, matched, elapsed / lines * 1e9);
+}
+
+static void benchCrc(const Input *input) {
+    uint16_t expected = crc16(0, input->data, input->size);
+    for (size_t v = 0; v < sizeof(crcVariants) / sizeof(crcVariants[0]); v++) {
+        uint64_t bytes = 0;
+        uint16_t crc = 0;
+        double start = now(), elapsed;
+        do {
+            crc = crcVariants[v].function(0, input->data, input->size);
+            bytes += input->size;
+        } while ((elapsed = now() - start) < minTime);
+        sink += crc;
+
+        printf("{\"bench\": \"%s\", \"input\": \"%s\", \"bytes\": %lu, \"bytes_per_ns\": %.3f, \"match\": %s}\n",
+               crcVariants[v].name, input->name, bytes, bytes / elapsed * 1e-9, crc == expected ? "true" : "false");
+    }
+}
+
+/**
+ * Lines, CRC and parser: what the firmware does per telegram, minus the UART.
+ */
+static void benchDecode(const Input *input, const CrcFunction crcFunction, const char *crcName) {
+    Packet p;
+    MBusSlot mbus[MBUS_CHANNELS];
+    ParserContext ctx;
+    initParser(&ctx, &p, mbus);
+    const char *end = input->data + input->size;
+
+    uint64_t telegrams = 0, crcErrors = 0, passes = 0;
+    double start = now(), elapsed;
+    do {
+        uint16_t crc = 0;
+        for (const char *line = input->data, *next; line < end; line = next) {
+            next = nextLine(line, end);
+            if (*line == '/') {
+                crc = 0;
+                resetParser(&ctx);
+            }
+            if (*line == '!') {
+                crc = crcFunction(crc, line, 1);
+                if (strtol(line + 1, NULL, 16) != crc) crcErrors++;
+                telegrams++;
+                sink += p.timestamp;
+            } else {
+                crc = crcFunction(crc, line, next - line);
+                parseLineWith(&ctx, next - line, line);
+            }
+        }
+        passes++;
+    } while ((elapsed = now() - start) < minTime);
+
+    printf("{\"bench\": \"decode\", \"crc\": \"%s\", \"input\": \"%s\", \"telegrams\": %lu, \"crc_errors\": %lu, "
+           "\"telegrams_per_second\": %.0f, \"mb_per_second\": %.1f}\n",
+           crcName, input->name, telegrams, crcErrors / passes, telegrams / elapsed, input->size * passes / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    unsigned synthetic = 20000;
+    Input *inputs = calloc(argc + 1, sizeof(Input));
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) minTime = atof(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) synthetic = atoi(argv[++i]);
+        else if (argv[i][0] == '-') {
+            error("Usage: bench_x64 [-t seconds per bench] [-n synthetic telegrams] [capture.txt...]\n"
+                  "  Prints one JSON object per result.");
+        } else if (!readFile(argv[i], &inputs[count++])) {
+            error("Failed to read capture.");
+        }
+    }
+    if (synthetic) synthCapture(&inputs[count++], synthetic);
+
+    printf("{\"bench\": \"info\", \"compiler\": \"%s\", \"line_cache\": %d, \"min_time\": %.3f}\n",
+           __VERSION__, LINE_CACHE, minTime);
+    for (int i = 0; i < count; i++) {
+        benchParse(&inputs[i]);
+        benchCrc(&inputs[i]);
+        benchDecode(&inputs[i], crc16, "crc16");
+        benchDecode(&inputs[i], crc16Table, "crc16Table");
+        free(inputs[i].data);
+    }
+    free(inputs);
+    return 0;
+}
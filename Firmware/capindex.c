@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capindex.h"
+#include "crc.h"
+
+typedef struct {
+    const char* data;
+    size_t size;
+} MappedFile;
+
+static bool mapFile(MappedFile* const file, const char* const path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    file->size = st.st_size;
+    file->data = NULL;
+    if (file->size != 0) {
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = data;
+    }
+    close(fd);
+    return true;
+}
+
+static void unmapFile(MappedFile* const file) {
+    if (file->data != NULL) munmap((void*) file->data, file->size);
+}
+
+/**
+ * @return the start of the next line, or end.
+ */
+static inline const char* nextLine(const char* const p, const char* const end) {
+    const char* nl = memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl + 1;
+}
+
+/**
+ * Decode one telegram into packet.
+ * @param p Start of the '/' header line.
+ * @param crcOk Output, if the CRC in the footer matched.
+ * @return The start of the line after the '!' footer, or NULL if the telegram is not complete.
+ */
+static const char* decodeTelegram(const char* p, const char* const end, bool* const crcOk) {
+    uint16_t crc = 0;
+    resetPacket();
+    while (p < end) {
+        const char* next = nextLine(p, end);
+        if (next == end && end[-1] != '\n') return NULL; // Telegram still being written.
+        size_t len = next - p;
+        if (*p == '!') {
+            crc = crc16(crc, p, 1);
+            *crcOk = strtol(p + 1, NULL, 16) == crc;
+            return next;
+        }
+        crc = crc16(crc, p, len);
+        parseLine(len > UINT16_MAX ? UINT16_MAX : len, p);
+        p = next;
+    }
+    return NULL;
+}
+
+bool capIndexBuild(const char* const capture, const char* const index, const uint32_t every) {
+    MappedFile file;
+    if (!mapFile(&file, capture)) return false;
+
+    CapIndexHeader header = {
+            .magic = CAPINDEX_MAGIC,
+            .every = every ? every : CAPINDEX_DEFAULT_EVERY,
+    };
+    FILE* fp = fopen(index, "r+b");
+    if (fp != NULL) {
+        if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CAPINDEX_MAGIC || header.resume > file.size) {
+            // Not an index, or the capture was truncated. Start over.
+            fclose(fp);
+            fp = NULL;
+            header = (CapIndexHeader) {.magic = CAPINDEX_MAGIC, .every = every ? every : CAPINDEX_DEFAULT_EVERY};
+        }
+    }
+    if (fp == NULL) {
+        fp = fopen(index, "w+b");
+        if (fp == NULL || fwrite(&header, sizeof(header), 1, fp) != 1) {
+            if (fp != NULL) fclose(fp);
+            unmapFile(&file);
+            return false;
+        }
+    }
+    fseek(fp, 0, SEEK_END);
+
+    const char* const end = file.data + file.size;
+    const char* p = file.data + header.resume;
+    const char* start = NULL;
+    bool sampled = false;
+    bool ok = true;
+
+    // Only the timestamp of sampled telegrams is decoded, everything else is skipped line by line.
+    while (p < end) {
+        const char* next = nextLine(p, end);
+        if (next == end && end[-1] != '\n') break; // Line still being written.
+        if (*p == '/') {
+            start = p;
+            sampled = header.telegrams % header.every == 0;
+        } else if (start != NULL && *p == '!') {
+            header.telegrams++;
+            header.resume = next - file.data;
+            start = NULL;
+        } else if (start != NULL && sampled && strncmp(p, TIMESTAMP, strlen(TIMESTAMP)) == 0) {
+            resetPacket();
+            if (parseLine(next - p, p)) {
+                CapIndexEntry entry = {
+                        .timestamp = packet.timestamp,
+                        .offset = start - file.data,
+                };
+                if (fwrite(&entry, sizeof(entry), 1, fp) != 1) {
+                    ok = false;
+                    break;
+                }
+            }
+            sampled = false;
+        }
+        p = next;
+    }
+    // Entries of a telegram that was not complete yet are written again on the next build.
+    if (ok && start != NULL) {
+        long entries = (ftell(fp) - (long) sizeof(header)) / sizeof(CapIndexEntry);
+        CapIndexEntry last;
+        if (entries > 0 && fseek(fp, -(long) sizeof(last), SEEK_END) == 0 && fread(&last, sizeof(last), 1, fp) == 1
+            && last.offset == (uint64_t) (start - file.data)) {
+            ok = ftruncate(fileno(fp), ftell(fp) - sizeof(last)) == 0;
+        }
+    }
+
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    unmapFile(&file);
+    return ok;
+}
+
+int64_t capIndexRead(const char* const capture, const char* const index, const uint32_t from, const uint32_t to,
+                     const CapIndexCallback callback, void* const ctx) {
+    MappedFile file, idx;
+    if (!mapFile(&file, capture)) return -1;
+    if (!mapFile(&idx, index) || idx.size < sizeof(CapIndexHeader)) {
+        unmapFile(&file);
+        return -1;
+    }
+    madvise((void*) idx.data, idx.size, MADV_RANDOM);
+    madvise((void*) file.data, file.size, MADV_NORMAL);
+
+    // Binary search for the last entry with timestamp < from: an entry with timestamp == from can have telegrams with the
+    // same timestamp before it (duplicates, the clock stepping back), the scan has to start before those.
+    const CapIndexEntry* entries = (const CapIndexEntry*) (idx.data + sizeof(CapIndexHeader));
+    size_t lo = 0, hi = (idx.size - sizeof(CapIndexHeader)) / sizeof(CapIndexEntry);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].timestamp < from) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t offset = lo == 0 ? 0 : entries[lo - 1].offset;
+
+    const char* const end = file.data + file.size;
+    const char* p = file.data + offset;
+    int64_t count = 0;
+    while (p < end) {
+        if (*p != '/') {
+            p = nextLine(p, end);
+            continue;
+        }
+        bool crcOk;
+        const char* next = decodeTelegram(p, end, &crcOk);
+        if (next == NULL) break;
+        if (packet.timestamp != 0xFFFFFFFF) {
+            if (packet.timestamp > to) break;
+            if (packet.timestamp >= from) {
+                count++;
+                if (!callback(&packet, p - file.data, crcOk, ctx)) break;
+            }
+        }
+        p = next;
+    }
+
+    unmapFile(&idx);
+    unmapFile(&file);
+    return count;
+}
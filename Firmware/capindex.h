@@ -0,0 +1,66 @@
+#ifndef FIRMWARE_CAPINDEX_H
+#define FIRMWARE_CAPINDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packet.h"
+
+/**
+ * Sidecar time index for raw P1 captures (the text as it comes out of the meter, like Testing/log.txt). Host only.
+ *
+ * Every `every` telegrams, the 0-0:1.0.0 timestamp and the byte offset of the '/' header line are stored.
+ * The index can be updated incrementally while the capture is still growing:
+ * building again only scans what was appended since the last time.
+ *
+ * File layout: CapIndexHeader, then CapIndexEntry[], sorted by timestamp.
+ */
+
+#define CAPINDEX_MAGIC 0x31584449 // "IDX1"
+#define CAPINDEX_DEFAULT_EVERY 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t every;
+    /**
+     * Nr of complete telegrams scanned.
+     */
+    uint64_t telegrams;
+    /**
+     * Offset of the first byte that was not part of a complete telegram, building resumes here.
+     */
+    uint64_t resume;
+} CapIndexHeader;
+
+typedef struct {
+    uint32_t timestamp;
+    uint32_t reserved;
+    uint64_t offset;
+} CapIndexEntry;
+
+/**
+ * Create or update the index of a capture.
+ * @param capture Path to the raw capture.
+ * @param index Path to the index, usually capture + ".idx".
+ * @param every Sample rate, ignored if the index already exists.
+ * @return false on IO error.
+ */
+bool capIndexBuild(const char* capture, const char* index, uint32_t every);
+
+/**
+ * Called for every decoded telegram, packet holds the decoded values.
+ * @param offset Offset of the '/' line of this telegram in the capture.
+ * @param crcOk If the CRC in the footer matched.
+ * @return false to stop reading.
+ */
+typedef bool (*CapIndexCallback)(const Packet* p, uint64_t offset, bool crcOk, void* ctx);
+
+/**
+ * Decode all telegrams with from <= timestamp <= to.
+ * Binary searches the index, so only the telegrams between the nearest index entry and to are parsed.
+ *
+ * @return nr of telegrams passed to the callback, or -1 on error.
+ */
+int64_t capIndexRead(const char* capture, const char* index, uint32_t from, uint32_t to, CapIndexCallback callback, void* ctx);
+
+#endif //FIRMWARE_CAPINDEX_H
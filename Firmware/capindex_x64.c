@@ -0,0 +1,61 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "capindex.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Seconds since epoch, or local time as YYYY-MM-DDThh:mm:ss (same as the meter's timestamps).
+ */
+static uint32_t parseTime(const char *s) {
+    struct tm tm = {0};
+    if (strptime(s, "%Y-%m-%dT%H:%M:%S", &tm) != NULL) {
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+    return strtoul(s, NULL, 10);
+}
+
+static bool printTelegram(const Packet *p, uint64_t offset, bool crcOk, void *ctx) {
+    (void) ctx;
+    time_t timestamp = p->timestamp;
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", localtime(&timestamp));
+    printf("%s @%lu: +%uW -%uW T1 %uWh T2 %uWh%s\n", buffer, offset, p->sum_power_delivered, p->sum_power_injected,
+           p->meter_delivered_t1, p->meter_delivered_t2, crcOk ? "" : " (CRC mismatch)");
+    return true;
+}
+
+int main(int argc, char **argv) {
+    char index[4096];
+    if (argc >= 3) snprintf(index, sizeof(index), "%s.idx", argv[2]);
+
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "build") == 0) {
+        double start = now();
+        if (!capIndexBuild(argv[2], index, argc == 4 ? atoi(argv[3]) : CAPINDEX_DEFAULT_EVERY)) error("Failed to build index.");
+        printf("Index %s updated in %.3f s\n", index, now() - start);
+    } else if (argc == 5 && strcmp(argv[1], "read") == 0) {
+        double start = now();
+        int64_t count = capIndexRead(argv[2], index, parseTime(argv[3]), parseTime(argv[4]), printTelegram, NULL);
+        if (count < 0) error("Failed to read capture or index.");
+        fprintf(stderr, "%ld telegrams in %.6f s\n", count, now() - start);
+    } else {
+        error("Usage: capindex_x64 build <capture.txt> [every]\n"
+              "       capindex_x64 read <capture.txt> <from> <to>\n"
+              "  from/to: seconds since epoch or YYYY-MM-DDThh:mm:ss (local time)");
+    }
+    return 0;
+}
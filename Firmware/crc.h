@@ -18,4 +18,17 @@
  */
 uint16_t crc16(uint16_t crc, const char *buf, int len);
 
+/**
+ * Same result as crc16, with a 16 entry table (32 bytes), 2 lookups per byte.
+ * Note: bytes are taken as unsigned, crc16 sign-extends bytes >= 0x80. The P1 telegram is ASCII.
+ */
+uint16_t crc16Nibble(uint16_t crc, const char *buf, int len);
+
+#if !defined(__AVR__)
+/**
+ * Same result as crc16Nibble, with a 256 entry table, 1 lookup per byte. Host only.
+ */
+uint16_t crc16Table(uint16_t crc, const char *buf, int len);
+#endif
+
 #endif //FIRMWARE_CRC_H
@@ -0,0 +1,307 @@
+"""
+Smart meter simulator, for load testing anything that reads a P1 port.
+
+Writes telegrams into a pty (or a real serial port with --port), either replayed from a capture or synthesised.
+    python p1_simulator.py replay ../Testing/log.txt --loop
+    python p1_simulator.py synth --speed 0 --count 100000
+Then point the receiver at the printed /dev/pts/N (or the --link symlink).
+
+Pacing:
+    --speed 1   1 telegram per second, sent at the line rate of --baud, like a real meter.
+    --speed N   N times faster (both the telegram interval and the line rate).
+    --speed 0   as fast as the receiver can take it.
+
+Faults, per telegram with --corrupt/--drop, or on demand:
+    kill -USR1 <pid>   flip a byte in the next telegram (CRC mismatch)
+    kill -USR2 <pid>   drop a line from the next telegram
+
+--sent-log writes "<meter timestamp> <unix time the telegram was sent>" for every telegram, for latency measurements.
+The rate printed at the end counts until the receiver read everything from the pty.
+"""
+
+import argparse
+import datetime
+import fcntl
+import math
+import os
+import random
+import signal
+import struct
+import sys
+import termios
+import time
+import tty
+
+import crcmod.predefined
+
+CRC16 = crcmod.predefined.mkPredefinedCrcFun('crc-16')
+
+
+def with_crc(lines):
+    """
+    Telegram from lines without line endings, from the header up to (not including) the '!' line.
+    """
+    body = b''.join(line + b'\r\n' for line in lines) + b'!'
+    return body + b'%04X\r\n' % CRC16(body)
+
+
+def meter_time(t):
+    """
+    YYMMDDhhmmssX, X = S (summer) or W (winter) time.
+    """
+    local = time.localtime(t)
+    return time.strftime('%y%m%d%H%M%S', local).encode() + (b'S' if local.tm_isdst > 0 else b'W')
+
+
+def replay(path, loop, retime):
+    """
+    Telegrams from a capture. Line endings are normalised to CRLF and the CRC is recalculated,
+    captures made on Linux often lost their CR's.
+    """
+    while True:
+        lines = None
+        start = int(time.time())
+        with open(path, 'rb') as f:
+            for raw in f:
+                line = raw.rstrip(b'\r\n')
+                if line.startswith(b'/'):
+                    lines = [line]
+                elif lines is None:
+                    continue
+                elif line.startswith(b'!'):
+                    yield lines
+                    lines = None
+                    start += 1
+                else:
+                    if retime and line.startswith(b'0-0:1.0.0('):
+                        line = b'0-0:1.0.0(' + meter_time(start) + b')'
+                    lines.append(line)
+        if not loop:
+            return
+
+
+class Synth:
+    """
+    A 3 phase eMUCs meter with a gas meter. Power is a random walk around a daily pattern,
+    the energy registers integrate the power, so values change like they do on a real meter.
+    """
+
+    def __init__(self, start, seed, meter_id):
+        self.t = start
+        self.meter_id = meter_id.encode().hex().upper().encode()
+        self.random = random.Random(seed)
+        self.registers = [2784374.0, 3270063.0, 350978.0, 158131.0]  # Wh: T1/T2 delivered, T1/T2 injected
+        self.phases = [300.0, 200.0, 100.0]  # W, negative is injection
+        self.gas = 1234567.0  # dm3
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        r = self.random
+        hour = time.localtime(self.t).tm_hour
+        solar = max(0.0, math.sin((hour - 6) / 14 * math.pi)) * 1500
+        for i in range(3):
+            self.phases[i] += r.gauss(0, 30) + (200 - solar / 3 - self.phases[i]) * 0.05
+            if r.random() < 0.002:
+                self.phases[i] += r.choice([-1, 1]) * 2000  # Kettle, oven, ...
+        tariff = 2 if 7 <= hour < 22 and time.localtime(self.t).tm_wday < 5 else 1
+        delivered = sum(max(p, 0) for p in self.phases)
+        injected = sum(max(-p, 0) for p in self.phases)
+        self.registers[tariff - 1] += delivered / 3600
+        self.registers[tariff + 1] += injected / 3600
+        if hour in (7, 8, 18, 19, 20):
+            self.gas += r.uniform(0, 0.5)
+        voltages = [230 + r.gauss(0, 1.5) - p / 1000 for p in self.phases]
+
+        lines = [
+            b'/FLU5\\253770234_A',
+            b'',
+            b'0-0:96.1.4(50215)',
+            b'0-0:96.1.1(%s)' % self.meter_id,
+            b'0-0:1.0.0(%s)' % meter_time(self.t),
+            b'1-0:1.8.1(%010.3f*kWh)' % (self.registers[0] / 1000),
+            b'1-0:1.8.2(%010.3f*kWh)' % (self.registers[1] / 1000),
+            b'1-0:2.8.1(%010.3f*kWh)' % (self.registers[2] / 1000),
+            b'1-0:2.8.2(%010.3f*kWh)' % (self.registers[3] / 1000),
+            b'0-0:96.14.0(%04d)' % tariff,
+            b'1-0:1.7.0(%06.3f*kW)' % (delivered / 1000),
+            b'1-0:2.7.0(%06.3f*kW)' % (injected / 1000),
+        ]
+        lines += [b'1-0:%d.7.0(%06.3f*kW)' % (21 + 20 * i, max(p, 0) / 1000) for i, p in enumerate(self.phases)]
+        lines += [b'1-0:%d.7.0(%06.3f*kW)' % (22 + 20 * i, max(-p, 0) / 1000) for i, p in enumerate(self.phases)]
+        lines += [b'1-0:%d.7.0(%05.1f*V)' % (32 + 20 * i, v) for i, v in enumerate(voltages)]
+        lines += [b'1-0:%d.7.0(%06.2f*A)' % (31 + 20 * i, abs(p) / v) for i, (p, v) in enumerate(zip(self.phases, voltages))]
+        lines += [
+            b'0-0:96.3.10(1)',
+            b'0-0:17.0.0(999.9*kW)',
+            b'1-0:31.4.0(999*A)',
+            b'0-0:96.13.0()',
+            b'0-1:24.1.0(003)',
+            b'0-1:96.1.1(37464C4F32313139303333373333)',
+            b'0-1:24.4.0(1)',
+            # The gas meter only reports every 5 minutes.
+            b'0-1:24.2.3(%s)(%09.3f*m3)' % (meter_time(self.t - self.t % 300), self.gas / 1000),
+        ]
+        self.t += 1
+        return lines
+
+
+class Faults:
+    def __init__(self, corrupt, drop, seed):
+        self.corrupt = corrupt
+        self.drop = drop
+        self.random = random.Random(seed)
+        self.corrupt_next = False
+        self.drop_next = False
+        self.stats = {'corrupted': 0, 'dropped': 0}
+        signal.signal(signal.SIGUSR1, lambda *_: setattr(self, 'corrupt_next', True))
+        signal.signal(signal.SIGUSR2, lambda *_: setattr(self, 'drop_next', True))
+
+    def apply(self, lines):
+        r = self.random
+        if (self.drop_next or r.random() < self.drop) and len(lines) > 2:
+            self.drop_next = False
+            self.stats['dropped'] += 1
+            lines = list(lines)
+            del lines[r.randrange(1, len(lines))]
+        telegram = with_crc(lines)
+        if self.corrupt_next or r.random() < self.corrupt:
+            self.corrupt_next = False
+            self.stats['corrupted'] += 1
+            telegram = bytearray(telegram)
+            # Not the header, the CRC or the line structure, the receiver must still see a whole telegram.
+            while True:
+                i = r.randrange(len(lines[0]) + 2, len(telegram) - 7)
+                flipped = telegram[i] ^ 1 << r.randrange(7)
+                if telegram[i] not in b'\r\n' and flipped not in b'\r\n/!':
+                    break
+            telegram[i] = flipped
+            telegram = bytes(telegram)
+        return telegram
+
+
+def open_output(args):
+    """
+    Returns fd, name, the pty slave (or None) and the serial.Serial (or None).
+    The Serial closes its fd when it's garbage collected, the caller keeps it until the end.
+    """
+    if args.port:
+        import serial
+        port = serial.Serial(args.port, args.baud)
+        return port.fileno(), args.port, None, port
+    master, slave = os.openpty()
+    # Raw, or the line discipline turns CRLF into CRCRLF.
+    tty.setraw(slave)
+    name = os.ttyname(slave)
+    if args.link:
+        if os.path.lexists(args.link):
+            os.remove(args.link)
+        os.symlink(name, args.link)
+        name = args.link
+    # The slave stays open here as well, so the receiver can close and reopen it without us getting EIO.
+    return master, name, slave, None
+
+
+def drain(slave):
+    """
+    Wait until the receiver read everything, closing the pty throws away what's still buffered.
+    """
+    pending = struct.pack('i', 0)
+    while struct.unpack('i', fcntl.ioctl(slave, termios.FIONREAD, pending))[0]:
+        time.sleep(0.01)
+
+
+def write_all(fd, data):
+    view = memoryview(data)
+    while view:
+        view = view[os.write(fd, view):]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='P1 smart meter simulator.')
+    sub = parser.add_subparsers(dest='source', required=True)
+    p = sub.add_parser('replay', help='Replay a capture.')
+    p.add_argument('capture')
+    p.add_argument('--loop', action='store_true', help='Start over at the end of the capture.')
+    p.add_argument('--retime', action='store_true', help='Replace the timestamps, 1 per telegram starting now.')
+    p = sub.add_parser('synth', help='Synthesise telegrams.')
+    p.add_argument('--start', type=datetime.datetime.fromisoformat, default=None,
+                   help='First timestamp (local time, YYYY-MM-DDThh:mm:ss), default now.')
+    p.add_argument('--meter-id', default='1SAG1100096196',
+                   help='Equipment identifier (0-0:96.1.1, hex encoded in the telegram), to tell simulated meters apart.')
+    for p in sub.choices.values():
+        p.add_argument('--port', help='Serial port to write to, instead of creating a pty.')
+        p.add_argument('--link', help='Create a symlink to the pty, like /tmp/p1.')
+        p.add_argument('--baud', type=int, default=115200)
+        p.add_argument('--speed', type=float, default=1, help='Speed-up factor, 0 = no pacing.')
+        p.add_argument('--count', type=int, default=0, help='Stop after this many telegrams.')
+        p.add_argument('--corrupt', type=float, default=0, help='Fraction of telegrams with a flipped bit.')
+        p.add_argument('--drop', type=float, default=0, help='Fraction of telegrams with a missing line.')
+        p.add_argument('--seed', type=int, default=None)
+        p.add_argument('--sent-log', help='Write "<meter timestamp> <time sent>" per telegram to this file.')
+        p.add_argument('--wait', action='store_true', help='Wait for enter before sending, to start the receiver.')
+    args = parser.parse_args()
+
+    if args.source == 'replay':
+        telegrams = replay(args.capture, args.loop, args.retime)
+    else:
+        telegrams = Synth(args.start.timestamp() if args.start else int(time.time()), args.seed, args.meter_id)
+    faults = Faults(args.corrupt, args.drop, args.seed)
+    fd, name, slave, port = open_output(args)
+    sent_log = open(args.sent_log, 'w') if args.sent_log else None
+    print(f'Sending on {name} (pid {os.getpid()})', file=sys.stderr)
+    if args.wait:
+        input('Press enter to start.')
+
+    # Seconds per byte at the line rate (8N1 = 10 bits per byte).
+    byte_time = 10 / args.baud / args.speed if args.speed else 0
+    interval = 1 / args.speed if args.speed else 0
+    count = size = 0
+    start = next_send = time.monotonic()
+    try:
+        for lines in telegrams:
+            if interval:
+                delay = next_send - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+                next_send += interval
+            telegram = faults.apply(lines)
+            if sent_log:
+                stamp = next((l[10:23] for l in lines if l.startswith(b'0-0:1.0.0(')), b'-')
+                sent_log.write(f'{stamp.decode()} {time.time():.6f}\n')
+            if byte_time:
+                # Line by line, so the receiver sees the telegram trickle in like on the real UART.
+                t = time.monotonic()
+                for line in telegram.splitlines(keepends=True):
+                    write_all(fd, line)
+                    t += len(line) * byte_time
+                    delay = t - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+            else:
+                write_all(fd, telegram)
+            count += 1
+            size += len(telegram)
+            if count == args.count:
+                break
+        if slave is not None:
+            drain(slave)
+        if port is not None:
+            port.flush()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if sent_log:
+            sent_log.close()
+        if port is not None:
+            port.close()
+        if args.link and not args.port and os.path.islink(args.link):
+            os.remove(args.link)
+    elapsed = time.monotonic() - start
+    print(f'{count} telegrams, {size} bytes in {elapsed:.3f} s ({count / elapsed:.1f} telegrams/s, '
+          f'{size / elapsed / 1000:.1f} kB/s), {faults.stats}', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
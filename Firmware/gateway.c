@@ -0,0 +1,352 @@
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include "gateway.h"
+#include "crc.h"
+
+#define READ_SIZE 4096
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t nowMs() {
+    return nowNs() / 1000000;
+}
+
+/**
+ * Raw mode, 115200 8N1, no flow control. Not a tty (FIFO, file) is fine, it's used as is.
+ */
+static void setRaw(const int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) return;
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void resetFraming(GatewayPort* const port) {
+    port->inTelegram = false;
+    port->atLineStart = true;
+    port->lastLine = false;
+}
+
+static bool openPort(Gateway* const gw, const uint16_t i) {
+    GatewayPort* port = &gw->ports[i];
+    int fd = open(port->path, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+    setRaw(fd);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+    if (epoll_ctl(gw->epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        return false;
+    }
+    port->fd = fd;
+    resetFraming(port);
+    return true;
+}
+
+static void closePort(Gateway* const gw, GatewayPort* const port) {
+    epoll_ctl(gw->epoll, EPOLL_CTL_DEL, port->fd, NULL);
+    close(port->fd);
+    port->fd = -1;
+    port->closedAt = nowMs();
+    resetFraming(port);
+}
+
+static void* parserMain(void* arg);
+static void* sinkMain(void* arg);
+
+/**
+ * Close the ports and epoll, and free the rings, once the threads are gone (or were never started).
+ */
+static void freeGateway(Gateway* const gw) {
+    spscFree(&gw->frames);
+    spscFree(&gw->records);
+    for (uint16_t i = 0; i < gw->count; i++) {
+        if (gw->ports[i].fd >= 0) close(gw->ports[i].fd);
+    }
+    close(gw->epoll);
+    free(gw->ports);
+    gw->ports = NULL;
+    gw->count = 0;
+}
+
+bool gatewayOpen(Gateway* const gw, const char* const* const paths, const uint16_t count, const GatewaySink* const sink) {
+    memset(gw, 0, sizeof(Gateway));
+    if (count == 0 || count > GATEWAY_MAX_PORTS) return false;
+    gw->sink = *sink;
+    if (gw->sink.batch == 0) gw->sink.batch = GATEWAY_DEFAULT_BATCH;
+    gw->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (gw->epoll < 0) return false;
+    gw->ports = calloc(count, sizeof(GatewayPort));
+    if (gw->ports == NULL
+        || !spscInit(&gw->frames, GATEWAY_FRAME_SLOTS, sizeof(GatewayFrame))
+        || !spscInit(&gw->records, GATEWAY_RECORD_SLOTS, sizeof(GatewayRecord))) {
+        freeGateway(gw);
+        return false;
+    }
+    gw->count = count;
+    for (uint16_t i = 0; i < count; i++) {
+        GatewayPort* port = &gw->ports[i];
+        port->path = paths[i];
+        // The parser decodes straight into the record slot, gatewayDecode points the context at it.
+        GatewayRecord* scratch = (GatewayRecord*) gw->records.slots;
+        initParser(&port->parser, &scratch->packet, scratch->mbus);
+        if (!openPort(gw, i)) {
+            port->fd = -1;
+            port->closedAt = nowMs();
+        }
+    }
+    if (pthread_create(&gw->parserThread, NULL, parserMain, gw) != 0) {
+        freeGateway(gw);
+        return false;
+    }
+    if (pthread_create(&gw->sinkThread, NULL, sinkMain, gw) != 0) {
+        // Nothing was read yet, so the parser stops right away.
+        __atomic_store_n(&gw->stopping, true, __ATOMIC_RELEASE);
+        spscWakeConsumer(&gw->frames);
+        pthread_join(gw->parserThread, NULL);
+        freeGateway(gw);
+        return false;
+    }
+    return true;
+}
+
+static void emitFrame(Gateway* const gw, const uint16_t i) {
+    GatewayPort* port = &gw->ports[i];
+    GatewayFrame* frame = spscReserve(&gw->frames);
+    if (frame == NULL) {
+        port->stats.dropped++;
+        return;
+    }
+    frame->port = i;
+    frame->len = port->frameLen;
+    frame->received = port->received;
+    frame->framed = nowNs();
+    memcpy(frame->data, port->frame, port->frameLen);
+    spscCommit(&gw->frames);
+    gw->io.items++;
+}
+
+void gatewayFeed(Gateway* const gw, const uint16_t i, const char* data, size_t len) {
+    GatewayPort* port = &gw->ports[i];
+    port->stats.bytes += len;
+    while (len > 0) {
+        const char* nl = memchr(data, '\n', len);
+        size_t n = nl == NULL ? len : (size_t) (nl - data) + 1;
+
+        if (port->atLineStart) {
+            if (data[0] == '/') {
+                if (port->inTelegram) port->stats.resyncs++;
+                port->inTelegram = true;
+                port->frameLen = 0;
+                port->received = nowNs();
+            }
+            port->lastLine = data[0] == '!';
+        }
+        if (port->inTelegram) {
+            if (port->frameLen + n > GATEWAY_FRAME_MAX) {
+                port->stats.overflows++;
+                port->stats.skipped += port->frameLen + n;
+                port->inTelegram = false;
+            } else {
+                memcpy(port->frame + port->frameLen, data, n);
+                port->frameLen += n;
+            }
+        } else {
+            port->stats.skipped += n;
+        }
+        port->atLineStart = nl != NULL;
+        if (nl != NULL && port->lastLine && port->inTelegram) {
+            emitFrame(gw, i);
+            port->inTelegram = false;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static inline int hexDigit(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+void gatewayDecode(Gateway* const gw, const GatewayFrame* const frame, GatewayRecord* const record) {
+    GatewayPort* port = &gw->ports[frame->port];
+    ParserContext* ctx = &port->parser;
+    ctx->packet = &record->packet;
+    ctx->mbus = record->mbus;
+    resetParser(ctx);
+    record->port = frame->port;
+    record->received = frame->received;
+    record->framed = frame->framed;
+    record->meterId[0] = 0;
+    record->header[0] = 0;
+
+    const char* line = frame->data;
+    const char* end = frame->data + frame->len;
+    uint16_t crc = 0;
+    bool crcOk = false;
+    while (line < end) {
+        const char* nl = memchr(line, '\n', end - line);
+        uint16_t len = nl == NULL ? end - line : nl - line + 1;
+        if (line[0] == '!') {
+            crc = crc16Table(crc, line, 1);
+            // DSMR 2.2 meters have no CRC: a bare '!' is never ok.
+            uint16_t expected = 0;
+            uint8_t digits = 0;
+            for (; digits < 4 && 1 + digits < len && hexDigit(line[1 + digits]) >= 0; digits++) {
+                expected = expected << 4 | hexDigit(line[1 + digits]);
+            }
+            crcOk = digits == 4 && expected == crc;
+            break;
+        }
+        crc = crc16Table(crc, line, len);
+        if (len > 11 && memcmp(line, "0-0:96.1.1(", 11) == 0) {
+            uint16_t n = 0;
+            while (n < GATEWAY_METER_ID_LEN && 11 + n < len && line[11 + n] != ')') {
+                record->meterId[n] = line[11 + n];
+                n++;
+            }
+            record->meterId[n] = 0;
+        } else if (line[0] == '/') {
+            uint16_t n = 0;
+            while (n < GATEWAY_HEADER_LEN && 1 + n < len && line[1 + n] >= ' ') {
+                record->header[n] = line[1 + n];
+                n++;
+            }
+            record->header[n] = 0;
+        } else {
+            parseLineWith(ctx, len, line);
+        }
+        line += len;
+    }
+
+    record->crcOk = crcOk;
+    record->parsed = nowNs();
+    if (crcOk && strcmp(port->meterId, record->meterId) != 0) strcpy(port->meterId, record->meterId);
+    port->stats.telegrams++;
+    if (!crcOk) port->stats.crcErrors++;
+}
+
+static void* parserMain(void* const arg) {
+    Gateway* gw = arg;
+    while (true) {
+        GatewayFrame* frame = spscPeek(&gw->frames);
+        if (frame == NULL) {
+            if (__atomic_load_n(&gw->stopping, __ATOMIC_ACQUIRE) && spscPeek(&gw->frames) == NULL) break;
+            spscWaitData(&gw->frames, 100);
+            continue;
+        }
+        GatewayRecord* record;
+        while ((record = spscReserve(&gw->records)) == NULL) spscWaitSpace(&gw->records, 100);
+        gatewayDecode(gw, frame, record);
+        spscRelease(&gw->frames);
+        spscCommit(&gw->records);
+        gw->parse.items++;
+    }
+    __atomic_store_n(&gw->parserDone, true, __ATOMIC_RELEASE);
+    spscWakeConsumer(&gw->records);
+    return NULL;
+}
+
+static void* sinkMain(void* const arg) {
+    Gateway* gw = arg;
+    const GatewaySink* sink = &gw->sink;
+    uint32_t pending = 0; // Records since the last flush.
+    uint64_t firstPending = 0;
+    while (true) {
+        GatewayRecord* record = spscPeek(&gw->records);
+        if (record != NULL) {
+            uint64_t now = nowNs();
+            uint64_t latency = now - record->framed;
+            gw->output.latencySum += latency;
+            if (latency > gw->output.latencyMax) gw->output.latencyMax = latency;
+            if (pending == 0) firstPending = now;
+            sink->record(record, sink->ctx);
+            spscRelease(&gw->records);
+            gw->output.items++;
+            if (++pending < sink->batch) continue;
+        } else if (pending == 0) {
+            if (__atomic_load_n(&gw->parserDone, __ATOMIC_ACQUIRE) && spscPeek(&gw->records) == NULL) break;
+            spscWaitData(&gw->records, 100);
+            continue;
+        } else if (sink->lingerMs != 0 && nowNs() - firstPending < sink->lingerMs * 1000000ULL) {
+            uint64_t left = firstPending + sink->lingerMs * 1000000ULL - nowNs();
+            spscWaitData(&gw->records, left / 1000000 + 1);
+            continue;
+        }
+        if (sink->flush != NULL) sink->flush(sink->ctx);
+        gw->output.batches++;
+        pending = 0;
+    }
+    return NULL;
+}
+
+static void readPort(Gateway* const gw, const uint16_t i) {
+    GatewayPort* port = &gw->ports[i];
+    char buf[READ_SIZE];
+    ssize_t n = read(port->fd, buf, sizeof(buf));
+    if (n > 0) {
+        gatewayFeed(gw, i, buf, n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // EOF or EIO: hung up.
+        closePort(gw, port);
+    }
+}
+
+bool gatewayPoll(Gateway* const gw, int timeoutMs) {
+    uint64_t now = nowMs();
+    bool closed = false;
+    for (uint16_t i = 0; i < gw->count; i++) {
+        GatewayPort* port = &gw->ports[i];
+        if (port->fd >= 0) continue;
+        if (now - port->closedAt >= GATEWAY_REOPEN_MS) {
+            if (openPort(gw, i)) {
+                port->stats.reopens++;
+                continue;
+            }
+            port->closedAt = now;
+        }
+        closed = true;
+    }
+    if (closed && (timeoutMs < 0 || timeoutMs > 1000)) timeoutMs = 1000;
+
+    struct epoll_event events[64];
+    int n = epoll_wait(gw->epoll, events, 64, timeoutMs);
+    if (n < 0) return errno == EINTR;
+    for (int e = 0; e < n; e++) {
+        uint16_t i = events[e].data.u32;
+        // Hangups are handled by the read (0 or EIO), after reading what's left.
+        if (gw->ports[i].fd >= 0) readPort(gw, i);
+    }
+    return true;
+}
+
+void gatewayStop(Gateway* const gw) {
+    if (gw->stopping) return;
+    __atomic_store_n(&gw->stopping, true, __ATOMIC_RELEASE);
+    spscWakeConsumer(&gw->frames);
+    pthread_join(gw->parserThread, NULL);
+    pthread_join(gw->sinkThread, NULL);
+}
+
+void gatewayClose(Gateway* const gw) {
+    gatewayStop(gw);
+    freeGateway(gw);
+}
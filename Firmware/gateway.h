@@ -0,0 +1,198 @@
+#ifndef FIRMWARE_GATEWAY_H
+#define FIRMWARE_GATEWAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "packet.h"
+#include "spsc.h"
+
+/**
+ * Many P1 ports in one process. Host only (Linux).
+ *
+ * Every port is a tty in raw mode (115200 8N1, or whatever it is if it's not a tty, like a FIFO),
+ * all of them are multiplexed with a single epoll.
+ * A telegram starts at a '/' line and ends with the '!' line.
+ * Bytes outside of a telegram (plugged in halfway, garbage) are skipped and counted.
+ * Ports that hang up (USB serial unplugged, pty closed) are closed and opened again every GATEWAY_REOPEN_MS.
+ *
+ * Three stages, on their own thread, connected by SpscRings of preallocated slots:
+ *   IO      gatewayPoll, on the caller's thread: reads the ports and frames telegrams (GatewayFrame).
+ *           Never blocks on the other stages: if the frame ring is full, the telegram is dropped and counted.
+ *   parser  checks the CRC and decodes a frame into a GatewayRecord, with the ParserContext of its port.
+ *           Waits for the sink if the record ring is full (so the frame ring fills up, not memory).
+ *   sink    hands records to the GatewaySink, and flushes it per batch.
+ * So a slow sink (disk, network) can only ever cost telegrams, never stall reading the serial ports.
+ */
+
+#define GATEWAY_MAX_PORTS 256
+#define GATEWAY_FRAME_MAX 4096 // DSMR 5: max 1024 characters per line, a telegram is typically < 1 kB.
+#define GATEWAY_HEADER_LEN 48 // The '/' line, DSMR: /XXXZ Ident, Ident is max 96 chars but never is.
+#define GATEWAY_METER_ID_LEN 32 // Chars, as in the telegram (hex), 0-0:96.1.1 is max 96 hex chars, only the first 32 are kept.
+#define GATEWAY_REOPEN_MS 5000
+#define GATEWAY_FRAME_SLOTS 64
+#define GATEWAY_RECORD_SLOTS 256
+#define GATEWAY_DEFAULT_BATCH 64
+
+typedef struct {
+    // IO stage.
+    uint64_t bytes;
+    /**
+     * Bytes outside of a telegram.
+     */
+    uint64_t skipped;
+    /**
+     * Telegrams cut short by a new header (lost bytes, meter restarted).
+     */
+    uint64_t resyncs;
+    /**
+     * Telegrams longer than GATEWAY_FRAME_MAX, dropped.
+     */
+    uint64_t overflows;
+    /**
+     * Telegrams dropped because the parser was behind (frame ring full).
+     */
+    uint64_t dropped;
+    uint32_t reopens;
+
+    // Parser stage.
+    uint64_t telegrams;
+    uint64_t crcErrors;
+} GatewayPortStats;
+
+typedef struct {
+    const char* path;
+    int fd; // -1 if closed, waiting to reopen.
+    uint64_t closedAt; // ms, CLOCK_MONOTONIC.
+
+    bool inTelegram;
+    bool atLineStart;
+    bool lastLine; // The current line started with '!'.
+    uint16_t frameLen;
+    uint64_t received;
+    // Telegrams of different ports are interleaved, so they're framed here and copied into the ring when complete.
+    char frame[GATEWAY_FRAME_MAX];
+
+    // Parser stage.
+    ParserContext parser;
+    char meterId[GATEWAY_METER_ID_LEN + 1]; // Last one seen, for the stats.
+    GatewayPortStats stats;
+} GatewayPort;
+
+typedef struct {
+    uint16_t port;
+    uint16_t len;
+    /**
+     * When the header line came in, ns CLOCK_MONOTONIC.
+     */
+    uint64_t received;
+    /**
+     * When the '!' line came in and the frame was handed to the parser.
+     */
+    uint64_t framed;
+    char data[GATEWAY_FRAME_MAX];
+} GatewayFrame;
+
+typedef struct {
+    /**
+     * Index in Gateway.ports.
+     */
+    uint16_t port;
+    bool crcOk;
+    char meterId[GATEWAY_METER_ID_LEN + 1]; // "" if the telegram had no 0-0:96.1.1 line.
+    char header[GATEWAY_HEADER_LEN + 1]; // Without the '/' and line end, truncated.
+    uint64_t received; // See GatewayFrame.
+    uint64_t framed;
+    uint64_t parsed; // ns CLOCK_MONOTONIC.
+    Packet packet;
+    MBusSlot mbus[MBUS_CHANNELS];
+} GatewayRecord;
+
+typedef struct {
+    /**
+     * Called for every telegram, also with a bad CRC, on the sink thread. The record is only valid during the call.
+     */
+    void (*record)(const GatewayRecord* record, void* ctx);
+    /**
+     * Called after every batch, may be NULL.
+     */
+    void (*flush)(void* ctx);
+    void* ctx;
+    /**
+     * Max nr of records per batch, 0 = GATEWAY_DEFAULT_BATCH.
+     */
+    uint32_t batch;
+    /**
+     * Wait up to this long for more records before flushing a batch that isn't full, 0 = flush when idle.
+     */
+    uint32_t lingerMs;
+} GatewaySink;
+
+typedef struct {
+    /**
+     * Items the stage handed to the next one (IO: frames, parser: records, sink: records, batches).
+     */
+    uint64_t items;
+    uint64_t batches;
+    /**
+     * Sink: time from the end of the telegram (framed) to the record callback, ns.
+     */
+    uint64_t latencySum;
+    uint64_t latencyMax;
+} GatewayStageStats;
+
+typedef struct {
+    int epoll;
+    uint16_t count;
+    GatewayPort* ports;
+
+    GatewaySink sink;
+    SpscRing frames; // IO -> parser.
+    SpscRing records; // parser -> sink.
+    pthread_t parserThread;
+    pthread_t sinkThread;
+    bool stopping;
+    bool parserDone;
+
+    GatewayStageStats io;
+    GatewayStageStats parse;
+    GatewayStageStats output;
+} Gateway;
+
+/**
+ * Open all ports and start the parser and sink threads. A port that can't be opened yet is retried like a
+ * port that hung up.
+ * @return false if epoll, the rings or the threads couldn't be created, or there are too many ports.
+ */
+bool gatewayOpen(Gateway* gw, const char* const* paths, uint16_t count, const GatewaySink* sink);
+
+/**
+ * The IO stage: wait for data on any port (at most timeoutMs) and frame everything that is available.
+ * @return false on a fatal (epoll) error.
+ */
+bool gatewayPoll(Gateway* gw, int timeoutMs);
+
+/**
+ * Frame bytes received on a port. gatewayPoll calls this, it's exposed for feeding from other sources.
+ * IO stage only.
+ */
+void gatewayFeed(Gateway* gw, uint16_t port, const char* data, size_t len);
+
+/**
+ * Decode a frame into record, with the parser context of its port. Parser stage only.
+ */
+void gatewayDecode(Gateway* gw, const GatewayFrame* frame, GatewayRecord* record);
+
+/**
+ * Stop reading, and wait until the parser and sink finished what's in the rings. The stats stay valid.
+ */
+void gatewayStop(Gateway* gw);
+
+/**
+ * gatewayStop, and close and free everything.
+ */
+void gatewayClose(Gateway* gw);
+
+#endif //FIRMWARE_GATEWAY_H
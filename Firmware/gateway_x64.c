@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "packet.h"
+#include "gateway.h"
+#include "shmring.h"
+#include "influx.h"
+#include "spool.h"
+
+// Spooled records are written back in batches of this many (InfluxDB's recommended batch size).
+#define REPLAY_BATCH 5000
+// While InfluxDB is down the replay tries the oldest batch again this often, the live batches go straight to the spool.
+#define REPLAY_RETRY_MS 5000
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpuSeconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+typedef struct {
+    bool quiet;
+    ShmRing* ring;
+    InfluxClient* influx;
+    LineBuffer lines;
+    uint32_t pending; // Lines in the buffer.
+    uint64_t lost; // Lines in failed writes (that couldn't be spooled).
+
+    // Write-ahead spool (-w): batches that fail go to disk, the replay thread writes them on its own connection.
+    Spool* spool;
+    SpoolRecord* records; // Of the lines in the buffer.
+    bool down; // The last write failed, until the replay gets one through.
+    bool stopping;
+    pthread_t replayThread;
+    InfluxClient replay;
+    uint64_t spooled;
+    uint64_t replayed;
+    uint64_t rejected; // Lines InfluxDB refused (4xx), they are dropped. By the sink and the replay thread: atomic.
+    uint64_t lastReplayed; // At the last report.
+    double lastReport;
+} Output;
+
+/**
+ * 4xx: InfluxDB is up but refuses the data (a bad line, ...), sending it again won't help. 429 is "slow down".
+ */
+static bool rejected(const int status) {
+    return status >= 400 && status < 500 && status != 429;
+}
+
+static void onRecord(const GatewayRecord* r, void* ctx) {
+    Output* out = ctx;
+    if (out->ring != NULL) {
+        ShmRingSlot slot;
+        shmRingFromPacket(&slot, &r->packet, r->mbus, r->meterId, r->crcOk);
+        shmRingPublish(out->ring, &slot);
+    }
+    // Like the other outputs: telegrams with a bad CRC are counted, not written.
+    if (out->influx != NULL && r->crcOk
+        && lineProtoTelegram(&out->lines, LINEPROTO_MEASUREMENT, r->header, r->meterId, &r->packet, r->mbus)) {
+        if (out->spool != NULL) spoolFromPacket(&out->records[out->pending], r->header, r->meterId, &r->packet, r->mbus, r->crcOk);
+        out->pending++;
+    }
+    if (out->quiet) return;
+    const Packet* p = &r->packet;
+    printf("{\"port\": %u, \"meter\": \"%s\", \"crc_ok\": %s, \"timestamp\": %u, \"tariff\": %u, "
+           "\"delivered\": [%u, %u], \"injected\": [%u, %u], \"power\": [%u, %u]}\n",
+           r->port, r->meterId, r->crcOk ? "true" : "false", p->timestamp, p->tariff,
+           p->meter_delivered_t1, p->meter_delivered_t2, p->meter_injected_t1, p->meter_injected_t2,
+           p->sum_power_delivered, p->sum_power_injected);
+}
+
+static void onFlush(void* ctx) {
+    Output* out = ctx;
+    if (out->influx != NULL && out->lines.len) {
+        // While it's down, don't wait for a timeout per batch: the replay finds out when it's back.
+        bool down = __atomic_load_n(&out->down, __ATOMIC_ACQUIRE);
+        if (down || !influxWrite(out->influx, out->lines.data, out->lines.len)) {
+            if (!down && rejected(out->influx->stats.lastStatus)) {
+                __atomic_add_fetch(&out->rejected, out->pending, __ATOMIC_RELAXED);
+            } else {
+                // What's in the spool isn't lost, even if the rest of the batch couldn't be written.
+                uint32_t n = out->spool != NULL ? spoolAppend(out->spool, out->records, out->pending) : 0;
+                out->spooled += n;
+                out->lost += out->pending - n;
+                if (n > 0) __atomic_store_n(&out->down, true, __ATOMIC_RELEASE);
+            }
+        }
+        out->lines.len = 0;
+        out->pending = 0;
+    }
+    if (!out->quiet) fflush(stdout);
+}
+
+static void sleepUnlessStopping(const Output* out, uint32_t ms) {
+    for (; ms > 0 && !__atomic_load_n(&out->stopping, __ATOMIC_ACQUIRE); ms -= ms < 100 ? ms : 100) {
+        usleep((ms < 100 ? ms : 100) * 1000);
+    }
+}
+
+/**
+ * Drains the spool, concurrently with the live batches: oldest records first, REPLAY_BATCH per request.
+ * A segment is deleted once all its records are written.
+ */
+static void* replayMain(void* arg) {
+    Output* out = arg;
+    SpoolRecord* records = malloc(REPLAY_BATCH * sizeof(SpoolRecord));
+    LineBuffer lines = {NULL, 0, 0};
+    char header[SPOOL_HEADER_LEN + 1], meterId[SPOOL_METER_ID_LEN + 1];
+    Packet p;
+    MBusSlot mbus[MBUS_CHANNELS];
+    while (!__atomic_load_n(&out->stopping, __ATOMIC_ACQUIRE)) {
+        if (spoolWait(out->spool, 500) == 0) continue;
+        uint32_t n = spoolRead(out->spool, records, REPLAY_BATCH);
+        if (n == 0) {
+            // Only corrupt records (skip them), or the writer is between segments.
+            spoolAck(out->spool);
+            sleepUnlessStopping(out, 100);
+            continue;
+        }
+        lines.len = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            spoolToPacket(&records[i], header, meterId, &p, mbus);
+            lineProtoTelegram(&lines, LINEPROTO_MEASUREMENT, header, meterId, &p, mbus);
+        }
+        if (influxWrite(&out->replay, lines.data, lines.len)) {
+            out->replayed += n;
+        } else if (rejected(out->replay.stats.lastStatus)) {
+            __atomic_add_fetch(&out->rejected, n, __ATOMIC_RELAXED);
+        } else {
+            sleepUnlessStopping(out, REPLAY_RETRY_MS);
+            continue;
+        }
+        spoolAck(out->spool);
+        __atomic_store_n(&out->down, false, __ATOMIC_RELEASE);
+    }
+    lineBufferFree(&lines);
+    free(records);
+    return NULL;
+}
+
+static void printRing(const char* name, const SpscRing* ring) {
+    printf("\"%s\": {\"occupancy\": %u, \"max_occupancy\": %u, \"capacity\": %u, \"stalls\": %lu, \"waits\": %lu}",
+           name, spscOccupancy(ring), ring->maxOccupancy, spscCapacity(ring), ring->stalls, ring->waits);
+}
+
+/**
+ * Totals, and per port. cpu_us_per_telegram is for this whole process, divide 1e6 by it for the nr of meters
+ * (at 1 telegram/s) one core can handle.
+ */
+static void printStats(const Gateway* gw, Output* out, double seconds, double cpu) {
+    uint64_t telegrams = 0, bytes = 0;
+    for (uint16_t i = 0; i < gw->count; i++) {
+        telegrams += gw->ports[i].stats.telegrams;
+        bytes += gw->ports[i].stats.bytes;
+    }
+    printf("{\"seconds\": %.1f, \"ports\": %u, \"telegrams\": %lu, \"bytes\": %lu, \"cpu_seconds\": %.3f, "
+           "\"cpu_percent\": %.2f, \"cpu_us_per_telegram\": %.1f, \"cpu_percent_per_port\": %.3f}\n",
+           seconds, gw->count, telegrams, bytes, cpu, 100 * cpu / seconds,
+           telegrams ? cpu * 1e6 / telegrams : 0, 100 * cpu / seconds / gw->count);
+    // Stalls: the stage writing to the ring found it full (IO: telegram dropped, parser: waited for the sink).
+    // Waits: the stage reading from the ring found it empty and slept.
+    printf("{\"io_frames\": %lu, \"parsed\": %lu, \"sink_records\": %lu, \"sink_batches\": %lu, "
+           "\"latency_mean_us\": %.1f, \"latency_max_us\": %.1f, ",
+           gw->io.items, gw->parse.items, gw->output.items, gw->output.batches,
+           gw->output.items ? gw->output.latencySum / 1e3 / gw->output.items : 0, gw->output.latencyMax / 1e3);
+    printRing("frames", &gw->frames);
+    printf(", ");
+    printRing("records", &gw->records);
+    printf("}\n");
+    if (out->influx != NULL) {
+        const InfluxStats* s = &out->influx->stats;
+        printf("{\"influx_requests\": %lu, \"failures\": %lu, \"connects\": %lu, \"lost_lines\": %lu, \"body_bytes\": %lu, "
+               "\"wire_bytes\": %lu, \"request_mean_ms\": %.2f, \"last_status\": %d}\n",
+               s->requests, s->failures, s->connects, out->lost, s->bodyBytes, s->wireBytes,
+               s->requests ? s->requestNs / 1e6 / s->requests : 0, s->lastStatus);
+    }
+    if (out->spool != NULL) {
+        // Catch-up: records replayed per second since the last report, eta: how long the spool takes to drain at that rate.
+        const SpoolStats* s = &out->spool->stats;
+        uint64_t depth = spoolDepth(out->spool);
+        uint64_t replayed = out->replayed;
+        double rate = seconds > out->lastReport ? (replayed - out->lastReplayed) / (seconds - out->lastReport) : 0;
+        out->lastReplayed = replayed;
+        out->lastReport = seconds;
+        printf("{\"spool_depth\": %lu, \"spool_segments\": %lu, \"influx_down\": %s, \"spooled\": %lu, \"replayed\": %lu, "
+               "\"rejected\": %lu, \"catch_up_per_second\": %.0f, \"catch_up_eta_seconds\": %.0f, \"fsyncs\": %lu, "
+               "\"segments_deleted\": %lu, \"torn\": %lu, \"corrupt\": %lu, \"replay_requests\": %lu, \"replay_failures\": %lu}\n",
+               depth, spoolSegments(out->spool), __atomic_load_n(&out->down, __ATOMIC_ACQUIRE) ? "true" : "false",
+               out->spooled, replayed, __atomic_load_n(&out->rejected, __ATOMIC_RELAXED), rate,
+               rate > 0 ? depth / rate : -1.0, s->fsyncs, s->deleted, s->torn, s->corrupt, out->replay.stats.requests,
+               out->replay.stats.failures);
+    }
+    for (uint16_t i = 0; i < gw->count; i++) {
+        const GatewayPort* port = &gw->ports[i];
+        const GatewayPortStats* s = &port->stats;
+        printf("{\"port\": %u, \"path\": \"%s\", \"meter\": \"%s\", \"open\": %s, \"telegrams\": %lu, \"crc_errors\": %lu, "
+               "\"bytes\": %lu, \"skipped\": %lu, \"resyncs\": %lu, \"overflows\": %lu, \"dropped\": %lu, \"reopens\": %u}\n",
+               i, port->path, port->meterId, port->fd >= 0 ? "true" : "false", s->telegrams, s->crcErrors,
+               s->bytes, s->skipped, s->resyncs, s->overflows, s->dropped, s->reopens);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *paths[GATEWAY_MAX_PORTS];
+    uint16_t count = 0;
+    const char *shm = NULL;
+    double report = 0, duration = 0;
+    Output out;
+    memset(&out, 0, sizeof(out));
+    const char *url = NULL, *spoolDir = NULL;
+    bool gzip = false;
+    uint32_t fsyncMs = SPOOL_DEFAULT_FSYNC_MS;
+    GatewaySink sink = {onRecord, onFlush, &out, 0, 0};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) shm = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) report = atof(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) duration = atof(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) sink.batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) sink.lingerMs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) url = argv[++i];
+        else if (strcmp(argv[i], "-z") == 0) gzip = true;
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) spoolDir = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) fsyncMs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-q") == 0) out.quiet = true;
+        else if (count < GATEWAY_MAX_PORTS) paths[count++] = argv[i];
+        else error("Too many ports.");
+    }
+    if (count == 0 || (spoolDir != NULL && url == NULL)) {
+        error("Usage: gateway_x64 [-q] [-s shm name] [-i http://host:port/db [-z] [-w spool dir [-f fsync ms]]] [-b batch] [-l linger ms] [-r report seconds] [-t seconds] <tty>...\n"
+              "  Prints a JSON line per telegram (unless -q) and publishes them in the shared memory ring with -s.\n"
+              "  -i writes them to InfluxDB (p1_human, like P1logger), a request per batch, -z gzips the requests.\n"
+              "  -w keeps what couldn't be written (InfluxDB down) on disk, and writes it when InfluxDB is back.\n"
+              "  The spool is fsync'd at most every -f ms (default 5000, 0 = every batch).\n"
+              "  Output is flushed per batch (-b records max, waiting up to -l ms for a batch to fill).\n"
+              "  Stats (CPU per meter, pipeline) every -r seconds and at exit (SIGINT/SIGTERM or after -t seconds).");
+    }
+
+    if (shm != NULL) {
+        out.ring = shmRingCreate(shm, 0);
+        if (out.ring == NULL) error("Failed to create ring.");
+    }
+
+    InfluxClient influx;
+    if (url != NULL) {
+        if (!influxInit(&influx, url, gzip)) error("Bad InfluxDB url, use http://host:port/database.");
+        out.influx = &influx;
+    }
+
+    Spool spool;
+    if (spoolDir != NULL) {
+        if (!spoolOpen(&spool, spoolDir, 0, fsyncMs)) error("Failed to open the spool.");
+        out.spool = &spool;
+        out.records = malloc((sink.batch ? sink.batch : GATEWAY_DEFAULT_BATCH) * sizeof(SpoolRecord));
+        influxInit(&out.replay, url, gzip);
+        pthread_create(&out.replayThread, NULL, replayMain, &out);
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    Gateway gw;
+    if (!gatewayOpen(&gw, paths, count, &sink)) error("Failed to start the gateway.");
+
+    double start = now(), lastReport = start;
+    double cpuStart = cpuSeconds();
+    while (!stop) {
+        if (!gatewayPoll(&gw, 200)) error("epoll failed.");
+        double t = now();
+        if (duration > 0 && t - start >= duration) break;
+        if (report > 0 && t - lastReport >= report) {
+            lastReport = t;
+            printStats(&gw, &out, t - start, cpuSeconds() - cpuStart);
+        }
+    }
+    double seconds = now() - start;
+    // Let the parser and sink finish first, so the stats include everything that was read.
+    gatewayStop(&gw);
+    if (out.spool != NULL) {
+        __atomic_store_n(&out.stopping, true, __ATOMIC_RELEASE);
+        pthread_join(out.replayThread, NULL);
+    }
+    printStats(&gw, &out, seconds, cpuSeconds() - cpuStart);
+    gatewayClose(&gw);
+    if (out.ring != NULL) shmRingClose(out.ring);
+    if (out.influx != NULL) influxClose(out.influx);
+    if (out.spool != NULL) {
+        // What wasn't replayed stays on disk for the next run.
+        spoolClose(out.spool);
+        influxClose(&out.replay);
+        free(out.records);
+    }
+    lineBufferFree(&out.lines);
+    return 0;
+}
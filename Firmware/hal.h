@@ -0,0 +1,131 @@
+#ifndef FIRMWARE_HAL_H
+#define FIRMWARE_HAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Hardware abstraction for main.c: the meter UART (RX), the RF UART (TX), the outputs on port C (LEDs),
+ * the watchdog, delays and interrupts.
+ *
+ * On the ATmega128 (hal_avr.h) every call is an inline register access, the same code main.c had before.
+ * On the host (hal_host.h, hal_host.c) the unchanged firmware runs as a Linux program: the meter UART is fed from
+ * a capture or a tty/pty, the RF UART writes to a file or a pty, and both run on a simulated byte clock.
+ *
+ * Interrupt handlers are written as ISR(HAL_..._VECT). On the host they run when the firmware waits (halIdle,
+ * halDelayMs), the firmware's own code takes no simulated time.
+ */
+
+/**
+ * Pin assignments
+ */
+// OUTPUTS, port C
+#define LED0        (1 << 0)  // RED
+#define LED1        (1 << 1)  // RED
+#define LED2        (1 << 2)  // YELLOW
+#define LED3        (1 << 3)  // YELLOW
+#define LED4        (1 << 4)  // GREEN
+#define LED5        (1 << 5)  // GREEN
+#define DATA_REQ    (1 << 6)
+#define RF_SET      (1 << 7)
+
+// INPUTS, port A
+#define SETTING7    (1 << 7)
+#define SETTING6    (1 << 6)
+#define SETTING5    (1 << 5)
+#define SETTING4    (1 << 4)
+#define SETTING3    (1 << 3)
+#define SETTING2    (1 << 2)
+#define SETTING1    (1 << 1)
+#define SETTING0    (1 << 0)
+
+/**
+ * What the firmware is waiting for in halIdle.
+ */
+#define HAL_WAIT_RX     0 // A byte from the meter.
+#define HAL_WAIT_TX     1 // The RF UART, to send the next packet.
+#define HAL_WAIT_HANG   2 // The watchdog, after a fatal error.
+#define HAL_WAITS       3
+
+/**
+ * Power profile. LOW_POWER 1 only ever lights the error LEDs (LED0, LED1): the activity LEDs are on half of the time
+ * and draw more than the CPU does while it sleeps. The analog comparator (on by default, unused) is switched off.
+ */
+#ifndef LOW_POWER
+#define LOW_POWER 0
+#endif
+
+#define HAL_LEDS (LED0 | LED1 | LED2 | LED3 | LED4 | LED5)
+#if LOW_POWER
+#define HAL_LEDS_ENABLED (LED0 | LED1)
+#else
+#define HAL_LEDS_ENABLED HAL_LEDS
+#endif
+// Outputs that can be switched on: all but the gated LEDs. A constant, so gating costs nothing.
+#define HAL_OUTPUTS ((uint8_t) ~(HAL_LEDS & ~HAL_LEDS_ENABLED))
+
+/**
+ * Diagnostics: how often and how long (in HAL_TICK_HZ ticks) the firmware slept in halIdle, per HAL_WAIT_*.
+ * With halTicks() that's the duty cycle: 1 - sum(sleepTicks) / ticks. Reported and reset every minute (ERROR_STATS).
+ */
+#define HAL_TICK_HZ 43200 // F_CPU / 256
+typedef struct {
+    uint32_t sleeps[HAL_WAITS];
+    uint32_t sleepTicks[HAL_WAITS];
+} HalStats;
+
+extern HalStats halStats;
+
+/**
+ * Payload of the ERROR_STATS packet (packet.h): halStats since the previous one, and the ticks that covers.
+ */
+typedef struct {
+    uint32_t ticks;
+    HalStats stats;
+} HalStatsReport;
+
+/**
+ * Wait until cond is false, asleep (on the AVR) until an interrupt changed something.
+ * cond is checked with interrupts off, so an interrupt that makes it false can't come in between the check and the
+ * sleep. Interrupts are on afterwards.
+ */
+#define halWaitWhile(cond, wait) do { \
+        halInterruptsDisable(); \
+        while (cond) { \
+            halIdle(wait); \
+            halInterruptsDisable(); \
+        } \
+        halInterruptsEnable(); \
+    } while (0)
+
+#ifdef __AVR__
+#include "hal_avr.h"
+#else
+#include "hal_host.h"
+#endif
+
+/*
+ * Both implementations provide:
+ *
+ * void halPinsInit(void)                   Port A inputs, port C outputs (except RF_SET).
+ * void halClockInit(void)                  Starts halTicks(), and the diagnostics.
+ * uint32_t halTicks(void)                  HAL_TICK_HZ ticks since halClockInit.
+ * void halOutputSet(uint8_t mask)          Port C, only HAL_OUTPUTS.
+ * void halOutputClear(uint8_t mask)
+ * void halOutputToggle(uint8_t mask)
+ * void halOutputWrite(uint8_t value)
+ * void halMeterUartInit(void)              115200 baud 8N1, RX only, HAL_METER_RX_VECT per byte.
+ * uint8_t halMeterRead(void)               The received byte, in HAL_METER_RX_VECT.
+ * void halRfUartInit(void)                 1200 baud 8N1, TX only.
+ * void halRfWrite(uint8_t byte)            Only when the data register is empty (first byte, or in HAL_RF_UDRE_VECT).
+ * void halRfTxInterrupt(bool enable)       HAL_RF_UDRE_VECT while the data register is empty.
+ * void halWatchdogEnable(void)             2 s.
+ * void halWatchdogReset(void)
+ * void halInterruptsEnable(void)
+ * void halInterruptsDisable(void)
+ * void halDelayMs(ms)                      Constant ms.
+ * void halIdle(uint8_t wait)               With interrupts off: enable them and sleep until one ran (use halWaitWhile).
+ *                                          wait is a HAL_WAIT_*.
+ */
+
+#endif //FIRMWARE_HAL_H
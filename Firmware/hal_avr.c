@@ -0,0 +1,8 @@
+#include "hal.h"
+
+HalStats halStats;
+volatile uint16_t halTickOverflows;
+
+ISR(TIMER1_OVF_vect) {
+    halTickOverflows++;
+}
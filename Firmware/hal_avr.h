@@ -0,0 +1,157 @@
+#ifndef FIRMWARE_HAL_AVR_H
+#define FIRMWARE_HAL_AVR_H
+
+/**
+ * hal.h on the ATmega128 at 11.0592 MHz. Include hal.h instead.
+ */
+
+#include <avr/io.h>
+#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+
+#define HAL_METER_RX_VECT   USART1_RX_vect
+#define HAL_RF_UDRE_VECT    USART0_UDRE_vect
+
+// Timer 1 overflows, counted by hal_avr.c.
+extern volatile uint16_t halTickOverflows;
+
+static inline void halPinsInit(void) {
+    DDRA = 0x00;
+    DDRC = 0x7F;
+#if LOW_POWER
+    ACSR = (1<<ACD);
+#endif
+}
+
+/**
+ * Timer 1, free running at F_CPU / 256 (HAL_TICK_HZ), overflows every 1.5 s.
+ * The overflow interrupt also wakes halIdle, so a single sleep always fits in 16 bits.
+ */
+static inline void halClockInit(void) {
+    TCCR1A = 0x00;
+    TCCR1B = (1<<CS12);
+    TIMSK |= (1<<TOIE1);
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+static inline uint32_t halTicks(void) {
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t low = TCNT1;
+    uint16_t high = halTickOverflows;
+    // Overflowed, but the interrupt didn't run yet.
+    if ((TIFR & (1<<TOV1)) && low < 0x8000) high++;
+    SREG = sreg;
+    return ((uint32_t) high << 16) | low;
+}
+
+static inline void halOutputSet(const uint8_t mask) {
+    PORTC |= mask & HAL_OUTPUTS;
+}
+
+static inline void halOutputClear(const uint8_t mask) {
+    PORTC &= ~mask;
+}
+
+static inline void halOutputToggle(const uint8_t mask) {
+    PORTC ^= mask & HAL_OUTPUTS;
+}
+
+static inline void halOutputWrite(const uint8_t value) {
+    PORTC = value & HAL_OUTPUTS;
+}
+
+/**
+ * UART 1 (P1 RX)
+ * 115200 baud, RX only, interrupt driven.
+ */
+static inline void halMeterUartInit(void) {
+    // 115200 baud, F_CPU 11.0592 MHz
+    // https://trolsoft.ru/en/uart-calc
+
+    // Set baud rate
+    UBRR1L = 0x05;
+    UBRR1H = 0x00;
+
+    // Enable RX and RX interrupts
+    UCSR1B= (1<<RXEN1) | (1<<RXCIE1);
+    // Set the "normal" 8N1 UART frame mode.
+    UCSR1C= (1<<UCSZ11) | (1<<UCSZ10);
+    UCSR1A= 0x00;
+
+    UCSR1A &= ~(1 << U2X1);
+}
+
+static inline uint8_t halMeterRead(void) {
+    return UDR1;
+}
+
+/**
+ * UART 0 (RF TX)
+ * 1200 baud, TX only, interrupt driven.
+ */
+static inline void halRfUartInit(void) {
+    // 1200 baud, F_CPU 11.0592 MHz
+    // https://trolsoft.ru/en/uart-calc
+
+    // Set baud rate
+    UBRR0L = 0x3F;
+    UBRR0H = 0x02;
+
+    // Enable TX.
+    UCSR0B= (1<<TXEN0);
+    // Set the "normal" 8N1 UART frame mode.
+    UCSR0C= (1<<UCSZ01) | (1<<UCSZ00);
+    UCSR0A= 0x00;
+
+    UCSR0A &= ~(1 << U2X0);
+}
+
+static inline void halRfWrite(const uint8_t byte) {
+    UDR0 = byte;
+}
+
+static inline void halRfTxInterrupt(const bool enable) {
+    if (enable) UCSR0B |= (1<<UDRIE0);
+    else UCSR0B &= ~(1<<UDRIE0);
+}
+
+static inline void halWatchdogEnable(void) {
+    wdt_enable(WDTO_2S);
+}
+
+static inline void halWatchdogReset(void) {
+    wdt_reset();
+}
+
+static inline void halInterruptsEnable(void) {
+    sei();
+}
+
+static inline void halInterruptsDisable(void) {
+    cli();
+}
+
+// _delay_ms needs a compile time constant.
+#define halDelayMs(ms) _delay_ms(ms)
+
+/**
+ * Idle sleep: the CPU stops, the UARTs and timer 1 keep running and their interrupts wake it (6 cycles, well within
+ * the 960 cycles a byte takes at 115200 baud, and the UART has a second receive buffer).
+ * Not sleep_mode(): the instruction after sei() always runs first, so an interrupt that arrives after the caller's
+ * check can't run before sleep_cpu() and leave the CPU asleep with the work it brought undone.
+ */
+static inline void halIdle(const uint8_t wait) {
+    const uint16_t start = TCNT1;
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    halStats.sleepTicks[wait] += (uint16_t) (TCNT1 - start);
+    halStats.sleeps[wait]++;
+}
+
+#endif //FIRMWARE_HAL_AVR_H
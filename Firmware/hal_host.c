@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include "hal.h"
+#include "packet.h"
+#include "crc.h"
+
+// hal_host.h renames main.c's main().
+#undef main
+
+#define NS 1000000000ULL
+#define WATCHDOG_NS (2 * NS)
+#define NEVER UINT64_MAX
+// Telegrams decoded by the receiver, waiting for the firmware's packet with the same timestamp.
+#define EXPECTED 64
+#define INPUT_CHUNK 4096
+
+/**
+ * What the AVR does while it's awake, in cycles, for the duty cycle estimate (the firmware takes no simulated time).
+ * Rough counts for avr-gcc -Os: a wake-up and the loop around halIdle, the RX interrupt and readLine per byte,
+ * parseLine per line, the UDRE interrupt per byte, and the bitwise crc16 over a packet.
+ */
+#define F_CPU_HZ 11059200.0
+#define CYCLES_WAKE 20
+#define CYCLES_RX_BYTE 60
+#define CYCLES_LINE 3000
+#define CYCLES_TX_BYTE 50
+#define CYCLES_PACKET 5000
+
+/**
+ * The simulated ATmega128 and what's connected to it.
+ * Times are ns since the start of the simulation. With a capture, time only moves when the firmware waits.
+ * With a tty, pty or fifo the clock follows the real one.
+ */
+static struct {
+    uint64_t now;
+    bool realtime;
+    uint64_t epoch; // Realtime: CLOCK_MONOTONIC at the start.
+    bool interrupts;
+    volatile sig_atomic_t stop;
+
+    uint8_t outputs;
+    uint64_t outputToggles[8];
+    uint64_t outputOnNs[8];
+    uint64_t outputsAt; // When outputs last changed.
+    uint64_t clockStart; // halClockInit.
+
+    // Supply current, mA: the CPU active, in idle sleep, and per LED that's on.
+    double activeMa;
+    double idleMa;
+    double ledMa;
+
+    // Meter UART: the input, with the time the next byte comes in.
+    bool rxEnabled;
+    uint64_t rxByteNs;
+    int meterFd;
+    uint8_t* input;
+    size_t inputLen;
+    size_t inputAt;
+    size_t inputCap;
+    bool inputEnd;
+    uint64_t rxNextAt;
+    uint64_t telegramInterval;
+    uint64_t nextTelegramAt;
+    uint32_t repeat; // Capture: times left to replay it.
+    uint8_t rxByte;
+    uint8_t rxPrevious;
+
+    // RF UART: data register and shift register.
+    bool txEnabled;
+    bool udrie;
+    uint64_t txByteNs;
+    bool udrFull;
+    uint8_t udr;
+    bool shifting;
+    uint8_t shifter;
+    uint64_t shiftDoneAt;
+    FILE* rfOut;
+
+    bool watchdog;
+    uint64_t watchdogAt;
+
+    // Receiver: the telegrams the meter sent, decoded on the host, and the packets that came out of the RF UART.
+    Packet expectedPackets[EXPECTED];
+    uint64_t expectedAt[EXPECTED]; // When the last byte went into the firmware.
+    uint32_t expectedHead;
+    Packet received;
+    MBusSlot receivedMbus[MBUS_CHANNELS];
+    ParserContext parser;
+    char line[1024];
+    uint16_t lineLen;
+    bool telegramLost; // A byte of this telegram was dropped.
+    uint8_t packet[sizeof(Packet)];
+    uint8_t packetLen;
+
+    struct {
+        uint64_t rxBytes;
+        uint64_t rxDropped; // Received while the RX interrupt was off.
+        uint64_t lines; // Lines the firmware got.
+        uint64_t telegrams;
+        uint64_t txBytes;
+        uint64_t txOverwrites; // Written while the data register was full.
+        uint64_t packets;
+        uint64_t errorPackets;
+        uint64_t badPackets; // Bytes skipped to find the next packet.
+        uint64_t matched;
+        uint64_t mismatched;
+        uint64_t unmatched; // A packet without telegram (timestamp), or a telegram that was lost on the way in.
+        uint64_t latencyNs;
+        uint64_t latencyMaxNs;
+        uint64_t waitMaxNs[HAL_WAITS];
+        // halStats is reset by every ERROR_STATS packet, these are the totals.
+        uint64_t sleeps[HAL_WAITS];
+        uint64_t sleepTicks[HAL_WAITS];
+        uint64_t statsPackets;
+        uint64_t reportedTicks; // Covered by ERROR_STATS packets.
+        uint64_t reportedSleepTicks;
+        uint64_t watchdogResets;
+        uint64_t watchdogKicks;
+    } stats;
+} sim;
+
+static uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+static double cpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+HalStats halStats;
+
+/**
+ * Duty cycle and supply current: sleeping is from halIdle, awake is the CYCLES_ estimate, LEDs are their on time.
+ */
+static void printPower(void) {
+    double seconds = (sim.now - sim.clockStart) / 1e9;
+    if (seconds <= 0) return;
+    uint64_t wakes = 0;
+    for (uint8_t w = 0; w < HAL_WAITS; w++) wakes += sim.stats.sleeps[w];
+    double cycles = (double) wakes * CYCLES_WAKE + (double) (sim.stats.rxBytes - sim.stats.rxDropped) * CYCLES_RX_BYTE
+                    + (double) sim.stats.lines * CYCLES_LINE + (double) sim.stats.txBytes * CYCLES_TX_BYTE
+                    + (double) sim.stats.packets * CYCLES_PACKET;
+    double duty = cycles / F_CPU_HZ / seconds;
+    if (duty > 1) duty = 1;
+    double leds = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+        if ((1 << i) & HAL_LEDS) leds += sim.outputOnNs[i] / 1e9 / seconds;
+    }
+    double cpuMa = sim.activeMa * duty + sim.idleMa * (1 - duty);
+    printf(", \"duty_cycle\": %.4f, \"leds_on_mean\": %.3f, \"current_ma\": %.1f, \"current_ma_cpu\": %.1f, "
+           "\"current_ma_busy_wait\": %.1f", duty, leds, cpuMa + sim.ledMa * leds, cpuMa,
+           sim.activeMa + sim.ledMa * leds);
+}
+
+static void printStats(void) {
+    static const char* const waits[HAL_WAITS] = {"rx", "tx", "hang"};
+    halOutputWrite(sim.outputs); // Count the LEDs' on time up to now.
+    printf("{\"sim_seconds\": %.3f, \"cpu_seconds\": %.3f, \"telegrams\": %lu, \"rx_bytes\": %lu, \"rx_dropped\": %lu, "
+           "\"tx_bytes\": %lu, \"tx_overwrites\": %lu, \"packets\": %lu, \"error_packets\": %lu, \"bad_packet_bytes\": %lu, "
+           "\"matched\": %lu, \"mismatched\": %lu, \"unmatched\": %lu, \"latency_ms_mean\": %.1f, \"latency_ms_max\": %.1f, "
+           "\"watchdog_kicks\": %lu, \"watchdog_resets\": %lu, \"cpu_us_per_telegram\": %.2f", sim.now / 1e9, cpuSeconds(),
+           sim.stats.telegrams, sim.stats.rxBytes, sim.stats.rxDropped, sim.stats.txBytes, sim.stats.txOverwrites,
+           sim.stats.packets, sim.stats.errorPackets, sim.stats.badPackets, sim.stats.matched, sim.stats.mismatched,
+           sim.stats.unmatched, sim.stats.matched ? sim.stats.latencyNs / 1e6 / sim.stats.matched : 0,
+           sim.stats.latencyMaxNs / 1e6, sim.stats.watchdogKicks, sim.stats.watchdogResets,
+           sim.stats.telegrams ? cpuSeconds() * 1e6 / sim.stats.telegrams : 0);
+    for (uint8_t w = 0; w < HAL_WAITS; w++) {
+        printf(", \"wait_%s\": %lu, \"wait_%s_seconds\": %.3f, \"wait_%s_ms_max\": %.1f", waits[w], sim.stats.sleeps[w],
+               waits[w], (double) sim.stats.sleepTicks[w] / HAL_TICK_HZ, waits[w], sim.stats.waitMaxNs[w] / 1e6);
+    }
+    // What the firmware itself reported. The simulated firmware takes no time, so it's asleep all of it.
+    printf(", \"stats_packets\": %lu, \"stats_seconds\": %.3f, \"stats_asleep_seconds\": %.3f", sim.stats.statsPackets,
+           (double) sim.stats.reportedTicks / HAL_TICK_HZ, (double) sim.stats.reportedSleepTicks / HAL_TICK_HZ);
+    printPower();
+    printf(", \"led_toggles\": [");
+    for (uint8_t i = 0; i < 8; i++) printf(i ? ", %lu" : "%lu", sim.outputToggles[i]);
+    printf("]}\n");
+}
+
+static void finish(const int status) {
+    if (sim.rfOut) fclose(sim.rfOut);
+    printStats();
+    exit(status);
+}
+
+/**
+ * Same fields, and same M-Bus gas value.
+ */
+static bool samePacket(const Packet* const a, const Packet* const b) {
+    for (Field f = 0; f < FIELD_COUNT; f++) {
+        uint32_t x = 0, y = 0;
+        if (packetField(a, f, &x) != packetField(b, f, &y) || x != y) return false;
+    }
+    return a->gas_volume == b->gas_volume;
+}
+
+/**
+ * A packet came out of the RF UART: find the telegram it was made from.
+ */
+static void checkPacket(const Packet* const p) {
+    sim.stats.packets++;
+    if (p->pre[2] != 0xFF && p->error == ERROR_STATS && p->error_payload_len == sizeof(HalStatsReport)) {
+        HalStatsReport report;
+        memcpy(&report, p->error_payload, sizeof(report));
+        sim.stats.statsPackets++;
+        sim.stats.reportedTicks += report.ticks;
+        for (uint8_t w = 0; w < HAL_WAITS; w++) sim.stats.reportedSleepTicks += report.stats.sleepTicks[w];
+        return;
+    }
+    if (p->pre[2] != 0xFF) {
+        sim.stats.errorPackets++;
+        return;
+    }
+    for (uint32_t i = 0; i < EXPECTED; i++) {
+        uint32_t slot = (sim.expectedHead - 1 - i) % EXPECTED;
+        if (sim.expectedAt[slot] == 0 || sim.expectedPackets[slot].timestamp != p->timestamp) continue;
+        if (samePacket(&sim.expectedPackets[slot], p)) {
+            uint64_t latency = sim.now - sim.expectedAt[slot];
+            sim.stats.matched++;
+            sim.stats.latencyNs += latency;
+            if (latency > sim.stats.latencyMaxNs) sim.stats.latencyMaxNs = latency;
+        } else {
+            sim.stats.mismatched++;
+        }
+        sim.expectedAt[slot] = 0;
+        return;
+    }
+    sim.stats.unmatched++;
+}
+
+/**
+ * A byte went out of the RF UART: find packets in the stream, like a receiver would (pre 0x42 0xAA, post 0x55 0xAA).
+ */
+static void receiveRf(const uint8_t byte) {
+    sim.stats.txBytes++;
+    if (sim.rfOut) {
+        fputc(byte, sim.rfOut);
+        if (sim.realtime) fflush(sim.rfOut);
+    }
+    sim.packet[sim.packetLen++] = byte;
+    while (sim.packetLen > 0) {
+        bool sync = sim.packet[0] == 0x42 && (sim.packetLen < 2 || sim.packet[1] == 0xAA);
+        if (sync && sim.packetLen < sizeof(Packet)) return;
+        if (sync) {
+            Packet p;
+            memcpy(&p, sim.packet, sizeof(Packet));
+            uint16_t checksum = p.checksum;
+            p.checksum = 0;
+            if (p.post[0] == 0x55 && p.post[1] == 0xAA && crc16(0, (const char*) &p, sizeof(Packet)) == checksum) {
+                p.checksum = checksum;
+                checkPacket(&p);
+                sim.packetLen = 0;
+                return;
+            }
+        }
+        sim.stats.badPackets++;
+        memmove(sim.packet, sim.packet + 1, --sim.packetLen);
+    }
+}
+
+/**
+ * A byte went into the firmware: decode the telegrams on the host too, to check the firmware's packets.
+ */
+static void receiveMeter(const uint8_t byte, const bool dropped) {
+    if (dropped) sim.telegramLost = true;
+    else if (byte == '\n') sim.stats.lines++;
+    if (sim.lineLen < sizeof(sim.line) - 1) sim.line[sim.lineLen++] = byte;
+    if (byte != '\n') return;
+    sim.line[sim.lineLen] = 0;
+    if (sim.line[0] == '/') {
+        resetParser(&sim.parser);
+        sim.telegramLost = dropped;
+    } else if (sim.line[0] == '!') {
+        sim.stats.telegrams++;
+        if (!sim.telegramLost && sim.received.timestamp != 0xFFFFFFFF) {
+            sim.expectedPackets[sim.expectedHead % EXPECTED] = sim.received;
+            sim.expectedAt[sim.expectedHead % EXPECTED] = sim.now;
+            sim.expectedHead++;
+        }
+    } else {
+        parseLineWith(&sim.parser, sim.lineLen, sim.line);
+    }
+    sim.lineLen = 0;
+}
+
+/**
+ * Realtime: read what the meter sent, waiting at most until (simulated) time until.
+ */
+static void readMeter(const uint64_t until) {
+    uint64_t now = monotonic() - sim.epoch;
+    int timeout = until == NEVER ? -1 : until > now ? (int) ((until - now + 999999) / 1000000) : 0;
+    struct pollfd pfd = {sim.meterFd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) > 0) {
+        if (sim.inputAt > 0) {
+            memmove(sim.input, sim.input + sim.inputAt, sim.inputLen - sim.inputAt);
+            sim.inputLen -= sim.inputAt;
+            sim.inputAt = 0;
+        }
+        if (sim.inputLen + INPUT_CHUNK > sim.inputCap) {
+            sim.inputCap = sim.inputLen + INPUT_CHUNK;
+            sim.input = realloc(sim.input, sim.inputCap);
+        }
+        ssize_t n = read(sim.meterFd, sim.input + sim.inputLen, INPUT_CHUNK);
+        if (n > 0) {
+            uint64_t arrived = monotonic() - sim.epoch;
+            if (sim.inputAt == sim.inputLen && sim.rxNextAt < arrived) sim.rxNextAt = arrived;
+            sim.inputLen += n;
+        } else if (n == 0 || errno != EAGAIN) {
+            // pty closed (EIO) or end of the fifo.
+            sim.inputEnd = true;
+        }
+    }
+    sim.now = monotonic() - sim.epoch;
+}
+
+static bool rxPending(void) {
+    if (sim.inputAt == sim.inputLen && !sim.realtime && sim.repeat > 1) {
+        sim.repeat--;
+        sim.inputAt = 0;
+    }
+    return sim.inputAt < sim.inputLen;
+}
+
+/**
+ * The next byte from the meter arrives.
+ */
+static void rxByte(void) {
+    uint8_t byte = sim.input[sim.inputAt++];
+    bool deliver = sim.rxEnabled && sim.interrupts;
+    sim.stats.rxBytes++;
+    if (deliver) {
+        sim.rxByte = byte;
+        halMeterRxIsr();
+    } else {
+        sim.stats.rxDropped++;
+    }
+    receiveMeter(byte, !deliver);
+    sim.rxPrevious = byte;
+
+    sim.rxNextAt += sim.rxByteNs;
+    // Capture: telegrams start every telegramInterval, like the meter sends them.
+    if (!sim.realtime && rxPending() && sim.input[sim.inputAt] == '/' && byte == '\n') {
+        if (sim.rxNextAt < sim.nextTelegramAt) sim.rxNextAt = sim.nextTelegramAt;
+        sim.nextTelegramAt = sim.rxNextAt + sim.telegramInterval;
+    }
+}
+
+/**
+ * The shift register is done with a byte: the next one comes out of the data register.
+ */
+static void txShifted(void) {
+    receiveRf(sim.shifter);
+    if (sim.udrFull) {
+        sim.shifter = sim.udr;
+        sim.udrFull = false;
+        sim.shiftDoneAt += sim.txByteNs;
+    } else {
+        sim.shifting = false;
+    }
+}
+
+/**
+ * Run the UDRE interrupt if it's due (it's level triggered: as long as the data register is empty).
+ * @return Whether it ran.
+ */
+static bool udre(void) {
+    if (!sim.interrupts || !sim.txEnabled || !sim.udrie || sim.udrFull) return false;
+    halRfUdreIsr();
+    return true;
+}
+
+/**
+ * Let time pass until the next event (or until, if that's earlier), and handle it.
+ * @return false if nothing happened before until.
+ */
+static bool step(const uint64_t until) {
+    if (udre()) return true;
+    while (true) {
+        if (sim.stop) finish(0);
+        uint64_t next = NEVER;
+        if (sim.shifting) next = sim.shiftDoneAt;
+        bool rx = rxPending();
+        if (rx && sim.rxNextAt < next) next = sim.rxNextAt;
+        bool done = next == NEVER && (!sim.realtime || sim.inputEnd);
+        if (sim.watchdog && sim.watchdogAt < next) next = sim.watchdogAt;
+        if (done && until == NEVER) {
+            // Nothing left that could wake the firmware up.
+            finish(0);
+        }
+        if (until < next) next = until;
+
+        if (sim.realtime) {
+            if (!sim.inputEnd) {
+                // Wait for the meter, or until next.
+                readMeter(next);
+                if (sim.now < next) continue;
+            } else if (next != NEVER && next > monotonic() - sim.epoch) {
+                uint64_t wait = next - (monotonic() - sim.epoch);
+                struct timespec ts = {wait / NS, wait % NS};
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (next > sim.now) sim.now = next;
+
+        if (sim.watchdog && sim.now >= sim.watchdogAt) {
+            // The real thing reboots, here that's the end.
+            sim.stats.watchdogResets++;
+            fprintf(stderr, "Watchdog reset at %.3f s\n", sim.now / 1e9);
+            finish(2);
+        }
+        if (sim.shifting && sim.now >= sim.shiftDoneAt) {
+            txShifted();
+            if (udre()) return true;
+            continue;
+        }
+        if (rx && sim.now >= sim.rxNextAt) {
+            rxByte();
+            return true;
+        }
+        if (sim.now >= until) return false;
+    }
+}
+
+void halPinsInit(void) {
+}
+
+void halClockInit(void) {
+    sim.clockStart = sim.now;
+}
+
+uint32_t halTicks(void) {
+    return (sim.now - sim.clockStart) * HAL_TICK_HZ / NS;
+}
+
+void halOutputWrite(uint8_t value) {
+    value &= HAL_OUTPUTS;
+    for (uint8_t i = 0; i < 8; i++) {
+        if (sim.outputs & (1 << i)) sim.outputOnNs[i] += sim.now - sim.outputsAt;
+        if ((sim.outputs ^ value) & (1 << i)) sim.outputToggles[i]++;
+    }
+    sim.outputs = value;
+    sim.outputsAt = sim.now;
+}
+
+void halOutputSet(const uint8_t mask) {
+    halOutputWrite(sim.outputs | mask);
+}
+
+void halOutputClear(const uint8_t mask) {
+    halOutputWrite(sim.outputs & ~mask);
+}
+
+void halOutputToggle(const uint8_t mask) {
+    halOutputWrite(sim.outputs ^ mask);
+}
+
+void halMeterUartInit(void) {
+    sim.rxEnabled = true;
+}
+
+uint8_t halMeterRead(void) {
+    return sim.rxByte;
+}
+
+void halRfUartInit(void) {
+    sim.txEnabled = true;
+}
+
+void halRfWrite(const uint8_t byte) {
+    if (!sim.txEnabled) return;
+    if (!sim.shifting) {
+        sim.shifter = byte;
+        sim.shifting = true;
+        sim.shiftDoneAt = sim.now + sim.txByteNs;
+        return;
+    }
+    if (sim.udrFull) sim.stats.txOverwrites++;
+    sim.udr = byte;
+    sim.udrFull = true;
+}
+
+void halRfTxInterrupt(const bool enable) {
+    sim.udrie = enable;
+}
+
+void halWatchdogEnable(void) {
+    sim.watchdog = true;
+    halWatchdogReset();
+}
+
+void halWatchdogReset(void) {
+    sim.stats.watchdogKicks++;
+    sim.watchdogAt = sim.now + WATCHDOG_NS;
+}
+
+void halInterruptsEnable(void) {
+    sim.interrupts = true;
+}
+
+void halInterruptsDisable(void) {
+    sim.interrupts = false;
+}
+
+void halDelayMs(const double ms) {
+    const uint64_t until = sim.now + (uint64_t) (ms * 1e6);
+    while (step(until));
+}
+
+/**
+ * Like the AVR: interrupts on, asleep until one ran.
+ */
+void halIdle(const uint8_t wait) {
+    uint64_t start = sim.now;
+    uint32_t startTicks = halTicks();
+    sim.interrupts = true;
+    step(NEVER);
+    uint64_t waited = sim.now - start;
+    uint32_t ticks = halTicks() - startTicks;
+    halStats.sleeps[wait]++;
+    halStats.sleepTicks[wait] += ticks;
+    sim.stats.sleeps[wait]++;
+    sim.stats.sleepTicks[wait] += ticks;
+    if (waited > sim.stats.waitMaxNs[wait]) sim.stats.waitMaxNs[wait] = waited;
+}
+
+static void onSignal(int sig) {
+    (void) sig;
+    sim.stop = true;
+}
+
+/**
+ * Open the meter side: a capture is read into memory, a tty, pty or fifo is read as it comes.
+ */
+static void openMeter(const char* const path) {
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Failed to open %s\n", path);
+        exit(-1);
+    }
+    if (S_ISREG(st.st_mode)) {
+        sim.inputCap = st.st_size + 1;
+        sim.input = malloc(sim.inputCap);
+        sim.inputLen = read(fd, sim.input, st.st_size);
+        sim.inputEnd = true;
+        close(fd);
+        return;
+    }
+    if (isatty(fd)) {
+        struct termios tio;
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            cfsetspeed(&tio, B115200);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    sim.meterFd = fd;
+    sim.realtime = true;
+    sim.epoch = monotonic();
+}
+
+/**
+ * Open the RF side: "pty" creates one (and prints its name), anything else is a file, tty or fifo.
+ */
+static void openRf(const char* const path) {
+    if (strcmp(path, "pty") == 0) {
+        int fd = posix_openpt(O_RDWR | O_NOCTTY);
+        struct termios tio;
+        if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+            puts("Failed to create pty");
+            exit(-1);
+        }
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+        printf("RF output on %s\n", ptsname(fd));
+        fflush(stdout);
+        sim.rfOut = fdopen(fd, "w");
+    } else {
+        sim.rfOut = fopen(path, "w");
+    }
+    if (sim.rfOut == NULL) {
+        printf("Failed to open %s\n", path);
+        exit(-1);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* meter = NULL;
+    const char* rf = NULL;
+    double interval = 1000, meterBaud = 115200, rfBaud = 1200;
+    sim.repeat = 1;
+    // ATmega128 typicals at 8 MHz, 5 V scaled to 11.0592 MHz, and an LED at about 5 mA. Measure the real ones.
+    sim.activeMa = 25;
+    sim.idleMa = 10;
+    sim.ledMa = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) rf = argv[++i];
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) interval = atof(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) meterBaud = atof(argv[++i]);
+        else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) rfBaud = atof(argv[++i]);
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) sim.repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) sim.activeMa = atof(argv[++i]);
+        else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) sim.idleMa = atof(argv[++i]);
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) sim.ledMa = atof(argv[++i]);
+        else if (meter == NULL) meter = argv[i];
+    }
+    if (meter == NULL || meterBaud <= 0 || rfBaud <= 0) {
+        puts("Usage: firmware_x64 <capture.txt | tty | pty | fifo> [-o rf output | -o pty] [-i telegram interval ms]\n"
+             "                    [-b meter baud] [-B rf baud] [-x repeat the capture]\n"
+             "                    [-A active mA] [-I idle mA] [-L mA per LED]\n"
+             "  Runs the firmware (main.c) on a simulated byte clock, 10 bits per byte. A capture is sent one telegram\n"
+             "  per interval (0 = back to back) as fast as the simulation goes, a tty, pty or fifo in real time.\n"
+             "  Every packet on the RF side is checked against the telegram it came from.\n"
+             "  Prints the duty cycle (time asleep in halIdle) and the estimated supply current at exit.");
+        return -1;
+    }
+    if (sim.repeat == 0) sim.repeat = 1;
+    sim.rxByteNs = 10 * NS / meterBaud;
+    sim.txByteNs = 10 * NS / rfBaud;
+    sim.telegramInterval = interval * 1e6;
+    sim.nextTelegramAt = sim.telegramInterval;
+    sim.meterFd = -1;
+    initParser(&sim.parser, &sim.received, sim.receivedMbus);
+    openMeter(meter);
+    if (rf) openRf(rf);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    firmwareMain();
+    finish(0);
+}
@@ -0,0 +1,39 @@
+#ifndef FIRMWARE_HAL_HOST_H
+#define FIRMWARE_HAL_HOST_H
+
+/**
+ * hal.h on Linux, implemented by hal_host.c. Include hal.h instead.
+ */
+
+// The interrupt handlers are plain functions, called by the simulation.
+#define ISR(vector) void vector(void)
+#define HAL_METER_RX_VECT   halMeterRxIsr
+#define HAL_RF_UDRE_VECT    halRfUdreIsr
+
+void halMeterRxIsr(void);
+void halRfUdreIsr(void);
+
+// main.c's main() is started by hal_host.c's main(), after the simulation is set up.
+#define main firmwareMain
+int firmwareMain(void);
+
+void halPinsInit(void);
+void halClockInit(void);
+uint32_t halTicks(void);
+void halOutputSet(uint8_t mask);
+void halOutputClear(uint8_t mask);
+void halOutputToggle(uint8_t mask);
+void halOutputWrite(uint8_t value);
+void halMeterUartInit(void);
+uint8_t halMeterRead(void);
+void halRfUartInit(void);
+void halRfWrite(uint8_t byte);
+void halRfTxInterrupt(bool enable);
+void halWatchdogEnable(void);
+void halWatchdogReset(void);
+void halInterruptsEnable(void);
+void halInterruptsDisable(void);
+void halDelayMs(double ms);
+void halIdle(uint8_t wait);
+
+#endif //FIRMWARE_HAL_HOST_H
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "influx.h"
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool influxInit(InfluxClient* const client, const char* url, const bool gzip) {
+    memset(client, 0, sizeof(InfluxClient));
+    client->fd = -1;
+    if (strncmp(url, "http://", 7) == 0) url += 7;
+    size_t hostLen = strcspn(url, ":/");
+    if (hostLen == 0 || hostLen >= sizeof(client->host)) return false;
+    memcpy(client->host, url, hostLen);
+    url += hostLen;
+    strcpy(client->port, "8086");
+    if (*url == ':') {
+        size_t portLen = strcspn(++url, "/");
+        if (portLen == 0 || portLen >= sizeof(client->port)) return false;
+        memcpy(client->port, url, portLen);
+        client->port[portLen] = 0;
+        url += portLen;
+    }
+    if (*url != '/' || url[1] == 0) return false;
+    if (snprintf(client->path, sizeof(client->path), "/write?db=%s&precision=s", url + 1) >= (int) sizeof(client->path)) return false;
+
+    client->gzip = gzip;
+    // Level 1: a telegram is mostly field names and digits that repeat, higher levels cost CPU for a few %.
+    if (gzip && deflateInit2(&client->zlib, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    return true;
+}
+
+static void disconnect(InfluxClient* const client) {
+    if (client->fd >= 0) close(client->fd);
+    client->fd = -1;
+}
+
+static bool connectServer(InfluxClient* const client) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* result;
+    if (getaddrinfo(client->host, client->port, &hints, &result) != 0) return false;
+    for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        struct timeval timeout = {INFLUX_TIMEOUT_MS / 1000, (INFLUX_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        // Headers and body are one sendmsg, don't let Nagle hold back the last segment.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            client->fd = fd;
+            client->stats.connects++;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(result);
+    return client->fd >= 0;
+}
+
+static bool sendAll(InfluxClient* const client, struct iovec* iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+        ssize_t n = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        client->stats.wireBytes += n;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static const char* findHeader(const char* headers, const char* name) {
+    size_t len = strlen(name);
+    for (const char* line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, len) == 0) return line + 2 + len;
+    }
+    return NULL;
+}
+
+/**
+ * Read the response headers, and skip the body.
+ * @return The status, 0 if the connection failed.
+ */
+static int readResponse(InfluxClient* const client) {
+    size_t len = 0;
+    char* end = NULL;
+    char* buf = client->response;
+    while (end == NULL) {
+        if (len == sizeof(client->response) - 1) return 0;
+        ssize_t n = recv(client->fd, buf + len, sizeof(client->response) - 1 - len, 0);
+        if (n <= 0) return 0;
+        len += n;
+        buf[len] = 0;
+        end = strstr(buf, "\r\n\r\n");
+    }
+    int status = 0;
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) return 0;
+    end[2] = 0; // findHeader only looks at the headers.
+
+    const char* contentLength = findHeader(buf, "Content-Length:");
+    size_t body = contentLength ? strtoul(contentLength, NULL, 10) : 0;
+    const char* connection = findHeader(buf, "Connection:");
+    bool closeAfter = connection != NULL && strstr(connection, "close") != NULL;
+    size_t have = len - (end + 4 - buf);
+    while (have < body) {
+        // Error bodies are small JSON, not worth keeping.
+        ssize_t n = recv(client->fd, buf, sizeof(client->response) - 1, 0);
+        if (n <= 0) return 0;
+        have += n;
+    }
+    if (closeAfter) disconnect(client);
+    return status;
+}
+
+static bool gzipBody(InfluxClient* const client, const char* const lines, const size_t len) {
+    z_stream* z = &client->zlib;
+    LineBuffer* out = &client->compressed;
+    out->len = 0;
+    if (!lineBufferReserve(out, deflateBound(z, len))) return false;
+    deflateReset(z);
+    z->next_in = (Bytef*) lines;
+    z->avail_in = len;
+    z->next_out = (Bytef*) out->data;
+    z->avail_out = out->cap;
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) return false;
+    out->len = z->total_out;
+    return true;
+}
+
+bool influxWrite(InfluxClient* const client, const char* lines, size_t len) {
+    client->stats.requests++;
+    client->stats.bodyBytes += len;
+    client->stats.lastStatus = 0;
+    if (client->gzip) {
+        if (!gzipBody(client, lines, len)) {
+            client->stats.failures++;
+            return false;
+        }
+        lines = client->compressed.data;
+        len = client->compressed.len;
+    }
+    int headerLen = snprintf(client->header, sizeof(client->header),
+                             "POST %s HTTP/1.1\r\n"
+                             "Host: %s:%s\r\n"
+                             "Content-Type: text/plain; charset=utf-8\r\n"
+                             "%s"
+                             "Content-Length: %zu\r\n"
+                             "\r\n",
+                             client->path, client->host, client->port,
+                             client->gzip ? "Content-Encoding: gzip\r\n" : "", len);
+
+    uint64_t start = nowNs();
+    int status = 0;
+    for (int attempt = 0; attempt < 2 && status == 0; attempt++) {
+        bool reused = client->fd >= 0;
+        if (!reused && !connectServer(client)) break;
+        struct iovec iov[2] = {{client->header, headerLen}, {(void*) lines, len}};
+        if (sendAll(client, iov, 2)) status = readResponse(client);
+        if (status == 0) {
+            disconnect(client);
+            // Only a connection that sat idle gets another chance, a new one that fails is down.
+            if (!reused) break;
+        }
+    }
+    client->stats.requestNs += nowNs() - start;
+    client->stats.lastStatus = status;
+    if (status < 200 || status >= 300) {
+        client->stats.failures++;
+        return false;
+    }
+    return true;
+}
+
+void influxClose(InfluxClient* const client) {
+    disconnect(client);
+    if (client->gzip) deflateEnd(&client->zlib);
+    lineBufferFree(&client->compressed);
+}
@@ -0,0 +1,68 @@
+#ifndef FIRMWARE_INFLUX_H
+#define FIRMWARE_INFLUX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#include "lineproto.h"
+
+/**
+ * Minimal InfluxDB 1.x /write client: line protocol over one keep-alive HTTP/1.1 connection, optionally gzipped.
+ * Host only. Not thread safe, one writer per client.
+ *
+ * A write that fails on a connection that was idle (the server closed it) is retried once on a new connection.
+ * All buffers (request headers, gzip output, response) are reused, nothing is allocated after the first writes.
+ */
+
+#define INFLUX_TIMEOUT_MS 10000
+
+typedef struct {
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t connects;
+    /**
+     * Line protocol bytes, and bytes on the wire (headers + compressed body).
+     */
+    uint64_t bodyBytes;
+    uint64_t wireBytes;
+    /**
+     * Send to response, ns.
+     */
+    uint64_t requestNs;
+    /**
+     * Status of the last response, 0 if there was none (connection error).
+     */
+    int lastStatus;
+} InfluxStats;
+
+typedef struct {
+    char host[128];
+    char port[8];
+    char path[256]; // "/write?db=...&precision=s"
+    int fd;
+    bool gzip;
+    z_stream zlib;
+    LineBuffer compressed;
+    char header[512];
+    char response[1024];
+    InfluxStats stats;
+} InfluxClient;
+
+/**
+ * @param url http://host[:port]/database (port 8086 by default).
+ * @param gzip Compress the bodies (Content-Encoding: gzip).
+ * @return false if the url can't be parsed.
+ */
+bool influxInit(InfluxClient* client, const char* url, bool gzip);
+
+/**
+ * POST lines (line protocol, timestamps in seconds) to /write. Connects if needed.
+ * @return true if InfluxDB accepted them (2xx).
+ */
+bool influxWrite(InfluxClient* client, const char* lines, size_t len);
+
+void influxClose(InfluxClient* client);
+
+#endif //FIRMWARE_INFLUX_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "lineproto.h"
+#include "influx.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    Packet packet;
+    MBusSlot mbus[MBUS_CHANNELS];
+    char header[64];
+    char meterId[33];
+} Telegram;
+
+/**
+ * All telegrams, repeated up to count (if count > 0), timestamps 1 s apart.
+ * The CRC isn't checked: most captures were made on Linux and lost their CR's.
+ */
+static Telegram *loadCapture(const char *capture, uint32_t *count) {
+    FILE *fp = fopen(capture, "r");
+    if (fp == NULL) error("Failed to open capture.");
+    uint32_t n = 0, cap = 1024;
+    Telegram *telegrams = malloc(cap * sizeof(Telegram));
+    Telegram t;
+    ParserContext ctx;
+    initParser(&ctx, &t.packet, t.mbus);
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, fp)) != -1) {
+        if (line[0] == '/') {
+            resetParser(&ctx);
+            t.meterId[0] = 0;
+            sscanf(line + 1, "%63[^\r\n]", t.header);
+        }
+        if (line[0] == '!') {
+            if (n == cap) telegrams = realloc(telegrams, (cap *= 2) * sizeof(Telegram));
+            telegrams[n++] = t;
+            continue;
+        }
+        if (strncmp(line, "0-0:96.1.1(", 11) == 0) sscanf(line + 11, "%32[0-9A-Fa-f]", t.meterId);
+        parseLineWith(&ctx, len, line);
+    }
+    free(line);
+    fclose(fp);
+    if (n == 0) error("No telegrams in the capture.");
+
+    uint32_t total = *count ? *count : n;
+    telegrams = realloc(telegrams, total * sizeof(Telegram));
+    for (uint32_t i = n; i < total; i++) telegrams[i] = telegrams[i % n];
+    uint32_t start = time(NULL) - total;
+    for (uint32_t i = 0; i < total; i++) telegrams[i].packet.timestamp = start + i;
+    *count = total;
+    return telegrams;
+}
+
+int main(int argc, char **argv) {
+    const char *args[2] = {NULL, NULL};
+    int nargs = 0;
+    uint32_t batch = 64, count = 0;
+    bool gzip = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-z") == 0) gzip = true;
+        else if (nargs < 2) args[nargs++] = argv[i];
+    }
+    if (nargs == 0 || batch == 0) {
+        error("Usage: influx_x64 <capture.txt> [http://host:port/db] [-b telegrams per request] [-n telegrams] [-z]\n"
+              "  Encodes the telegrams of a capture as line protocol (p1_human), and writes them if a url is given.\n"
+              "  Timestamps are replaced, 1 s apart, ending now. -n repeats the capture to get that many telegrams.");
+    }
+
+    Telegram *telegrams = loadCapture(args[0], &count);
+    LineBuffer lines = {NULL, 0, 0};
+
+    // Encoding only, the buffer is reused per batch like in the gateway.
+    uint64_t bytes = 0;
+    double start = now();
+    for (uint32_t i = 0; i < count; i++) {
+        Telegram *t = &telegrams[i];
+        lineProtoTelegram(&lines, LINEPROTO_MEASUREMENT, t->header, t->meterId, &t->packet, t->mbus);
+        if ((i + 1) % batch == 0 || i + 1 == count) {
+            bytes += lines.len;
+            lines.len = 0;
+        }
+    }
+    double encode = now() - start;
+    printf("{\"telegrams\": %u, \"encode_ns_per_telegram\": %.1f, \"bytes_per_telegram\": %.1f, \"encode_mb_per_second\": %.1f}\n",
+           count, encode * 1e9 / count, (double) bytes / count, bytes / encode / 1e6);
+
+    if (nargs == 2) {
+        InfluxClient client;
+        if (!influxInit(&client, args[1], gzip)) error("Bad url, use http://host:port/database.");
+        start = now();
+        for (uint32_t i = 0; i < count; i++) {
+            Telegram *t = &telegrams[i];
+            lineProtoTelegram(&lines, LINEPROTO_MEASUREMENT, t->header, t->meterId, &t->packet, t->mbus);
+            if ((i + 1) % batch == 0 || i + 1 == count) {
+                influxWrite(&client, lines.data, lines.len);
+                lines.len = 0;
+            }
+        }
+        double elapsed = now() - start;
+        const InfluxStats *s = &client.stats;
+        // A meter sends a telegram per second: one request per batch of its telegrams.
+        printf("{\"batch\": %u, \"gzip\": %s, \"seconds\": %.3f, \"telegrams_per_second\": %.0f, \"requests\": %lu, "
+               "\"failures\": %lu, \"connects\": %lu, \"last_status\": %d, \"body_bytes_per_second\": %.0f, \"wire_bytes_per_second\": %.0f, "
+               "\"wire_bytes_per_telegram\": %.1f, \"request_mean_ms\": %.3f, \"requests_per_day_per_meter\": %.0f}\n",
+               batch, gzip ? "true" : "false", elapsed, count / elapsed, s->requests, s->failures, s->connects, s->lastStatus,
+               s->bodyBytes / elapsed, s->wireBytes / elapsed, (double) s->wireBytes / count,
+               s->requests ? s->requestNs / 1e6 / s->requests : 0, 86400.0 / batch);
+        influxClose(&client);
+    }
+    lineBufferFree(&lines);
+    free(telegrams);
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <string.h>
+#include <stdlib.h>
+#include "lineproto.h"
+
+typedef struct {
+    const char* name; // Human name, as in P1logger/obis.py.
+    uint8_t nameLen;
+    uint8_t decimals; // Packet units -> human units.
+    bool integer; // Integer field (i suffix) instead of a float.
+} FieldFormat;
+
+#define F(name, decimals, integer) {name, sizeof(name) - 1, decimals, integer}
+
+// Indexed by Field.
+static const FieldFormat formats[FIELD_COUNT] = {
+        [FIELD_TIMESTAMP] = F("time", 0, true), // Not a field, the timestamp of the line.
+        [FIELD_TARIFF] = F("tariff", 0, true),
+        [FIELD_METER_T1_DELIVERED] = F("meter_t1_used", 3, false),
+        [FIELD_METER_T2_DELIVERED] = F("meter_t2_used", 3, false),
+        [FIELD_METER_T1_INJECTED] = F("meter_t1_injected", 3, false),
+        [FIELD_METER_T2_INJECTED] = F("meter_t2_injected", 3, false),
+        [FIELD_SUM_POWER_DELIVERED] = F("power_used", 3, false),
+        [FIELD_SUM_POWER_INJECTED] = F("power_injected", 3, false),
+        [FIELD_POWER_P1_DELIVERED] = F("power_l1_pos", 3, false),
+        [FIELD_POWER_P2_DELIVERED] = F("power_l2_pos", 3, false),
+        [FIELD_POWER_P3_DELIVERED] = F("power_l3_pos", 3, false),
+        [FIELD_POWER_P1_INJECTED] = F("power_l1_neg", 3, false),
+        [FIELD_POWER_P2_INJECTED] = F("power_l2_neg", 3, false),
+        [FIELD_POWER_P3_INJECTED] = F("power_l3_neg", 3, false),
+        [FIELD_VOLTAGE_P1] = F("voltage_l1", 1, false),
+        [FIELD_VOLTAGE_P2] = F("voltage_l2", 1, false),
+        [FIELD_VOLTAGE_P3] = F("voltage_l3", 1, false),
+        [FIELD_CURRENT_P1] = F("current_l1", 2, false),
+        [FIELD_CURRENT_P2] = F("current_l2", 2, false),
+        [FIELD_CURRENT_P3] = F("current_l3", 2, false),
+};
+
+#undef F
+
+// Longest field: name (< 20) + '=' + 10 digits + '.' + 'i' + ','
+#define FIELD_MAX 36
+// mbusN_value=..., mbusN_value_time=...i, mbusN_device_type=...i, mbusN_id="..." (escaped).
+#define MBUS_MAX (3 * FIELD_MAX + 12 + 2 * MBUS_ID_MAX_LEN)
+
+static const char digitPairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+static const uint32_t powers[10] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+bool lineBufferReserve(LineBuffer* const buf, const size_t n) {
+    if (buf->len + n <= buf->cap) return true;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + n) cap *= 2;
+    char* data = realloc(buf->data, cap);
+    if (data == NULL) return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+void lineBufferFree(LineBuffer* const buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(LineBuffer));
+}
+
+static inline uint8_t digitCount(const uint32_t v) {
+    uint8_t n = 1;
+    while (n < 10 && v >= powers[n]) n++;
+    return n;
+}
+
+/**
+ * Exactly n digits of v (zero padded), two at a time from the back.
+ */
+static inline char* writeDigits(char* const out, uint32_t v, const uint8_t n) {
+    char* p = out + n;
+    while (p - out >= 2) {
+        p -= 2;
+        memcpy(p, digitPairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (p != out) *--p = (char) ('0' + v % 10);
+    return out + n;
+}
+
+char* lineProtoU32(char* const out, const uint32_t v) {
+    return writeDigits(out, v, digitCount(v));
+}
+
+char* lineProtoFixed(char* out, const uint32_t v, const uint8_t decimals) {
+    if (decimals == 0) return lineProtoU32(out, v);
+    out = lineProtoU32(out, v / powers[decimals]);
+    *out++ = '.';
+    return writeDigits(out, v % powers[decimals], decimals);
+}
+
+/**
+ * Tag values: escape ',', ' ' and '='. Stops at the end of the string or a control character.
+ */
+static char* writeTag(char* out, const char* s) {
+    for (; *s >= ' '; s++) {
+        if (*s == ',' || *s == ' ' || *s == '=' || *s == '\\') *out++ = '\\';
+        *out++ = *s;
+    }
+    return out;
+}
+
+static inline char* writeName(char* out, const char* name, const size_t len) {
+    memcpy(out, name, len);
+    return out + len;
+}
+
+static inline char* writeMBusName(char* out, const uint8_t channel, const char* name, const size_t len) {
+    memcpy(out, "mbus", 4);
+    out[4] = (char) ('1' + channel);
+    out[5] = '_';
+    memcpy(out + 6, name, len);
+    return out + 6 + len;
+}
+
+bool lineProtoTelegram(LineBuffer* const buf, const char* const measurement, const char* const header,
+                       const char* const meterId, const Packet* const p, const MBusSlot* const mbus) {
+    size_t headerLen = header ? strlen(header) : 0;
+    size_t meterLen = meterId ? strlen(meterId) : 0;
+    size_t max = strlen(measurement) + 2 * headerLen + 2 * meterLen + 16 + FIELD_COUNT * FIELD_MAX
+                 + MBUS_CHANNELS * MBUS_MAX + 12;
+    if (!lineBufferReserve(buf, max)) return false;
+
+    char* const start = buf->data + buf->len;
+    char* out = writeName(start, measurement, strlen(measurement));
+    if (headerLen) {
+        out = writeName(out, ",header=", 8);
+        out = writeTag(out, header);
+    }
+    if (meterLen) {
+        out = writeName(out, ",meter=", 7);
+        out = writeTag(out, meterId);
+    }
+    *out++ = ' ';
+    char* const fieldsStart = out;
+
+    for (Field f = FIELD_TARIFF; f < FIELD_COUNT; f++) {
+        uint32_t value;
+        if (!packetField(p, f, &value)) continue;
+        const FieldFormat* fmt = &formats[f];
+        out = writeName(out, fmt->name, fmt->nameLen);
+        *out++ = '=';
+        out = lineProtoFixed(out, value, fmt->decimals);
+        if (fmt->integer) *out++ = 'i';
+        *out++ = ',';
+    }
+    for (uint8_t i = 0; mbus != NULL && i < MBUS_CHANNELS; i++) {
+        const MBusSlot* slot = &mbus[i];
+        if (slot->value != 0xFFFFFFFF) {
+            out = writeMBusName(out, i, "value=", 6);
+            out = lineProtoFixed(out, slot->value, 3);
+            *out++ = ',';
+        }
+        if (slot->timestamp != 0xFFFFFFFF) {
+            out = writeMBusName(out, i, "value_time=", 11);
+            out = lineProtoU32(out, slot->timestamp);
+            *out++ = 'i';
+            *out++ = ',';
+        }
+        if (slot->deviceType != 0xFF) {
+            out = writeMBusName(out, i, "device_type=", 12);
+            out = lineProtoU32(out, slot->deviceType);
+            *out++ = 'i';
+            *out++ = ',';
+        }
+        if (slot->idLen) {
+            out = writeMBusName(out, i, "id=\"", 4);
+            for (uint8_t j = 0; j < slot->idLen; j++) {
+                if (slot->id[j] == '"' || slot->id[j] == '\\') *out++ = '\\';
+                *out++ = slot->id[j];
+            }
+            *out++ = '"';
+            *out++ = ',';
+        }
+    }
+    if (out == fieldsStart) return false;
+    out--; // Last ','.
+
+    if (p->timestamp != 0xFFFFFFFF) {
+        *out++ = ' ';
+        out = lineProtoU32(out, p->timestamp);
+    }
+    *out++ = '\n';
+    buf->len = out - buf->data;
+    return true;
+}
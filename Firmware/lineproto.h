@@ -0,0 +1,64 @@
+#ifndef FIRMWARE_LINEPROTO_H
+#define FIRMWARE_LINEPROTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+/**
+ * InfluxDB line protocol, straight from a decoded Packet. Host only.
+ *
+ * Same measurement, field names and units as P1logger's p1_human (kWh, kW, V, A, m3), so both can write into the
+ * same database. The integer units of Packet are written as fixed point decimals (Wh 2784374 -> 2784.374),
+ * with an integer to ASCII routine: no printf, no floats, no allocation once the buffer is big enough.
+ *
+ *   p1_human,header=FLU5\253770234_A,meter=3153...36 tariff=2i,meter_t1_used=2784.374,...,mbus1_value=1234.567,
+ *       mbus1_value_time=1625250300i,mbus1_device_type=3i 1625250354
+ *
+ * The timestamp is in seconds: write with precision=s.
+ */
+
+#define LINEPROTO_MEASUREMENT "p1_human"
+
+/**
+ * Growable output buffer, reused between batches. Only grows, so after the first few batches it never allocates.
+ */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} LineBuffer;
+
+/**
+ * Make room for n more bytes.
+ * @return false if out of memory.
+ */
+bool lineBufferReserve(LineBuffer* buf, size_t n);
+
+void lineBufferFree(LineBuffer* buf);
+
+/**
+ * Decimal ASCII of v, no terminator.
+ * @return Pointer past the last digit.
+ */
+char* lineProtoU32(char* out, uint32_t v);
+
+/**
+ * v / 10^decimals as a decimal with exactly that many decimals (1234, 3 -> "1.234"). decimals <= 9.
+ * @return Pointer past the last digit.
+ */
+char* lineProtoFixed(char* out, uint32_t v, uint8_t decimals);
+
+/**
+ * Append one line for a telegram. Fields that are missing (0xFF...) are left out, the timestamp too if missing.
+ * @param header Telegram header without the '/', tag. May be NULL.
+ * @param meterId 0-0:96.1.1, tag. May be NULL or "".
+ * @param mbus MBUS_CHANNELS slots, may be NULL.
+ * @return false if out of memory, or there are no fields at all (nothing appended).
+ */
+bool lineProtoTelegram(LineBuffer* buf, const char* measurement, const char* header, const char* meterId,
+                       const Packet* p, const MBusSlot* mbus);
+
+#endif //FIRMWARE_LINEPROTO_H
@@ -1,47 +1,16 @@
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
-#include <avr/wdt.h>
-#include <util/twi.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "hal.h"
 #include "packet.h"
 #include "crc.h"
 
 /**
- * Pin assignments
+ * Send an ERROR_STATS packet every minute.
  */
-// OUTPUTS
-#define LED0        _BV(PORTC0)  // RED
-#define LED1        _BV(PORTC1)  // RED
-#define LED2        _BV(PORTC2)  // YELLOW
-#define LED3        _BV(PORTC3)  // YELLOW
-#define LED4        _BV(PORTC4)  // GREEN
-#define LED5        _BV(PORTC5)  // GREEN
-#define DATA_REQ    _BV(PORTC6)
-#define RF_SET      _BV(PORTC7)
-
-// INPUTS
-#define SETTING7    _BV(PORTA7)
-#define SETTING6    _BV(PORTA6)
-#define SETTING5    _BV(PORTA5)
-#define SETTING4    _BV(PORTA4)
-#define SETTING3    _BV(PORTA3)
-#define SETTING2    _BV(PORTA2)
-#define SETTING1    _BV(PORTA1)
-#define SETTING0    _BV(PORTA0)
-
-/**
- * Error codes
- */
-#define ERROR_BASE      0x80000000
-#define ERROR_FATAL     0x40000000
-#define ERROR_UNKNOWN   (ERROR_BASE | ERROR_FATAL)
-#define ERROR_BOOT      (ERROR_BASE | 0x0001)
-#define ERROR_CRC       (ERROR_BASE | 0x0002)
+#define STATS_INTERVAL (60UL * HAL_TICK_HZ)
 
 
 /**
@@ -62,6 +31,9 @@ volatile uint8_t tx_buffer[sizeof(Packet)];
 volatile bool tx_sending = 0;
 volatile uint8_t tx_index = 0;
 
+// halTicks() at the last ERROR_STATS packet.
+uint32_t statsStart = 0;
+
 // readLine uses this global buffer.
 #define readLineBufferSize 256
 char readLineBuffer[readLineBufferSize];
@@ -71,19 +43,19 @@ char readLineBuffer[readLineBufferSize];
  * ISR for UART1 (P1 RX) Received Bytes.
  * Fills up ring buffer.
  */
-ISR(USART1_RX_vect) {
-    rb1.buffer[rb1.writeIndex++] = UDR1;
+ISR(HAL_METER_RX_VECT) {
+    rb1.buffer[rb1.writeIndex++] = halMeterRead();
 }
 
 /**
  * ISR for UART0 (RF TX) Data Register Empty.
  * Used for async tx of the entire tx_buffer.
  */
-ISR(USART0_UDRE_vect) {
-    UCSR0B &= ~(1<<UDRIE0);
+ISR(HAL_RF_UDRE_VECT) {
+    halRfTxInterrupt(false);
     if (tx_index < sizeof(Packet)) {
-        UDR0 = tx_buffer[tx_index++];
-        UCSR0B |= (1<<UDRIE0);
+        halRfWrite(tx_buffer[tx_index++]);
+        halRfTxInterrupt(true);
     } else {
         tx_sending = false;
     }
@@ -95,6 +67,18 @@ ISR(USART0_UDRE_vect) {
  */
 static inline void error(uint32_t code, void* payload, uint8_t len);
 
+/**
+ * Send a packet with code instead of a telegram, without waiting for it to go out.
+ */
+static inline void sendCode(uint32_t code, const void* payload, uint8_t len);
+
+/**
+ * Send halStats in an ERROR_STATS packet, and start counting from 0 again.
+ * So the 32 bit counters only ever hold STATS_INTERVAL worth. Without telegrams the watchdog resets the chip long
+ * before they could wrap.
+ */
+static inline void sendStats();
+
 /**
  * Send packet.
  * This function calculates & sets the CRC,
@@ -114,72 +98,30 @@ static inline void sendPacket();
  */
 static inline uint8_t readLine();
 
-/**
- * Init UART 1 (P1 RX)
- * 115200 baud, RX only, interrupt driven.
- */
-static inline void meterUARTInit(void) {
-    // 115200 baud, F_CPU 11.0592 MHz
-    // https://trolsoft.ru/en/uart-calc
-
-    // Set baud rate
-    UBRR1L = 0x05;
-    UBRR1H = 0x00;
-
-    // Enable RX and RX interrupts
-    UCSR1B= (1<<RXEN1) | (1<<RXCIE1);
-    // Set the "normal" 8N1 UART frame mode.
-    UCSR1C= (1<<UCSZ11) | (1<<UCSZ10);
-    UCSR1A= 0x00;
-
-    UCSR1A &= ~(1 << U2X1);
-}
-
-/**
- * Init UART 0 (RF TX)
- * 1200 baud, TX only, interrupt driven.
- */
-static inline void RF_UART_Init(void) {
-    // 1200 baud, F_CPU 11.0592 MHz
-    // https://trolsoft.ru/en/uart-calc
-
-    // Set baud rate
-    UBRR0L = 0x3F;
-    UBRR0H = 0x02;
-
-    // Enable TX.
-    UCSR0B= (1<<TXEN0);
-    // Set the "normal" 8N1 UART frame mode.
-    UCSR0C= (1<<UCSZ01) | (1<<UCSZ00);
-    UCSR0A= 0x00;
-
-    UCSR0A &= ~(1 << U2X0);
-}
-
 /**
  * Do some kit-kat with the LEDs to show we're alive.
  * This function resets the watchdog.
  */
 static inline void bootAnimation() {
-    PORTC = 0;
+    halOutputWrite(0);
     for (int i = 0; i <= 1; ++i) {
-        PORTC ^= LED0;
-        _delay_ms(50);
-        PORTC ^= LED1;
-        _delay_ms(50);
-        PORTC ^= LED2;
-        _delay_ms(50);
-        PORTC ^= LED3;
-        _delay_ms(50);
-        PORTC ^= LED4;
-        _delay_ms(50);
-        PORTC ^= LED5;
-        _delay_ms(50);
-        wdt_reset();
+        halOutputToggle(LED0);
+        halDelayMs(50);
+        halOutputToggle(LED1);
+        halDelayMs(50);
+        halOutputToggle(LED2);
+        halDelayMs(50);
+        halOutputToggle(LED3);
+        halDelayMs(50);
+        halOutputToggle(LED4);
+        halDelayMs(50);
+        halOutputToggle(LED5);
+        halDelayMs(50);
+        halWatchdogReset();
     }
-    _delay_ms(500);
-    PORTC = 0;
-    wdt_reset();
+    halDelayMs(500);
+    halOutputWrite(0);
+    halWatchdogReset();
 }
 
 /**
@@ -189,8 +131,8 @@ static inline void loop() {
 //    uint16_t crc = 0;
     uint8_t len;
 
-    // 0xFF is a lot more recognisable as "bad data" then 0.
-    memset(&packet, 0xFF, sizeof(Packet));
+    // Keeps the line cache, so unchanged lines are not decoded again.
+    resetPacket();
     packet.pre[0] = 0x42;
     packet.pre[1] = 0xAA;
     packet.pre[2] = 0xFF;
@@ -205,7 +147,7 @@ static inline void loop() {
     }
 //    crc = crc16(crc, readLineBuffer, len);
 
-    PORTC ^= LED2; // Show we are getting some data, alternate so it's not out too quickly.
+    halOutputToggle(LED2); // Show we are getting some data, alternate so it's not out too quickly.
 
     // Parse packet
     while (readLineBuffer[0] != '!') {
@@ -215,14 +157,16 @@ static inline void loop() {
     }
 //    crc = crc16(crc, "!", 1);
 
-    wdt_reset();
-    PORTC ^= LED4; // Sending packet
+    halWatchdogReset();
+    halOutputToggle(LED4); // Sending packet
     sendPacket();
 
+    if (halTicks() - statsStart >= STATS_INTERVAL) sendStats();
+
 //    // Check CRC. If it did not match, send a specially crafted timestamped packet.
 //    uint16_t expected_crc = strtol(readLineBuffer+1, NULL, 16);
 //    if (expected_crc != crc) {
-//        PORTC ^= LED1; // CRC bad LED
+//        halOutputToggle(LED1); // CRC bad LED
 //        uint8_t payload[4];
 //
 //        payload[0] = crc & 0xFF;
@@ -242,32 +186,32 @@ int main (void)
     // First thing to do: Enable watchdog. Mainly to auto-reboot if we somehow crash.
     // The exact timeout isn't that important, we can miss a packet or two.
     // Keeping the timeout to >1s means we only need to poke it once every received packet.
-    wdt_enable(WDTO_2S);
+    halWatchdogEnable();
 
     // Set all pin data directions
-    DDRA = 0x00;
-    DDRC = 0x7F;
+    halPinsInit();
 
     // Make sure RF module is not in SET mode.
-    // PORTC |= RF_SET;
+    // halOutputSet(RF_SET);
 
     // Boot animation
     bootAnimation();
 
     // Now for the real work.
-    meterUARTInit();
-    RF_UART_Init();
+    halMeterUartInit();
+    halRfUartInit();
+    halClockInit();
 
     // enable all interrupts
-    sei();
+    halInterruptsEnable();
 
     error(ERROR_BOOT, NULL, 0);
 
     // Start requesting data from meter
-    PORTC |= DATA_REQ;
+    halOutputSet(DATA_REQ);
 
     while (1) {
-        wdt_reset();
+        halWatchdogReset();
         loop();
     }
 }
@@ -278,20 +222,40 @@ void sendPacket() {
     packet.checksum = 0;
     packet.checksum = crc16(0, (void*) &packet, sizeof(Packet));
 
-    while (tx_sending); // Wait for previous TX to be done, if any.
+    halWaitWhile(tx_sending, HAL_WAIT_TX); // Wait for previous TX to be done, if any.
     tx_sending = true;
 
     memcpy((void*)tx_buffer, &packet, sizeof(Packet));
     tx_index = 0;
-    UDR0 = tx_buffer[tx_index];
-    UCSR0B |= (1<<UDRIE0);
+    halRfWrite(tx_buffer[tx_index]);
+    halRfTxInterrupt(true);
 }
 
 void error(uint32_t code, void* payload, uint8_t len) {
-    wdt_reset(); // Give us ample time to construct packet & send it out.
+    halWatchdogReset(); // Give us ample time to construct packet & send it out.
+
+    halOutputSet(LED0); // Indicate an error has happened.
+
+    // This puts data in the que, but is likely to return immediately.
+    sendCode(code, payload, len);
+
+    // Wait for TX to be done
+    halWatchdogReset();
+    halWaitWhile(tx_sending, HAL_WAIT_TX);
 
-    PORTC |= LED0; // Indicate an error has happened.
+    // Wait a bit longer, less chance error LEDs are missed.
+    //halWatchdogReset();
+    //halDelayMs(100);
+
+    // Fatal error. Hang until watchdog resets entire chip.
+    if (code & ERROR_FATAL) {
+        halWaitWhile(true, HAL_WAIT_HANG);
+    }
 
+    halOutputClear(LED0); // Reset ERROR LED
+}
+
+void sendCode(uint32_t code, const void* payload, uint8_t len) {
     // Prevent programmer = idiot mistakes.
     if (len > ERROR_PAYLOAD_MAX_LEN) {
         len = ERROR_PAYLOAD_MAX_LEN;
@@ -308,29 +272,22 @@ void error(uint32_t code, void* payload, uint8_t len) {
     packet.error_payload_len = len;
     memcpy(&packet.error_payload, payload, len);
 
-    // This puts data in the que, but is likely to return immediately.
     sendPacket();
+}
 
-    // Wait for TX to be done
-    wdt_reset();
-    while (tx_sending);
-
-    // Wait a bit longer, less chance error LEDs are missed.
-    //wdt_reset();
-    //_delay_ms(100);
-
-    // Fatal error. Hang until watchdog resets entire chip.
-    if (code & ERROR_FATAL) {
-        while (1);
-    }
-
-    PORTC &= ~LED0; // Reset ERROR LED
+void sendStats() {
+    // halStats only changes in halIdle, never in an interrupt: no need to turn them off.
+    const uint32_t now = halTicks();
+    HalStatsReport report = {now - statsStart, halStats};
+    statsStart = now;
+    memset(&halStats, 0, sizeof(HalStats));
+    sendCode(ERROR_STATS, &report, sizeof(report));
 }
 
 uint8_t readLine() {
     int l = 0;
     while (l < readLineBufferSize) {
-        while (rb1.readIndex == rb1.writeIndex);
+        halWaitWhile(rb1.readIndex == rb1.writeIndex, HAL_WAIT_RX);
         char c = rb1.buffer[rb1.readIndex++];
         readLineBuffer[l++] = c;
         if (c == '\n') break;
@@ -49,16 +49,22 @@ int main(int argc, char** argv) {
     }
 
     while (!feof(fp)) {
-        memset(&packet, 0xFF, sizeof(Packet));
+        resetPacket();
 
         char * line = NULL;
         size_t len = 0;
         ssize_t read;
-        uint16_t crc;
+        uint16_t crc = 0;
         while ((read = getline(&line, &len, fp)) != -1) {
             crc = crc16(crc, line, line[0] != '!' ? read : 1);
 
             printf("Read n=%2zu: %s", read, line);
+            ListEntry entries[10];
+            int16_t count = parseList(read, line, POWER_FAILURE_LOG, entries, 10);
+            if (count < 0) count = parseList(read, line, MONTHLY_PEAKS, entries, 10);
+            for (int16_t i = 0; i < count; i++) {
+                printf("    Entry %d: %u %u -> %u\n", i, entries[i].timestamp[0], entries[i].timestamp[1], entries[i].value);
+            }
             if (parseLine(read, line)) {
 //            puts("Y");
             } else {
@@ -71,6 +77,11 @@ int main(int argc, char** argv) {
         }
 
         printf("CRC: %X\n", crc);
+        printf("Unchanged: 0x%08X\n", packetUnchanged);
+        for (int i = 0; i < MBUS_CHANNELS; i++) {
+            if (mbus[i].deviceType == 0xFF) continue;
+            printf("M-Bus %d: type %d, id %.*s, %u @ %u\n", i + 1, mbus[i].deviceType, mbus[i].idLen, mbus[i].id, mbus[i].value, mbus[i].timestamp);
+        }
     }
 
 
@@ -4,83 +4,84 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <time.h>
 #include "packet.h"
 
 Packet packet;
+MBusSlot mbus[MBUS_CHANNELS];
+ParserContext parser = {
+        .packet = &packet,
+        .mbus = mbus,
+};
 
 /**
- * Parse a value from a line if the prefix is present, optionally skipping an additional timestamp value.
- * The value is stored as if it was an integer, the decimal point is entirely ignored if present.
- *
- * @param inp Input line of text. No null terminator is required.
- * @param len Length of inp.
- * @param prefix The prefix we should expect before accepting this value.
- * @param store The output. Untouched if prefix is a mismatch.
- * @param timestamped If true, an additional timestamp is ignored before the value is read.
- * @return true if a value was stored in the store.
+ * How the value of a line should be decoded, and how wide the store in packet is.
  */
-static bool parseValue32(const char* const inp, const size_t len, const char* const prefix, uint32_t* const store, const bool timestamped) {
-    size_t i = strlen(prefix);
-    if (strncmp(inp, prefix, i) != 0) return false;
-    if (timestamped) {
-        while (i < len && inp[i++] != '(');
-    }
-    *store = 0;
-    while (i < len && inp[i] != '*') {
-        char c = inp[i++];
-        if (!isdigit(c)) continue; // Skip over '.'
-        *store *= 10;
-        *store += c - '0';
-    }
-    return true;
-}
+typedef enum {
+    VALUE_8,
+    VALUE_16,
+    VALUE_32,
+    VALUE_TIMESTAMP,
+} ValueType;
+
+typedef struct {
+    const char* prefix;
+    uint8_t prefixLen;
+    ValueType type;
+    uint8_t offset; // offsetof(Packet, ...)
+} FieldDef;
+
+#define FIELD(prefix, type, member) {prefix, sizeof(prefix) - 1, type, offsetof(Packet, member)}
 
 /**
- * Parse a value from a line if the prefix is present.
- * The value is stored as if it was an integer, the decimal point is entirely ignored if present.
- *
- * @param inp Input line of text. No null terminator is required.
- * @param len Length of inp.
- * @param prefix The prefix we should expect before accepting this value.
- * @param store The output. Untouched if prefix is a mismatch.
- * @return true if a value was stored in the store.
+ * Indexed by Field, order must match the enum.
  */
-static bool parseValue16(const char* const inp, const size_t len, const char* const prefix, uint16_t* const store) {
-    size_t i = strlen(prefix);
-    if (strncmp(inp, prefix, i) != 0) return false;
-    *store = 0;
-    while (i < len && inp[i] != '*') {
-        char c = inp[i++];
-        if (!isdigit(c)) continue; // Skip over '.'
-        *store *= 10;
-        *store += c - '0';
-    }
-    return true;
-}
+static const FieldDef fields[FIELD_COUNT] = {
+        FIELD(TIMESTAMP, VALUE_TIMESTAMP, timestamp),
+        FIELD(TARIFF, VALUE_8, tariff),
+        FIELD(METER_T1_DELIVERED, VALUE_32, meter_delivered_t1),
+        FIELD(METER_T2_DELIVERED, VALUE_32, meter_delivered_t2),
+        FIELD(METER_T1_INJECTED, VALUE_32, meter_injected_t1),
+        FIELD(METER_T2_INJECTED, VALUE_32, meter_injected_t2),
+        FIELD(SUM_POWER_DELIVERED, VALUE_16, sum_power_delivered),
+        FIELD(SUM_POWER_INJECTED, VALUE_16, sum_power_injected),
+        FIELD(POWER_P1_DELIVERED, VALUE_16, power_per_phase_delivered[0]),
+        FIELD(POWER_P2_DELIVERED, VALUE_16, power_per_phase_delivered[1]),
+        FIELD(POWER_P3_DELIVERED, VALUE_16, power_per_phase_delivered[2]),
+        FIELD(POWER_P1_INJECTED, VALUE_16, power_per_phase_injected[0]),
+        FIELD(POWER_P2_INJECTED, VALUE_16, power_per_phase_injected[1]),
+        FIELD(POWER_P3_INJECTED, VALUE_16, power_per_phase_injected[2]),
+        FIELD(VOLTAGE_P1, VALUE_16, voltage_per_phase[0]),
+        FIELD(VOLTAGE_P2, VALUE_16, voltage_per_phase[1]),
+        FIELD(VOLTAGE_P3, VALUE_16, voltage_per_phase[2]),
+        FIELD(CURRENT_P1, VALUE_16, current_per_phase[0]),
+        FIELD(CURRENT_P2, VALUE_16, current_per_phase[1]),
+        FIELD(CURRENT_P3, VALUE_16, current_per_phase[2]),
+        //FIELD(LIMITER, VALUE_16, limiter),
+        //FIELD(FUSE_SUPERVISION, VALUE_16, fuse_supervision),
+};
 
 /**
- * Parse a value from a line if the prefix is present.
+ * Parse a value starting at i, up to (but excluding) stop.
  * The value is stored as if it was an integer, the decimal point is entirely ignored if present.
  *
  * @param inp Input line of text. No null terminator is required.
  * @param len Length of inp.
- * @param prefix The prefix we should expect before accepting this value.
- * @param store The output. Untouched if prefix is a mismatch.
- * @return true if a value was stored in the store.
+ * @param i Index of the first character of the value.
+ * @param stop Character that ends the value.
+ * @return the value.
  */
-static bool parseValue8(const char *const inp, const size_t len, const char *const prefix, uint8_t *const store) {
-    size_t i = strlen(prefix);
-    if (strncmp(inp, prefix, i) != 0) return false;
-    *store = 0;
-    while (i < len && inp[i] != ')') {
+static uint32_t parseValue(const char* const inp, const size_t len, size_t i, const char stop) {
+    uint32_t value = 0;
+    while (i < len && inp[i] != stop) {
         char c = inp[i++];
         if (!isdigit(c)) continue; // Skip over '.'
-        *store *= 10;
-        *store += c - '0';
+        value *= 10;
+        value += c - '0';
     }
-    return true;
+    return value;
 }
 
 static inline int doubleDigitNumber(const char *const inp, const size_t i) {
@@ -91,20 +92,13 @@ static inline int doubleDigitNumber(const char *const inp, const size_t i) {
 }
 
 /**
- * Parse a value from a line if the prefix is present.
- * The value is stored as if it was an integer, the decimal point is entirely ignored if present.
+ * Parse a timestamp starting at i.
  *
  * @param inp Input line of text. No null terminator is required.
- * @param len Length of inp.
- * @param prefix The prefix we should expect before accepting this value.
- * @param store The output. Untouched if prefix is a mismatch.
- * @return true if a value was stored in the store.
+ * @param i Index of the first character of the timestamp.
+ * @return seconds since epoch.
  */
-static bool parseValueTimestamp(const char *const inp, const size_t len, const char *const prefix, uint32_t *const store) {
-    if (len < 24) return false;
-    size_t i = strlen(prefix);
-    if (strncmp(inp, prefix, i) != 0) return false;
-
+static uint32_t parseValueTimestamp(const char *const inp, const size_t i) {
 //    printf("Timestamp: %s %c\n", inp + i, inp[i+12]);
 
     // YYMMDDhhmmssz
@@ -119,37 +113,314 @@ static bool parseValueTimestamp(const char *const inp, const size_t len, const c
             .tm_isdst = inp[i+12] == 'S' ? 1 : 0,
     };
 
-    *store = mktime(&time);
-    return true;
+    return mktime(&time);
+}
+
+/**
+ * parseValueTimestamp, but mktime is only called when the hour changes.
+ * mktime is slow (and takes a lock in glibc), everything below the hour is the same in every timezone.
+ */
+static uint32_t parseValueTimestampCached(ParserContext *const ctx, const char *const inp, const size_t i) {
+    int hh = doubleDigitNumber(inp, i + 6);
+    int mm = doubleDigitNumber(inp, i + 8);
+    int ss = doubleDigitNumber(inp, i + 10);
+    if (hh < 0 || mm < 0 || ss < 0) return parseValueTimestamp(inp, i);
+
+    uint32_t hour = (uint32_t) parseValue(inp, i + 8, i, ')');
+    if (hour != ctx->hour || inp[i + 12] != ctx->hourDst) {
+        char start[13];
+        memcpy(start, inp + i, 8);
+        memcpy(start + 8, "0000", 4);
+        start[12] = inp[i + 12];
+        ctx->hour = hour;
+        ctx->hourDst = inp[i + 12];
+        ctx->hourStart = parseValueTimestamp(start, 0);
+    }
+    return ctx->hourStart + mm * 60 + ss;
+}
+
+/**
+ * @return true if the value between ( and ) at i is a timestamp (YYMMDDhhmmssX).
+ */
+static bool isTimestamp(const char *const inp, const size_t len, const size_t i) {
+    if (i + 14 > len || inp[i + 13] != ')') return false;
+    return inp[i + 12] == 'S' || inp[i + 12] == 'W';
+}
+
+int16_t parseList(const uint16_t n, const char *const line, const char *const prefix, ListEntry *const entries, const uint8_t capacity) {
+    size_t i = strlen(prefix);
+    if (strncmp(line, prefix, i) != 0) return -1;
+
+    uint8_t stored = 0;
+    uint8_t timestamps = 0;
+    bool first = true;
+
+    // i points to the first character of a value, right after a (.
+    while (i < n) {
+        if (first) {
+            // Number of entries in the list, we only care about the number we actually find.
+            first = false;
+        } else if (isTimestamp(line, n, i)) {
+            if (stored < capacity && timestamps < 2) {
+                if (timestamps == 0) {
+                    entries[stored].timestamp[1] = 0xFFFFFFFF;
+                }
+                entries[stored].timestamp[timestamps] = parseValueTimestamp(line, i);
+            }
+            timestamps++;
+        } else {
+            // Skip over the OBIS id(s) that describe the entries.
+            size_t j = i;
+            bool obis = false;
+            while (j < n && line[j] != ')') {
+                if (line[j++] == ':') obis = true;
+            }
+            if (!obis) {
+                if (stored < capacity) {
+                    if (timestamps == 0) {
+                        entries[stored].timestamp[0] = 0xFFFFFFFF;
+                        entries[stored].timestamp[1] = 0xFFFFFFFF;
+                    }
+                    entries[stored].value = parseValue(line, n, i, '*');
+                    stored++;
+                }
+                timestamps = 0;
+            }
+        }
+
+        // Move to the next value
+        while (i < n && line[i++] != ')');
+        if (i >= n || line[i] != '(') break;
+        i++;
+    }
+
+    return stored;
+}
+
+/**
+ * Decode the value of a line of which the prefix already matched.
+ *
+ * @param ctx parser context.
+ * @param field Definition of the field.
+ * @param inp Input line of text. No null terminator is required.
+ * @param len Length of inp.
+ * @param value The output.
+ * @return false if the line can't be decoded.
+ */
+static bool decodeField(ParserContext *const ctx, const FieldDef *const field, const char *const inp, const size_t len, uint32_t *const value) {
+    size_t i = field->prefixLen;
+    switch (field->type) {
+        case VALUE_TIMESTAMP:
+            if (len < 24) return false;
+            *value = parseValueTimestampCached(ctx, inp, i);
+            return true;
+        case VALUE_32:
+        case VALUE_16:
+            *value = parseValue(inp, len, i, '*');
+            return true;
+        case VALUE_8:
+            *value = parseValue(inp, len, i, ')');
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Store value in packet, truncated to the width of the field.
+ * memcpy because packet is packed on AVR.
+ */
+static void storeField(Packet *const p, const FieldDef *const field, const uint32_t value) {
+    uint8_t *store = (uint8_t *) p + field->offset;
+    switch (field->type) {
+        case VALUE_8: {
+            uint8_t v = value;
+            memcpy(store, &v, sizeof(v));
+            break;
+        }
+        case VALUE_16: {
+            uint16_t v = value;
+            memcpy(store, &v, sizeof(v));
+            break;
+        }
+        default:
+            memcpy(store, &value, sizeof(value));
+            break;
+    }
+}
+
+bool packetField(const Packet *const p, const Field field, uint32_t *const value) {
+    const FieldDef *def = &fields[field];
+    const uint8_t *store = (const uint8_t *) p + def->offset;
+    switch (def->type) {
+        case VALUE_8: {
+            uint8_t v;
+            memcpy(&v, store, sizeof(v));
+            *value = v;
+            return v != 0xFF;
+        }
+        case VALUE_16: {
+            uint16_t v;
+            memcpy(&v, store, sizeof(v));
+            *value = v;
+            return v != 0xFFFF;
+        }
+        default:
+            memcpy(value, store, sizeof(*value));
+            return *value != 0xFFFFFFFF;
+    }
+}
+
+void setPacketField(Packet *const p, const Field field, const uint32_t value) {
+    storeField(p, &fields[field], value);
+}
+
+void initParser(ParserContext *const ctx, Packet *const p, MBusSlot *const mbus) {
+    memset(ctx, 0, sizeof(ParserContext));
+    ctx->packet = p;
+    ctx->mbus = mbus;
+    resetParser(ctx);
+}
+
+void resetParser(ParserContext *const ctx) {
+    // 0xFF is a lot more recognisable as "bad data" then 0.
+    memset(ctx->packet, 0xFF, sizeof(Packet));
+    memset(ctx->mbus, 0xFF, sizeof(MBusSlot) * MBUS_CHANNELS);
+    for (uint8_t i = 0; i < MBUS_CHANNELS; i++) {
+        ctx->mbus[i].idLen = 0;
+    }
+    ctx->unchanged = 0;
+    ctx->gasChannel = MBUS_CHANNELS;
+}
+
+void resetPacket(void) {
+    resetParser(&parser);
+}
+
+static inline int hexDigit(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Copy the value of channel into packet->gas_volume, if it's a gas meter on a lower channel than the current one.
+ * Called for both the device type and the value line, so it doesn't matter which of the two comes first.
+ */
+static void resolveGas(ParserContext *const ctx, const uint8_t channel) {
+    const MBusSlot *slot = &ctx->mbus[channel];
+    if (slot->deviceType != MBUS_DEVICE_TYPE_GAS || slot->value == 0xFFFFFFFF || channel >= ctx->gasChannel) return;
+    ctx->packet->gas_volume = slot->value;
+    ctx->gasChannel = channel;
 }
 
+/**
+ * Parse an M-Bus line (0-b:...) into the slot for channel b.
+ * The channel is used as index, so this is the same amount of work for any number of meters.
+ *
+ * @param ctx parser context.
+ * @param inp Input line of text. No null terminator is required.
+ * @param len Length of inp.
+ * @return true if a value was stored.
+ */
+static bool parseMBus(ParserContext *const ctx, const char *const inp, const size_t len) {
+    if (inp[0] != '0' || inp[1] != '-' || inp[3] != ':') return false;
+    if (inp[2] < '1' || inp[2] >= '1' + MBUS_CHANNELS) return false;
+    const uint8_t channel = inp[2] - '1';
+    MBusSlot *slot = &ctx->mbus[channel];
+    const char *rest = inp + 4;
+    size_t i = 4 + strlen(MBUS_VALUE); // All prefixes are the same length.
+
+    if (strncmp(rest, MBUS_DEVICE_TYPE, strlen(MBUS_DEVICE_TYPE)) == 0) {
+        slot->deviceType = parseValue(inp, len, i, ')');
+        resolveGas(ctx, channel);
+        return true;
+    }
+    if (strncmp(rest, MBUS_EQUIPMENT_ID, strlen(MBUS_EQUIPMENT_ID)) == 0
+        || strncmp(rest, MBUS_EQUIPMENT_ID_EMUCS, strlen(MBUS_EQUIPMENT_ID_EMUCS)) == 0) {
+        slot->idLen = 0;
+        while (i + 1 < len && slot->idLen < MBUS_ID_MAX_LEN) {
+            int hi = hexDigit(inp[i]);
+            int lo = hexDigit(inp[i + 1]);
+            if (hi < 0 || lo < 0) break;
+            slot->id[slot->idLen++] = (char) (hi << 4 | lo);
+            i += 2;
+        }
+        return true;
+    }
+    if (strncmp(rest, MBUS_VALUE, strlen(MBUS_VALUE)) == 0
+        || strncmp(rest, MBUS_VALUE_EMUCS, strlen(MBUS_VALUE_EMUCS)) == 0) {
+        if (len < i + 15) return false;
+#if LINE_CACHE
+        MBusLineCache *cache = &ctx->mbusCache[channel];
+        const char *raw = inp + i;
+        const size_t rawLen = len - i;
+
+        if (cache->len != 0 && cache->len == rawLen && memcmp(cache->raw, raw, rawLen) == 0) {
+            slot->timestamp = cache->timestamp;
+            slot->value = cache->value;
+            resolveGas(ctx, channel);
+            return true;
+        }
+#endif
+        slot->timestamp = parseValueTimestampCached(ctx, inp, i);
+        // Skip over the timestamp
+        while (i < len && inp[i++] != '(');
+        slot->value = parseValue(inp, len, i, '*');
+#if LINE_CACHE
+        if (rawLen <= LINE_CACHE_RAW_LEN) {
+            cache->len = rawLen;
+            memcpy(cache->raw, raw, rawLen);
+            cache->timestamp = slot->timestamp;
+            cache->value = slot->value;
+        } else {
+            cache->len = 0;
+        }
+#endif
+        resolveGas(ctx, channel);
+        return true;
+    }
+    return false;
+}
 
 bool parseLine(const uint16_t n, const char *line) {
+    return parseLineWith(&parser, n, line);
+}
+
+bool parseLineWith(ParserContext *const ctx, const uint16_t n, const char *line) {
     if (n < 14) return false;
 
-    if (parseValueTimestamp(line, n, TIMESTAMP, &packet.timestamp)) return true;
-    if (parseValue8(line, n, TARIFF, &packet.tariff)) return true;
-    if (parseValue32(line, n, METER_T1_DELIVERED, &packet.meter_delivered_t1, false)) return true;
-    if (parseValue32(line, n, METER_T2_DELIVERED, &packet.meter_delivered_t2, false)) return true;
-    if (parseValue32(line, n, METER_T1_INJECTED, &packet.meter_injected_t1, false)) return true;
-    if (parseValue32(line, n, METER_T2_INJECTED, &packet.meter_injected_t2, false)) return true;
-    if (parseValue16(line, n, SUM_POWER_DELIVERED, &packet.sum_power_delivered)) return true;
-    if (parseValue16(line, n, SUM_POWER_INJECTED, &packet.sum_power_injected)) return true;
-    if (parseValue16(line, n, POWER_P1_DELIVERED, &packet.power_per_phase_delivered[0])) return true;
-    if (parseValue16(line, n, POWER_P2_DELIVERED, &packet.power_per_phase_delivered[1])) return true;
-    if (parseValue16(line, n, POWER_P3_DELIVERED, &packet.power_per_phase_delivered[2])) return true;
-    if (parseValue16(line, n, POWER_P1_INJECTED, &packet.power_per_phase_injected[0])) return true;
-    if (parseValue16(line, n, POWER_P2_INJECTED, &packet.power_per_phase_injected[1])) return true;
-    if (parseValue16(line, n, POWER_P3_INJECTED, &packet.power_per_phase_injected[2])) return true;
-    if (parseValue16(line, n, VOLTAGE_P1, &packet.voltage_per_phase[0])) return true;
-    if (parseValue16(line, n, VOLTAGE_P2, &packet.voltage_per_phase[1])) return true;
-    if (parseValue16(line, n, VOLTAGE_P3, &packet.voltage_per_phase[2])) return true;
-    if (parseValue16(line, n, CURRENT_P1, &packet.current_per_phase[0])) return true;
-    if (parseValue16(line, n, CURRENT_P2, &packet.current_per_phase[1])) return true;
-    if (parseValue16(line, n, CURRENT_P3, &packet.current_per_phase[2])) return true;
-    //if (parseValue16(line, n, LIMITER, &packet.limiter)) return true;
-    //if (parseValue16(line, n, FUSE_SUPERVISION, &packet.fuse_supervision)) return true;
-    if (parseValue32(line, n, GAS_VOLUME, &packet.gas_volume, true)) return true;
+    if (parseMBus(ctx, line, n)) return true;
+
+    for (uint8_t f = 0; f < FIELD_COUNT; f++) {
+        const FieldDef *field = &fields[f];
+        if (strncmp(line, field->prefix, field->prefixLen) != 0) continue;
+
+        uint32_t value;
+#if LINE_CACHE
+        LineCache *cache = &ctx->lineCache[f];
+        const char *raw = line + field->prefixLen;
+        uint16_t rawLen = n - field->prefixLen;
+
+        if (cache->len != 0 && cache->len == rawLen && memcmp(cache->raw, raw, rawLen) == 0) {
+            storeField(ctx->packet, field, cache->value);
+            ctx->unchanged |= (uint32_t) 1 << f;
+            return true;
+        }
+#endif
+        if (!decodeField(ctx, field, line, n, &value)) return false;
+        storeField(ctx->packet, field, value);
+#if LINE_CACHE
+        if (rawLen <= LINE_CACHE_RAW_LEN) {
+            cache->len = rawLen;
+            memcpy(cache->raw, raw, rawLen);
+            cache->value = value;
+        } else {
+            cache->len = 0;
+        }
+#endif
+        return true;
+    }
 
     return false;
 }
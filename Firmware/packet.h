@@ -14,7 +14,6 @@
 #define METER_T2_DELIVERED "1-0:1.8.2("
 #define METER_T1_INJECTED "1-0:2.8.1("
 #define METER_T2_INJECTED "1-0:2.8.2("
-#define METER_T2_INJECTED "1-0:2.8.2("
 #define SUM_POWER_DELIVERED "1-0:1.7.0("
 #define SUM_POWER_INJECTED "1-0:2.7.0("
 #define POWER_P1_DELIVERED "1-0:21.7.0("
@@ -29,10 +28,103 @@
 #define CURRENT_P1 "1-0:31.7.0("
 #define CURRENT_P2 "1-0:51.7.0("
 #define CURRENT_P3 "1-0:71.7.0("
-#define GAS_VOLUME "0-1:24.2.3("
+#define POWER_FAILURE_LOG "1-0:99.97.0("
+#define MONTHLY_PEAKS "0-0:98.1.0("
 
 #define ERROR_PAYLOAD_MAX_LEN 50
 
+/**
+ * Error codes, in Packet.error (error packets have pre[2] = 0).
+ */
+#define ERROR_BASE      0x80000000
+#define ERROR_FATAL     0x40000000
+#define ERROR_UNKNOWN   (ERROR_BASE | ERROR_FATAL)
+#define ERROR_BOOT      (ERROR_BASE | 0x0001)
+#define ERROR_CRC       (ERROR_BASE | 0x0002)
+#define ERROR_STATS     (ERROR_BASE | 0x0003) // Not an error: the payload is a HalStatsReport (hal.h).
+
+/**
+ * Keep a copy of the raw value of every parsed line, so unchanged lines are not decoded again.
+ * Costs (LINE_CACHE_RAW_LEN + 6) bytes of RAM per field, and (LINE_CACHE_RAW_LEN + 9) per M-Bus channel.
+ */
+#ifndef LINE_CACHE
+#define LINE_CACHE 1
+#endif
+#define LINE_CACHE_RAW_LEN 32
+
+/**
+ * Every value parseLine can extract, used as bit index in packetUnchanged.
+ */
+typedef enum {
+    FIELD_TIMESTAMP,
+    FIELD_TARIFF,
+    FIELD_METER_T1_DELIVERED,
+    FIELD_METER_T2_DELIVERED,
+    FIELD_METER_T1_INJECTED,
+    FIELD_METER_T2_INJECTED,
+    FIELD_SUM_POWER_DELIVERED,
+    FIELD_SUM_POWER_INJECTED,
+    FIELD_POWER_P1_DELIVERED,
+    FIELD_POWER_P2_DELIVERED,
+    FIELD_POWER_P3_DELIVERED,
+    FIELD_POWER_P1_INJECTED,
+    FIELD_POWER_P2_INJECTED,
+    FIELD_POWER_P3_INJECTED,
+    FIELD_VOLTAGE_P1,
+    FIELD_VOLTAGE_P2,
+    FIELD_VOLTAGE_P3,
+    FIELD_CURRENT_P1,
+    FIELD_CURRENT_P2,
+    FIELD_CURRENT_P3,
+    FIELD_COUNT,
+} Field;
+
+/**
+ * Extra meters (gas, water, heat, ...) on the M-Bus, lines "0-b:..." with b the channel (1 to MBUS_CHANNELS).
+ * The prefixes below follow the "0-b:".
+ */
+#define MBUS_CHANNELS 4
+#define MBUS_DEVICE_TYPE "24.1.0("
+#define MBUS_EQUIPMENT_ID "96.1.0("
+#define MBUS_EQUIPMENT_ID_EMUCS "96.1.1("
+#define MBUS_VALUE "24.2.1("
+#define MBUS_VALUE_EMUCS "24.2.3("
+
+#define MBUS_DEVICE_TYPE_GAS 3
+#define MBUS_ID_MAX_LEN 20
+
+/**
+ * Everything known about the meter on one M-Bus channel.
+ * Not part of Packet, that has to fit in 60 bytes. Packet.gas_volume is copied from the gas meter on the lowest
+ * channel, whatever the order of the lines.
+ * Values that are not present are 0xFF..., idLen is 0.
+ */
+typedef struct {
+    /**
+     * Device type. 3 = gas, 7 = water, see EN 13757-3.
+     * Source: 0-b:24.1.0
+     */
+    uint8_t deviceType;
+
+    /**
+     * Equipment identifier, hex decoded. Truncated to MBUS_ID_MAX_LEN.
+     * Source: 0-b:96.1.0 (DSMR), 0-b:96.1.1 (eMUCs)
+     */
+    uint8_t idLen;
+    char id[MBUS_ID_MAX_LEN];
+
+    /**
+     * Time of the last 5-minute value, in seconds since epoch.
+     */
+    uint32_t timestamp;
+
+    /**
+     * Last 5-minute value in 0.001 units (m3 for gas).
+     * Source: 0-b:24.2.1 (DSMR), 0-b:24.2.3 (eMUCs)
+     */
+    uint32_t value;
+} MBusSlot;
+
 /**
  * This struct is the main packet that is send over UART
  * It must be <= 60 bytes to be able to transmit in mode 4 of the HC12 serial module.
@@ -129,7 +221,8 @@ struct {
     /**
      * Gas volume in 0.001m3.
      * Only present if meter present & connected.
-     * Source: 0-1:24.2.3
+     * Copied from the first M-Bus channel with a gas meter, see mbus.
+     * Source: 0-b:24.2.3
      */
     uint32_t gas_volume;
 
@@ -166,6 +259,143 @@ _Static_assert(sizeof(Packet) == 60, "Packet should be 60 bytes.");
 
 extern Packet packet;
 
+/**
+ * Indexed by M-Bus channel - 1.
+ */
+extern MBusSlot mbus[MBUS_CHANNELS];
+
+#if LINE_CACHE
+/**
+ * Raw bytes (everything after the prefix) of the last line parsed for a field, and the value it decoded to.
+ * len == 0 means empty, or the line was too long to be cached.
+ */
+typedef struct {
+    uint8_t len;
+    char raw[LINE_CACHE_RAW_LEN];
+    uint32_t value;
+} LineCache;
+
+/**
+ * The same for the 5-minute value line of an M-Bus channel, which decodes to a timestamp and a value.
+ */
+typedef struct {
+    uint8_t len;
+    char raw[LINE_CACHE_RAW_LEN];
+    uint32_t timestamp;
+    uint32_t value;
+} MBusLineCache;
+#endif
+
+/**
+ * All state of the parser. Every thread that parses needs its own.
+ * The global functions (parseLine, resetPacket) use parser, which decodes into packet & mbus.
+ */
+typedef struct {
+    Packet* packet;
+    MBusSlot* mbus; // MBUS_CHANNELS slots
+
+    /**
+     * Bit (1 << Field) is set if that line was byte-for-byte identical to the previous time it was parsed.
+     * The value in packet is still filled in, from the cache instead of by decoding the line again.
+     * Only meaningful for fields that were present in the current telegram.
+     */
+    uint32_t unchanged;
+
+    /**
+     * Timestamps only need mktime once per hour, the rest is added.
+     * hour = YYMMDDhh of the last timestamp, 0 if none.
+     */
+    uint32_t hour;
+    char hourDst;
+    uint32_t hourStart;
+
+    /**
+     * M-Bus channel (index) packet->gas_volume was copied from, MBUS_CHANNELS if none yet.
+     */
+    uint8_t gasChannel;
+
+#if LINE_CACHE
+    LineCache lineCache[FIELD_COUNT];
+    MBusLineCache mbusCache[MBUS_CHANNELS];
+#endif
+} ParserContext;
+
+extern ParserContext parser;
+#define packetUnchanged (parser.unchanged)
+
+/**
+ * Set up a parser context that decodes into p and mbus, with an empty cache.
+ */
+void initParser(ParserContext* ctx, Packet* p, MBusSlot* mbus);
+
+/**
+ * Reset packet and mbus (all 0xFF, "bad data") and unchanged before parsing a new telegram.
+ * The line cache is kept.
+ */
+void resetParser(ParserContext* ctx);
+
+/**
+ * resetParser for the global parser.
+ */
+void resetPacket(void);
+
+/**
+ * One entry of a line with a list of values, like the power failure log or the history of monthly peaks.
+ *
+ * Power failure log (1-0:99.97.0):
+ *  timestamp[0]: End of failure.
+ *  value: Duration in seconds.
+ *
+ * Monthly peaks (0-0:98.1.0):
+ *  timestamp[0]: Start of the month.
+ *  timestamp[1]: Time of the peak.
+ *  value: Peak demand in W.
+ *
+ * Timestamps that are not present are 0xFFFFFFFF.
+ */
+typedef struct {
+    uint32_t timestamp[2];
+    uint32_t value;
+} ListEntry;
+
+/**
+ * Parse a line that carries a list of values, like
+ *  1-0:99.97.0(2)(0-0:96.7.19)(101208152415W)(0000000240*s)(101208151004W)(0000000301*s)
+ * Every entry is a number of timestamps followed by one value.
+ * No memory is allocated, entries that don't fit in the caller's slots are skipped.
+ *
+ * @param n nr of characters that can be safely read from line.
+ * @param line pointer to string buffer.
+ * @param prefix The prefix we should expect, eg POWER_FAILURE_LOG.
+ * @param entries Caller provided slots.
+ * @param capacity Number of slots in entries.
+ * @return the number of entries stored in entries, or -1 if the prefix does not match.
+ */
+int16_t parseList(uint16_t n, const char* line, const char* prefix, ListEntry* entries, uint8_t capacity);
+
+/**
+ * Read one field out of a packet, widened to 32 bit.
+ * @param p The packet.
+ * @param field The field.
+ * @param value The output.
+ * @return false if the field was not present in the telegram (all 0xFF).
+ */
+bool packetField(const Packet* p, Field field, uint32_t* value);
+
+/**
+ * Inverse of packetField.
+ */
+void setPacketField(Packet* p, Field field, uint32_t value);
+
+/**
+ * Parse a single line of the telegram into the packet of ctx.
+ * @param ctx parser context.
+ * @param n nr of characters that can be safely read from line.
+ * @param line pointer to string buffer.
+ * @return if this line contained parseable text that resulted in an assignment.
+ */
+bool parseLineWith(ParserContext* ctx, uint16_t n, const char* line);
+
 /**
  * Parse a single line of the telegram into the global variable packet.
  * @param n nr of characters that can be safely read from line.
@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <string.h>
+#include "query.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define QUERY_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define MAX_BUCKETS 10000000
+
+typedef struct {
+    uint32_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+} RunStats;
+
+// -1 until the first query checks the CPU.
+static int8_t simd = -1;
+
+/**
+ * Count, sum, min and max of the values with lo <= v <= hi. Missing values (QUERY_MISSING) are always above hi.
+ */
+static void statsScalar(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi,
+                        RunStats* const out) {
+    uint32_t count = 0, min = UINT32_MAX, max = 0;
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = values[i];
+        if (v < lo || v > hi) continue;
+        count++;
+        sum += v;
+        if (v < min) min = v;
+        if (v > max) max = v;
+    }
+    out->count = count;
+    out->sum = sum;
+    out->min = min;
+    out->max = max;
+}
+
+/**
+ * @return Index of the first value with lo <= v <= hi, n if there is none.
+ */
+static uint32_t findScalar(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (values[i] >= lo && values[i] <= hi) return i;
+    }
+    return n;
+}
+
+#ifdef QUERY_AVX2
+
+// There's no unsigned compare: v >= lo is max(v, lo) == v.
+__attribute__((target("avx2")))
+static inline __m256i inRange(const __m256i v, const __m256i lo, const __m256i hi) {
+    return _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(v, lo), v),
+                            _mm256_cmpeq_epi32(_mm256_min_epu32(v, hi), v));
+}
+
+__attribute__((target("avx2")))
+static void statsAvx2(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi,
+                      RunStats* const out) {
+    const __m256i vlo = _mm256_set1_epi32((int) lo), vhi = _mm256_set1_epi32((int) hi);
+    const __m256i ones = _mm256_set1_epi32(-1), low = _mm256_set1_epi64x(0xFFFFFFFF);
+    __m256i count = _mm256_setzero_si256(), sumLow = count, sumHigh = count, max = count, min = ones;
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+        __m256i mask = inRange(v, vlo, vhi);
+        __m256i kept = _mm256_and_si256(v, mask); // 0 if not in range.
+        // 64 bit sums of the even and the odd lanes.
+        sumLow = _mm256_add_epi64(sumLow, _mm256_and_si256(kept, low));
+        sumHigh = _mm256_add_epi64(sumHigh, _mm256_srli_epi64(kept, 32));
+        min = _mm256_min_epu32(min, _mm256_or_si256(kept, _mm256_andnot_si256(mask, ones)));
+        max = _mm256_max_epu32(max, kept);
+        count = _mm256_sub_epi32(count, mask);
+    }
+    uint32_t lanes[8], mins[8], maxs[8];
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i*) lanes, count);
+    _mm256_storeu_si256((__m256i*) mins, min);
+    _mm256_storeu_si256((__m256i*) maxs, max);
+    _mm256_storeu_si256((__m256i*) sums, _mm256_add_epi64(sumLow, sumHigh));
+
+    statsScalar(values + i, n - i, lo, hi, out);
+    for (uint8_t l = 0; l < 8; l++) {
+        out->count += lanes[l];
+        if (mins[l] < out->min) out->min = mins[l];
+        if (maxs[l] > out->max) out->max = maxs[l];
+    }
+    out->sum += sums[0] + sums[1] + sums[2] + sums[3];
+    if (out->count == 0) {
+        out->min = UINT32_MAX;
+        out->max = 0;
+    }
+}
+
+__attribute__((target("avx2")))
+static uint32_t findAvx2(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi) {
+    const __m256i vlo = _mm256_set1_epi32((int) lo), vhi = _mm256_set1_epi32((int) hi);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+        uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(inRange(v, vlo, vhi)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + findScalar(values + i, n - i, lo, hi);
+}
+
+#endif
+
+bool querySetSimd(const bool enable) {
+#ifdef QUERY_AVX2
+    simd = enable && __builtin_cpu_supports("avx2");
+#else
+    simd = false;
+#endif
+    return simd;
+}
+
+static inline void runStats(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi,
+                            RunStats* const out) {
+#ifdef QUERY_AVX2
+    if (simd) return statsAvx2(values, n, lo, hi, out);
+#endif
+    statsScalar(values, n, lo, hi, out);
+}
+
+static inline uint32_t find(const uint32_t* const values, const uint32_t n, const uint32_t lo, const uint32_t hi) {
+#ifdef QUERY_AVX2
+    if (simd) return findAvx2(values, n, lo, hi);
+#endif
+    return findScalar(values, n, lo, hi);
+}
+
+void queryInit(Query* const query, const uint8_t column) {
+    memset(query, 0, sizeof(Query));
+    query->column = column;
+    query->to = UINT32_MAX;
+    query->max = QUERY_MISSING - 1;
+}
+
+/**
+ * Narrow from and to down to the timestamps that are in the archive, from the block headers.
+ * @return false if there are no rows in range.
+ */
+static bool timeRange(const ArchiveReader* const reader, const Query* const query, uint32_t* const from,
+                      uint32_t* const to) {
+    uint32_t min = UINT32_MAX, max = 0;
+    size_t offset = 0;
+    const ArchiveBlockHeader* block;
+    while ((block = archiveNextBlock(reader, &offset)) != NULL) {
+        const ArchiveColumnHeader* t = &block->columns[ARCHIVE_TIMESTAMP];
+        if (t->count == 0) continue;
+        if (t->min < min) min = t->min;
+        if (t->max > max) max = t->max;
+    }
+    *from = query->from > min ? query->from : min;
+    *to = query->to < (uint64_t) max + 1 ? query->to : max + 1;
+    return *from < *to;
+}
+
+static inline int64_t bucketIndex(const Query* const query, const uint32_t timestamp) {
+    if (query->step == 0) return 0;
+    int64_t t = (int64_t) timestamp + query->offset;
+    return t >= 0 ? t / query->step : -((-t + query->step - 1) / query->step);
+}
+
+/**
+ * Can this block have rows that pass the query, going by its header?
+ */
+static bool blockMatches(const ArchiveBlockHeader* const block, const Query* const query, const uint32_t from,
+                         const uint32_t to) {
+    const ArchiveColumnHeader* t = &block->columns[ARCHIVE_TIMESTAMP];
+    const ArchiveColumnHeader* c = &block->columns[query->column];
+    return t->count != 0 && c->count != 0 && t->max >= from && t->min < to && c->max >= query->min
+           && c->min <= query->max;
+}
+
+/**
+ * Index of the first timestamp >= t in times[i..n).
+ */
+static uint32_t lowerBound(const uint32_t* const times, uint32_t i, uint32_t n, const uint32_t t) {
+    while (i < n) {
+        uint32_t mid = i + (n - i) / 2;
+        if (times[mid] < t) i = mid + 1;
+        else n = mid;
+    }
+    return i;
+}
+
+/**
+ * @return Whether every row has a timestamp, in order.
+ */
+static bool sorted(const ArchiveBlockHeader* const block, const uint32_t* const times) {
+    if (block->columns[ARCHIVE_TIMESTAMP].count != block->rows) return false;
+    for (uint32_t i = 1; i < block->rows; i++) {
+        if (times[i] < times[i - 1]) return false;
+    }
+    return true;
+}
+
+static void addRun(QueryBucket* const bucket, const uint32_t* const values, const uint32_t n,
+                   const Query* const query, QueryStats* const stats) {
+    RunStats run;
+    runStats(values, n, query->min, query->max, &run);
+    if (run.count == 0) return;
+    uint32_t last = n - 1;
+    while (values[last] < query->min || values[last] > query->max) last--;
+    if (bucket->count == 0) {
+        bucket->min = run.min;
+        bucket->max = run.max;
+        bucket->first = values[find(values, n, query->min, query->max)];
+    } else {
+        if (run.min < bucket->min) bucket->min = run.min;
+        if (run.max > bucket->max) bucket->max = run.max;
+    }
+    bucket->count += run.count;
+    bucket->sum += run.sum;
+    bucket->last = values[last];
+    stats->matched += run.count;
+}
+
+QueryBucket* queryBuckets(const ArchiveReader* const reader, const Query* const query, uint32_t* const count,
+                          QueryStats* stats) {
+    if (simd < 0) querySetSimd(true);
+    QueryStats ignored;
+    if (stats == NULL) stats = &ignored;
+    uint32_t from, to;
+    if (!timeRange(reader, query, &from, &to)) return NULL;
+    const int64_t first = bucketIndex(query, from);
+    const int64_t n = bucketIndex(query, to - 1) - first + 1;
+    if (n > MAX_BUCKETS) return NULL;
+    QueryBucket* buckets = calloc(n, sizeof(QueryBucket));
+    if (buckets == NULL) return NULL;
+    for (int64_t b = 0; b < n; b++) {
+        buckets[b].start = query->step ? (first + b) * query->step - query->offset : from;
+    }
+
+    uint32_t times[ARCHIVE_BLOCK_ROWS], values[ARCHIVE_BLOCK_ROWS];
+    size_t offset = 0;
+    const ArchiveBlockHeader* block;
+    while ((block = archiveNextBlock(reader, &offset)) != NULL) {
+        stats->blocks++;
+        if (!blockMatches(block, query, from, to)) {
+            stats->skipped++;
+            continue;
+        }
+        if (archiveDecodeColumn(block, ARCHIVE_TIMESTAMP, times) < 0
+            || archiveDecodeColumn(block, query->column, values) < 0) {
+            stats->corrupt++;
+            continue;
+        }
+        stats->rows += block->rows;
+
+        if (!sorted(block, times)) {
+            for (uint32_t row = 0; row < block->rows; row++) {
+                if (times[row] < from || times[row] >= to) continue;
+                addRun(&buckets[bucketIndex(query, times[row]) - first], values + row, 1, query, stats);
+            }
+            continue;
+        }
+        // Runs of rows in the same bucket.
+        uint32_t i = lowerBound(times, 0, block->rows, from);
+        const uint32_t end = lowerBound(times, i, block->rows, to);
+        while (i < end) {
+            int64_t b = bucketIndex(query, times[i]);
+            uint32_t j = end;
+            if (query->step) {
+                int64_t next = (b + 1) * query->step - query->offset;
+                if (next < to) j = lowerBound(times, i, end, next);
+            }
+            addRun(&buckets[b - first], values + i, j - i, query, stats);
+            i = j;
+        }
+    }
+
+    const QueryBucket* previous = NULL;
+    for (int64_t b = 0; b < n; b++) {
+        if (buckets[b].count == 0) continue;
+        buckets[b].delta = buckets[b].last - (previous ? previous->last : buckets[b].first);
+        previous = &buckets[b];
+    }
+    *count = n;
+    return buckets;
+}
+
+// Min-heap on value; of equal values, the later one is the smallest so the earliest is kept.
+static inline bool below(const QueryPeak* const a, const QueryPeak* const b) {
+    return a->value < b->value || (a->value == b->value && a->timestamp > b->timestamp);
+}
+
+static void siftDown(QueryPeak* const heap, const uint32_t n, uint32_t i) {
+    while (true) {
+        uint32_t smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && below(&heap[l], &heap[smallest])) smallest = l;
+        if (r < n && below(&heap[r], &heap[smallest])) smallest = r;
+        if (smallest == i) return;
+        QueryPeak tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void push(QueryPeak* const heap, uint32_t* const n, const uint32_t k, const QueryPeak peak) {
+    if (*n < k) {
+        uint32_t i = (*n)++;
+        heap[i] = peak;
+        while (i > 0 && below(&heap[i], &heap[(i - 1) / 2])) {
+            QueryPeak tmp = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (below(&heap[0], &peak)) {
+        heap[0] = peak;
+        siftDown(heap, k, 0);
+    }
+}
+
+/**
+ * Heap to largest first.
+ */
+static void sortPeaks(QueryPeak* const heap, uint32_t n) {
+    while (n > 1) {
+        QueryPeak tmp = heap[0];
+        heap[0] = heap[--n];
+        heap[n] = tmp;
+        siftDown(heap, n, 0);
+    }
+}
+
+static uint32_t topBuckets(const ArchiveReader* const reader, const Query* const query, const uint32_t k,
+                           QueryPeak* const peaks, QueryStats* const stats) {
+    uint32_t count, n = 0;
+    QueryBucket* buckets = queryBuckets(reader, query, &count, stats);
+    if (buckets == NULL) return 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (buckets[b].count == 0) continue;
+        QueryPeak peak = {buckets[b].start, (buckets[b].sum + buckets[b].count / 2) / buckets[b].count};
+        push(peaks, &n, k, peak);
+    }
+    free(buckets);
+    sortPeaks(peaks, n);
+    return n;
+}
+
+uint32_t queryTopK(const ArchiveReader* const reader, const Query* const query, const uint32_t k,
+                   QueryPeak* const peaks, QueryStats* stats) {
+    if (simd < 0) querySetSimd(true);
+    QueryStats ignored;
+    if (stats == NULL) stats = &ignored;
+    if (k == 0) return 0;
+    if (query->step) return topBuckets(reader, query, k, peaks, stats);
+    uint32_t from, to;
+    if (!timeRange(reader, query, &from, &to)) return 0;
+
+    uint32_t times[ARCHIVE_BLOCK_ROWS], values[ARCHIVE_BLOCK_ROWS];
+    uint32_t n = 0;
+    size_t offset = 0;
+    const ArchiveBlockHeader* block;
+    while ((block = archiveNextBlock(reader, &offset)) != NULL) {
+        stats->blocks++;
+        // Once the heap is full, only values above the smallest in it count.
+        if (!blockMatches(block, query, from, to) || (n == k && block->columns[query->column].max <= peaks[0].value)) {
+            stats->skipped++;
+            continue;
+        }
+        if (archiveDecodeColumn(block, ARCHIVE_TIMESTAMP, times) < 0
+            || archiveDecodeColumn(block, query->column, values) < 0) {
+            stats->corrupt++;
+            continue;
+        }
+        stats->rows += block->rows;
+
+        uint32_t i = 0, end = block->rows;
+        bool inOrder = sorted(block, times);
+        if (inOrder) {
+            i = lowerBound(times, 0, end, from);
+            end = lowerBound(times, i, end, to);
+        }
+        uint32_t lo = n == k && peaks[0].value >= query->min ? peaks[0].value + 1 : query->min;
+        while (lo <= query->max && (i += find(values + i, end - i, lo, query->max)) < end) {
+            if (inOrder || (times[i] >= from && times[i] < to)) {
+                QueryPeak peak = {times[i], values[i]};
+                push(peaks, &n, k, peak);
+                stats->matched++;
+                if (n == k && peaks[0].value >= query->min) lo = peaks[0].value + 1;
+            }
+            i++;
+        }
+    }
+    sortPeaks(peaks, n);
+    return n;
+}
@@ -0,0 +1,91 @@
+#ifndef FIRMWARE_QUERY_H
+#define FIRMWARE_QUERY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "archive.h"
+
+/**
+ * Aggregations over one column of an archive (archive.h), per time bucket. Host only.
+ *
+ * Blocks are skipped on their header alone when their timestamps are outside the range, when none of their values
+ * can pass the value filter, or (top-k) when none of them can make it into the top. Only the timestamp column and
+ * the queried column of the other blocks are decoded.
+ * The kernels that run over the decoded values use AVX2 if the CPU has it, the scalar versions give the same results.
+ *
+ * Blocks are expected in time order (replay_x64 -o writes them sorted): the first and last value of a bucket are
+ * those of its first and last row in the file.
+ */
+
+#define QUERY_MISSING 0xFFFFFFFF
+
+typedef struct {
+    uint8_t column;
+    // Rows with from <= timestamp < to.
+    uint32_t from;
+    uint32_t to;
+    // Bucket size in seconds, 0 for a single bucket. Buckets start at multiples of step, shifted by offset
+    // (3600 for days in CET).
+    uint32_t step;
+    int32_t offset;
+    // Only rows with min <= value <= max. max is at most QUERY_MISSING - 1.
+    uint32_t min;
+    uint32_t max;
+} Query;
+
+typedef struct {
+    uint32_t start; // Of the bucket, seconds since epoch.
+    uint32_t count; // Rows with a value, 0 if the bucket was empty (the rest is not set).
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint32_t first;
+    uint32_t last;
+    // For meter registers: last value of this bucket - last value of the previous one with values
+    // (last - first for the first bucket), what was used during the bucket.
+    uint32_t delta;
+} QueryBucket;
+
+typedef struct {
+    uint32_t timestamp;
+    uint32_t value;
+} QueryPeak;
+
+typedef struct {
+    uint64_t blocks;
+    uint64_t skipped; // Blocks that weren't decoded.
+    uint64_t corrupt; // Blocks that failed to decode, and were left out.
+    uint64_t rows; // Rows in the decoded blocks.
+    uint64_t matched; // Rows that were in range and passed the filter (top-k rows: that were a candidate).
+} QueryStats;
+
+/**
+ * A query on column, for all rows.
+ */
+void queryInit(Query* query, uint8_t column);
+
+/**
+ * Use the AVX2 kernels if the CPU has them (default), or always the scalar ones.
+ * @return Whether the AVX2 kernels are used.
+ */
+bool querySetSimd(bool enable);
+
+/**
+ * Count, sum, min, max, first, last and delta per bucket, from the first to the last bucket with rows in range.
+ * @param count Nr of buckets.
+ * @param stats Added to, may be NULL.
+ * @return Buckets, free() them. NULL if there are no rows in range, or more than 10M buckets.
+ */
+QueryBucket* queryBuckets(const ArchiveReader* reader, const Query* query, uint32_t* count, QueryStats* stats);
+
+/**
+ * The k largest values, largest first. Ties go to the earliest row.
+ * With a step, the k buckets with the largest mean (the quarter hour peaks, with step 900 on sum_power_delivered).
+ * @param peaks k slots. For buckets, timestamp is the start of the bucket.
+ * @param stats Added to, may be NULL.
+ * @return Nr of peaks found, at most k.
+ */
+uint32_t queryTopK(const ArchiveReader* reader, const Query* query, uint32_t k, QueryPeak* peaks, QueryStats* stats);
+
+#endif //FIRMWARE_QUERY_H
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "packet.h"
+#include "archive.h"
+#include "query.h"
+
+// 2020-01-01 00:00:00 UTC
+#define SYNTH_START 1577836800
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rngState = 88172645463325252ULL;
+
+static uint64_t rng() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+// Uniform in [0, 1).
+static double rngUniform() {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Seconds since epoch, or YYYY-MM-DD[Thh:mm:ss] in UTC.
+ */
+static uint32_t parseTime(const char *s) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, "%Y-%m-%dT%H:%M:%S", &tm) != NULL || strptime(s, "%Y-%m-%d", &tm) != NULL) return timegm(&tm);
+    return strtoul(s, NULL, 10);
+}
+
+/**
+ * A household with a 3 phase connection at 1 telegram per second, from 2020-01-01:
+ * base load with a morning and evening bump, appliances (1.5 to 3 kW, minutes), an 11 kW car charging some nights,
+ * 4 kWp of solar on phase 1 (seasonal, with passing clouds), voltage that rises with solar and drops with load,
+ * and gas heating in winter.
+ */
+static void synth(const char *path, double years, uint64_t seed) {
+    rngState ^= seed * 0x9E3779B97F4A7C15ULL;
+    ArchiveWriter *writer = archiveOpenWriter(path);
+    if (writer == NULL) error("Failed to open archive.");
+
+    const uint64_t seconds = (uint64_t) (years * 365.25 * 86400);
+    double registers[4] = {1234567, 2345678, 345678, 123456}; // Wh
+    double gas = 4567890; // dm3
+    uint32_t gasReported = 0;
+    double appliance = 0, cloud = 1;
+    uint32_t applianceLeft = 0, carLeft = 0;
+    uint8_t appliancePhase = 0;
+    Packet p;
+    double start = now();
+    for (uint64_t s = 0; s < seconds; s++) {
+        uint32_t t = SYNTH_START + s;
+        double hour = fmod((t + 3600) / 3600.0, 24); // CET, near enough.
+        uint32_t day = (t + 3600) / 86400;
+        double season = cos(2 * M_PI * (day % 365 - 172) / 365.0); // 1 in June, -1 in December.
+        bool weekday = (day + 3) % 7 < 5; // 1970-01-01 was a Thursday.
+
+        if (s % 86400 == 75600 && rngUniform() < 0.25) carLeft = 7200 + rng() % 7200;
+        if (applianceLeft == 0 && rngUniform() < 1 / 1800.0) {
+            appliance = 1500 + rngUniform() * 1500;
+            applianceLeft = 60 + rng() % 540;
+            appliancePhase = rng() % 3;
+        }
+        cloud += (rngUniform() - 0.5) * 0.02;
+        if (cloud < 0.2) cloud = 0.2;
+        if (cloud > 1) cloud = 1;
+
+        double base = 150 + 250 * exp(-pow(hour - 7.5, 2)) + 450 * exp(-pow(hour - 19, 2) / 4);
+        double load[3];
+        for (uint8_t i = 0; i < 3; i++) load[i] = base / 3 + rngUniform() * 30;
+        if (applianceLeft) {
+            load[appliancePhase] += appliance;
+            applianceLeft--;
+        }
+        if (carLeft) {
+            for (uint8_t i = 0; i < 3; i++) load[i] += 3680;
+            carLeft--;
+        }
+        double daylight = 12 + 4 * season;
+        double sun = sin(M_PI * (hour - (13.5 - daylight / 2)) / daylight);
+        double pv = sun > 0 ? 4000 * sun * (0.65 + 0.35 * season) * cloud : 0;
+
+        memset(&p, 0xFF, sizeof(p));
+        uint8_t tariff = weekday && hour >= 7 && hour < 22 ? 1 : 2;
+        double delivered = 0, injected = 0;
+        for (uint8_t i = 0; i < 3; i++) {
+            double net = load[i] - (i == 0 ? pv : 0);
+            double voltage = 2300 + (rngUniform() - 0.5) * 40 - load[i] / 60 + (i == 0 ? pv / 40 : 0);
+            setPacketField(&p, FIELD_POWER_P1_DELIVERED + i, net > 0 ? net : 0);
+            setPacketField(&p, FIELD_POWER_P1_INJECTED + i, net < 0 ? -net : 0);
+            setPacketField(&p, FIELD_VOLTAGE_P1 + i, voltage);
+            setPacketField(&p, FIELD_CURRENT_P1 + i, fabs(net) / voltage * 1000);
+            if (net > 0) delivered += net;
+            else injected -= net;
+        }
+        registers[tariff == 1 ? 0 : 1] += delivered / 3600;
+        registers[tariff == 1 ? 2 : 3] += injected / 3600;
+        if (season < 0.3) gas += (0.3 - season) * (hour >= 6 && hour < 23 ? 0.4 : 0.1);
+
+        setPacketField(&p, FIELD_TIMESTAMP, t);
+        setPacketField(&p, FIELD_TARIFF, tariff);
+        setPacketField(&p, FIELD_METER_T1_DELIVERED, registers[0]);
+        setPacketField(&p, FIELD_METER_T2_DELIVERED, registers[1]);
+        setPacketField(&p, FIELD_METER_T1_INJECTED, registers[2]);
+        setPacketField(&p, FIELD_METER_T2_INJECTED, registers[3]);
+        setPacketField(&p, FIELD_SUM_POWER_DELIVERED, delivered);
+        setPacketField(&p, FIELD_SUM_POWER_INJECTED, injected);
+        // The meter only reports gas every 5 minutes.
+        if (s % 300 == 0) gasReported = gas;
+        p.gas_volume = gasReported;
+        if (!archiveAppend(writer, &p)) error("Failed to write archive.");
+    }
+    if (!archiveCloseWriter(writer)) error("Failed to write archive.");
+    printf("Wrote %lu telegrams (%.1f years) in %.1f s\n", seconds, years, now() - start);
+}
+
+static void printStats(const QueryStats *s, double elapsed) {
+    printf("{\"blocks\": %lu, \"skipped\": %lu, \"corrupt\": %lu, \"rows\": %lu, \"matched\": %lu, \"seconds\": %.3f}\n",
+           s->blocks, s->skipped, s->corrupt, s->rows, s->matched, elapsed);
+}
+
+static void buckets(const ArchiveReader *reader, const Query *query) {
+    QueryStats stats = {0};
+    uint32_t count;
+    double start = now();
+    QueryBucket *buckets = queryBuckets(reader, query, &count, &stats);
+    double elapsed = now() - start;
+    if (buckets == NULL) error("No rows, or too many buckets.");
+    for (uint32_t b = 0; b < count; b++) {
+        const QueryBucket *q = &buckets[b];
+        if (q->count == 0) {
+            printf("{\"start\": %u, \"count\": 0}\n", q->start);
+            continue;
+        }
+        printf("{\"start\": %u, \"count\": %u, \"sum\": %lu, \"min\": %u, \"max\": %u, \"mean\": %.3f, \"first\": %u, "
+               "\"last\": %u, \"delta\": %u}\n", q->start, q->count, q->sum, q->min, q->max, (double) q->sum / q->count,
+               q->first, q->last, q->delta);
+    }
+    printStats(&stats, elapsed);
+    free(buckets);
+}
+
+static void topk(const ArchiveReader *reader, const Query *query, uint32_t k) {
+    QueryPeak *peaks = malloc(k * sizeof(QueryPeak));
+    QueryStats stats = {0};
+    double start = now();
+    uint32_t n = queryTopK(reader, query, k, peaks, &stats);
+    double elapsed = now() - start;
+    for (uint32_t i = 0; i < n; i++) printf("{\"timestamp\": %u, \"value\": %u}\n", peaks[i].timestamp, peaks[i].value);
+    printStats(&stats, elapsed);
+    free(peaks);
+}
+
+static uint64_t archiveRows(const ArchiveReader *reader) {
+    uint64_t rows = 0;
+    size_t offset = 0;
+    const ArchiveBlockHeader *block;
+    while ((block = archiveNextBlock(reader, &offset)) != NULL) rows += block->rows;
+    return rows;
+}
+
+typedef struct {
+    const char *name;
+    const char *column;
+    uint32_t step;
+    uint32_t k; // 0 for buckets.
+    const char *from;
+    const char *to;
+    uint32_t min;
+} BenchQuery;
+
+/**
+ * The monthly report queries, with the scalar and the AVX2 kernels. Rows per second is over all rows of the archive.
+ */
+static void bench(const ArchiveReader *reader, uint32_t repeat) {
+    static const BenchQuery queries[] = {
+            {"daily_energy_t1", "meter_delivered_t1", 86400, 0, NULL, NULL, 0},
+            {"hourly_power", "sum_power_delivered", 3600, 0, NULL, NULL, 0},
+            {"daily_voltage_p1", "voltage_p1", 86400, 0, NULL, NULL, 0},
+            {"quarter_peaks_top10", "sum_power_delivered", 900, 10, NULL, NULL, 0},
+            {"power_top10", "sum_power_delivered", 0, 10, NULL, NULL, 0},
+            {"above_240v_p1", "voltage_p1", 86400, 0, NULL, NULL, 2400},
+            {"june_2021_quarters", "sum_power_delivered", 900, 0, "2021-06-01", "2021-07-01", 0},
+    };
+    const uint64_t rows = archiveRows(reader);
+    static uint32_t values[ARCHIVE_BLOCK_ROWS];
+
+    // Decoding the timestamp and one other column, without aggregating.
+    double start = now();
+    for (uint32_t r = 0; r < repeat; r++) {
+        size_t offset = 0;
+        const ArchiveBlockHeader *block;
+        while ((block = archiveNextBlock(reader, &offset)) != NULL) {
+            if (archiveDecodeColumn(block, ARCHIVE_TIMESTAMP, values) < 0
+                || archiveDecodeColumn(block, FIELD_SUM_POWER_DELIVERED, values) < 0) {
+                error("Corrupt archive.");
+            }
+        }
+    }
+    double elapsed = (now() - start) / repeat;
+    printf("{\"query\": \"decode_only\", \"rows\": %lu, \"ms\": %.1f, \"mrows_per_s\": %.1f}\n", rows, elapsed * 1e3,
+           rows / elapsed / 1e6);
+
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        const BenchQuery *b = &queries[i];
+        Query query;
+        queryInit(&query, archiveColumn(b->column));
+        query.step = b->step;
+        query.offset = b->step >= 86400 ? 3600 : 0;
+        if (b->from) query.from = parseTime(b->from);
+        if (b->to) query.to = parseTime(b->to);
+        if (b->min) query.min = b->min;
+        for (int simd = 0; simd < 2; simd++) {
+            if (querySetSimd(simd) != simd) continue;
+            QueryStats stats = {0};
+            QueryPeak peaks[16];
+            uint64_t check = 0;
+            start = now();
+            for (uint32_t r = 0; r < repeat; r++) {
+                if (b->k) {
+                    uint32_t n = queryTopK(reader, &query, b->k, peaks, &stats);
+                    check += n ? peaks[0].value : 0;
+                } else {
+                    uint32_t count;
+                    QueryBucket *buckets = queryBuckets(reader, &query, &count, &stats);
+                    for (uint32_t j = 0; buckets && j < count; j++) check += buckets[j].sum + buckets[j].delta;
+                    free(buckets);
+                }
+            }
+            elapsed = (now() - start) / repeat;
+            printf("{\"query\": \"%s\", \"kernels\": \"%s\", \"blocks\": %lu, \"skipped\": %lu, \"decoded_rows\": %lu, "
+                   "\"ms\": %.1f, \"mrows_per_s\": %.1f, \"check\": %lu}\n", b->name, simd ? "avx2" : "scalar",
+                   stats.blocks / repeat, stats.skipped / repeat, stats.rows / repeat, elapsed * 1e3,
+                   rows / elapsed / 1e6, check / repeat);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *args[3] = {NULL, NULL, NULL};
+    int nargs = 0;
+    Query query;
+    queryInit(&query, 0);
+    const char *from = NULL, *to = NULL;
+    uint32_t k = 10, repeat = 3, min = 0, max = QUERY_MISSING - 1;
+    double years = 3;
+    uint64_t seed = 1;
+    bool scalar = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) from = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) to = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) query.step = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) query.offset = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) min = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) max = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) k = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc) years = atof(argv[++i]);
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--scalar") == 0) scalar = true;
+        else if (nargs < 3) args[nargs++] = argv[i];
+    }
+    if (from) query.from = parseTime(from);
+    if (to) query.to = parseTime(to);
+    query.min = min;
+    query.max = max < QUERY_MISSING ? max : QUERY_MISSING - 1;
+    if (scalar) querySetSimd(false);
+    if (repeat == 0) repeat = 1;
+
+    if (nargs == 2 && strcmp(args[0], "synth") == 0) {
+        synth(args[1], years, seed);
+        return 0;
+    }
+    ArchiveReader reader;
+    if (nargs >= 2 && !archiveOpenReader(&reader, args[1])) error("Failed to open archive.");
+    if (nargs == 3 && (strcmp(args[0], "buckets") == 0 || strcmp(args[0], "topk") == 0)) {
+        int column = archiveColumn(args[2]);
+        if (column < 0) error("Unknown column.");
+        query.column = column;
+        if (args[0][0] == 'b') buckets(&reader, &query);
+        else topk(&reader, &query, k);
+    } else if (nargs == 2 && strcmp(args[0], "bench") == 0) {
+        bench(&reader, repeat);
+    } else {
+        error("Usage: query_x64 synth <archive.p1a> [-y years] [-S seed]\n"
+              "       query_x64 buckets <archive.p1a> <column> [-f from] [-t to] [-s step] [-z offset] [-m min] [-M max] [--scalar]\n"
+              "       query_x64 topk <archive.p1a> <column> [-k k] [-f from] [-t to] [-s step] [-z offset] [-m min] [-M max] [--scalar]\n"
+              "       query_x64 bench <archive.p1a> [-r repeat]\n"
+              "  Times are seconds since epoch or YYYY-MM-DD[Thh:mm:ss] (UTC), buckets start at multiples of step - offset.");
+    }
+    if (nargs >= 2) archiveCloseReader(&reader);
+    return 0;
+}
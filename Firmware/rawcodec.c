@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include "rawcodec.h"
+#include "crc.h"
+
+_Static_assert(sizeof(RawCodecHeader) == 8, "RawCodecHeader is the file format.");
+
+// Longer gaps are split into several records.
+#define GAP_MAX 65536
+// Records are collected up to this size before they go through zlib.
+#define RECORDS_SIZE (256 * 1024)
+// Largest record: a gap (the rest are smaller), plus tag and length.
+#define RECORD_MAX (GAP_MAX + 16)
+#define CHUNK 65536
+// Worst case diff: tag, count, every number changed (skip + 64 bit difference), footer length and footer.
+#define DIFF_MAX (1 + 3 + RAWCODEC_NUMBERS_MAX * (3 + 10) + 3 + RAWCODEC_TELEGRAM_MAX)
+
+typedef struct {
+    uint16_t offset;
+    uint8_t len;
+    uint8_t dot; // Position of the decimal point in the run, 0 if there is none.
+} Number;
+
+/**
+ * The last telegram of a meter, with its numbers and their predictions. Encoder and decoder keep the same.
+ */
+typedef struct {
+    bool used;
+    uint16_t len;
+    uint16_t bodyLen; // Up to and including the '!'.
+    uint16_t headerLen; // The first line, including the '\n'.
+    bool crc; // The footer was the CRC (4 hex digits) followed by suffix.
+    uint8_t suffixLen;
+    char suffix[8];
+    int16_t count; // -1 if there are too many numbers, it can't be diffed.
+    Number numbers[RAWCODEC_NUMBERS_MAX];
+    int64_t value[RAWCODEC_NUMBERS_MAX];
+    int64_t previous[RAWCODEC_NUMBERS_MAX];
+    // Decaying sums of how far off "unchanged" and "same change as last time" were.
+    uint64_t errorSame[RAWCODEC_NUMBERS_MAX];
+    uint64_t errorLinear[RAWCODEC_NUMBERS_MAX];
+    char text[RAWCODEC_TELEGRAM_MAX];
+} Template;
+
+struct RawEncoder {
+    FILE* fp;
+    z_stream zlib;
+    uint8_t out[CHUNK];
+    uint8_t records[RECORDS_SIZE + DIFF_MAX + RECORD_MAX];
+    size_t recordsLen;
+    // Raw data that isn't a complete telegram yet.
+    char* pending;
+    size_t pendingLen;
+    size_t pendingCap;
+    bool lineStart; // The byte before pending[0] was a '\n' (or there was none).
+    uint8_t nextTemplate;
+    Template templates[RAWCODEC_TEMPLATES];
+    // Scratch for the telegram being encoded.
+    Number numbers[RAWCODEC_NUMBERS_MAX];
+    int64_t values[RAWCODEC_NUMBERS_MAX];
+    uint8_t changes[RAWCODEC_NUMBERS_MAX * (3 + 10)];
+    RawCodecStats stats;
+};
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static inline uint64_t zigzag64(const int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag64(const uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline uint8_t* putVarint(uint8_t* out, uint64_t v) {
+    while (v >= 0x80) {
+        *out++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (uint8_t) v;
+    return out;
+}
+
+/**
+ * @return NULL if the varint doesn't end before end.
+ */
+static inline const uint8_t* getVarint(const uint8_t* in, const uint8_t* const end, uint64_t* v) {
+    uint64_t result = 0;
+    for (uint8_t shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t b = *in++;
+        result |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The numbers of a telegram: digit runs between '(' and ')', up to RAWCODEC_DIGITS_MAX digits.
+ * A decimal point is part of the run ("002784.374" is 2784374), so a register that goes past a whole kWh is still
+ * a small change.
+ * @return How many, -1 if there are more than RAWCODEC_NUMBERS_MAX.
+ */
+static int16_t findNumbers(const char* const text, const uint16_t len, Number* const numbers, int64_t* const values) {
+    int16_t count = 0;
+    bool value = false;
+    for (uint16_t i = 0; i < len;) {
+        char c = text[i];
+        if (c == '(') value = true;
+        else if (c == ')' || c == '\n') value = false;
+        if (!value || c < '0' || c > '9') {
+            i++;
+            continue;
+        }
+        uint16_t start = i, digits = 0;
+        uint8_t dot = 0;
+        int64_t v = 0;
+        for (; i < len; i++) {
+            c = text[i];
+            if (c == '.' && !dot && i + 1 < len && text[i + 1] >= '0' && text[i + 1] <= '9') {
+                dot = i - start;
+                continue;
+            }
+            if (c < '0' || c > '9') break;
+            if (digits++ < RAWCODEC_DIGITS_MAX) v = v * 10 + (c - '0');
+        }
+        if (digits > RAWCODEC_DIGITS_MAX) continue;
+        if (count == RAWCODEC_NUMBERS_MAX) return -1;
+        numbers[count].offset = start;
+        numbers[count].len = i - start;
+        numbers[count].dot = dot;
+        values[count++] = v;
+    }
+    return count;
+}
+
+/**
+ * Length of the telegram up to and including the '!' at the start of a line, 0 if there is none.
+ */
+static uint16_t bodyLength(const char* const text, const uint16_t len) {
+    for (uint16_t i = 1; i < len; i++) {
+        if (text[i] == '!' && text[i - 1] == '\n') return i + 1;
+    }
+    return 0;
+}
+
+static inline void crcHex(char* const out, const char* const body, const uint16_t len) {
+    uint16_t crc = crc16Table(0, body, len);
+    out[0] = hexDigits[crc >> 12];
+    out[1] = hexDigits[(crc >> 8) & 0xF];
+    out[2] = hexDigits[(crc >> 4) & 0xF];
+    out[3] = hexDigits[crc & 0xF];
+}
+
+static void setTemplate(Template* const t, const char* const text, const uint16_t len) {
+    memcpy(t->text, text, len);
+    t->used = true;
+    t->len = len;
+    t->bodyLen = bodyLength(text, len);
+    const char* newline = memchr(text, '\n', len);
+    t->headerLen = newline ? newline - text + 1 : len;
+    const char* footer = text + t->bodyLen;
+    uint16_t footerLen = len - t->bodyLen;
+    char hex[4];
+    crcHex(hex, text, t->bodyLen);
+    t->crc = footerLen >= 4 && footerLen - 4 <= (int) sizeof(t->suffix) && memcmp(footer, hex, 4) == 0;
+    t->suffixLen = t->crc ? footerLen - 4 : 0;
+    memcpy(t->suffix, footer + 4, t->suffixLen);
+    t->count = findNumbers(text, t->bodyLen, t->numbers, t->value);
+    for (int16_t i = 0; i < t->count; i++) {
+        t->previous[i] = t->value[i];
+        t->errorSame[i] = t->errorLinear[i] = 0;
+    }
+}
+
+static inline int64_t predict(const Template* const t, const int16_t i) {
+    return t->errorLinear[i] < t->errorSame[i] ? 2 * t->value[i] - t->previous[i] : t->value[i];
+}
+
+static inline uint64_t decay(const uint64_t error, int64_t off) {
+    if (off < 0) off = -off;
+    if (off > (1LL << 40)) off = 1LL << 40;
+    return error - (error >> 3) + off;
+}
+
+static inline void update(Template* const t, const int16_t i, const int64_t v) {
+    t->errorSame[i] = decay(t->errorSame[i], v - t->value[i]);
+    t->errorLinear[i] = decay(t->errorLinear[i], v - (2 * t->value[i] - t->previous[i]));
+    t->previous[i] = t->value[i];
+    t->value[i] = v;
+}
+
+/**
+ * Zero padded, in the digits of number (the decimal point is already there).
+ * @return false if v doesn't fit.
+ */
+static bool writeNumber(char* const out, const Number* const number, int64_t v) {
+    if (v < 0) return false;
+    for (int i = number->len - 1; i >= 0; i--) {
+        if (number->dot && i == number->dot) continue;
+        out[i] = (char) ('0' + v % 10);
+        v /= 10;
+    }
+    return v == 0;
+}
+
+static bool deflateRecords(RawEncoder* const e, const int flush) {
+    z_stream* z = &e->zlib;
+    z->next_in = e->records;
+    z->avail_in = e->recordsLen;
+    do {
+        z->next_out = e->out;
+        z->avail_out = sizeof(e->out);
+        if (deflate(z, flush) == Z_STREAM_ERROR) return false;
+        size_t n = sizeof(e->out) - z->avail_out;
+        if (n && fwrite(e->out, 1, n, e->fp) != n) return false;
+        e->stats.outBytes += n;
+    } while (z->avail_out == 0);
+    e->recordsLen = 0;
+    return true;
+}
+
+static bool putBytes(RawEncoder* const e, const uint8_t tag, const char* const data, const size_t len) {
+    uint8_t* out = e->records + e->recordsLen;
+    *out++ = tag;
+    out = putVarint(out, len);
+    memcpy(out, data, len);
+    e->recordsLen = out + len - e->records;
+    return e->recordsLen < RECORDS_SIZE || deflateRecords(e, Z_NO_FLUSH);
+}
+
+static bool putGap(RawEncoder* const e, const char* data, size_t len) {
+    while (len > 0) {
+        size_t n = len < GAP_MAX ? len : GAP_MAX;
+        e->stats.gaps++;
+        if (!putBytes(e, RAWCODEC_GAP, data, n)) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool putTelegram(RawEncoder* const e, const char* const text, const uint16_t len) {
+    e->stats.telegrams++;
+    uint16_t bodyLen = bodyLength(text, len);
+    const char* newline = memchr(text, '\n', len);
+    uint16_t headerLen = newline - text + 1;
+
+    // The template of this meter, or the slot to (re)use for it.
+    Template* t = NULL;
+    uint8_t index = 0;
+    for (; index < RAWCODEC_TEMPLATES; index++) {
+        t = &e->templates[index];
+        if (t->used && t->headerLen == headerLen && memcmp(t->text, text, headerLen) == 0) break;
+    }
+    int16_t count = findNumbers(text, bodyLen, e->numbers, e->values);
+    bool same = index < RAWCODEC_TEMPLATES && count >= 0 && t->count == count && t->bodyLen == bodyLen;
+    for (int16_t i = 0, at = 0; same && i <= count; i++) {
+        // The text between the numbers has to be the same.
+        uint16_t end = i < count ? e->numbers[i].offset : bodyLen;
+        same = memcmp(text + at, t->text + at, end - at) == 0
+               && (i == count || (t->numbers[i].offset == end && t->numbers[i].len == e->numbers[i].len
+                                   && t->numbers[i].dot == e->numbers[i].dot));
+        if (i < count) at = end + e->numbers[i].len;
+    }
+    if (!same) {
+        if (index == RAWCODEC_TEMPLATES) {
+            index = e->nextTemplate;
+            e->nextTemplate = (e->nextTemplate + 1) % RAWCODEC_TEMPLATES;
+        }
+        setTemplate(&e->templates[index], text, len);
+        e->stats.templates++;
+        return putBytes(e, RAWCODEC_TEMPLATE | index, text, len);
+    }
+
+    uint8_t* changes = e->changes;
+    uint16_t changed = 0;
+    int16_t last = -1;
+    for (int16_t i = 0; i < count; i++) {
+        int64_t off = e->values[i] - predict(t, i);
+        if (off != 0) {
+            changes = putVarint(changes, i - last - 1);
+            changes = putVarint(changes, zigzag64(off));
+            last = i;
+            changed++;
+        }
+        update(t, i, e->values[i]);
+    }
+    const char* footer = text + bodyLen;
+    uint16_t footerLen = len - bodyLen;
+    char hex[4];
+    crcHex(hex, text, bodyLen);
+    bool crc = t->crc && footerLen == 4 + t->suffixLen && memcmp(footer, hex, 4) == 0
+               && memcmp(footer + 4, t->suffix, t->suffixLen) == 0;
+    memcpy(t->text, text, len);
+    t->len = len;
+
+    uint8_t* out = e->records + e->recordsLen;
+    *out++ = RAWCODEC_DIFF | (crc ? RAWCODEC_CRC : 0) | index;
+    out = putVarint(out, changed);
+    memcpy(out, e->changes, changes - e->changes);
+    out += changes - e->changes;
+    if (!crc) {
+        out = putVarint(out, footerLen);
+        memcpy(out, footer, footerLen);
+        out += footerLen;
+    }
+    e->recordsLen = out - e->records;
+    e->stats.diffs++;
+    e->stats.crcs += crc;
+    e->stats.changed += changed;
+    return e->recordsLen < RECORDS_SIZE || deflateRecords(e, Z_NO_FLUSH);
+}
+
+/**
+ * Split pending into telegrams ('/' at the start of a line up to the end of the '!' line) and gaps.
+ * A telegram that's cut off by the next '/' line, or that's too long, is a gap.
+ * @param final No more data is coming, the rest is a gap.
+ */
+static bool encodePending(RawEncoder* const e, const bool final) {
+    char* const data = e->pending;
+    const size_t len = e->pendingLen;
+    size_t done = 0, at = 0;
+    bool ok = true;
+    while (ok && at < len) {
+        // Start of the next telegram.
+        size_t start = at;
+        while (start < len && !(data[start] == '/' && (start == 0 ? e->lineStart : data[start - 1] == '\n'))) start++;
+        if (start == len) {
+            at = len;
+            break;
+        }
+        // End: the '\n' after the '!' line.
+        size_t end = 0, next = 0;
+        bool complete = false;
+        for (size_t i = start; i + 1 < len && i - start < RAWCODEC_TELEGRAM_MAX; i++) {
+            if (data[i] != '\n') continue;
+            if (data[i + 1] == '/') {
+                next = i + 1;
+                break;
+            }
+            if (data[i + 1] == '!') {
+                const char* lf = memchr(data + i + 1, '\n', len - i - 1);
+                if (lf != NULL) {
+                    end = lf - data + 1;
+                    complete = end - start <= RAWCODEC_TELEGRAM_MAX;
+                    if (!complete) next = start + 1;
+                }
+                break;
+            }
+        }
+        if (complete) {
+            ok = putGap(e, data + done, start - done) && putTelegram(e, data + start, end - start);
+            done = at = end;
+        } else if (next) {
+            at = next;
+        } else if (len - start > RAWCODEC_TELEGRAM_MAX + 64) {
+            // Too long to be a telegram.
+            at = start + 1;
+        } else {
+            // Incomplete, wait for more.
+            at = start;
+            break;
+        }
+    }
+    size_t keep = final ? len : at;
+    if (ok && keep > done) ok = putGap(e, data + done, keep - done);
+    if (keep > 0) e->lineStart = data[keep - 1] == '\n';
+    memmove(data, data + keep, len - keep);
+    e->pendingLen = len - keep;
+    return ok;
+}
+
+RawEncoder* rawEncoderOpen(const char* const path, const int level) {
+    RawEncoder* e = calloc(1, sizeof(RawEncoder));
+    if (e == NULL) return NULL;
+    e->fp = fopen(path, "wb");
+    RawCodecHeader header = {RAWCODEC_MAGIC, RAWCODEC_VERSION, 0};
+    if (e->fp == NULL || fwrite(&header, sizeof(header), 1, e->fp) != 1
+        || deflateInit(&e->zlib, level ? level : RAWCODEC_DEFAULT_LEVEL) != Z_OK) {
+        if (e->fp) fclose(e->fp);
+        free(e);
+        return NULL;
+    }
+    e->stats.outBytes = sizeof(header);
+    e->lineStart = true;
+    return e;
+}
+
+bool rawEncoderWrite(RawEncoder* const e, const char* const data, const size_t len) {
+    if (e->pendingLen + len > e->pendingCap) {
+        size_t cap = e->pendingCap ? e->pendingCap : 16384;
+        while (cap < e->pendingLen + len) cap *= 2;
+        char* pending = realloc(e->pending, cap);
+        if (pending == NULL) return false;
+        e->pending = pending;
+        e->pendingCap = cap;
+    }
+    memcpy(e->pending + e->pendingLen, data, len);
+    e->pendingLen += len;
+    e->stats.inBytes += len;
+    return encodePending(e, false);
+}
+
+bool rawEncoderClose(RawEncoder* const e, RawCodecStats* const stats) {
+    bool ok = encodePending(e, true) && deflateRecords(e, Z_FINISH);
+    deflateEnd(&e->zlib);
+    ok = fclose(e->fp) == 0 && ok;
+    if (stats != NULL) *stats = e->stats;
+    free(e->pending);
+    free(e);
+    return ok;
+}
+
+/**
+ * Inflated records, refilled as they are used.
+ */
+typedef struct {
+    FILE* fp;
+    z_stream zlib;
+    bool end;
+    uint8_t in[CHUNK];
+    uint8_t buf[2 * RECORD_MAX + DIFF_MAX];
+    size_t start;
+    size_t len;
+} Source;
+
+/**
+ * Make sure there are n bytes (or all that's left) after start.
+ * @return false on a zlib or read error.
+ */
+static bool fill(Source* const s, const size_t n) {
+    if (s->len - s->start >= n || s->end) return true;
+    memmove(s->buf, s->buf + s->start, s->len - s->start);
+    s->len -= s->start;
+    s->start = 0;
+    z_stream* z = &s->zlib;
+    while (s->len < n && !s->end) {
+        if (z->avail_in == 0) {
+            z->avail_in = fread(s->in, 1, sizeof(s->in), s->fp);
+            z->next_in = s->in;
+            if (z->avail_in == 0) return false; // Truncated.
+        }
+        z->next_out = s->buf + s->len;
+        z->avail_out = sizeof(s->buf) - s->len;
+        int status = inflate(z, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) return false;
+        s->len = sizeof(s->buf) - z->avail_out;
+        s->end = status == Z_STREAM_END;
+    }
+    return true;
+}
+
+static bool decodeDiff(Source* const s, Template* const t, const uint8_t tag) {
+    const uint8_t* in = s->buf + s->start + 1;
+    const uint8_t* const end = s->buf + s->len;
+    uint64_t changed, skip, off;
+    int64_t offs[RAWCODEC_NUMBERS_MAX] = {0};
+    if ((in = getVarint(in, end, &changed)) == NULL || t->count < 0 || changed > (uint64_t) t->count) return false;
+    int64_t i = -1;
+    for (uint64_t k = 0; k < changed; k++) {
+        if ((in = getVarint(in, end, &skip)) == NULL || (in = getVarint(in, end, &off)) == NULL) return false;
+        i += skip + 1;
+        if (i >= t->count) return false;
+        offs[i] = unzigzag64(off);
+    }
+    for (int16_t j = 0; j < t->count; j++) {
+        int64_t v = predict(t, j) + offs[j];
+        if (v != t->value[j] && !writeNumber(t->text + t->numbers[j].offset, &t->numbers[j], v)) return false;
+        update(t, j, v);
+    }
+    char* footer = t->text + t->bodyLen;
+    if (tag & RAWCODEC_CRC) {
+        crcHex(footer, t->text, t->bodyLen);
+        memcpy(footer + 4, t->suffix, t->suffixLen);
+        t->len = t->bodyLen + 4 + t->suffixLen;
+    } else {
+        uint64_t footerLen;
+        if ((in = getVarint(in, end, &footerLen)) == NULL || footerLen > (uint64_t) (end - in)
+            || t->bodyLen + footerLen > RAWCODEC_TELEGRAM_MAX) return false;
+        memcpy(footer, in, footerLen);
+        in += footerLen;
+        t->len = t->bodyLen + footerLen;
+    }
+    s->start = in - s->buf;
+    return true;
+}
+
+int64_t rawDecode(const char* const path, const RawDecodeCallback callback, void* const ctx) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+    RawCodecHeader header;
+    Source* s = calloc(1, sizeof(Source));
+    Template* templates = calloc(RAWCODEC_TEMPLATES, sizeof(Template));
+    int64_t telegrams = -1;
+    if (s == NULL || templates == NULL || fread(&header, sizeof(header), 1, fp) != 1 || header.magic != RAWCODEC_MAGIC
+        || header.version != RAWCODEC_VERSION || inflateInit(&s->zlib) != Z_OK) goto done;
+    s->fp = fp;
+
+    int64_t count = 0;
+    bool stop = false;
+    while (!stop) {
+        if (!fill(s, DIFF_MAX)) goto done;
+        if (s->start == s->len) break;
+        uint8_t tag = s->buf[s->start];
+        Template* t = &templates[tag & 0x0F];
+        if ((tag & 0xC0) == RAWCODEC_DIFF) {
+            if (!t->used || !decodeDiff(s, t, tag)) goto done;
+            count++;
+            stop = !callback(t->text, t->len, true, ctx);
+            continue;
+        }
+        uint64_t len;
+        const uint8_t* in = getVarint(s->buf + s->start + 1, s->buf + s->len, &len);
+        if (in == NULL || len > GAP_MAX) goto done;
+        size_t headerLen = in - (s->buf + s->start);
+        if (!fill(s, headerLen + len) || s->len - s->start < headerLen + len) goto done;
+        const char* data = (const char*) s->buf + s->start + headerLen;
+        s->start += headerLen + len;
+        if ((tag & 0xC0) == RAWCODEC_GAP) {
+            stop = !callback(data, len, false, ctx);
+        } else if ((tag & 0xC0) == RAWCODEC_TEMPLATE && len <= RAWCODEC_TELEGRAM_MAX) {
+            setTemplate(t, data, len);
+            count++;
+            stop = !callback(t->text, t->len, true, ctx);
+        } else {
+            goto done;
+        }
+    }
+    telegrams = count;
+
+done:
+    if (s != NULL) inflateEnd(&s->zlib);
+    free(s);
+    free(templates);
+    fclose(fp);
+    return telegrams;
+}
@@ -0,0 +1,92 @@
+#ifndef FIRMWARE_RAWCODEC_H
+#define FIRMWARE_RAWCODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Lossless compression of raw P1 captures (the text as it comes out of the meter, like Testing/log.txt). Host only.
+ * Decoding gives back the exact bytes, line endings, CRC footers and garbage between telegrams included.
+ *
+ * Consecutive telegrams of a meter only differ in a few numbers. Per meter (header line) a template is kept:
+ * the previous telegram, with the digit runs between '(' and ')' as numbers (runs longer than
+ * RAWCODEC_DIGITS_MAX, like hex encoded IDs, are text). A telegram with the same text around the numbers
+ * is stored as the numbers that differ from their prediction, everything else (OBIS codes, units, the header)
+ * comes from the template. Every number is predicted as either unchanged or changing by the same amount as
+ * last time (timestamps, registers), whichever was closer lately; encoder and decoder make the same choice.
+ * The CRC is left out if it's right: the decoder calculates it again.
+ *
+ * File layout: RawCodecHeader, then a zlib stream of records. A record starts with a tag byte:
+ *  bits 6-7 kind, bit 5 RAWCODEC_CRC, bits 0-3 the template.
+ *  RAWCODEC_GAP      varint length, bytes. Data that is not a telegram.
+ *  RAWCODEC_TEMPLATE varint length, bytes. A telegram, stored as is, that becomes the template.
+ *  RAWCODEC_DIFF     varint n, then n times: varint nr of numbers skipped, zig-zag varint difference from the prediction.
+ *                    Without RAWCODEC_CRC: varint length, bytes of the footer (after the '!').
+ */
+
+#define RAWCODEC_MAGIC 0x315A3150 // "P1Z1"
+#define RAWCODEC_VERSION 1
+#define RAWCODEC_TEMPLATES 16
+#define RAWCODEC_TELEGRAM_MAX 4096
+#define RAWCODEC_NUMBERS_MAX 256
+#define RAWCODEC_DIGITS_MAX 18
+#define RAWCODEC_DEFAULT_LEVEL 6
+
+#define RAWCODEC_GAP 0x00
+#define RAWCODEC_TEMPLATE 0x40
+#define RAWCODEC_DIFF 0x80
+#define RAWCODEC_CRC 0x20
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+} RawCodecHeader;
+
+typedef struct {
+    uint64_t telegrams;
+    uint64_t templates; // Telegrams stored as is (new meter, or a line was added or changed length).
+    uint64_t diffs;
+    uint64_t crcs; // Diffs with a CRC that was left out.
+    uint64_t gaps;
+    uint64_t changed; // Numbers that weren't predicted.
+    uint64_t inBytes;
+    uint64_t outBytes;
+} RawCodecStats;
+
+typedef struct RawEncoder RawEncoder;
+
+/**
+ * Create a compressed capture.
+ * @param level zlib level, 1 (fastest) to 9.
+ * @return NULL on error.
+ */
+RawEncoder* rawEncoderOpen(const char* path, int level);
+
+/**
+ * Append raw capture data, in chunks of any size (telegrams don't have to be complete).
+ * @return false on write error.
+ */
+bool rawEncoderWrite(RawEncoder* encoder, const char* data, size_t len);
+
+/**
+ * Store what's left (an incomplete telegram) and close.
+ * @param stats Filled in, may be NULL.
+ * @return false on write error.
+ */
+bool rawEncoderClose(RawEncoder* encoder, RawCodecStats* stats);
+
+/**
+ * Called with the decoded data, in order: a telegram (with its footer), or data between telegrams.
+ * @return false to stop decoding.
+ */
+typedef bool (*RawDecodeCallback)(const char* data, size_t len, bool telegram, void* ctx);
+
+/**
+ * Decode a compressed capture.
+ * @return Nr of telegrams, -1 on error (not a compressed capture, truncated, corrupt).
+ */
+int64_t rawDecode(const char* path, RawDecodeCallback callback, void* ctx);
+
+#endif //FIRMWARE_RAWCODEC_H
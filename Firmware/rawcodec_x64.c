@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "crc.h"
+#include "rawcodec.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *readFile(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) error("Failed to open capture.");
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = malloc(*len + 1);
+    if (data == NULL || fread(data, 1, *len, fp) != *len) error("Failed to read capture.");
+    fclose(fp);
+    return data;
+}
+
+static void printStats(const char *mode, const RawCodecStats *s, double seconds) {
+    printf("{\"mode\": \"%s\", \"telegrams\": %lu, \"templates\": %lu, \"diffs\": %lu, \"crcs_left_out\": %lu, \"gaps\": %lu, "
+           "\"numbers_changed\": %.2f, \"in_bytes\": %lu, \"out_bytes\": %lu, \"ratio\": %.1f, \"bytes_per_telegram\": %.2f, "
+           "\"mb_per_s\": %.1f}\n", mode, s->telegrams, s->templates, s->diffs, s->crcs, s->gaps,
+           s->diffs ? (double) s->changed / s->diffs : 0, s->inBytes, s->outBytes, (double) s->inBytes / s->outBytes,
+           s->telegrams ? (double) s->outBytes / s->telegrams : 0, s->inBytes / seconds / 1e6);
+}
+
+static RawCodecStats encode(const char *in, const char *out, int level, size_t chunk, double *seconds) {
+    FILE *fp = fopen(in, "rb");
+    if (fp == NULL) error("Failed to open capture.");
+    char *buf = malloc(chunk);
+    RawEncoder *encoder = rawEncoderOpen(out, level);
+    if (encoder == NULL) error("Failed to create output.");
+    double start = now();
+    size_t n;
+    while ((n = fread(buf, 1, chunk, fp)) > 0) {
+        if (!rawEncoderWrite(encoder, buf, n)) error("Failed to write output.");
+    }
+    RawCodecStats stats;
+    if (!rawEncoderClose(encoder, &stats)) error("Failed to write output.");
+    *seconds = now() - start;
+    fclose(fp);
+    free(buf);
+    return stats;
+}
+
+static bool writeData(const char *data, size_t len, bool telegram, void *ctx) {
+    (void) telegram;
+    return fwrite(data, 1, len, ctx) == len;
+}
+
+typedef struct {
+    const char *original;
+    size_t len;
+    size_t at;
+    uint64_t telegrams;
+    uint64_t crcOk;
+    uint64_t bytes;
+} Verify;
+
+/**
+ * Compare with the original, and check the CRC of every telegram.
+ */
+static bool verifyData(const char *data, size_t len, bool telegram, void *ctx) {
+    Verify *v = ctx;
+    if (v->at + len > v->len || memcmp(v->original + v->at, data, len) != 0) {
+        printf("Mismatch at byte %lu\n", v->at);
+        return false;
+    }
+    v->at += len;
+    v->bytes += len;
+    if (telegram) {
+        v->telegrams++;
+        const char *end = memchr(data, '!', len);
+        // The body ends at the '!' at the start of a line.
+        while (end != NULL && end > data && end[-1] != '\n') end = memchr(end + 1, '!', len - (end + 1 - data));
+        if (end != NULL && end + 5 <= data + len) {
+            uint16_t crc = crc16Table(0, data, end + 1 - data);
+            v->crcOk += strtol(end + 1, NULL, 16) == crc;
+        }
+    }
+    return true;
+}
+
+static bool countData(const char *data, size_t len, bool telegram, void *ctx) {
+    (void) data;
+    (void) telegram;
+    *(uint64_t *) ctx += len;
+    return true;
+}
+
+/**
+ * Plain zlib at the same level, to see what the templates add.
+ */
+static size_t zlibSize(const char *data, size_t len, int level, double *seconds) {
+    double start = now();
+    uLongf size = compressBound(len);
+    Bytef *out = malloc(size);
+    if (compress2(out, &size, (const Bytef *) data, len, level) != Z_OK) error("zlib failed.");
+    *seconds = now() - start;
+    free(out);
+    return size;
+}
+
+int main(int argc, char **argv) {
+    const char *args[3] = {NULL, NULL, NULL};
+    int nargs = 0;
+    int level = RAWCODEC_DEFAULT_LEVEL;
+    size_t chunk = 65536;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) level = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) chunk = atoi(argv[++i]);
+        else if (nargs < 3) args[nargs++] = argv[i];
+    }
+    if (chunk == 0) chunk = 1;
+
+    if (nargs == 3 && strcmp(args[0], "encode") == 0) {
+        double seconds;
+        RawCodecStats stats = encode(args[1], args[2], level, chunk, &seconds);
+        printStats("encode", &stats, seconds);
+    } else if (nargs == 3 && strcmp(args[0], "decode") == 0) {
+        FILE *fp = fopen(args[2], "wb");
+        if (fp == NULL) error("Failed to create output.");
+        int64_t telegrams = rawDecode(args[1], writeData, fp);
+        if (fclose(fp) != 0 || telegrams < 0) error("Failed to decode.");
+        printf("Decoded %ld telegrams\n", telegrams);
+    } else if (nargs == 3 && strcmp(args[0], "verify") == 0) {
+        Verify v = {0};
+        v.original = readFile(args[1], &v.len);
+        int64_t telegrams = rawDecode(args[2], verifyData, &v);
+        bool ok = telegrams >= 0 && v.at == v.len;
+        printf("{\"ok\": %s, \"telegrams\": %lu, \"crc_ok\": %lu, \"bytes\": %lu, \"original_bytes\": %lu}\n",
+               ok ? "true" : "false", v.telegrams, v.crcOk, v.bytes, v.len);
+        if (!ok) return -1;
+    } else if (nargs == 2 && strcmp(args[0], "bench") == 0) {
+        char out[] = "/tmp/rawcodec-XXXXXX";
+        int fd = mkstemp(out);
+        if (fd < 0) error("Failed to create temporary file.");
+        double encodeSeconds, decodeSeconds, zlibSeconds;
+        RawCodecStats stats = encode(args[1], out, level, chunk, &encodeSeconds);
+        printStats("encode", &stats, encodeSeconds);
+
+        uint64_t bytes = 0;
+        double start = now();
+        int64_t telegrams = rawDecode(out, countData, &bytes);
+        decodeSeconds = now() - start;
+        remove(out);
+        if (telegrams < 0 || bytes != stats.inBytes) error("Failed to decode.");
+        printf("{\"mode\": \"decode\", \"telegrams\": %ld, \"bytes\": %lu, \"mb_per_s\": %.1f, \"telegrams_per_s\": %.0f}\n",
+               telegrams, bytes, bytes / decodeSeconds / 1e6, telegrams / decodeSeconds);
+
+        size_t len;
+        char *data = readFile(args[1], &len);
+        size_t size = zlibSize(data, len, level, &zlibSeconds);
+        printf("{\"mode\": \"zlib\", \"level\": %d, \"out_bytes\": %lu, \"ratio\": %.1f, \"mb_per_s\": %.1f}\n", level,
+               size, (double) len / size, len / zlibSeconds / 1e6);
+        free(data);
+    } else {
+        error("Usage: rawcodec_x64 encode <capture.txt> <capture.p1z> [-l zlib level] [-c chunk]\n"
+              "       rawcodec_x64 decode <capture.p1z> <capture.txt>\n"
+              "       rawcodec_x64 verify <capture.txt> <capture.p1z>\n"
+              "       rawcodec_x64 bench <capture.txt> [-l zlib level] [-c chunk]");
+    }
+    return 0;
+}
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "replay.h"
+#include "crc.h"
+
+typedef struct {
+    const char* start;
+    const char* end;
+    ReplayRecord* records;
+    size_t count;
+    size_t capacity;
+    size_t next; // Next record to merge.
+    uint64_t crcErrors;
+    bool failed;
+    bool decoded;
+    bool merged; // And its records freed.
+} Chunk;
+
+/**
+ * Chunks [head, tail) that were handed to this worker and still have to be decoded, in a ring of window slots.
+ * The owner takes from the head, thieves from the tail, so they don't fight over the same chunks.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t* items;
+    uint32_t head;
+    uint32_t tail;
+} Deque;
+
+typedef struct {
+    Chunk* chunks;
+    Deque* deques;
+    unsigned threads;
+    uint32_t window;
+    atomic_uint queued; // In the deques.
+    atomic_uint steals;
+    // Workers wait on work for queued chunks, the merge waits on decoded for the next chunk it needs.
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t decoded;
+    bool closed; // No more chunks will be queued.
+} Pool;
+
+typedef struct {
+    Pool* pool;
+    unsigned id;
+} Worker;
+static inline const char* nextLine(const char* const p, const char* const end) {
+    const char* nl = memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl + 1;
+}
+
+/**
+ * @return the first line at or after p that starts with '/', or end.
+ */
+static const char* nextHeader(const char* p, const char* const begin, const char* const end) {
+    if (p > begin && p[-1] != '\n') p = nextLine(p, end);
+    while (p < end && *p != '/') p = nextLine(p, end);
+    return p;
+}
+
+static bool pushRecord(Chunk* const chunk, const Packet* const p, const uint64_t offset, const bool crcOk) {
+    if (chunk->count == chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+        ReplayRecord* records = realloc(chunk->records, capacity * sizeof(ReplayRecord));
+        if (records == NULL) return false;
+        chunk->records = records;
+        chunk->capacity = capacity;
+    }
+    ReplayRecord* record = &chunk->records[chunk->count++];
+    record->packet = *p;
+    record->offset = offset;
+    record->crcOk = crcOk;
+    return true;
+}
+
+static void decodeChunk(Chunk* const chunk, const char* const base) {
+    Packet p;
+    MBusSlot mbus[MBUS_CHANNELS];
+    ParserContext ctx;
+    initParser(&ctx, &p, mbus);
+
+    const char* line = chunk->start;
+    const char* header = NULL;
+    uint16_t crc = 0;
+    while (line < chunk->end) {
+        const char* next = nextLine(line, chunk->end);
+        size_t len = next - line;
+        if (*line == '/') {
+            header = line;
+            crc = 0;
+            resetParser(&ctx);
+        }
+        if (header == NULL) {
+            // Garbage before the first header
+        } else if (*line == '!') {
+            crc = crc16(crc, line, 1);
+            bool crcOk = strtol(line + 1, NULL, 16) == crc;
+            if (!crcOk) chunk->crcErrors++;
+            if (p.timestamp != 0xFFFFFFFF && !pushRecord(chunk, &p, header - base, crcOk)) {
+                chunk->failed = true;
+                return;
+            }
+            header = NULL;
+        } else {
+            crc = crc16(crc, line, len);
+            parseLineWith(&ctx, len > UINT16_MAX ? UINT16_MAX : len, line);
+        }
+        line = next;
+    }
+}
+
+static bool takeChunk(Deque* const deque, const uint32_t window, uint32_t* const chunk, const bool steal) {
+    bool ok = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head != deque->tail) {
+        *chunk = deque->items[(steal ? --deque->tail : deque->head++) % window];
+        ok = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+static void pushChunk(Pool* const pool, const uint32_t chunk) {
+    Deque* deque = &pool->deques[chunk % pool->threads];
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->tail++ % pool->window] = chunk;
+    pthread_mutex_unlock(&deque->lock);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void closePool(Pool* const pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* workerMain(void* const arg) {
+    Worker* worker = arg;
+    Pool* pool = worker->pool;
+    const char* base = pool->chunks[0].start;
+    uint32_t chunk;
+    while (true) {
+        bool taken = takeChunk(&pool->deques[worker->id], pool->window, &chunk, false);
+        for (unsigned i = 1; i < pool->threads && !taken; i++) {
+            taken = takeChunk(&pool->deques[(worker->id + i) % pool->threads], pool->window, &chunk, true);
+            if (taken) atomic_fetch_add(&pool->steals, 1);
+        }
+        if (!taken) {
+            pthread_mutex_lock(&pool->lock);
+            bool done = pool->closed && atomic_load(&pool->queued) == 0;
+            if (!done && atomic_load(&pool->queued) == 0) pthread_cond_wait(&pool->work, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+            if (done) break;
+            continue;
+        }
+        atomic_fetch_sub(&pool->queued, 1);
+        decodeChunk(&pool->chunks[chunk], base);
+        pthread_mutex_lock(&pool->lock);
+        pool->chunks[chunk].decoded = true;
+        pthread_cond_broadcast(&pool->decoded);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static Chunk* waitDecoded(Pool* const pool, const uint32_t chunk) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->chunks[chunk].decoded) pthread_cond_wait(&pool->decoded, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return &pool->chunks[chunk];
+}
+
+static void freeChunk(Chunk* const chunk) {
+    free(chunk->records);
+    chunk->records = NULL;
+    chunk->merged = true;
+    // Its part of the capture isn't needed any more either. Whole pages only, the next chunk shares the last one.
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) chunk->start + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t) chunk->end & ~(page - 1);
+    if (end > start) madvise((void*) start, end - start, MADV_DONTNEED);
+}
+
+/**
+ * Min-heap of chunk indices, on the timestamp of the next record of every chunk.
+ * Ties go to the lower chunk, so telegrams with the same timestamp stay in file order.
+ */
+static inline bool before(const Chunk* const chunks, const uint32_t a, const uint32_t b) {
+    uint32_t ta = chunks[a].records[chunks[a].next].packet.timestamp;
+    uint32_t tb = chunks[b].records[chunks[b].next].packet.timestamp;
+    return ta < tb || (ta == tb && a < b);
+}
+
+static void siftDown(uint32_t* const heap, const size_t n, size_t i, const Chunk* const chunks) {
+    while (true) {
+        size_t smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && before(chunks, heap[l], heap[smallest])) smallest = l;
+        if (r < n && before(chunks, heap[r], heap[smallest])) smallest = r;
+        if (smallest == i) return;
+        uint32_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void siftUp(uint32_t* const heap, size_t i, const Chunk* const chunks) {
+    while (i > 0 && before(chunks, heap[i], heap[(i - 1) / 2])) {
+        uint32_t tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Merge the chunks as they are decoded: a k-way heap merge over the oldest REPLAY_MERGE_CHUNKS * threads chunks
+ * that aren't merged yet, the workers decode up to REPLAY_AHEAD_CHUNKS * threads more. A chunk is freed once all
+ * its records went to the callback, so only the window is ever in memory.
+ * @return false on a decode error, or if the callback stopped it.
+ */
+static bool merge(Pool* const pool, const uint32_t count, const ReplayCallback callback, void* const ctx,
+                  ReplayStats* const stats) {
+    Chunk* chunks = pool->chunks;
+    const uint32_t mergeWindow = pool->window - REPLAY_AHEAD_CHUNKS * pool->threads;
+    uint32_t* heap = malloc(mergeWindow * sizeof(uint32_t));
+    if (heap == NULL) return false;
+    size_t size = 0;
+    uint32_t front = 0, queued = 0, entered = 0;
+    bool ok = true;
+    while (true) {
+        while (front < count && chunks[front].merged) front++;
+        while (queued < count && queued < front + pool->window) pushChunk(pool, queued++);
+        if (queued == count) closePool(pool);
+
+        if (entered < count && entered < front + mergeWindow) {
+            Chunk* chunk = waitDecoded(pool, entered);
+            if (chunk->failed) {
+                ok = false;
+                break;
+            }
+            stats->telegrams += chunk->count;
+            stats->crcErrors += chunk->crcErrors;
+            if (chunk->count == 0) {
+                freeChunk(chunk);
+            } else {
+                heap[size++] = entered;
+                siftUp(heap, size - 1, chunks);
+            }
+            entered++;
+            continue;
+        }
+        if (size == 0) break;
+
+        Chunk* chunk = &chunks[heap[0]];
+        if (callback != NULL && !callback(&chunk->records[chunk->next], ctx)) {
+            ok = false;
+            break;
+        }
+        if (++chunk->next == chunk->count) {
+            freeChunk(chunk);
+            heap[0] = heap[--size];
+        }
+        siftDown(heap, size, 0, chunks);
+    }
+    free(heap);
+    return ok;
+}
+
+bool replayCapture(const char* const capture, unsigned threads, size_t chunkSize, const ReplayCallback callback,
+                   void* const ctx, ReplayStats* const stats) {
+    if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (chunkSize == 0) chunkSize = REPLAY_DEFAULT_CHUNK;
+
+    int fd = open(capture, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    const char* const end = data + st.st_size;
+
+    // Cut into chunks that start on a header line.
+    uint32_t n = st.st_size / chunkSize + 1;
+    Chunk* chunks = calloc(n, sizeof(Chunk));
+    uint32_t count = 0;
+    const char* start = data;
+    for (uint32_t i = 1; i <= n && start < end; i++) {
+        const char* cut = i == n ? end : nextHeader(data + (size_t) i * chunkSize, data, end);
+        if (cut <= start) continue;
+        chunks[count].start = start;
+        chunks[count].end = cut;
+        count++;
+        start = cut;
+    }
+
+    if (threads > count) threads = count ? count : 1;
+    Pool pool = {
+            .chunks = chunks,
+            .deques = calloc(threads, sizeof(Deque)),
+            .threads = threads,
+            .window = (REPLAY_MERGE_CHUNKS + REPLAY_AHEAD_CHUNKS) * threads,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.decoded, NULL);
+    Worker* workers = calloc(threads, sizeof(Worker));
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_mutex_init(&pool.deques[t].lock, NULL);
+        pool.deques[t].items = malloc(pool.window * sizeof(uint32_t));
+        workers[t].pool = &pool;
+        workers[t].id = t;
+    }
+    // The calling thread merges.
+    for (unsigned t = 0; t < threads; t++) pthread_create(&ids[t], NULL, workerMain, &workers[t]);
+
+    ReplayStats result = {
+            .bytes = st.st_size,
+            .chunks = count,
+    };
+    bool ok = merge(&pool, count, callback, ctx, &result);
+
+    // After an error: stop handing out chunks, let the workers finish the ones they have.
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_mutex_lock(&pool.deques[t].lock);
+        atomic_fetch_sub(&pool.queued, pool.deques[t].tail - pool.deques[t].head);
+        pool.deques[t].head = pool.deques[t].tail;
+        pthread_mutex_unlock(&pool.deques[t].lock);
+    }
+    closePool(&pool);
+    for (unsigned t = 0; t < threads; t++) pthread_join(ids[t], NULL);
+    result.steals = atomic_load(&pool.steals);
+    if (stats != NULL) *stats = result;
+
+    for (uint32_t c = 0; c < count; c++) free(chunks[c].records);
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_mutex_destroy(&pool.deques[t].lock);
+        free(pool.deques[t].items);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work);
+    pthread_cond_destroy(&pool.decoded);
+    free(chunks);
+    free(pool.deques);
+    free(workers);
+    free(ids);
+    munmap((void*) data, st.st_size);
+    return ok;
+}
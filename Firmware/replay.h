@@ -0,0 +1,56 @@
+#ifndef FIRMWARE_REPLAY_H
+#define FIRMWARE_REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+/**
+ * Parallel decoding of (large) raw P1 captures. Host only.
+ *
+ * The memory mapped capture is cut into chunks, every cut is moved forward to the next '/' header line,
+ * so every chunk holds whole telegrams. The chunks are decoded on a work-stealing thread pool, every worker
+ * has its own ParserContext. The results are handed to the callback in timestamp order, on the calling thread.
+ *
+ * Only a window of chunks is in memory: the records are merged while the workers decode what comes next, and a
+ * chunk is freed once it's merged. So the order is by timestamp within REPLAY_MERGE_CHUNKS * threads chunks,
+ * telegrams that are further out of place come out in file order (replay_x64 counts them as out_of_order).
+ */
+
+#define REPLAY_DEFAULT_CHUNK (8 * 1024 * 1024)
+// Per thread: chunks in the merge, and chunks decoded ahead of it.
+#define REPLAY_MERGE_CHUNKS 2
+#define REPLAY_AHEAD_CHUNKS 2
+
+typedef struct {
+    Packet packet;
+    uint64_t offset; // Offset of the '/' line in the capture.
+    bool crcOk;
+} ReplayRecord;
+
+typedef struct {
+    uint64_t telegrams;
+    uint64_t crcErrors;
+    uint64_t bytes;
+    uint32_t chunks;
+    uint32_t steals;
+} ReplayStats;
+
+/**
+ * @return false to stop, replayCapture then returns false.
+ */
+typedef bool (*ReplayCallback)(const ReplayRecord* record, void* ctx);
+
+/**
+ * @param capture Path of the raw capture.
+ * @param threads Nr of worker threads, 0 = nr of CPUs.
+ * @param chunkSize Approximate chunk size in bytes, 0 = REPLAY_DEFAULT_CHUNK.
+ * @param callback Called for every telegram with a timestamp, in timestamp order. May be NULL.
+ * @param stats Output, may be NULL.
+ * @return false on IO or allocation error, or if the callback stopped it.
+ */
+bool replayCapture(const char* capture, unsigned threads, size_t chunkSize, ReplayCallback callback, void* ctx, ReplayStats* stats);
+
+#endif //FIRMWARE_REPLAY_H
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet.h"
+#include "archive.h"
+#include "replay.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    ArchiveWriter *writer;
+    uint32_t last;
+    uint64_t outOfOrder;
+    const char *error; // Why output stopped the replay.
+} Output;
+
+static bool output(const ReplayRecord *record, void *ctx) {
+    Output *out = ctx;
+    if (record->packet.timestamp < out->last) out->outOfOrder++;
+    out->last = record->packet.timestamp;
+    if (out->writer != NULL && record->crcOk && !archiveAppend(out->writer, &record->packet)) {
+        out->error = "Failed to write archive.";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *capture = NULL;
+    const char *archive = NULL;
+    unsigned threads = 0;
+    size_t chunk = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) archive = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) chunk = strtoul(argv[++i], NULL, 10);
+        else if (capture == NULL) capture = argv[i];
+        else capture = NULL, i = argc;
+    }
+    if (capture == NULL) {
+        error("Usage: replay_x64 <capture.txt> [-t threads] [-c chunk bytes] [-o archive.p1a]\n"
+              "  Decodes the capture in parallel, and appends telegrams with a good CRC to the archive.");
+    }
+
+    Output out = {0};
+    if (archive != NULL && (out.writer = archiveOpenWriter(archive)) == NULL) error("Failed to open archive.");
+
+    ReplayStats stats;
+    double start = now();
+    if (!replayCapture(capture, threads, chunk, output, &out, &stats)) {
+        error(out.error != NULL ? out.error : "Failed to replay capture.");
+    }
+    double elapsed = now() - start;
+    if (out.writer != NULL && !archiveCloseWriter(out.writer)) error("Failed to write archive.");
+
+    printf("{\"telegrams\": %lu, \"crc_errors\": %lu, \"out_of_order\": %lu, \"chunks\": %u, \"steals\": %u, "
+           "\"seconds\": %.3f, \"telegrams_per_second\": %.0f, \"mb_per_second\": %.1f}\n",
+           stats.telegrams, stats.crcErrors, out.outOfOrder, stats.chunks, stats.steals,
+           elapsed, stats.telegrams / elapsed, stats.bytes / elapsed / 1e6);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shmring.h"
+
+_Static_assert(sizeof(ShmRingHeader) == 64, "ShmRingHeader is shared with P1logger/shmring.py.");
+_Static_assert(sizeof(ShmRingSlot) == 144, "ShmRingSlot is shared with P1logger/shmring.py.");
+
+static ShmRing* mapRing(const int fd, const size_t size, const int prot) {
+    void* data = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    ShmRing* ring = malloc(sizeof(ShmRing));
+    if (ring == NULL) {
+        munmap(data, size);
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->size = size;
+    ring->header = data;
+    ring->slots = (ShmRingSlot*) ((char*) data + sizeof(ShmRingHeader));
+    return ring;
+}
+
+static long futex(uint32_t* const word, const int op, const uint32_t value, const struct timespec* const timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * Publish a new generation and wake the readers that wait for records, so they notice right away.
+ */
+static void setGeneration(ShmRingHeader* const h, const uint32_t generation) {
+    __atomic_store_n(&h->generation, generation, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->futex, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&h->waiters, __ATOMIC_ACQUIRE)) futex(&h->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+ShmRing* shmRingCreate(const char* const name, uint32_t slots) {
+    if (slots == 0) slots = SHMRING_DEFAULT_SLOTS;
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    size_t size = sizeof(ShmRingHeader) + (size_t) slots * sizeof(ShmRingSlot);
+    struct stat st;
+    ShmRingHeader old;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    bool isRing = (size_t) st.st_size >= sizeof(ShmRingHeader) && pread(fd, &old, sizeof(old), 0) == sizeof(old)
+                && memcmp(old.magic, SHMRING_MAGIC, 4) == 0;
+    ShmRing* prev = NULL;
+
+    if (isRing && (size_t) st.st_size == size && old.version == SHMRING_VERSION && old.slots == slots
+        && old.slotSize == sizeof(ShmRingSlot)) {
+        // Same layout: take it over in place, never resize what readers have mapped (SIGBUS).
+        ShmRing* r = mapRing(fd, size, PROT_READ | PROT_WRITE);
+        if (r == NULL) return NULL;
+        __atomic_store_n(&r->header->head, 0, __ATOMIC_RELEASE);
+        for (uint32_t i = 0; i < slots; i++) __atomic_store_n(&r->slots[i].seq, 0, __ATOMIC_RELEASE);
+        uint32_t generation = old.generation + 1;
+        setGeneration(r->header, generation == SHMRING_REPLACED ? 1 : generation);
+        return r;
+    }
+
+    if (st.st_size != 0) {
+        // Another layout: readers keep the old one mapped until they see SHMRING_REPLACED, the new one gets the name.
+        if (isRing) prev = mapRing(fd, st.st_size, PROT_READ | PROT_WRITE);
+        else close(fd);
+        if (shm_unlink(name) != 0 || (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+            if (prev != NULL) shmRingClose(prev);
+            return NULL;
+        }
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        if (prev != NULL) shmRingClose(prev);
+        return NULL;
+    }
+    ShmRing* r = mapRing(fd, size, PROT_READ | PROT_WRITE);
+    if (r != NULL) {
+        r->header->version = SHMRING_VERSION;
+        r->header->slots = slots;
+        r->header->slotSize = sizeof(ShmRingSlot);
+        r->header->generation = 1;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        // Magic last, readers check it.
+        memcpy(r->header->magic, SHMRING_MAGIC, 4);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    if (prev != NULL) {
+        // Only once the new one is ready, readers that see this open it right away.
+        setGeneration(prev->header, SHMRING_REPLACED);
+        shmRingClose(prev);
+    }
+    return r;
+}
+
+ShmRing* shmRingOpen(const char* const name) {
+    // O_RDWR for the waiters counter.
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShmRingHeader)) {
+        close(fd);
+        return NULL;
+    }
+    ShmRing* ring = mapRing(fd, st.st_size, PROT_READ | PROT_WRITE);
+    if (ring == NULL) return NULL;
+    ShmRingHeader* h = ring->header;
+    if (memcmp(h->magic, SHMRING_MAGIC, 4) != 0 || h->version != SHMRING_VERSION || h->slotSize != sizeof(ShmRingSlot)
+        || sizeof(ShmRingHeader) + (size_t) h->slots * h->slotSize > ring->size) {
+        shmRingClose(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void shmRingClose(ShmRing* const ring) {
+    munmap(ring->header, ring->size);
+    close(ring->fd);
+    free(ring);
+}
+
+void shmRingFromPacket(ShmRingSlot* const slot, const Packet* const p, const MBusSlot* const mbus,
+                       const char* const meterId, const bool crcOk) {
+    memset(slot, 0, sizeof(ShmRingSlot));
+    slot->crcOk = crcOk;
+    if (meterId != NULL) {
+        size_t len = strlen(meterId);
+        slot->meterIdLen = len > SHMRING_METER_ID_LEN ? SHMRING_METER_ID_LEN : len;
+        memcpy(slot->meterId, meterId, slot->meterIdLen);
+    }
+    for (Field f = 0; f < FIELD_COUNT; f++) {
+        uint32_t value;
+        slot->values[f] = packetField(p, f, &value) ? value : SHMRING_MISSING;
+    }
+    slot->values[SHMRING_GAS_VOLUME] = SHMRING_MISSING;
+    for (int i = 0; mbus != NULL && i < MBUS_CHANNELS; i++) {
+        if (mbus[i].deviceType == MBUS_DEVICE_TYPE_GAS) {
+            slot->values[SHMRING_GAS_VOLUME] = mbus[i].value;
+            break;
+        }
+    }
+}
+
+void shmRingPublish(ShmRing* const ring, const ShmRingSlot* const record) {
+    ShmRingHeader* h = ring->header;
+    uint64_t n = h->head + 1;
+    ShmRingSlot* slot = &ring->slots[n % h->slots];
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*) slot + sizeof(slot->seq), (const char*) record + sizeof(record->seq), sizeof(ShmRingSlot) - sizeof(slot->seq));
+    slot->published = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    __atomic_store_n(&slot->seq, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, n, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->futex, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&h->waiters, __ATOMIC_ACQUIRE)) futex(&h->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void shmRingReaderInit(ShmRingReader* const reader, ShmRing* const ring, const bool all) {
+    uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    uint32_t slots = ring->header->slots;
+    reader->ring = ring;
+    reader->next = all ? (head >= slots ? head - slots + 1 : 1) : head + 1;
+    reader->lost = 0;
+    reader->futex = __atomic_load_n(&ring->header->futex, __ATOMIC_ACQUIRE);
+    reader->generation = __atomic_load_n(&ring->header->generation, __ATOMIC_ACQUIRE);
+}
+
+bool shmRingNext(ShmRingReader* const reader, ShmRingSlot* const out) {
+    ShmRingHeader* h = reader->ring->header;
+    uint32_t slots = h->slots;
+    while (true) {
+        // Before head, so a publish after this is noticed by shmRingWait.
+        reader->futex = __atomic_load_n(&h->futex, __ATOMIC_ACQUIRE);
+        // Before head: a new generation's head is only published after the generation.
+        uint32_t generation = __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (generation == SHMRING_REPLACED) return false;
+        if (generation != reader->generation || head + 1 < reader->next) {
+            // The writer restarted, its records start at 1 again.
+            reader->generation = generation;
+            reader->next = 1;
+            continue;
+        }
+        if (reader->next > head) return false;
+        if (head - reader->next >= slots) {
+            // Overwritten already, skip to the oldest one that's still there.
+            reader->lost += head - slots + 1 - reader->next;
+            reader->next = head - slots + 1;
+        }
+        ShmRingSlot* slot = &reader->ring->slots[reader->next % slots];
+        uint64_t s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, slot, sizeof(ShmRingSlot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        // A new writer could have published this seq before we saw its generation.
+        if (s1 == reader->next && s2 == reader->next
+            && __atomic_load_n(&h->generation, __ATOMIC_RELAXED) == reader->generation) {
+            out->seq = reader->next++;
+            return true;
+        }
+        // Being overwritten while we copied: the writer lapped us (or restarted), check head again.
+    }
+}
+
+bool shmRingReplaced(const ShmRingReader* const reader) {
+    return __atomic_load_n(&reader->ring->header->generation, __ATOMIC_ACQUIRE) == SHMRING_REPLACED;
+}
+
+void shmRingWait(ShmRingReader* const reader, const uint32_t timeoutMs) {
+    ShmRingHeader* h = reader->ring->header;
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_add_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+    // Returns right away if futex changed since shmRingNext looked.
+    futex(&h->futex, FUTEX_WAIT, reader->futex, &timeout);
+    __atomic_sub_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,147 @@
+#ifndef FIRMWARE_SHMRING_H
+#define FIRMWARE_SHMRING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+/**
+ * Ring of the most recent decoded telegrams in POSIX shared memory (/dev/shm), one writer, any nr of readers.
+ * Host only. P1logger/shmring.py reads and writes the same layout.
+ *
+ * Layout: ShmRingHeader, then header.slots slots of header.slotSize bytes (ShmRingSlot).
+ * Record n (1, 2, ...) goes into slot n % slots. Publishing:
+ *   slot.seq = 0, write the record, slot.seq = n, header.head = n, header.futex++ (+ FUTEX_WAKE if header.waiters)
+ * Reading record n: s1 = slot.seq, copy, s2 = slot.seq. Only valid if s1 == s2 == n.
+ * If head - n >= slots, record n is already overwritten: the reader fell behind and lost records.
+ * A writer that (re)starts sets head = 0, clears every slot's seq, then increments generation. Readers that see
+ * another generation, or head + 1 < n, start over at record 1 of the new writer. The ring is never resized: a writer
+ * that wants other slots unlinks it, creates a new one, then sets the old one's generation to SHMRING_REPLACED so
+ * readers open the new one.
+ * No locks, readers never write to the ring (except waiters), so they don't slow down the writer.
+ */
+
+#define SHMRING_MAGIC "P1R1"
+#define SHMRING_VERSION 1
+#define SHMRING_DEFAULT_NAME "/p1ring"
+#define SHMRING_DEFAULT_SLOTS 256
+#define SHMRING_METER_ID_LEN 32
+
+// Same columns as the archive: a value per Field, and the gas volume.
+#define SHMRING_GAS_VOLUME FIELD_COUNT
+#define SHMRING_VALUES (FIELD_COUNT + 1)
+#define SHMRING_MISSING 0xFFFFFFFF
+#define SHMRING_REPLACED 0xFFFFFFFF
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;
+    /**
+     * Sequence nr of the last published record, 0 = none yet.
+     */
+    uint64_t head;
+    /**
+     * Incremented on every publish, readers can FUTEX_WAIT on it.
+     */
+    uint32_t futex;
+    /**
+     * Nr of readers in FUTEX_WAIT, the writer only makes the wake syscall if there are any.
+     */
+    uint32_t waiters;
+    /**
+     * Incremented every time a writer takes over the ring, its records start at 1 again.
+     * SHMRING_REPLACED: there is a new ring with the same name.
+     */
+    uint32_t generation;
+    uint8_t reserved[28];
+} ShmRingHeader;
+
+typedef struct {
+    uint64_t seq;
+    /**
+     * When it was published, in ns since epoch (CLOCK_REALTIME), set by the ring.
+     */
+    uint64_t published;
+    uint8_t crcOk;
+    uint8_t meterIdLen;
+    uint16_t reserved;
+    /**
+     * Equipment identifier (0-0:96.1.1), as in the telegram (hex).
+     */
+    char meterId[SHMRING_METER_ID_LEN];
+    /**
+     * Indexed by Field, units as in Packet (but 32 bit): timestamp in seconds since epoch, Wh, W, 0.1 V, 0.01 A.
+     * values[SHMRING_GAS_VOLUME] in 0.001 m3. SHMRING_MISSING if not in the telegram.
+     */
+    uint32_t values[SHMRING_VALUES];
+    uint32_t reserved2;
+} ShmRingSlot;
+
+typedef struct {
+    int fd;
+    size_t size;
+    ShmRingHeader* header;
+    ShmRingSlot* slots;
+} ShmRing;
+
+typedef struct {
+    ShmRing* ring;
+    uint64_t next;
+    uint64_t lost;
+    uint32_t futex;
+    uint32_t generation;
+} ShmRingReader;
+
+/**
+ * Create (or take over) the ring, for the writer. A ring with the same nr of slots is reused, otherwise replaced.
+ * @param name Shared memory name, like "/p1ring".
+ * @param slots 0 = SHMRING_DEFAULT_SLOTS.
+ * @return NULL on error.
+ */
+ShmRing* shmRingCreate(const char* name, uint32_t slots);
+
+/**
+ * Open an existing ring, read only (except for the waiters counter).
+ * @return NULL on error or if it's not a ring.
+ */
+ShmRing* shmRingOpen(const char* name);
+
+void shmRingClose(ShmRing* ring);
+
+/**
+ * Fill a slot (everything but seq) from a decoded packet and M-Bus slots. meterId may be NULL.
+ */
+void shmRingFromPacket(ShmRingSlot* slot, const Packet* p, const MBusSlot* mbus, const char* meterId, bool crcOk);
+
+/**
+ * Publish a record, seq and published are set by the ring.
+ */
+void shmRingPublish(ShmRing* ring, const ShmRingSlot* record);
+
+/**
+ * Start at the oldest record still in the ring (all = true), or only new records.
+ */
+void shmRingReaderInit(ShmRingReader* reader, ShmRing* ring, bool all);
+
+/**
+ * Copy the next record into out.
+ * @return false if there is no new record (yet). Records that were overwritten before they could be read are
+ *         skipped, and added to reader->lost. After the writer restarted, reading continues with its first record.
+ */
+bool shmRingNext(ShmRingReader* reader, ShmRingSlot* out);
+
+/**
+ * @return true if the writer replaced the ring by a new one (other nr of slots), reopen it to follow that one.
+ */
+bool shmRingReplaced(const ShmRingReader* reader);
+
+/**
+ * Block until a record is published after the last shmRingNext returned false, or timeoutMs passed.
+ */
+void shmRingWait(ShmRingReader* reader, uint32_t timeoutMs);
+
+#endif //FIRMWARE_SHMRING_H
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "packet.h"
+#include "crc.h"
+#include "shmring.h"
+
+void error(const char *msg) {
+    puts(msg);
+    exit(-1);
+}
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepNs(uint64_t ns) {
+    struct timespec ts = {ns / 1000000000ULL, ns % 1000000000ULL};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Decode a capture and publish every telegram, rate per second (0 = as fast as possible).
+ */
+static uint64_t publishCapture(ShmRing *ring, const char *capture, double rate) {
+    FILE *fp = fopen(capture, "r");
+    if (fp == NULL) error("Failed to open capture.");
+    Packet p;
+    MBusSlot mbus[MBUS_CHANNELS];
+    ParserContext ctx;
+    initParser(&ctx, &p, mbus);
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    uint16_t crc = 0;
+    char meterId[SHMRING_METER_ID_LEN + 1] = "";
+    uint64_t count = 0;
+    while ((len = getline(&line, &size, fp)) != -1) {
+        if (line[0] == '/') {
+            crc = 0;
+            resetParser(&ctx);
+        }
+        if (line[0] == '!') {
+            crc = crc16(crc, line, 1);
+            ShmRingSlot record;
+            shmRingFromPacket(&record, &p, mbus, meterId, strtol(line + 1, NULL, 16) == crc);
+            shmRingPublish(ring, &record);
+            count++;
+            if (rate > 0) sleepNs(1e9 / rate);
+            continue;
+        }
+        crc = crc16(crc, line, len);
+        if (strncmp(line, "0-0:96.1.1(", 11) == 0) sscanf(line + 11, "%32[0-9A-Fa-f]", meterId);
+        parseLineWith(&ctx, len, line);
+    }
+    free(line);
+    fclose(fp);
+    return count;
+}
+
+static void printRecord(const ShmRingSlot *r) {
+    printf("#%lu %.*s %u: +%uW -%uW T1 %uWh T2 %uWh gas %u%s (%.1f us old)\n", r->seq, r->meterIdLen, r->meterId,
+           r->values[FIELD_TIMESTAMP], r->values[FIELD_SUM_POWER_DELIVERED], r->values[FIELD_SUM_POWER_INJECTED],
+           r->values[FIELD_METER_T1_DELIVERED], r->values[FIELD_METER_T2_DELIVERED], r->values[SHMRING_GAS_VOLUME],
+           r->crcOk ? "" : " (CRC mismatch)", (nowNs() - r->published) / 1e3);
+    fflush(stdout);
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Publish count records every interval us, a forked reader measures how long it takes for them to arrive.
+ */
+static void bench(const char *name, uint32_t count, uint32_t interval) {
+    ShmRing *ring = shmRingCreate(name, 0);
+    if (ring == NULL) error("Failed to create ring.");
+    int ready[2];
+    if (pipe(ready) != 0) error("Failed to create pipe.");
+
+    pid_t child = fork();
+    if (child == 0) {
+        ShmRing *reader = shmRingOpen(name);
+        if (reader == NULL) error("Failed to open ring.");
+        ShmRingReader r;
+        shmRingReaderInit(&r, reader, false);
+        uint64_t *latency = malloc(count * sizeof(uint64_t));
+        uint32_t received = 0;
+        ShmRingSlot record;
+        write(ready[1], "R", 1);
+        while (received + r.lost < count) {
+            if (shmRingNext(&r, &record)) latency[received++] = nowNs() - record.published;
+            else shmRingWait(&r, 100);
+        }
+        qsort(latency, received, sizeof(uint64_t), compare);
+        printf("{\"records\": %u, \"lost\": %lu, \"interval_us\": %u, \"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, "
+               "\"latency_max_us\": %.1f}\n", received, r.lost, interval, latency[received / 2] / 1e3,
+               latency[(uint64_t) received * 99 / 100] / 1e3, latency[received - 1] / 1e3);
+        exit(0);
+    }
+
+    char c;
+    if (read(ready[0], &c, 1) != 1) error("Reader failed.");
+    ShmRingSlot record;
+    memset(&record, 0, sizeof(record));
+    for (uint32_t i = 0; i < count; i++) {
+        record.values[FIELD_TIMESTAMP] = i;
+        shmRingPublish(ring, &record);
+        if (interval) sleepNs(interval * 1000ULL);
+    }
+    waitpid(child, NULL, 0);
+    shmRingClose(ring);
+    shm_unlink(name);
+}
+
+int main(int argc, char **argv) {
+    const char *name = SHMRING_DEFAULT_NAME;
+    const char *args[2] = {NULL, NULL};
+    int nargs = 0;
+    double rate = 0;
+    uint32_t slots = 0, count = 100000, interval = 100;
+    bool all = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) name = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) slots = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-a") == 0) all = true;
+        else if (nargs < 2) args[nargs++] = argv[i];
+    }
+
+    if (nargs == 2 && strcmp(args[0], "publish") == 0) {
+        ShmRing *ring = shmRingCreate(name, slots);
+        if (ring == NULL) error("Failed to create ring.");
+        uint64_t count = publishCapture(ring, args[1], rate);
+        printf("Published %lu telegrams on %s\n", count, name);
+        shmRingClose(ring);
+    } else if (nargs == 1 && strcmp(args[0], "follow") == 0) {
+        ShmRing *ring = shmRingOpen(name);
+        if (ring == NULL) error("Failed to open ring.");
+        ShmRingReader reader;
+        shmRingReaderInit(&reader, ring, all);
+        ShmRingSlot record;
+        uint64_t lost = 0;
+        while (true) {
+            while (shmRingNext(&reader, &record)) printRecord(&record);
+            if (reader.lost != lost) {
+                printf("Lost %lu records\n", reader.lost - lost);
+                lost = reader.lost;
+            }
+            if (shmRingReplaced(&reader)) {
+                shmRingClose(ring);
+                ring = shmRingOpen(name);
+                if (ring == NULL) error("Failed to open ring.");
+                shmRingReaderInit(&reader, ring, true);
+                lost = 0;
+                continue;
+            }
+            shmRingWait(&reader, 1000);
+        }
+    } else if (nargs == 1 && strcmp(args[0], "bench") == 0) {
+        bench(name, count, interval);
+    } else {
+        error("Usage: shmring_x64 publish <capture.txt> [-n name] [-s slots] [-r telegrams per second]\n"
+              "       shmring_x64 follow [-n name] [-a]\n"
+              "       shmring_x64 bench [-n name] [-c records] [-i interval us]\n"
+              "  Default name " SHMRING_DEFAULT_NAME ", -a starts at the oldest record in the ring.");
+    }
+    return 0;
+}
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "spool.h"
+
+_Static_assert(sizeof(SpoolSegmentHeader) == 16, "SpoolSegmentHeader is the on-disk format.");
+_Static_assert(sizeof(SpoolRecord) == 296, "SpoolRecord is the on-disk format.");
+
+#define RECORD_SIZE sizeof(SpoolRecord)
+#define FIRST_RECORD sizeof(SpoolSegmentHeader)
+#define NAME_LEN 26 // spool-<16 hex digits>.p1s
+#define ACK_LEN 34 // <16 hex digits> <16 hex digits>\n
+
+static uint64_t nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void segmentName(char* const name, const uint64_t seq) {
+    snprintf(name, NAME_LEN + 1, "spool-%016lx.p1s", seq);
+}
+
+static uint32_t recordCrc(const SpoolRecord* const record) {
+    return crc32(0, (const Bytef*) record + sizeof(record->crc), RECORD_SIZE - sizeof(record->crc));
+}
+
+static bool headerOk(const SpoolSegmentHeader* const h) {
+    return h->magic == SPOOL_MAGIC && h->version == SPOOL_VERSION && h->recordSize == RECORD_SIZE;
+}
+
+static bool writeAll(const int fd, const void* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data = (const char*) data + n;
+        len -= n;
+    }
+    return true;
+}
+
+static void writeAck(Spool* const spool, const uint64_t seq, const uint64_t offset) {
+    if (spool->ackFd < 0) return;
+    char ack[ACK_LEN + 1];
+    snprintf(ack, sizeof(ack), "%016lx %016lx\n", seq, offset);
+    // Fixed length, overwrites the previous one in place.
+    if (pwrite(spool->ackFd, ack, ACK_LEN, 0) != ACK_LEN) return;
+}
+
+/**
+ * Check the records of the last segment (the only one that can be torn), cut off the first bad one and everything after.
+ * @return Size of the segment, 0 if it has no valid header (it's deleted).
+ */
+static uint64_t recoverSegment(Spool* const spool, const uint64_t seq) {
+    char name[NAME_LEN + 1];
+    segmentName(name, seq);
+    int fd = openat(spool->dirFd, name, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    SpoolSegmentHeader h;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) || !headerOk(&h)) {
+        close(fd);
+        unlinkat(spool->dirFd, name, 0);
+        return 0;
+    }
+
+    uint64_t end = FIRST_RECORD;
+    SpoolRecord records[256];
+    while (end + RECORD_SIZE <= (uint64_t) st.st_size) {
+        ssize_t n = pread(fd, records, sizeof(records), end);
+        if (n < (ssize_t) RECORD_SIZE) break;
+        uint32_t i = 0;
+        while (i < n / RECORD_SIZE && recordCrc(&records[i]) == records[i].crc) i++;
+        end += i * RECORD_SIZE;
+        if (i < n / RECORD_SIZE) break;
+    }
+    if (end != (uint64_t) st.st_size) {
+        spool->stats.torn += (st.st_size - end + RECORD_SIZE - 1) / RECORD_SIZE;
+        if (ftruncate(fd, end) == 0) fdatasync(fd);
+    }
+    close(fd);
+    return end;
+}
+
+bool spoolOpen(Spool* const spool, const char* const dir, uint32_t segmentSize, const uint32_t fsyncMs) {
+    memset(spool, 0, sizeof(Spool));
+    spool->writeFd = spool->readFd = spool->ackFd = spool->dirFd = -1;
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&spool->appended, &attr);
+    pthread_condattr_destroy(&attr);
+    if (segmentSize == 0) segmentSize = SPOOL_DEFAULT_SEGMENT;
+    uint32_t records = segmentSize > FIRST_RECORD + RECORD_SIZE ? (segmentSize - FIRST_RECORD) / RECORD_SIZE : 1;
+    spool->segmentSize = FIRST_RECORD + records * RECORD_SIZE;
+    spool->fsyncMs = fsyncMs;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    spool->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (spool->dirFd < 0) return false;
+    spool->dir = strdup(dir);
+
+    // The segments on disk, they are numbered without gaps (unless someone deleted some, spoolRead skips those).
+    uint64_t first = 0, last = 0;
+    DIR* d = fdopendir(dup(spool->dirFd));
+    if (d == NULL) {
+        spoolClose(spool);
+        return false;
+    }
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        uint64_t seq;
+        if (strlen(e->d_name) != NAME_LEN || strcmp(e->d_name + NAME_LEN - 4, ".p1s") != 0
+            || sscanf(e->d_name, "spool-%16lx", &seq) != 1 || seq == 0) continue;
+        if (first == 0 || seq < first) first = seq;
+        if (seq > last) last = seq;
+    }
+    closedir(d);
+
+    spool->ackFd = openat(spool->dirFd, "ack", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    spool->readSeq = spool->writeSeq = last ? last : 1;
+    spool->readOffset = FIRST_RECORD;
+    if (last != 0) {
+        spool->writeSize = recoverSegment(spool, last);
+        uint64_t seq = 0, offset = 0;
+        char ack[ACK_LEN + 1] = {0};
+        if (spool->ackFd >= 0 && pread(spool->ackFd, ack, ACK_LEN, 0) == ACK_LEN
+            && sscanf(ack, "%16lx %16lx", &seq, &offset) == 2 && seq >= first && seq <= last && offset >= FIRST_RECORD) {
+            spool->readSeq = seq;
+            spool->readOffset = offset;
+        } else {
+            spool->readSeq = first;
+        }
+        // Records after the ack position were cut off: start at the end, where the next append goes.
+        if (spool->readSeq == last && spool->readOffset > spool->writeSize) {
+            spool->readOffset = spool->writeSize ? spool->writeSize : FIRST_RECORD;
+        }
+        for (uint64_t s = spool->readSeq; s <= last; s++) {
+            uint64_t size = spool->writeSize;
+            if (s != last) {
+                char name[NAME_LEN + 1];
+                struct stat st;
+                segmentName(name, s);
+                size = fstatat(spool->dirFd, name, &st, 0) == 0 ? st.st_size : 0;
+            }
+            uint64_t start = s == spool->readSeq ? spool->readOffset : FIRST_RECORD;
+            if (size > start) spool->depth += (size - start) / RECORD_SIZE;
+        }
+    }
+    return true;
+}
+
+static bool openSegment(Spool* const spool) {
+    char name[NAME_LEN + 1];
+    segmentName(name, spool->writeSeq);
+    if (spool->writeSize != 0) {
+        spool->writeFd = openat(spool->dirFd, name, O_WRONLY | O_APPEND | O_CLOEXEC);
+        return spool->writeFd >= 0;
+    }
+    spool->writeFd = openat(spool->dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (spool->writeFd < 0) return false;
+    SpoolSegmentHeader h = {SPOOL_MAGIC, SPOOL_VERSION, RECORD_SIZE, 0};
+    if (!writeAll(spool->writeFd, &h, sizeof(h))) {
+        close(spool->writeFd);
+        spool->writeFd = -1;
+        return false;
+    }
+    spool->unsynced += sizeof(h);
+    spool->dirUnsynced = true;
+    pthread_mutex_lock(&spool->lock);
+    spool->writeSize = FIRST_RECORD;
+    spool->stats.segments++;
+    pthread_mutex_unlock(&spool->lock);
+    return true;
+}
+
+/**
+ * The current segment is full: make it durable and start the next one (on the next append).
+ */
+static void sealSegment(Spool* const spool) {
+    if (spool->writeFd >= 0) {
+        spoolSync(spool);
+        close(spool->writeFd);
+        spool->writeFd = -1;
+    }
+    pthread_mutex_lock(&spool->lock);
+    spool->writeSeq++;
+    spool->writeSize = 0;
+    pthread_mutex_unlock(&spool->lock);
+}
+
+uint32_t spoolAppend(Spool* const spool, SpoolRecord* records, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) records[i].crc = recordCrc(&records[i]);
+    uint32_t appended = 0;
+    while (appended < count) {
+        // Only the writer changes writeSeq and writeSize, it can read them without the lock.
+        if (spool->writeSize >= spool->segmentSize) sealSegment(spool);
+        if (spool->writeFd < 0 && !openSegment(spool)) return appended;
+        uint32_t n = (spool->segmentSize - spool->writeSize) / RECORD_SIZE;
+        if (n > count - appended) n = count - appended;
+        if (!writeAll(spool->writeFd, records + appended, n * RECORD_SIZE)) {
+            // Keep whole records, a partial one would be cut off (with everything after it) on the next open.
+            if (ftruncate(spool->writeFd, spool->writeSize) != 0) {
+                close(spool->writeFd);
+                spool->writeFd = -1;
+            }
+            return appended;
+        }
+        appended += n;
+        spool->unsynced += n * RECORD_SIZE;
+        pthread_mutex_lock(&spool->lock);
+        spool->writeSize += n * RECORD_SIZE;
+        spool->depth += n;
+        spool->stats.appended += n;
+        pthread_cond_signal(&spool->appended);
+        pthread_mutex_unlock(&spool->lock);
+        if (spool->writeSize >= spool->segmentSize) sealSegment(spool);
+    }
+    if (spool->fsyncMs == 0 || nowMs() - spool->lastSync >= spool->fsyncMs) spoolSync(spool);
+    return appended;
+}
+
+void spoolSync(Spool* const spool) {
+    if (spool->writeFd >= 0 && spool->unsynced) {
+        // fdatasync: the size is included, the timestamps are not worth a second write.
+        fdatasync(spool->writeFd);
+        spool->unsynced = 0;
+        spool->stats.fsyncs++;
+    }
+    if (spool->dirUnsynced) {
+        fsync(spool->dirFd);
+        spool->dirUnsynced = false;
+    }
+    spool->lastSync = nowMs();
+}
+
+uint64_t spoolWait(Spool* const spool, const uint32_t timeoutMs) {
+    pthread_mutex_lock(&spool->lock);
+    if (spool->depth == 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&spool->appended, &spool->lock, &deadline);
+    }
+    uint64_t depth = spool->depth;
+    pthread_mutex_unlock(&spool->lock);
+    return depth;
+}
+
+/**
+ * The reader is done with segment seq (all acked, or it's missing): delete it and move to the next one.
+ */
+static void finishSegment(Spool* const spool, const uint64_t seq) {
+    if (spool->readFd >= 0) close(spool->readFd);
+    spool->readFd = -1;
+    char name[NAME_LEN + 1];
+    segmentName(name, seq);
+    unlinkat(spool->dirFd, name, 0);
+    pthread_mutex_lock(&spool->lock);
+    spool->readSeq = seq + 1;
+    spool->readOffset = FIRST_RECORD;
+    spool->stats.deleted++;
+    pthread_mutex_unlock(&spool->lock);
+    writeAck(spool, seq + 1, FIRST_RECORD);
+}
+
+uint32_t spoolRead(Spool* const spool, SpoolRecord* const out, const uint32_t max) {
+    spool->readPending = 0;
+    uint64_t seq, offset, end;
+    while (true) {
+        pthread_mutex_lock(&spool->lock);
+        seq = spool->readSeq;
+        offset = spool->readOffset;
+        bool sealed = seq < spool->writeSeq;
+        end = spool->writeSize;
+        pthread_mutex_unlock(&spool->lock);
+        if (!sealed && end <= offset) return 0;
+
+        if (spool->readFd < 0 || spool->readFdSeq != seq) {
+            if (spool->readFd >= 0) close(spool->readFd);
+            char name[NAME_LEN + 1];
+            segmentName(name, seq);
+            spool->readFd = openat(spool->dirFd, name, O_RDONLY | O_CLOEXEC);
+            spool->readFdSeq = seq;
+            if (spool->readFd < 0) {
+                if (!sealed) return 0;
+                finishSegment(spool, seq);
+                continue;
+            }
+            SpoolSegmentHeader h;
+            if (pread(spool->readFd, &h, sizeof(h), 0) != sizeof(h) || !headerOk(&h)) {
+                // Not ours, or a different version: skip the whole segment.
+                struct stat st;
+                end = fstat(spool->readFd, &st) == 0 ? (uint64_t) st.st_size : offset;
+                uint64_t n = end > offset ? (end - offset) / RECORD_SIZE : 0;
+                spool->stats.corrupt += n;
+                spool->readPending = n * RECORD_SIZE;
+                return 0;
+            }
+        }
+        if (sealed) {
+            struct stat st;
+            end = fstat(spool->readFd, &st) == 0 ? (uint64_t) st.st_size : 0;
+            if (end < offset + RECORD_SIZE) {
+                finishSegment(spool, seq);
+                continue;
+            }
+        }
+        break;
+    }
+
+    uint64_t n = (end - offset) / RECORD_SIZE;
+    if (n > max) n = max;
+    ssize_t got = pread(spool->readFd, out, n * RECORD_SIZE, offset);
+    if (got <= 0) return 0;
+    n = got / RECORD_SIZE;
+    spool->readPending = n * RECORD_SIZE;
+    uint32_t valid = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (recordCrc(&out[i]) != out[i].crc) {
+            spool->stats.corrupt++;
+            continue;
+        }
+        if (valid != i) out[valid] = out[i];
+        valid++;
+    }
+    return valid;
+}
+
+void spoolAck(Spool* const spool) {
+    if (spool->readPending == 0) return;
+    uint64_t records = spool->readPending / RECORD_SIZE;
+    pthread_mutex_lock(&spool->lock);
+    spool->readOffset += spool->readPending;
+    spool->depth = spool->depth > records ? spool->depth - records : 0;
+    spool->stats.acked += records;
+    uint64_t seq = spool->readSeq, offset = spool->readOffset;
+    bool sealed = seq < spool->writeSeq;
+    pthread_mutex_unlock(&spool->lock);
+    spool->readPending = 0;
+    writeAck(spool, seq, offset);
+
+    struct stat st;
+    if (sealed && spool->readFd >= 0 && fstat(spool->readFd, &st) == 0 && (uint64_t) st.st_size < offset + RECORD_SIZE) {
+        finishSegment(spool, seq);
+    }
+}
+
+uint64_t spoolDepth(Spool* const spool) {
+    pthread_mutex_lock(&spool->lock);
+    uint64_t depth = spool->depth;
+    pthread_mutex_unlock(&spool->lock);
+    return depth;
+}
+
+uint64_t spoolSegments(Spool* const spool) {
+    pthread_mutex_lock(&spool->lock);
+    uint64_t segments = spool->writeSeq - spool->readSeq + (spool->writeSize != 0);
+    pthread_mutex_unlock(&spool->lock);
+    return segments;
+}
+
+void spoolClose(Spool* const spool) {
+    if (spool->dirFd >= 0) spoolSync(spool);
+    pthread_mutex_destroy(&spool->lock);
+    pthread_cond_destroy(&spool->appended);
+    if (spool->writeFd >= 0) close(spool->writeFd);
+    if (spool->readFd >= 0) close(spool->readFd);
+    if (spool->ackFd >= 0) close(spool->ackFd);
+    if (spool->dirFd >= 0) close(spool->dirFd);
+    free(spool->dir);
+    memset(spool, 0, sizeof(Spool));
+    spool->writeFd = spool->readFd = spool->ackFd = spool->dirFd = -1;
+}
+
+static uint8_t copyString(char* const out, const char* const s, const size_t max) {
+    if (s == NULL) return 0;
+    size_t len = strnlen(s, max);
+    memcpy(out, s, len);
+    return len;
+}
+
+void spoolFromPacket(SpoolRecord* const record, const char* const header, const char* const meterId,
+                     const Packet* const p, const MBusSlot* const mbus, const bool crcOk) {
+    memset(record, 0, sizeof(SpoolRecord));
+    record->crcOk = crcOk;
+    record->headerLen = copyString(record->header, header, SPOOL_HEADER_LEN);
+    record->meterIdLen = copyString(record->meterId, meterId, SPOOL_METER_ID_LEN);
+    for (Field f = 0; f < FIELD_COUNT; f++) {
+        uint32_t value;
+        record->values[f] = packetField(p, f, &value) ? value : SPOOL_MISSING;
+    }
+    for (uint8_t i = 0; i < MBUS_CHANNELS; i++) {
+        SpoolMBus* slot = &record->mbus[i];
+        if (mbus == NULL) {
+            slot->deviceType = 0xFF;
+            slot->timestamp = slot->value = SPOOL_MISSING;
+            continue;
+        }
+        slot->deviceType = mbus[i].deviceType;
+        slot->idLen = mbus[i].idLen <= MBUS_ID_MAX_LEN ? mbus[i].idLen : MBUS_ID_MAX_LEN;
+        memcpy(slot->id, mbus[i].id, slot->idLen);
+        slot->timestamp = mbus[i].timestamp;
+        slot->value = mbus[i].value;
+    }
+}
+
+void spoolToPacket(const SpoolRecord* const record, char* const header, char* const meterId, Packet* const p,
+                   MBusSlot* const mbus) {
+    memcpy(header, record->header, record->headerLen);
+    header[record->headerLen] = 0;
+    memcpy(meterId, record->meterId, record->meterIdLen);
+    meterId[record->meterIdLen] = 0;
+    memset(p, 0xFF, sizeof(Packet));
+    for (Field f = 0; f < FIELD_COUNT; f++) {
+        if (record->values[f] != SPOOL_MISSING) setPacketField(p, f, record->values[f]);
+    }
+    memset(mbus, 0xFF, sizeof(MBusSlot) * MBUS_CHANNELS);
+    bool gas = false;
+    for (uint8_t i = 0; i < MBUS_CHANNELS; i++) {
+        const SpoolMBus* slot = &record->mbus[i];
+        mbus[i].deviceType = slot->deviceType;
+        mbus[i].idLen = slot->idLen <= MBUS_ID_MAX_LEN ? slot->idLen : MBUS_ID_MAX_LEN;
+        memcpy(mbus[i].id, slot->id, mbus[i].idLen);
+        mbus[i].timestamp = slot->timestamp;
+        mbus[i].value = slot->value;
+        // Like the parser: the gas meter on the lowest channel that has a value.
+        if (!gas && slot->deviceType == MBUS_DEVICE_TYPE_GAS && slot->value != SPOOL_MISSING) {
+            p->gas_volume = slot->value;
+            gas = true;
+        }
+    }
+}
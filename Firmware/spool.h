@@ -0,0 +1,178 @@
+#ifndef FIRMWARE_SPOOL_H
+#define FIRMWARE_SPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "packet.h"
+
+/**
+ * Write-ahead spool: decoded telegrams that couldn't be written yet (database down), on disk until they are.
+ * Host only. One writer thread and one reader (replay) thread.
+ *
+ * The spool is a directory of segments, spool-<16 hex digits>.p1s, numbered in order. A segment is a SpoolSegmentHeader
+ * and fixed size SpoolRecords, appended until it's segmentSize, then the next segment is started.
+ * Every record has a CRC32: after a crash (or power loss, SD cards), a torn record at the end is cut off on open.
+ *
+ * fsync is batched for SD cards: appends are only fsync'd when fsyncMs passed since the last fsync, or when a
+ * segment is full. A crash loses at most fsyncMs of records, in exchange for a few large writes instead of many
+ * small ones (which wear the card and take 10-100 ms each).
+ *
+ * Reading starts at the ack position, spoolAck moves it forward once the records are written, and deletes the
+ * segments that are done. The ack position is kept in the file "ack" (not fsync'd: after a crash some records are
+ * written twice, InfluxDB overwrites points with the same series and timestamp).
+ */
+
+#define SPOOL_MAGIC 0x31533150 // "P1S1"
+#define SPOOL_VERSION 2
+#define SPOOL_DEFAULT_SEGMENT (4 * 1024 * 1024)
+#define SPOOL_DEFAULT_FSYNC_MS 5000
+#define SPOOL_HEADER_LEN 48
+#define SPOOL_METER_ID_LEN 32
+
+#define SPOOL_MISSING 0xFFFFFFFF
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+} SpoolSegmentHeader;
+
+/**
+ * An MBusSlot, with explicit padding (the whole record is CRC'd and on disk).
+ */
+typedef struct {
+    uint8_t deviceType;
+    uint8_t idLen;
+    char id[MBUS_ID_MAX_LEN];
+    uint8_t reserved[2];
+    uint32_t timestamp;
+    uint32_t value;
+} SpoolMBus;
+
+typedef struct {
+    /**
+     * CRC32 (zlib) of the rest of the record.
+     */
+    uint32_t crc;
+    uint8_t crcOk; // Of the telegram.
+    uint8_t headerLen;
+    uint8_t meterIdLen;
+    uint8_t reserved;
+    char header[SPOOL_HEADER_LEN];
+    char meterId[SPOOL_METER_ID_LEN];
+    /**
+     * Indexed by Field, units as in Packet (32 bit). SPOOL_MISSING if not present.
+     */
+    uint32_t values[FIELD_COUNT];
+    /**
+     * Every M-Bus channel (gas, water, ...), as in MBusSlot: values that are not present are 0xFF..., idLen is 0.
+     */
+    SpoolMBus mbus[MBUS_CHANNELS];
+} SpoolRecord;
+
+typedef struct {
+    uint64_t appended;
+    uint64_t acked;
+    uint64_t fsyncs;
+    uint64_t segments; // Started.
+    uint64_t deleted; // Segments deleted after they were acked.
+    uint64_t torn; // Records cut off the end on open.
+    uint64_t corrupt; // Records with a bad CRC, skipped by spoolRead.
+} SpoolStats;
+
+typedef struct {
+    char* dir;
+    uint32_t segmentSize; // Bytes, rounded to whole records.
+    uint32_t fsyncMs;
+    int dirFd;
+    int ackFd;
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+
+    // Writer only.
+    int writeFd;
+    uint64_t unsynced; // Bytes.
+    bool dirUnsynced; // A segment was created.
+    uint64_t lastSync; // ms, CLOCK_MONOTONIC.
+
+    // Reader only.
+    int readFd;
+    uint64_t readFdSeq;
+    uint64_t readPending; // Bytes returned by the last spoolRead, acked by spoolAck.
+
+    // Under lock, set by the writer: the segment appended to and its size (bytes, 0 = not created yet).
+    uint64_t writeSeq;
+    uint64_t writeSize;
+    // Under lock, set by the reader: the ack position.
+    uint64_t readSeq;
+    uint64_t readOffset;
+    uint64_t depth; // Records appended but not acked.
+    SpoolStats stats;
+} Spool;
+
+/**
+ * Open (or create) the spool in dir. Existing segments are checked and their records will be read first.
+ * @param segmentSize 0 = SPOOL_DEFAULT_SEGMENT.
+ * @param fsyncMs 0 = fsync every append.
+ * @return false if the directory can't be created or read.
+ */
+bool spoolOpen(Spool* spool, const char* dir, uint32_t segmentSize, uint32_t fsyncMs);
+
+/**
+ * Append records (one write), fsync if fsyncMs passed. Sets the CRC of the records.
+ * @return the nr of records appended (the first ones), less than count on IO error (disk full, ...).
+ */
+uint32_t spoolAppend(Spool* spool, SpoolRecord* records, uint32_t count);
+
+/**
+ * fsync now, if anything was appended since the last one.
+ */
+void spoolSync(Spool* spool);
+
+/**
+ * Wait until there is something to read, or timeoutMs passed.
+ * @return Records appended but not acked.
+ */
+uint64_t spoolWait(Spool* spool, uint32_t timeoutMs);
+
+/**
+ * Copy up to max records, starting at the ack position, without moving it. Reads one segment at most.
+ * Records with a bad CRC are skipped (and counted).
+ * @return Nr of records copied, 0 if there are none (or they were all corrupt, spoolAck skips them).
+ */
+uint32_t spoolRead(Spool* spool, SpoolRecord* out, uint32_t max);
+
+/**
+ * The records of the last spoolRead are written: move the ack position past them, and delete the segments that are done.
+ */
+void spoolAck(Spool* spool);
+
+/**
+ * Records appended but not acked.
+ */
+uint64_t spoolDepth(Spool* spool);
+
+/**
+ * Segments on disk.
+ */
+uint64_t spoolSegments(Spool* spool);
+
+void spoolClose(Spool* spool);
+
+/**
+ * Fill a record from a decoded telegram. header and meterId may be NULL, and are truncated if too long.
+ */
+void spoolFromPacket(SpoolRecord* record, const char* header, const char* meterId, const Packet* p, const MBusSlot* mbus, bool crcOk);
+
+/**
+ * Inverse of spoolFromPacket, with all M-Bus channels. Packet.gas_volume is set from the gas meter on the lowest channel.
+ * @param header SPOOL_HEADER_LEN + 1 chars.
+ * @param meterId SPOOL_METER_ID_LEN + 1 chars.
+ */
+void spoolToPacket(const SpoolRecord* record, char* header, char* meterId, Packet* p, MBusSlot* mbus);
+
+#endif //FIRMWARE_SPOOL_H
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "spsc.h"
+
+static long futex(uint32_t* const word, const int op, const uint32_t value, const struct timespec* const timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+bool spscInit(SpscRing* const ring, const uint32_t slots, const size_t slotSize) {
+    memset(ring, 0, sizeof(SpscRing));
+    uint32_t n = 1;
+    while (n < slots) n <<= 1;
+    ring->mask = n - 1;
+    ring->slotSize = (slotSize + 7) & ~(size_t) 7;
+    if (posix_memalign((void**) &ring->slots, SPSC_CACHE_LINE, (size_t) n * ring->slotSize) != 0) return false;
+    // Touch everything now, not on the first lap.
+    memset(ring->slots, 0, (size_t) n * ring->slotSize);
+    return true;
+}
+
+void spscFree(SpscRing* const ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+void spscWakeConsumer(SpscRing* const ring) {
+    futex(&ring->head, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+void spscWakeProducer(SpscRing* const ring) {
+    futex(&ring->tail, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+void spscWaitData(SpscRing* const ring, const uint32_t timeoutMs) {
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == ring->tail) {
+        ring->waits++;
+        // Returns right away if head moved after we looked.
+        futex(&ring->head, FUTEX_WAIT_PRIVATE, head, &timeout);
+    }
+    __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+}
+
+void spscWaitSpace(SpscRing* const ring, const uint32_t timeoutMs) {
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail > ring->mask) futex(&ring->tail, FUTEX_WAIT_PRIVATE, tail, &timeout);
+    __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,127 @@
+#ifndef FIRMWARE_SPSC_H
+#define FIRMWARE_SPSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Bounded single producer, single consumer ring of preallocated fixed size slots. Host only.
+ *
+ * Lock free: the producer only writes head, the consumer only writes tail, each keeps a cached copy of the other
+ * side's index so it only touches the other cache line when the ring looks full (or empty).
+ * The producer fills the slot spscReserve returns and publishes it with spscCommit, the consumer reads the slot
+ * spscPeek returns and gives it back with spscRelease. No allocation after spscInit.
+ *
+ * Either side can block until there is something to do (spscWaitData, spscWaitSpace), with a futex on the other
+ * side's index. The other side only makes the wake syscall if someone is waiting.
+ */
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+    // Producer.
+    uint32_t head;
+    uint32_t tailCache;
+    uint32_t producerWaiting;
+    /**
+     * Found the ring full (spscReserve returned NULL).
+     */
+    uint64_t stalls;
+
+    // Consumer, on its own cache line.
+    _Alignas(SPSC_CACHE_LINE) uint32_t tail;
+    uint32_t headCache;
+    uint32_t consumerWaiting;
+    /**
+     * Found the ring empty and blocked in spscWaitData.
+     */
+    uint64_t waits;
+    /**
+     * Highest nr of used slots the consumer saw.
+     */
+    uint32_t maxOccupancy;
+
+    // Read only after spscInit.
+    _Alignas(SPSC_CACHE_LINE) uint32_t mask;
+    uint32_t slotSize;
+    char* slots;
+} SpscRing;
+
+/**
+ * @param slots Rounded up to a power of 2.
+ * @param slotSize Rounded up to a multiple of 8.
+ * @return false if out of memory.
+ */
+bool spscInit(SpscRing* ring, uint32_t slots, size_t slotSize);
+
+void spscFree(SpscRing* ring);
+
+static inline uint32_t spscOccupancy(const SpscRing* const ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t spscCapacity(const SpscRing* const ring) {
+    return ring->mask + 1;
+}
+
+void spscWakeConsumer(SpscRing* ring);
+void spscWakeProducer(SpscRing* ring);
+
+/**
+ * Producer: the next free slot, or NULL if the ring is full (counted as a stall).
+ */
+static inline void* spscReserve(SpscRing* const ring) {
+    if (ring->head - ring->tailCache > ring->mask) {
+        ring->tailCache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->tailCache > ring->mask) {
+            ring->stalls++;
+            return NULL;
+        }
+    }
+    return ring->slots + (size_t) (ring->head & ring->mask) * ring->slotSize;
+}
+
+/**
+ * Producer: publish the slot from spscReserve.
+ */
+static inline void spscCommit(SpscRing* const ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    // Pairs with the fence in spscWaitData: either it sees the new head, or we see it waiting.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_RELAXED)) spscWakeConsumer(ring);
+}
+
+/**
+ * Consumer: the oldest slot, or NULL if the ring is empty.
+ */
+static inline void* spscPeek(SpscRing* const ring) {
+    if (ring->tail == ring->headCache) {
+        ring->headCache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail == ring->headCache) return NULL;
+        // Exact here: tail is ours and head was just loaded.
+        if (ring->headCache - ring->tail > ring->maxOccupancy) ring->maxOccupancy = ring->headCache - ring->tail;
+    }
+    return ring->slots + (size_t) (ring->tail & ring->mask) * ring->slotSize;
+}
+
+/**
+ * Consumer: done with the slot from spscPeek.
+ */
+static inline void spscRelease(SpscRing* const ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_RELAXED)) spscWakeProducer(ring);
+}
+
+/**
+ * Consumer: block until the ring is not empty, spscWakeConsumer is called or timeoutMs passed.
+ */
+void spscWaitData(SpscRing* ring, uint32_t timeoutMs);
+
+/**
+ * Producer: block until the ring is not full, spscWakeProducer is called or timeoutMs passed.
+ */
+void spscWaitSpace(SpscRing* ring, uint32_t timeoutMs);
+
+#endif //FIRMWARE_SPSC_H
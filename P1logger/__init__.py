@@ -8,24 +8,81 @@ import serial
 import re
 import influxdb
 import traceback
+import datetime
+from time import monotonic
+from typing import NamedTuple, Optional
 
-from .obis import EMUCS_V1_4
+from .obis import EMUCS_V1_4, MBUS
+from .rollup import Rollup, parse_period
+from .capacity import CapacityTracker
+from .stats import LatencyStats
+from .metrics import MetricsServer
+from .shmring import ShmRingWriter
+from .ringstore import RingStore, DEFAULT_FIELDS
 
 OBJECT_REGEX = re.compile(r"^(\d)-(\d):(\d+)\.(\d+)\.(\d+)")
 
 
+class Telegram(NamedTuple):
+    """
+    One decoded telegram.
+    unchanged contains the keys (of fields & human_fields) of lines that were byte-for-byte identical to the
+    previous telegram, and were not decoded again.
+    lists contains the lines with a list of records (power failure log, monthly peaks), by human name.
+    received and parsed are the time.monotonic() when the header came in and when the telegram was decoded.
+    """
+    header: str
+    time: Optional[datetime.datetime]
+    fields: dict
+    human_fields: dict
+    unchanged: set
+    crc_ok: bool
+    lists: dict
+    received: float = 0.0
+    parsed: float = 0.0
+
+
 class P1logger:
     """
     Data logger for P1 port on digital power/gas/... meters.
     """
-    def __init__(self, port: str, influx: str) -> None:
-        self.serial = serial.Serial(port, 115200)
+    def __init__(self, port: str, influx: str, measurements: str = "p1,p1_human", changes_only: bool = False,
+                 heartbeat: float = 300, rollups: str = "", capacity: bool = False, stats: float = 0,
+                 metrics: str = "", shm: str = "", store: str = "", store_hours: float = 24,
+                 store_fields: str = DEFAULT_FIELDS) -> None:
+        # No port when reading from a capture file instead (see importer).
+        self.serial = serial.Serial(port, 115200) if port else None
         self.crc16 = crcmod.predefined.mkPredefinedCrcFun('crc-16')
         self.influx = influxdb.client.InfluxDBClient.from_dsn(influx)
         # noinspection PyProtectedMember
         self.influx.create_database(self.influx._database)
+        # OBIS prefix -> (raw line after prefix, decoded value, human name)
+        self.line_cache = {}
+        # Which of "p1" (raw OBIS keys) and "p1_human" (human names) to write.
+        self.measurements = {x.strip() for x in measurements.split(',') if x.strip()}
+        # Only write fields that changed, or that have not been written for heartbeat seconds.
+        self.changes_only = changes_only
+        self.heartbeat = heartbeat
+        # (measurement, field) -> timestamp of last write
+        self.last_written = {}
+        # Same, for points that were made but not written yet: only in last_written once write_points succeeded.
+        self.pending_written = {}
+        # Downsampled measurements (p1_1m, p1_15m, ...), written when their window closes.
+        self.rollups = [Rollup(parse_period(x)) for x in rollups.split(',') if x.strip()]
+        # Quarter-hour peak demand (capacity tariff), written to p1_capacity.
+        self.capacity = CapacityTracker() if capacity else None
+        # Latency histograms and error counters, written to p1_stats every stats seconds.
+        self.stats = LatencyStats(stats) if stats else None
+        # Latest values on http://<metrics>/metrics, for Prometheus.
+        self.metrics = MetricsServer(metrics) if metrics else None
+        # Every telegram in a shared memory ring, for local consumers (see shmring.py).
+        self.shm = ShmRingWriter(shm) if shm else None
+        # The last store_hours of telegrams in memory, range and downsample queries on http://<store>/query.
+        self.store = RingStore(store, store_hours, store_fields) if store else None
+        if self.store:
+            print(f"Keeping {store_hours:g} h of {','.join(self.store.fields)} in memory ({self.store.memory / 1e6:.1f} MB).")
 
-    def read_packet(self):
+    def read_telegram(self) -> Telegram:
         # For full specs of packets, documents in readme.
         #   eMUCs – P1 v1.4
         #   DSMR 5.0.2 P1
@@ -41,8 +98,14 @@ class P1logger:
         # Buffer entire message (for CRC)
 
         line = self.serial.readline()
+        skipped = 0
         while not line.startswith(b'/'):
             line = self.serial.readline()
+            skipped += 1
+        received = monotonic()
+        if skipped and self.stats:
+            # Started in the middle of a telegram, or garbage on the line.
+            self.stats.count("resyncs")
 
         header = line[1:].strip().decode('ascii')
         crc = self.crc16(line)
@@ -55,24 +118,59 @@ class P1logger:
         # Now comes data
         fields = {}
         human_fields = {}
+        lists = {}
+        unchanged = set()
         line = self.serial.readline()
         while not line.startswith(b'!'):
             crc = self.crc16(line, crc)
             raw = line.strip().decode('ascii')
-            m = OBJECT_REGEX.match(raw)
-            a, b, c, d, e = map(int, m.groups())
-            # b = meter ID in case of extra meters, not used for OBIS lookup.
-            f, human_name, *_ = EMUCS_V1_4[(a, c, d, e)]
-            # Full prefix
-            prefix = raw[:m.end()]
-            # Value without ( and )
-            raw_value = raw[m.end()+1:-1]
-
-            value = f(raw_value)
-
-            fields[prefix] = value
-            if human_name:
+            # Full prefix, everything up to the first (
+            prefix, _, rest = raw.partition('(')
+
+            cached = self.line_cache.get(prefix)
+            if cached is not None and cached[0] == rest:
+                # Byte-for-byte the same as last time, don't decode again.
+                _, value, human_name = cached
+                unchanged.add(prefix)
+                if human_name:
+                    unchanged.add(human_name)
+                    unchanged.add(human_name + "_time")
+            else:
+                m = OBJECT_REGEX.match(raw)
+                a, b, c, d, e = map(int, m.groups())
+                try:
+                    if a != 0 or b == 0:
+                        f, human_name, *_ = EMUCS_V1_4[(a, c, d, e)]
+                    else:
+                        # b = M-Bus channel of extra meters (gas, water, ...), every channel gets its own fields.
+                        f, human_name, *_ = MBUS[(c, d, e)]
+                        human_name = f"mbus{b}_{human_name}"
+                except KeyError:
+                    # Not in the tables, skip the line instead of losing the whole telegram.
+                    if self.stats:
+                        self.stats.count("unknown_obis")
+                    line = self.serial.readline()
+                    continue
+                # Value without ( and )
+                raw_value = raw[m.end()+1:-1]
+
+                value = f(raw_value)
+                self.line_cache[prefix] = (rest, value, human_name)
+
+            if isinstance(value, list):
+                # Records can't be stored as a field, they go to their own measurement.
+                lists[human_name] = value
+            elif isinstance(value, tuple):
+                # Value with the time it was measured at.
+                value_time, value = value
+                fields[prefix] = value
                 human_fields[human_name] = value
+                if value_time:
+                    human_fields[human_name + "_time"] = int(value_time.timestamp())
+            else:
+                fields[prefix] = value
+                if human_name:
+                    human_fields[human_name] = value
 
             # print(human_name, value, prefix, raw_value, raw, sep='\t')
 
@@ -89,27 +187,138 @@ class P1logger:
             del human_fields["time"]
 
         fields["crc_ok"] = crc_ok
-        # print(f"{time}: {fields} CRC={crc_ok}")
-        # print(f"{time}: {human_fields} CRC={crc_ok}")
-        self.influx.write_points([
-            {
-                "measurement": "p1",
+        return Telegram(header, time, fields, human_fields, unchanged, crc_ok, lists, received, monotonic())
+
+    def changed_fields(self, measurement: str, fields: dict, unchanged: set, now: float) -> dict:
+        """
+        Filter out fields that did not change since the last telegram, unless their heartbeat is due.
+        Without changes_only, all fields are returned.
+        The fields that are due count as written once commit_written() is called, after they were written.
+        """
+        if not self.changes_only:
+            return fields
+        out = {}
+        for key, value in fields.items():
+            last = self.pending_written.get((measurement, key), self.last_written.get((measurement, key)))
+            if key not in unchanged or last is None or now - last >= self.heartbeat:
+                out[key] = value
+                self.pending_written[(measurement, key)] = now
+        return out
+
+    def commit_written(self, written: bool = True) -> None:
+        """
+        The points since the last call were written, or not: then their fields are due again with the next telegram,
+        even if they don't change in it.
+        """
+        if written:
+            self.last_written.update(self.pending_written)
+        else:
+            for key in self.pending_written:
+                self.last_written.pop(key, None)
+        self.pending_written.clear()
+
+    @staticmethod
+    def record_points(measurement: str, header: str, records: list) -> list:
+        """
+        One point per record, timestamped with the first field of the record.
+        Other timestamps are stored as seconds since epoch.
+        Rewriting the same record overwrites the same point.
+        """
+        points = []
+        for record in records:
+            time, *values = record
+            if time is None:
+                continue
+            fields = {}
+            for key, value in zip(record._fields[1:], values):
+                if isinstance(value, datetime.datetime):
+                    value = int(value.timestamp())
+                if value is not None:
+                    fields[key] = value
+            points.append({
+                "measurement": measurement,
                 "time": time,
                 "fields": fields,
                 "tags": {
                     "header": header,
                 },
-            },
-            {
-                "measurement": "p1_human",
+            })
+        return points
+
+    def read_packet(self):
+        telegram = self.read_telegram()
+        if self.metrics:
+            self.metrics.update(telegram.header, telegram.time, telegram.human_fields, telegram.crc_ok)
+        if self.shm:
+            self.shm.publish(telegram.time, telegram.human_fields, telegram.crc_ok)
+        if self.store:
+            self.store.add(telegram.time, telegram.human_fields, telegram.crc_ok)
+        points = self.telegram_points(telegram)
+        enqueued = monotonic()
+        try:
+            if points:
+                self.influx.write_points(points)
+        except Exception:
+            self.commit_written(False)
+            if self.stats:
+                self.stats.count("write_errors")
+            raise
+        self.commit_written()
+        if self.stats:
+            self.stats.telegram(telegram.received, telegram.parsed, enqueued, monotonic(), telegram.time)
+            if not telegram.crc_ok:
+                self.stats.count("crc_failures")
+            stats_points = self.stats.publish(telegram.header)
+            if stats_points:
+                self.influx.write_points(stats_points)
+        human_fields = telegram.human_fields
+        print(f"{telegram.time}: +{human_fields['power_used']:.1f}kW -{human_fields['power_injected']:.1f}kW CRC={telegram.crc_ok}")
+
+    def telegram_points(self, telegram: Telegram) -> list:
+        """
+        All points to write for this telegram: the raw measurements, records and any closed rollups.
+        """
+        time = telegram.time
+        header = telegram.header
+        crc_ok = telegram.crc_ok
+        now = time.timestamp() if time else datetime.datetime.now().timestamp()
+        # print(f"{time}: {fields} CRC={crc_ok}")
+        # print(f"{time}: {human_fields} CRC={crc_ok}")
+        points = []
+        for measurement, all_fields in (("p1", telegram.fields), ("p1_human", telegram.human_fields)):
+            if measurement not in self.measurements:
+                continue
+            fields = self.changed_fields(measurement, all_fields, telegram.unchanged, now)
+            if not fields:
+                continue
+            points.append({
+                "measurement": measurement,
                 "time": time,
-                "fields": human_fields,
+                "fields": fields,
                 "tags": {
                     "header": header,
                 },
-            }
-        ])
-        print(f"{time}: +{human_fields['power_used']:.1f}kW -{human_fields['power_injected']:.1f}kW CRC={crc_ok}")
+            })
+        if crc_ok:
+            for name, records in telegram.lists.items():
+                if name not in telegram.unchanged:
+                    points.extend(self.record_points("p1_" + name, header, records))
+        points.extend(self.derived_points(telegram))
+        return points
+
+    def derived_points(self, telegram: Telegram) -> list:
+        """
+        The points of closed rollups and capacity quarters. Every telegram has to go through here, in order.
+        """
+        points = []
+        if telegram.time and telegram.crc_ok:
+            for rollup in self.rollups:
+                point = rollup.add(telegram.time, telegram.header, telegram.human_fields)
+                if point:
+                    points.append(point)
+            if self.capacity:
+                points.extend(self.capacity.add(telegram.time, telegram.header, telegram.human_fields))
+        return points
 
     def run(self):
         while True:
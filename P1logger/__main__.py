@@ -7,11 +7,56 @@ import os
 import argparse
 
 from . import P1logger
+from .importer import Importer
+from .ringstore import DEFAULT_FIELDS
+
+
+def env_flag(name: str) -> bool:
+    """
+    On/off from the environment: 1, true, yes or on (any case) is on, anything else (or not set) is off.
+    """
+    return os.environ.get(name, "").strip().lower() in ("1", "true", "yes", "on")
+
 
 args = argparse.ArgumentParser()
 args.add_argument("-p", "--port", default=os.environ.get("P1_PORT", "/dev/ttyUSB0"))
 args.add_argument("-i", "--influx", default=os.environ.get("P1_INFLUX", "influxdb://localhost:8086/p1log"))
+args.add_argument("-m", "--measurements", default=os.environ.get("P1_MEASUREMENTS", "p1,p1_human"),
+                  help="Comma separated list of measurements to write: p1 (OBIS keys), p1_human (readable names).")
+args.add_argument("-c", "--changes-only", action="store_true", default=env_flag("P1_CHANGES_ONLY"),
+                  help="Only write fields that changed since the previous telegram.")
+args.add_argument("--heartbeat", type=float, default=float(os.environ.get("P1_HEARTBEAT", 300)),
+                  help="With --changes-only, write unchanged fields anyway after this many seconds.")
+args.add_argument("-r", "--rollups", default=os.environ.get("P1_ROLLUPS", ""),
+                  help="Comma separated list of downsample periods (eg 1m,15m,1h), each written to p1_<period>.")
+args.add_argument("--capacity", action="store_true", default=env_flag("P1_CAPACITY"),
+                  help="Track the quarter-hour peak demand of the month, written to p1_capacity.")
+args.add_argument("--stats", type=float, default=float(os.environ.get("P1_STATS", 0)),
+                  help="Write latency percentiles and error counters to p1_stats every this many seconds, 0 = off.")
+args.add_argument("--metrics", default=os.environ.get("P1_METRICS", ""), metavar="[HOST:]PORT",
+                  help="Serve the latest values on http://HOST:PORT/metrics (Prometheus).")
+args.add_argument("--shm", default=os.environ.get("P1_SHM", ""), metavar="NAME",
+                  help="Publish every telegram in a shared memory ring (eg /p1ring), see shmring.py.")
+args.add_argument("--store", default=os.environ.get("P1_STORE", ""), metavar="[HOST:]PORT",
+                  help="Keep the last hours in memory, and serve range queries on http://HOST:PORT/query.")
+args.add_argument("--store-hours", type=float, default=float(os.environ.get("P1_STORE_HOURS", 24)),
+                  help="With --store, how many hours to keep (at one telegram per second).")
+args.add_argument("--store-fields", default=os.environ.get("P1_STORE_FIELDS", DEFAULT_FIELDS),
+                  help="With --store, comma separated list of p1_human fields to keep (gas = first gas meter).")
+args.add_argument("--import", dest="import_files", nargs="+", metavar="FILE",
+                  help="Import raw capture files (plain, .gz, .bz2 or .xz) instead of reading the serial port.")
+args.add_argument("--checkpoint", default="p1import.checkpoint.json",
+                  help="With --import, where to keep track of progress, so an import can be resumed.")
+args.add_argument("--batch", type=int, default=5000, help="With --import, nr of telegrams per write.")
+args.add_argument("--no-skip-existing", dest="skip_existing", action="store_false",
+                  help="With --import, don't check which telegrams are already in the database.")
 
 
 if __name__ == '__main__':
-    P1logger(**args.parse_args().__dict__).run()
+    kwargs = args.parse_args().__dict__
+    import_files = kwargs.pop("import_files")
+    import_args = {k: kwargs.pop(k) for k in ("checkpoint", "batch", "skip_existing")}
+    if import_files:
+        Importer(import_files, **import_args, **kwargs).run()
+    else:
+        P1logger(**kwargs).run()
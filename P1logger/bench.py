@@ -0,0 +1,262 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+End-to-end benchmark: P1logger reading from an in-memory serial port, writing to a local stand-in for InfluxDB.
+    python -m P1logger.bench Firmware/Testing/log.txt --telegrams 5000 --delay 5
+Reports where the time goes per telegram (readline, CRC, parsing, building points, writing),
+and the maximum rate, which is the number of meters at 1 telegram/s one process could keep up with.
+
+The stand-in on its own, for other writers (Firmware/influx_x64, gateway_x64 -i), prints the counts on Ctrl-C (or SIGTERM):
+    python -m P1logger.bench --serve 8086
+"""
+
+import argparse
+import gzip
+import json
+import re
+import signal
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+import crcmod.predefined
+
+from . import P1logger
+
+TIMESTAMP_REGEX = re.compile(rb"^0-0:1\.0\.0\((\d{12})([SW])\)")
+
+
+def load_telegrams(paths, count):
+    """
+    count telegrams from the captures (repeated if needed) as lists of lines, with CRLF line endings,
+    consecutive timestamps and a correct CRC, like the meter would send them.
+    """
+    crc16 = crcmod.predefined.mkPredefinedCrcFun('crc-16')
+    templates = []
+    for path in paths:
+        lines = None
+        with open(path, 'rb') as f:
+            for raw in f:
+                line = raw.rstrip(b'\r\n') + b'\r\n'
+                if line.startswith(b'/'):
+                    lines = [line]
+                elif lines is None:
+                    continue
+                elif line.startswith(b'!'):
+                    # Some captures lost the empty line after the header, the meter always sends it.
+                    if len(lines) < 2 or lines[1] != b'\r\n':
+                        lines.insert(1, b'\r\n')
+                    templates.append(lines)
+                    lines = None
+                else:
+                    lines.append(line)
+    if not templates:
+        raise ValueError("No telegrams in the captures.")
+
+    start = int(time.time()) - count
+    telegrams = []
+    for i in range(count):
+        stamp = time.strftime('%y%m%d%H%M%S', time.localtime(start + i)).encode()
+        dst = b'S' if time.localtime(start + i).tm_isdst > 0 else b'W'
+        lines = [TIMESTAMP_REGEX.sub(b"0-0:1.0.0(" + stamp + dst + b")", line) for line in templates[i % len(templates)]]
+        body = b''.join(lines) + b'!'
+        lines.append(b'!%04X\r\n' % crc16(body))
+        telegrams.append(lines)
+    return telegrams
+
+
+class MockSerial:
+    """
+    Hands out the lines of the telegrams, as fast as they're asked for. Raises EOFError at the end.
+    """
+
+    def __init__(self, telegrams) -> None:
+        self.lines = iter([line for telegram in telegrams for line in telegram])
+
+    def readline(self) -> bytes:
+        line = next(self.lines, None)
+        if line is None:
+            raise EOFError
+        return line
+
+
+class InfluxStandIn(ThreadingHTTPServer):
+    """
+    Enough of the InfluxDB 1.x HTTP API for P1logger: /ping, /query (always empty) and /write (counts points).
+    Every write takes at least delay seconds.
+    """
+    daemon_threads = True
+
+    def __init__(self, delay: float, port: int = 0) -> None:
+        super().__init__(("127.0.0.1", port), InfluxHandler)
+        self.delay = delay
+        self.lock = threading.Lock()
+        self.writes = 0
+        self.points = 0
+        self.bytes = 0
+        self.wire_bytes = 0
+
+    @property
+    def dsn(self) -> str:
+        return f"influxdb://127.0.0.1:{self.server_port}/p1bench"
+
+
+class InfluxHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def reply(self, status: int, body: bytes = b"") -> None:
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        self.reply(204 if self.path.startswith("/ping") else 200, b'{"results":[{"statement_id":0}]}')
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        wire = len(body)
+        if self.headers.get("Content-Encoding") == "gzip":
+            body = gzip.decompress(body)
+        if not self.path.startswith("/write"):
+            self.reply(200, b'{"results":[{"statement_id":0}]}')
+            return
+        if self.server.delay:
+            time.sleep(self.server.delay)
+        with self.server.lock:
+            self.server.writes += 1
+            self.server.points += body.count(b"\n") + (not body.endswith(b"\n"))
+            self.server.bytes += len(body)
+            self.server.wire_bytes += wire
+        self.reply(204)
+
+    def log_message(self, *args):
+        pass
+
+
+class Stage:
+    """
+    Wraps a function, and adds up the time spent in it.
+    """
+
+    def __init__(self, function) -> None:
+        self.function = function
+        self.calls = 0
+        self.seconds = 0.0
+
+    def __call__(self, *args, **kwargs):
+        start = time.perf_counter()
+        try:
+            return self.function(*args, **kwargs)
+        finally:
+            self.seconds += time.perf_counter() - start
+            self.calls += 1
+
+
+def bench(telegrams, influx, **kwargs) -> dict:
+    logger = P1logger(port=None, influx=influx, **kwargs)
+    logger.serial = MockSerial(telegrams)
+    stages = {
+        "readline": Stage(logger.serial.readline),
+        "crc": Stage(logger.crc16),
+        "read_telegram": Stage(logger.read_telegram),
+        "telegram_points": Stage(logger.telegram_points),
+        "write_points": Stage(logger.influx.write_points),
+    }
+    logger.serial.readline = stages["readline"]
+    logger.crc16 = stages["crc"]
+    logger.read_telegram = stages["read_telegram"]
+    logger.telegram_points = stages["telegram_points"]
+    logger.influx.write_points = stages["write_points"]
+
+    count = 0
+    start = time.perf_counter()
+    while True:
+        try:
+            telegram = logger.read_telegram()
+        except EOFError:
+            break
+        # Same as P1logger.read_packet, without the print.
+        points = logger.telegram_points(telegram)
+        if points:
+            logger.influx.write_points(points)
+        logger.commit_written()
+        count += 1
+    elapsed = time.perf_counter() - start
+
+    # read_telegram includes readline and crc, what's left is the regex, the cache and the OBIS value parsing.
+    seconds = {name: stage.seconds for name, stage in stages.items()}
+    seconds["parse"] = seconds.pop("read_telegram") - seconds["readline"] - seconds["crc"]
+    seconds["other"] = elapsed - sum(seconds.values())
+    return {
+        "telegrams": count,
+        "seconds": elapsed,
+        "telegrams_per_second": count / elapsed,
+        "us_per_telegram": {name: s / count * 1e6 for name, s in seconds.items()},
+        "writes": stages["write_points"].calls,
+    }
+
+
+def main():
+    args = argparse.ArgumentParser(description="P1logger end-to-end benchmark.")
+    args.add_argument("captures", nargs="*", help="Raw captures to take the telegrams from, eg Firmware/Testing/log.txt.")
+    args.add_argument("-n", "--telegrams", type=int, default=5000)
+    args.add_argument("-d", "--delay", type=float, default=0, help="Milliseconds every write takes in the stand-in.")
+    args.add_argument("--influx", help="Use this InfluxDB instead of the stand-in.")
+    args.add_argument("--json", help="Also write the results to this file.")
+    args.add_argument("-m", "--measurements", default="p1,p1_human")
+    args.add_argument("-c", "--changes-only", action="store_true")
+    args.add_argument("-r", "--rollups", default="")
+    args.add_argument("--capacity", action="store_true")
+    args.add_argument("--serve", type=int, metavar="PORT", help="Only run the stand-in, on this port.")
+    args = args.parse_args()
+
+    if args.serve is not None:
+        server = InfluxStandIn(args.delay / 1000, args.serve)
+        print(f"Stand-in listening on http://127.0.0.1:{server.server_port}/p1bench", flush=True)
+        # Same as Ctrl-C, for when it runs in the background.
+        signal.signal(signal.SIGTERM, signal.default_int_handler)
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
+        print(json.dumps({"writes": server.writes, "points": server.points, "line_protocol_bytes": server.bytes,
+                          "wire_bytes": server.wire_bytes}))
+        return
+    if not args.captures:
+        raise SystemExit("No captures given.")
+
+    telegrams = load_telegrams(args.captures, args.telegrams)
+    server = None
+    influx = args.influx
+    if not influx:
+        server = InfluxStandIn(args.delay / 1000)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        influx = server.dsn
+
+    result = bench(telegrams, influx, measurements=args.measurements, changes_only=args.changes_only,
+                   rollups=args.rollups, capacity=args.capacity)
+    if server:
+        server.shutdown()
+        result["points"] = server.points
+        result["line_protocol_bytes"] = server.bytes
+    result["options"] = {k: v for k, v in vars(args).items() if k not in ("captures", "json")}
+
+    print(f"{result['telegrams']} telegrams in {result['seconds']:.2f} s: "
+          f"{result['telegrams_per_second']:.0f} telegrams/s, so up to {int(result['telegrams_per_second'])} meters at 1 Hz")
+    total = sum(result["us_per_telegram"].values())
+    for name, us in sorted(result["us_per_telegram"].items(), key=lambda x: -x[1]):
+        print(f"  {name:16} {us:9.1f} us/telegram {us / total * 100:5.1f}%")
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=2)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(1)
@@ -0,0 +1,116 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Quarter-hour peak demand, as used for the Flemish capacity tariff.
+The grid fee is based on the highest 15 minute average demand of the month.
+Everything is kept incrementally, O(1) per telegram.
+"""
+
+import datetime
+from typing import List
+
+QUARTER = 15 * 60
+
+
+class CapacityTracker:
+    """
+    Integrates the delivered energy registers (meter_t1_used + meter_t2_used, kWh) per quarter hour.
+
+    Published in measurement "p1_capacity":
+      every interval seconds:
+        demand_avg        Average demand of the running quarter so far, in kW (energy so far / 15 minutes).
+        demand_projected  Expected demand at the end of the quarter, if the current power is sustained, in kW.
+        month_peak        Highest closed quarter of the running month, in kW.
+        meter_demand_avg, meter_demand_peak_month   As reported by the meter (1-0:1.4.0, 1-0:1.6.0), if present.
+      when a quarter closes (timestamped with the start of that quarter):
+        quarter_demand    Average demand of that quarter, in kW.
+
+    Across a gap in the telegrams, the register is interpolated at every quarter boundary in between: the energy used
+    during the gap is spread evenly over the quarters it covers, instead of all going to the one that closes.
+    """
+
+    def __init__(self, interval: int = 60, measurement: str = "p1_capacity") -> None:
+        self.interval = interval
+        self.measurement = measurement
+        self.quarter_start = None
+        self.quarter_energy = None  # kWh register value at start of quarter
+        self.last_ts = None
+        self.last_energy = None
+        self.month = None
+        self.month_peak = 0.0
+        self.last_publish = None
+
+    def add(self, time: datetime.datetime, header: str, human_fields: dict) -> List[dict]:
+        try:
+            energy = human_fields["meter_t1_used"] + human_fields["meter_t2_used"]
+        except KeyError:
+            return []
+        power = human_fields.get("power_used", 0.0)
+        ts = int(time.timestamp())
+        start = ts - ts % QUARTER
+        points = []
+
+        if self.quarter_start is None or start < self.quarter_start:
+            self.quarter_start = start
+            self.quarter_energy = energy
+        elif start == self.quarter_start + QUARTER:
+            # The energy between the last telegram and the boundary is attributed to the closing quarter.
+            points.append(self.close(header, energy))
+        elif start != self.quarter_start:
+            rate = (energy - self.last_energy) / (ts - self.last_ts)
+            while self.quarter_start < start:
+                boundary = self.quarter_start + QUARTER
+                points.append(self.close(header, self.last_energy + rate * (boundary - self.last_ts)))
+        self.last_ts = ts
+        self.last_energy = energy
+        # The quarters of the previous month are closed, the peak starts over with its first telegram.
+        self.start_month(ts)
+
+        if self.last_publish is None or ts - self.last_publish >= self.interval:
+            self.last_publish = ts
+            used = energy - self.quarter_energy
+            remaining = self.quarter_start + QUARTER - ts
+            fields = {
+                "demand_avg": used * 3600 / QUARTER,
+                "demand_projected": (used + power * remaining / 3600) * 3600 / QUARTER,
+                "month_peak": self.month_peak,
+            }
+            if "demand_avg" in human_fields:
+                fields["meter_demand_avg"] = human_fields["demand_avg"]
+            if "demand_peak_month" in human_fields:
+                fields["meter_demand_peak_month"] = human_fields["demand_peak_month"]
+            points.append(self.point(time, header, fields))
+        return points
+
+    def close(self, header: str, energy: float) -> dict:
+        """
+        Close the running quarter, with energy the register value at its end, and start the next one.
+        """
+        demand = (energy - self.quarter_energy) * 3600 / QUARTER
+        closed = datetime.datetime.fromtimestamp(self.quarter_start, datetime.timezone.utc)
+        self.start_month(self.quarter_start)
+        if demand > self.month_peak:
+            self.month_peak = demand
+        self.quarter_start += QUARTER
+        self.quarter_energy = energy
+        return self.point(closed, header, {"quarter_demand": demand})
+
+    def start_month(self, ts: int) -> None:
+        """
+        Reset month_peak if ts is in another (local) month than the last quarter or telegram.
+        """
+        month = datetime.datetime.fromtimestamp(ts).strftime("%Y-%m")
+        if month != self.month:
+            self.month = month
+            self.month_peak = 0.0
+
+    def point(self, time: datetime.datetime, header: str, fields: dict) -> dict:
+        return {
+            "measurement": self.measurement,
+            "time": time,
+            "fields": fields,
+            "tags": {
+                "header": header,
+            },
+        }
@@ -0,0 +1,212 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Offline import of raw P1 captures (as written by Firmware/extra/log.py), as fast as InfluxDB can take it.
+"""
+
+import bz2
+import gzip
+import json
+import lzma
+import os
+import sys
+import time
+import traceback
+from typing import List
+
+from . import P1logger, Telegram
+from .capacity import CapacityTracker
+from .rollup import Rollup
+
+OPENERS = {
+    ".gz": gzip.GzipFile,
+    ".bz2": bz2.BZ2File,
+    ".xz": lzma.LZMAFile,
+}
+
+# Field that is present in every point of a measurement, used to find telegrams that were already imported.
+PRESENT_FIELD = {
+    "p1": "crc_ok",
+    "p1_human": "power_used",
+}
+
+
+class CaptureReader:
+    """
+    Stands in for the serial port. readline raises EOFError at the end of the file, so a partial telegram at the
+    end is dropped instead of waiting forever.
+    """
+
+    def __init__(self, path: str) -> None:
+        self.raw = open(path, "rb")
+        self.size = os.fstat(self.raw.fileno()).st_size
+        opener = OPENERS.get(os.path.splitext(path)[1])
+        self.file = opener(fileobj=self.raw) if opener else self.raw
+
+    def readline(self) -> bytes:
+        line = self.file.readline()
+        if not line:
+            raise EOFError
+        return line
+
+    def tell(self) -> int:
+        # Offset in the decompressed stream, used for resuming.
+        return self.file.tell()
+
+    def seek(self, offset: int) -> None:
+        self.file.seek(offset)
+
+    def progress(self) -> float:
+        # Of the compressed file, so it can be used for progress without knowing the decompressed size.
+        return self.raw.tell() / self.size if self.size else 1.0
+
+    def close(self) -> None:
+        self.file.close()
+        self.raw.close()
+
+
+class Importer(P1logger):
+    """
+    Reads capture files instead of the serial port. Telegrams with a bad CRC are skipped.
+    Points are written in batches, after every batch the position is saved in the checkpoint file,
+    so an interrupted import continues where it stopped.
+    """
+
+    def __init__(self, files: List[str], checkpoint: str, batch: int = 5000, skip_existing: bool = True,
+                 **kwargs) -> None:
+        kwargs["port"] = None
+        super().__init__(**kwargs)
+        self.files = files
+        self.checkpoint_path = checkpoint
+        self.batch = batch
+        self.skip_existing = skip_existing
+        self.checkpoint = {}
+        if checkpoint and os.path.exists(checkpoint):
+            with open(checkpoint) as f:
+                self.checkpoint = json.load(f)
+        # Not self.stats, that is the LatencyStats read_telegram counts resyncs in.
+        self.import_stats = {"telegrams": 0, "written": 0, "crc_errors": 0, "errors": 0, "existing": 0}
+
+    def save_checkpoint(self) -> None:
+        if not self.checkpoint_path:
+            return
+        tmp = self.checkpoint_path + ".tmp"
+        with open(tmp, "w") as f:
+            json.dump(self.checkpoint, f)
+        os.replace(tmp, self.checkpoint_path)
+
+    def existing_times(self, telegrams: List[Telegram]) -> set:
+        """
+        Timestamps (seconds since epoch) of telegrams in this batch that are already in the database.
+        """
+        measurement = next((m for m in ("p1_human", "p1") if m in self.measurements), None)
+        times = [t.time for t in telegrams if t.time]
+        if not self.skip_existing or not measurement or not times:
+            return set()
+        query = f'SELECT "{PRESENT_FIELD[measurement]}" FROM "{measurement}" ' \
+                f"WHERE time >= '{min(times).isoformat()}' AND time <= '{max(times).isoformat()}'"
+        result = self.influx.query(query, epoch="s")
+        return {point["time"] for point in result.get_points()}
+
+    def flush(self, telegrams: List[Telegram], key: str, offset: int) -> None:
+        existing = self.existing_times(telegrams)
+        points = []
+        for telegram in telegrams:
+            if telegram.time and int(telegram.time.timestamp()) in existing:
+                # Only the raw points are there already, the rollups and capacity still need the telegram.
+                self.import_stats["existing"] += 1
+                points.extend(self.derived_points(telegram))
+                continue
+            points.extend(self.telegram_points(telegram))
+        try:
+            if points:
+                self.influx.write_points(points, batch_size=self.batch * 2)
+        except Exception:
+            self.commit_written(False)
+            raise
+        self.commit_written()
+        self.import_stats["written"] += len(points)
+        self.checkpoint[key] = {"offset": offset, "done": False}
+        self.save_checkpoint()
+
+    def reset_derived(self) -> None:
+        """
+        Start the rollups and capacity over, every file is a separate stretch of time.
+        """
+        self.rollups = [Rollup(rollup.period) for rollup in self.rollups]
+        if self.capacity:
+            self.capacity = CapacityTracker(self.capacity.interval, self.capacity.measurement)
+
+    def replay(self, reader: CaptureReader, offset: int) -> None:
+        """
+        Resuming: the windows that closed before offset were written, the open ones are rebuilt from the telegrams
+        before it.
+        """
+        while reader.tell() < offset:
+            try:
+                telegram = self.read_telegram()
+            except EOFError:
+                break
+            except Exception:
+                continue
+            if telegram.crc_ok:
+                self.derived_points(telegram)
+
+    def import_file(self, path: str) -> None:
+        key = os.path.abspath(path)
+        state = self.checkpoint.get(key, {})
+        if state.get("done"):
+            print(f"{path}: already imported, skipping.")
+            return
+
+        self.serial = reader = CaptureReader(path)
+        # The line cache, rollups and capacity must not carry over between files.
+        self.line_cache = {}
+        self.reset_derived()
+        if state.get("offset"):
+            self.replay(reader, state["offset"])
+        telegrams = []
+        offset = reader.tell()
+        start = last_report = time.monotonic()
+        try:
+            while True:
+                try:
+                    telegram = self.read_telegram()
+                except EOFError:
+                    break
+                except Exception:
+                    # Garbage in the capture, read_telegram resyncs on the next header.
+                    self.import_stats["errors"] += 1
+                    continue
+                self.import_stats["telegrams"] += 1
+                offset = reader.tell()
+                if not telegram.crc_ok:
+                    self.import_stats["crc_errors"] += 1
+                    continue
+                telegrams.append(telegram)
+                if len(telegrams) >= self.batch:
+                    self.flush(telegrams, key, offset)
+                    telegrams = []
+                now = time.monotonic()
+                if now - last_report >= 1:
+                    last_report = now
+                    rate = self.import_stats["telegrams"] / (now - start)
+                    print(f"\r{path}: {reader.progress() * 100:5.1f}% {self.import_stats['telegrams']} telegrams "
+                          f"({rate:.0f}/s), {self.import_stats['written']} points", end="", file=sys.stderr)
+            self.flush(telegrams, key, offset)
+            self.checkpoint[key]["done"] = True
+            self.save_checkpoint()
+        finally:
+            reader.close()
+            self.serial = None
+        print(f"\r{path}: done, {self.import_stats}", file=sys.stderr)
+
+    def run(self):
+        try:
+            for path in self.files:
+                self.import_file(path)
+        except KeyboardInterrupt:
+            print("\nInterrupted, run again to continue from the checkpoint.", file=sys.stderr)
+        except Exception:
+            traceback.print_exc()
@@ -0,0 +1,109 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Prometheus /metrics endpoint with the latest telegram, so dashboards that only need the current values
+don't have to query InfluxDB.
+
+The reader thread formats the complete HTTP response (headers and body) once per telegram and swaps it in
+with a single reference assignment, the serving thread only ever sends the current bytes object.
+A scrape never waits for the serial reader, and the reader never waits for a scrape.
+"""
+
+import re
+import socket
+import threading
+import traceback
+from typing import Optional
+
+NAME_REGEX = re.compile(r"[^a-zA-Z0-9_]")
+NOT_FOUND = b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+
+def http_response(body: bytes) -> bytes:
+    return b"HTTP/1.1 200 OK\r\n" \
+           b"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n" \
+           b"Content-Length: %d\r\n" \
+           b"Connection: close\r\n\r\n" % len(body) + body
+
+
+class MetricsServer:
+    """
+    Serves GET /metrics on address ("host:port" or "port"), from a daemon thread.
+
+    Metrics (label meter = telegram header):
+      p1_<human name>                 Every numeric field of the last telegram with a good CRC (kW, kWh, V, A, m3, ...).
+      p1_telegram_timestamp_seconds   Meter time of that telegram.
+      p1_telegrams_total              Telegrams received.
+      p1_crc_failures_total           Telegrams with a bad CRC.
+    """
+
+    def __init__(self, address: str) -> None:
+        host, _, port = address.rpartition(":")
+        self.socket = socket.create_server((host or "0.0.0.0", int(port)))
+        self.telegrams = 0
+        self.crc_failures = 0
+        self.last_fields = ""
+        # The snapshot, replaced as a whole, never modified.
+        self.response = http_response(b"")
+        threading.Thread(target=self.serve, name="metrics", daemon=True).start()
+
+    def update(self, header: str, time, human_fields: dict, crc_ok: bool) -> None:
+        self.telegrams += 1
+        if crc_ok:
+            label = '{meter="%s"}' % header.replace("\\", "\\\\").replace('"', '\\"')
+            lines = []
+            for name, value in human_fields.items():
+                if isinstance(value, bool):
+                    value = int(value)
+                elif not isinstance(value, (int, float)):
+                    continue
+                metric = "p1_" + NAME_REGEX.sub("_", name)
+                lines.append(f"# TYPE {metric} gauge\n{metric}{label} {value}\n")
+            if time:
+                lines.append(f"# TYPE p1_telegram_timestamp_seconds gauge\n"
+                             f"p1_telegram_timestamp_seconds{label} {int(time.timestamp())}\n")
+            self.last_fields = "".join(lines)
+        else:
+            self.crc_failures += 1
+        body = f"{self.last_fields}" \
+               f"# TYPE p1_telegrams_total counter\np1_telegrams_total {self.telegrams}\n" \
+               f"# TYPE p1_crc_failures_total counter\np1_crc_failures_total {self.crc_failures}\n"
+        self.response = http_response(body.encode())
+
+    def serve(self) -> None:
+        while True:
+            try:
+                connection, _ = self.socket.accept()
+            except OSError:
+                return
+            try:
+                with connection:
+                    connection.settimeout(2)
+                    request = self.read_request(connection)
+                    if request is None:
+                        continue
+                    path = request.split(b" ", 2)[1] if request.count(b" ") >= 2 else b""
+                    # One reference read, whatever the reader does meanwhile, this response stays consistent.
+                    response = self.response
+                    connection.sendall(response if path.split(b"?")[0] == b"/metrics" else NOT_FOUND)
+            except OSError:
+                pass
+            except Exception:
+                traceback.print_exc()
+
+    @staticmethod
+    def read_request(connection: socket.socket) -> Optional[bytes]:
+        """
+        The request line, after reading up to the end of the headers.
+        """
+        data = b""
+        while b"\r\n\r\n" not in data and len(data) < 8192:
+            chunk = connection.recv(4096)
+            if not chunk:
+                return None
+            data += chunk
+        return data.split(b"\r\n", 1)[0]
+
+    def close(self) -> None:
+        self.socket.close()
@@ -7,18 +7,75 @@ Their only purpose here is to inform the unit conversion.
 """
 
 import datetime
+from typing import List, NamedTuple, Optional, Tuple
 
 
 def float_without_unit(x: str) -> float:
     return float(x[:x.index('*')])
 
 
+def float_with_timestamp(x: str) -> float:
+    # Value preceded by a timestamp, as in "200509134558S)(02.589*kW".
+    return float_without_unit(x[x.rindex('(') + 1:])
+
+
+def value_with_timestamp(x: str) -> Tuple[Optional[datetime.datetime], float]:
+    # Value preceded by the time it was measured, as in "101209112500W)(12785.123*m3".
+    return optional_tst(x[:x.index(')')]), float_with_timestamp(x)
+
+
 def tst(x: str) -> datetime:
     # dst = x[-1] == 'S'  # Not used.
     # 20 prepended to get a full year and avoid any possible ambiguity there.
     return datetime.datetime.strptime("20" + x[:-1], "%Y%m%d%H%M%S").astimezone(datetime.timezone.utc)
 
 
+class PowerFailure(NamedTuple):
+    end: Optional[datetime.datetime]
+    duration: int  # seconds
+
+
+class MonthlyPeak(NamedTuple):
+    month: Optional[datetime.datetime]
+    time: Optional[datetime.datetime]
+    demand: float  # kW
+
+
+def value_list(x: str) -> List[List[str]]:
+    """
+    Split a list value, like "2)(0-0:96.7.19)(101208152415W)(0000000240*s)(101208151004W)(0000000301*s",
+    into its entries. The OBIS ids that describe the entries are dropped, every entry is a number of timestamps
+    followed by a value.
+    """
+    parts = x.split(')(')
+    entries = []
+    entry = []
+    for part in parts[1:]:
+        if ':' in part:
+            continue
+        entry.append(part)
+        if not (len(part) == 13 and part[-1] in 'SW'):
+            entries.append(entry)
+            entry = []
+    return entries
+
+
+def optional_tst(x: str) -> Optional[datetime.datetime]:
+    try:
+        return tst(x)
+    except ValueError:
+        return None
+
+
+def power_failure_log(x: str) -> List[PowerFailure]:
+    return [PowerFailure(optional_tst(end), int(float_without_unit(duration))) for end, duration in value_list(x)]
+
+
+def monthly_peaks(x: str) -> List[MonthlyPeak]:
+    return [MonthlyPeak(optional_tst(month), optional_tst(time), float_without_unit(demand))
+            for month, time, demand in value_list(x)]
+
+
 DSMR_V5_0_2 = {
     # Electric
     (0, 96,    1,  1):  (str, "id", "Equipment identifier"),
@@ -31,7 +88,7 @@ DSMR_V5_0_2 = {
     (1, 2,     7,  0):  (float_without_unit, "power_injected", "Actual electricity power received (-P) in 1 Watt resolution"),
     (0, 96,    7,  21): (int, None, "Number of power failures in any phases"),
     (0, 96,    7,  9):  (int, None, "Number of long power failures in any phases"),
-    (1, 99,    97, 0):  (str, None, "Power failure event log"),
+    (1, 99,    97, 0):  (power_failure_log, "power_failure_log", "Power failure event log"),
     (1, 32,    32, 0):  (int, None, "Number of voltage sags in phase L1"),
     (1, 52,    32, 0):  (int, None, "Number of voltage sags in phase L2"),
     (1, 72,    32, 0):  (int, None, "Number of voltage sags in phase L3"),
@@ -50,10 +107,6 @@ DSMR_V5_0_2 = {
     (1, 22,    7,  0):  (float_without_unit, "power_l1_neg", "Instantaneous active power L1 (-P)"),
     (1, 42,    7,  0):  (float_without_unit, "power_l2_neg", "Instantaneous active power L2 (-P)"),
     (1, 62,    7,  0):  (float_without_unit, "power_l3_neg", "Instantaneous active power L3 (-P)"),
-    # Extra meters (Gas, Water, Heat, Cold, ...)
-    (0, 24,    1,  0):  (str, None, "Device-Type"),
-    (0, 96,    1,  0):  (str, None, "Equipment identifier"),
-    (0, 24,    2,  1):  (float_without_unit, None, "Last 5-minute value"),
     # Other
     (0, 96,    13, 0):  (str, "message", "Text message"),
     (1, 0,     2,  8):  (str, "version", "Version info"),
@@ -68,7 +121,17 @@ EMUCS_V1_4 = {
     (0, 96,    3,  10): (int, "breaker_state", "Breaker state"),
     (0, 17,    0,  0):  (float_without_unit, "limiter", "Limiter threshold"),
     (1, 31,    4,  0):  (float_without_unit, "fuse", "Fuse supervision threshold (L1)"),
-    # Gas
-    (0, 96,    1,  1):  (str, None, "M-Bus Device ID 2"),
-    (0, 24,    4,  0):  (int, None, "Valve state"),
+    (1, 1,     4,  0):  (float_without_unit, "demand_avg", "Current average demand - Active energy import"),
+    (1, 1,     6,  0):  (float_with_timestamp, "demand_peak_month", "Maximum demand - Active energy import of the running month"),
+    (0, 98,    1,  0):  (monthly_peaks, "monthly_peaks", "Maximum demand of the last 13 months"),
+}
+# Extra meters (Gas, Water, Heat, Cold, ...) on M-Bus channel b (0-b:c.d.e), keyed by (c, d, e).
+# Human names get prefixed by "mbus<b>_".
+MBUS = {
+    (24,    1,  0):  (int, "device_type", "Device-Type"),
+    (96,    1,  0):  (str, "id", "Equipment identifier"),
+    (96,    1,  1):  (str, "id", "Equipment identifier (eMUCs)"),
+    (24,    2,  1):  (value_with_timestamp, "value", "Last 5-minute value"),
+    (24,    2,  3):  (value_with_timestamp, "value", "Last 5-minute value (eMUCs)"),
+    (24,    4,  0):  (int, "valve_state", "Valve state"),
 }
@@ -0,0 +1,268 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+The last hours of telegrams in memory, with a small HTTP API for range and downsample queries, so dashboards
+that only look at the last day don't have to go through InfluxDB.
+
+Every field is its own preallocated array (structure of arrays) of integers in the units of Firmware/packet.h
+(W, Wh, 0.1 V, 0.01 A, dm3), so three days of the default fields at one telegram per second take 8.3 MB.
+Telegrams are appended in time order, a range is found by bisecting the time column, and a bucket's min, max
+and mean come from slices of the columns (C loops, no Python loop per value).
+
+API (times are seconds since epoch, or relative to now: "now", "-15m", "-6h", "-2d"):
+    GET /fields                         Stored fields, the time range that's in memory, memory used.
+    GET /query?fields=power_used,meter_t1_used&start=-1h[&end=now][&step=60 | &points=500]
+        Without step or points: every telegram, {"time": [...], "<field>": [...]}.
+        With step (seconds) or points (max nr of buckets): per bucket,
+        {"time": [bucket start, ...], "<field>": {"min": [...], "max": [...], "mean": [...]}}.
+    Values are in the units of p1_human (kW, kWh, V, A, m3), null if there was no value in the bucket.
+"""
+
+import json
+import math
+import socket
+import threading
+import time
+import traceback
+from array import array
+from bisect import bisect_left
+from typing import Optional
+from urllib.parse import urlsplit, parse_qs
+
+from .metrics import MetricsServer, NOT_FOUND
+
+# human name -> (array typecode, factor from human units)
+COLUMNS = {
+    "tariff": ("B", 1),
+    "meter_t1_used": ("I", 1000),
+    "meter_t2_used": ("I", 1000),
+    "meter_t1_injected": ("I", 1000),
+    "meter_t2_injected": ("I", 1000),
+    "power_used": ("I", 1000),
+    "power_injected": ("I", 1000),
+    "power_l1_pos": ("I", 1000),
+    "power_l2_pos": ("I", 1000),
+    "power_l3_pos": ("I", 1000),
+    "power_l1_neg": ("I", 1000),
+    "power_l2_neg": ("I", 1000),
+    "power_l3_neg": ("I", 1000),
+    "voltage_l1": ("H", 10),
+    "voltage_l2": ("H", 10),
+    "voltage_l3": ("H", 10),
+    "current_l1": ("H", 100),
+    "current_l2": ("H", 100),
+    "current_l3": ("H", 100),
+    # The first M-Bus meter with device type 3.
+    "gas": ("I", 1000),
+}
+# What grafana.json shows, and the gas meter.
+DEFAULT_FIELDS = "power_used,power_injected,meter_t1_used,meter_t2_used,meter_t1_injected,meter_t2_injected,gas"
+BAD_REQUEST = b"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+# The writer may be overwriting the oldest slots while a query runs, those are left out.
+MARGIN = 60
+MAX_BUCKETS = 100000
+UNITS = {"s": 1, "m": 60, "h": 3600, "d": 86400}
+
+
+def json_response(body: dict) -> bytes:
+    data = json.dumps(body, separators=(",", ":")).encode()
+    return b"HTTP/1.1 200 OK\r\n" \
+           b"Content-Type: application/json\r\n" \
+           b"Access-Control-Allow-Origin: *\r\n" \
+           b"Content-Length: %d\r\n" \
+           b"Connection: close\r\n\r\n" % len(data) + data
+
+
+def parse_time(value: str, now: float) -> float:
+    if value == "now":
+        return now
+    if value.startswith("-"):
+        return now - float(value[1:-1]) * UNITS[value[-1]] if value[-1] in UNITS else now - float(value[1:])
+    return float(value)
+
+
+class TimeColumn:
+    """
+    The time column in logical order (0 = oldest record still kept), for bisect.
+    """
+
+    def __init__(self, store: "RingStore", first: int, head: int) -> None:
+        self.store = store
+        self.first = first
+        self.head = head
+
+    def __len__(self) -> int:
+        return self.head - self.first
+
+    def __getitem__(self, i: int) -> int:
+        return self.store.time[(self.first + i) % self.store.slots]
+
+
+class RingStore:
+    """
+    Keeps hours of telegrams (one per second) in memory, and serves queries on address ("host:port" or "port")
+    from a daemon thread. add() is called by the reader thread only.
+    """
+
+    def __init__(self, address: str, hours: float = 24, fields: str = DEFAULT_FIELDS) -> None:
+        self.slots = int(hours * 3600)
+        self.fields = [x.strip() for x in fields.split(",") if x.strip()]
+        for name in self.fields:
+            if name not in COLUMNS:
+                raise ValueError(f"Can't store {name}, one of: {', '.join(COLUMNS)}")
+        self.time = array("I", [0]) * self.slots
+        self.columns = {}
+        self.missing = {}
+        for name in self.fields:
+            code, _ = COLUMNS[name]
+            missing = (1 << (8 * array(code).itemsize)) - 1
+            self.columns[name] = array(code, [missing]) * self.slots
+            self.missing[name] = missing
+        # Nr of records ever added, the next one goes into slot head % slots.
+        self.head = 0
+        self.out_of_order = 0
+        self.memory = self.slots * (self.time.itemsize + sum(c.itemsize for c in self.columns.values()))
+
+        host, _, port = address.rpartition(":")
+        self.socket = socket.create_server((host or "0.0.0.0", int(port)))
+        threading.Thread(target=self.serve, name="ringstore", daemon=True).start()
+
+    def add(self, timestamp, human_fields: dict, crc_ok: bool) -> None:
+        if not crc_ok or not timestamp:
+            return
+        t = int(timestamp.timestamp())
+        if self.head and t <= self.time[(self.head - 1) % self.slots]:
+            # Bisecting needs increasing times: the meter's clock was set back, or a duplicate.
+            self.out_of_order += 1
+            return
+        i = self.head % self.slots
+        for name, column in self.columns.items():
+            if name == "gas":
+                value = None
+                for channel in range(1, 5):
+                    if human_fields.get(f"mbus{channel}_device_type") == 3:
+                        value = human_fields.get(f"mbus{channel}_value")
+                        break
+            else:
+                value = human_fields.get(name)
+            if value is None:
+                column[i] = self.missing[name]
+            else:
+                column[i] = min(int(round(value * COLUMNS[name][1])), self.missing[name] - 1)
+        self.time[i] = t
+        # Last: a query never looks at a slot that's only half written.
+        self.head += 1
+
+    def window(self) -> TimeColumn:
+        head = self.head
+        first = head - self.slots + min(MARGIN, self.slots // 10) if head >= self.slots else 0
+        return TimeColumn(self, first, head)
+
+    def slice(self, column: array, i: int, j: int) -> array:
+        """
+        Physical slots of logical records i to j (absolute, not relative to the window).
+        """
+        a, b = i % self.slots, j % self.slots
+        if j - i <= 0:
+            return column[0:0]
+        if a < b or b == 0:
+            return column[a:b or self.slots]
+        return column[a:] + column[:b]
+
+    def query(self, fields: list, start: float, end: float, step: Optional[float]) -> dict:
+        times = self.window()
+        i = times.first + bisect_left(times, math.ceil(start))
+        j = times.first + bisect_left(times, math.floor(end) + 1)
+        if step is None:
+            result = {"time": self.slice(self.time, i, j).tolist()}
+            for name in fields:
+                missing = self.missing[name]
+                factor = COLUMNS[name][1]
+                result[name] = [None if v == missing else v / factor for v in self.slice(self.columns[name], i, j)]
+            return result
+
+        # Bucket boundaries, aligned to step like GROUP BY time().
+        bucket = math.floor(start / step) * step
+        starts, bounds = [], [i]
+        while bucket < end:
+            starts.append(int(bucket))
+            bucket += step
+            bounds.append(min(j, times.first + bisect_left(times, math.ceil(bucket))))
+        result = {"time": starts}
+        for name in fields:
+            column = self.columns[name]
+            missing = self.missing[name]
+            factor = COLUMNS[name][1]
+            mins, maxs, means = [], [], []
+            for a, b in zip(bounds, bounds[1:]):
+                values = self.slice(column, a, b)
+                if missing in values:
+                    values = [v for v in values if v != missing]
+                if not values:
+                    mins.append(None)
+                    maxs.append(None)
+                    means.append(None)
+                    continue
+                mins.append(min(values) / factor)
+                maxs.append(max(values) / factor)
+                means.append(sum(values) / len(values) / factor)
+            result[name] = {"min": mins, "max": maxs, "mean": means}
+        return result
+
+    def info(self) -> dict:
+        times = self.window()
+        return {
+            "fields": self.fields,
+            "slots": self.slots,
+            "records": len(times),
+            "first": times[0] if len(times) else None,
+            "last": times[len(times) - 1] if len(times) else None,
+            "out_of_order": self.out_of_order,
+            "memory_bytes": self.memory,
+        }
+
+    def handle(self, target: bytes) -> bytes:
+        url = urlsplit(target.decode("ascii", "replace"))
+        if url.path == "/fields":
+            return json_response(self.info())
+        if url.path != "/query":
+            return NOT_FOUND
+        params = {k: v[-1] for k, v in parse_qs(url.query).items()}
+        fields = [x for x in params.get("fields", ",".join(self.fields)).split(",") if x]
+        if any(name not in self.columns for name in fields):
+            return BAD_REQUEST
+        try:
+            now = time.time()
+            start = parse_time(params.get("start", "-1h"), now)
+            end = parse_time(params.get("end", "now"), now)
+            step = float(params["step"]) if "step" in params else None
+            if "points" in params:
+                step = max(1.0, math.ceil((end - start) / max(1, int(params["points"]))))
+        except (ValueError, KeyError):
+            return BAD_REQUEST
+        if end < start or (step is not None and (step <= 0 or (end - start) / step > MAX_BUCKETS)):
+            return BAD_REQUEST
+        return json_response(self.query(fields, start, end, step))
+
+    def serve(self) -> None:
+        while True:
+            try:
+                connection, _ = self.socket.accept()
+            except OSError:
+                return
+            try:
+                with connection:
+                    connection.settimeout(2)
+                    request = MetricsServer.read_request(connection)
+                    if request is None:
+                        continue
+                    parts = request.split(b" ", 2)
+                    connection.sendall(self.handle(parts[1]) if len(parts) == 3 and parts[0] == b"GET" else BAD_REQUEST)
+            except OSError:
+                pass
+            except Exception:
+                traceback.print_exc()
+
+    def close(self) -> None:
+        self.socket.close()
@@ -0,0 +1,114 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Incremental downsampling of telegrams into fixed time windows.
+Every window is O(1) per telegram: only running sums, extremes and the last value are kept.
+"""
+
+import datetime
+from typing import Optional
+
+# Human field name prefixes that are averaged (min/max/mean/last).
+GAUGE_PREFIXES = ("power_", "voltage_", "current_")
+# Human field name prefixes that are cumulative registers (delta per window).
+REGISTER_PREFIXES = ("meter_",)
+
+
+def parse_period(x: str) -> int:
+    """
+    "60", "60s", "15m", "1h" -> seconds.
+    """
+    x = x.strip()
+    units = {"s": 1, "m": 60, "h": 3600, "d": 86400}
+    if x[-1] in units:
+        return int(x[:-1]) * units[x[-1]]
+    return int(x)
+
+
+def period_name(period: int) -> str:
+    for unit, size in (("d", 86400), ("h", 3600), ("m", 60)):
+        if period % size == 0:
+            return f"{period // size}{unit}"
+    return f"{period}s"
+
+
+class Gauge:
+    __slots__ = ("count", "sum", "min", "max", "last")
+
+    def __init__(self, value: float) -> None:
+        self.count = 1
+        self.sum = value
+        self.min = value
+        self.max = value
+        self.last = value
+
+    def add(self, value: float) -> None:
+        self.count += 1
+        self.sum += value
+        if value < self.min:
+            self.min = value
+        if value > self.max:
+            self.max = value
+        self.last = value
+
+
+class Rollup:
+    """
+    Aggregates the human fields of telegrams into windows of period seconds, aligned to the epoch.
+    add returns the finished point when a telegram falls in a new window.
+    """
+
+    def __init__(self, period: int, measurement_prefix: str = "p1_") -> None:
+        self.period = period
+        self.measurement = measurement_prefix + period_name(period)
+        self.start = None
+        self.header = None
+        self.gauges = {}
+        # Register value at the end of the previous window, or first value ever seen.
+        self.base = {}
+        self.last = {}
+
+    def add(self, time: datetime.datetime, header: str, human_fields: dict) -> Optional[dict]:
+        ts = int(time.timestamp())
+        start = ts - ts % self.period
+        point = None
+        if self.start is not None and start != self.start:
+            point = self.close()
+        self.start = start
+        self.header = header
+
+        for key, value in human_fields.items():
+            if key.startswith(GAUGE_PREFIXES):
+                gauge = self.gauges.get(key)
+                if gauge is None:
+                    self.gauges[key] = Gauge(value)
+                else:
+                    gauge.add(value)
+            elif key.startswith(REGISTER_PREFIXES):
+                self.base.setdefault(key, value)
+                self.last[key] = value
+        return point
+
+    def close(self) -> Optional[dict]:
+        fields = {}
+        for key, gauge in self.gauges.items():
+            fields[key + "_min"] = gauge.min
+            fields[key + "_max"] = gauge.max
+            fields[key + "_mean"] = gauge.sum / gauge.count
+            fields[key + "_last"] = gauge.last
+        for key, value in self.last.items():
+            fields[key + "_delta"] = value - self.base[key]
+            self.base[key] = value
+        self.gauges = {}
+        self.last = {}
+        if not fields:
+            return None
+        return {
+            "measurement": self.measurement,
+            "time": datetime.datetime.fromtimestamp(self.start, datetime.timezone.utc),
+            "fields": fields,
+            "tags": {
+                "header": self.header,
+            },
+        }
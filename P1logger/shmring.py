@@ -0,0 +1,289 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Ring of the most recent telegrams in POSIX shared memory, so local processes can follow the meter without polling
+InfluxDB. Same layout as Firmware/shmring.h (see there for the protocol), so C and Python can be on either side.
+
+Following the ring from Python:
+    from P1logger.shmring import ShmRingReader
+    for record in ShmRingReader().follow():
+        print(record["seq"], record["timestamp"], record["sum_power_delivered"])
+"""
+
+import ctypes
+import mmap
+import os
+import platform
+import struct
+import time
+from typing import Iterator, List, Optional
+
+MAGIC = b"P1R1"
+VERSION = 1
+DEFAULT_NAME = "/p1ring"
+DEFAULT_SLOTS = 256
+MISSING = 0xFFFFFFFF
+
+# magic, version, slots, slotSize, head, futex, waiters, generation
+HEADER = struct.Struct("<4sIIIQIII28x")
+HEAD_OFFSET = 16
+FUTEX_OFFSET = 24
+GENERATION_OFFSET = 32
+# seq, published, crcOk, meterIdLen, meterId, values
+SLOT = struct.Struct("<QQBBxx32s21I8x")
+SEQ = struct.Struct("<Q")
+
+# The values of a slot (Field in packet.h + gas volume), with the human_fields name and the factor to get to
+# the integer units of Packet.
+VALUES = [
+    ("timestamp", None, 1),
+    ("tariff", "tariff", 1),
+    ("meter_delivered_t1", "meter_t1_used", 1000),
+    ("meter_delivered_t2", "meter_t2_used", 1000),
+    ("meter_injected_t1", "meter_t1_injected", 1000),
+    ("meter_injected_t2", "meter_t2_injected", 1000),
+    ("sum_power_delivered", "power_used", 1000),
+    ("sum_power_injected", "power_injected", 1000),
+    ("power_p1_delivered", "power_l1_pos", 1000),
+    ("power_p2_delivered", "power_l2_pos", 1000),
+    ("power_p3_delivered", "power_l3_pos", 1000),
+    ("power_p1_injected", "power_l1_neg", 1000),
+    ("power_p2_injected", "power_l2_neg", 1000),
+    ("power_p3_injected", "power_l3_neg", 1000),
+    ("voltage_p1", "voltage_l1", 10),
+    ("voltage_p2", "voltage_l2", 10),
+    ("voltage_p3", "voltage_l3", 10),
+    ("current_p1", "current_l1", 100),
+    ("current_p2", "current_l2", 100),
+    ("current_p3", "current_l3", 100),
+    ("gas_volume", None, 1000),
+]
+assert HEADER.size == 64 and SLOT.size == 144 and len(VALUES) == 21
+
+# Only used to wake C readers that wait on the futex, Python readers poll.
+FUTEX_SYSCALL = {"x86_64": 202, "aarch64": 98, "armv7l": 240, "armv6l": 240}.get(platform.machine())
+FUTEX_WAKE = 1
+# Generation of a ring that was replaced by a new one with the same name.
+REPLACED = 0xFFFFFFFF
+GENERATION = struct.Struct("<I")
+LIBC = ctypes.CDLL(None, use_errno=True)
+
+
+def shm_path(name: str) -> str:
+    return "/dev/shm/" + name.lstrip("/")
+
+
+class Fence:
+    """
+    Full memory barrier, Python has none. Unlocking and locking a private (so never contended) spinlock is a release
+    followed by an acquire, which keeps loads and stores on either side in order on ARM as well.
+    """
+
+    def __init__(self) -> None:
+        # pthread_spinlock_t is an int on Linux.
+        self.lock = ctypes.c_int()
+        self.ref = ctypes.byref(self.lock)
+        LIBC.pthread_spin_init(self.ref, 0)
+        LIBC.pthread_spin_lock(self.ref)
+
+    def __call__(self) -> None:
+        LIBC.pthread_spin_unlock(self.ref)
+        LIBC.pthread_spin_lock(self.ref)
+
+
+class ShmRingWriter:
+    """
+    Creates (or takes over) the ring. Only one writer per ring.
+    A ring with the same nr of slots is reused, otherwise it's replaced by a new one (see shmRingCreate).
+    """
+
+    def __init__(self, name: str = DEFAULT_NAME, slots: int = DEFAULT_SLOTS) -> None:
+        self.slots = slots
+        self.fence = Fence()
+        size = HEADER.size + slots * SLOT.size
+        path = shm_path(name)
+        prev = None
+        fd = os.open(path, os.O_RDWR | os.O_CREAT, 0o644)
+        try:
+            old_size = os.fstat(fd).st_size
+            old = os.pread(fd, HEADER.size, 0)
+            header = HEADER.unpack(old) if len(old) == HEADER.size and old[:4] == MAGIC else None
+            if header and header[1:4] == (VERSION, slots, SLOT.size) and old_size == size:
+                # Same layout: take it over in place, never resize what readers have mapped (SIGBUS).
+                self.mm = mmap.mmap(fd, size)
+                generation = header[7] + 1
+            else:
+                if old_size:
+                    # Another layout: readers keep the old one mapped until they see REPLACED, the new one gets
+                    # the name.
+                    prev = mmap.mmap(fd, old_size) if header else None
+                    os.unlink(path)
+                    new = os.open(path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o644)
+                    os.close(fd)
+                    fd = new
+                os.ftruncate(fd, size)
+                self.mm = mmap.mmap(fd, size)
+                generation = None
+        finally:
+            os.close(fd)
+
+        self.head = 0
+        self.head_value = ctypes.c_uint64.from_buffer(self.mm, HEAD_OFFSET)
+        self.seqs = [ctypes.c_uint64.from_buffer(self.mm, HEADER.size + i * SLOT.size) for i in range(slots)]
+        self.futex = ctypes.c_uint32.from_buffer(self.mm, FUTEX_OFFSET)
+        if generation is not None:
+            self.head_value.value = 0
+            for seq in self.seqs:
+                seq.value = 0
+            self.set_generation(self.mm, 1 if generation >= REPLACED else generation)
+        else:
+            HEADER.pack_into(self.mm, 0, b"\0\0\0\0", VERSION, slots, SLOT.size, 0, 0, 0, 1)
+            self.fence()
+            # Magic last, readers check it.
+            self.mm[0:4] = MAGIC
+            if prev is not None:
+                # Only once the new one is ready, readers that see this open it right away.
+                self.set_generation(prev, REPLACED)
+                prev.close()
+
+    def set_generation(self, mm: mmap.mmap, generation: int) -> None:
+        """
+        Publish a new generation and wake the readers that wait for records, so they notice right away.
+        """
+        self.fence()
+        GENERATION.pack_into(mm, GENERATION_OFFSET, generation)
+        self.fence()
+        futex = ctypes.c_uint32.from_buffer(mm, FUTEX_OFFSET)
+        self.wake(futex, mm)
+        del futex
+
+    def wake(self, futex: ctypes.c_uint32, mm: mmap.mmap) -> None:
+        futex.value += 1
+        self.fence()
+        if FUTEX_SYSCALL and GENERATION.unpack_from(mm, FUTEX_OFFSET + 4)[0]:
+            LIBC.syscall(FUTEX_SYSCALL, ctypes.byref(futex), FUTEX_WAKE, 0x7FFFFFFF, None, None, 0)
+
+    def publish(self, timestamp, human_fields: dict, crc_ok: bool) -> None:
+        values = [int(timestamp.timestamp()) if timestamp else MISSING]
+        for _, name, factor in VALUES[1:-1]:
+            value = human_fields.get(name)
+            values.append(MISSING if value is None else int(round(value * factor)))
+        gas = MISSING
+        for channel in range(1, 5):
+            if human_fields.get(f"mbus{channel}_device_type") == 3 and f"mbus{channel}_value" in human_fields:
+                gas = int(round(human_fields[f"mbus{channel}_value"] * 1000))
+                break
+        values.append(gas)
+        meter_id = str(human_fields.get("id", "")).encode("ascii", "replace")[:32]
+
+        n = self.head + 1
+        offset = HEADER.size + (n % self.slots) * SLOT.size
+        # seq and head through ctypes, so they're single stores that readers can't see half done.
+        seq = self.seqs[n % self.slots]
+        seq.value = 0
+        self.fence()
+        SLOT.pack_into(self.mm, offset, 0, time.time_ns(), crc_ok, len(meter_id), meter_id,
+                       *(v & MISSING for v in values))
+        self.fence()
+        seq.value = n
+        self.fence()
+        self.head_value.value = n
+        self.head = n
+        self.wake(self.futex, self.mm)
+
+    def close(self) -> None:
+        del self.futex, self.head_value, self.seqs
+        self.mm.close()
+
+
+class ShmRingReader:
+    """
+    Follows the ring. Records are dicts with seq, published (ns since epoch), crc_ok, meter_id and the VALUES
+    (integer units, see shmring.h), or None if missing.
+    """
+
+    def __init__(self, name: str = DEFAULT_NAME, all: bool = False) -> None:
+        self.name = name
+        self.fence = Fence()
+        self.lost = 0
+        self.open(all)
+
+    def open(self, all: bool) -> None:
+        fd = os.open(shm_path(self.name), os.O_RDONLY)
+        try:
+            self.mm = mmap.mmap(fd, 0, prot=mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        magic, version, self.slots, slot_size, head, _, _, self.generation = HEADER.unpack_from(self.mm, 0)
+        if magic != MAGIC or version != VERSION or slot_size != SLOT.size:
+            self.mm.close()
+            raise ValueError(f"{self.name} is not a P1 ring (or another version).")
+        self.next = max(1, head - self.slots + 1) if all else head + 1
+
+    def read(self) -> List[dict]:
+        """
+        All new records since the last read. After the writer restarted, reading continues with its first record,
+        if it replaced the ring the new one is opened.
+        """
+        records = []
+        while True:
+            generation = GENERATION.unpack_from(self.mm, GENERATION_OFFSET)[0]
+            if generation == REPLACED:
+                self.mm.close()
+                self.open(True)
+                continue
+            # Before head: a new generation's head is only published after the generation.
+            self.fence()
+            head = SEQ.unpack_from(self.mm, HEAD_OFFSET)[0]
+            if generation != self.generation or head + 1 < self.next:
+                # The writer restarted, its records start at 1 again.
+                self.generation = generation
+                self.next = 1
+                continue
+            if self.next > head:
+                return records
+            if head - self.next >= self.slots:
+                self.lost += head - self.slots + 1 - self.next
+                self.next = head - self.slots + 1
+            offset = HEADER.size + (self.next % self.slots) * SLOT.size
+            self.fence()
+            s1 = SEQ.unpack_from(self.mm, offset)[0]
+            self.fence()
+            data = self.mm[offset:offset + SLOT.size]
+            self.fence()
+            s2 = SEQ.unpack_from(self.mm, offset)[0]
+            # A new writer could have published this seq before we saw its generation.
+            if s1 != self.next or s2 != self.next \
+                    or GENERATION.unpack_from(self.mm, GENERATION_OFFSET)[0] != generation:
+                # Being written (or overwritten, then head moved on), try again next time.
+                return records
+            seq, published, crc_ok, id_len, meter_id, *values = SLOT.unpack(data)
+            record = {
+                "seq": seq,
+                "published": published,
+                "crc_ok": bool(crc_ok),
+                "meter_id": meter_id[:id_len].decode("ascii", "replace"),
+            }
+            for (name, _, _), value in zip(VALUES, values):
+                record[name] = None if value == MISSING else value
+            records.append(record)
+            self.next += 1
+
+    def follow(self, interval: float = 0.01, timeout: Optional[float] = None) -> Iterator[dict]:
+        """
+        Yields records as they come in, checking every interval seconds. Stops after timeout seconds without records.
+        """
+        last = time.monotonic()
+        while True:
+            records = self.read()
+            if records:
+                last = time.monotonic()
+                yield from records
+            elif timeout is not None and time.monotonic() - last > timeout:
+                return
+            else:
+                time.sleep(interval)
+
+    def close(self) -> None:
+        self.mm.close()
@@ -0,0 +1,108 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+
+Latency of every telegram through P1logger, and error counters.
+Adding a sample is a bisect and an increment, the percentiles are only worked out when the stats are published.
+"""
+
+import bisect
+import datetime
+import time
+from typing import List, Optional
+
+# Bucket upper bounds in ms: 4 per doubling from 0.01 ms to ~170 s, so percentiles are within 19%.
+BUCKETS = [0.01 * 2 ** (i / 4) for i in range(97)]
+
+
+class Histogram:
+    def __init__(self) -> None:
+        self.counts = [0] * (len(BUCKETS) + 1)
+        self.count = 0
+        self.max = 0.0
+
+    def add(self, ms: float) -> None:
+        self.counts[bisect.bisect_left(BUCKETS, ms)] += 1
+        self.count += 1
+        if ms > self.max:
+            self.max = ms
+
+    def percentile(self, q: float) -> float:
+        """
+        Upper bound of the bucket the q-th sample is in, at most max.
+        """
+        rank = q * self.count
+        seen = 0
+        for i, n in enumerate(self.counts):
+            seen += n
+            if seen >= rank and n:
+                return min(BUCKETS[i], self.max) if i < len(BUCKETS) else self.max
+        return self.max
+
+
+class LatencyStats:
+    """
+    Every telegram gets timestamped (time.monotonic) when its header arrives, when it's parsed and the CRC is checked,
+    when its points are ready to be written (enqueued) and when the write was acknowledged.
+
+    Published in measurement "p1_stats" every interval seconds, for that interval, all times in ms:
+      <stage>_p50, <stage>_p99, <stage>_max   for the stages
+        parse      header -> parsed (includes receiving the rest of the telegram)
+        enqueue    parsed -> points ready
+        write      points ready -> write acknowledged
+        total      header -> write acknowledged
+        staleness  meter timestamp -> write acknowledged (1 s resolution, includes the meter's clock error)
+      telegrams, crc_failures, unknown_obis, resyncs, write_errors
+    """
+
+    STAGES = ("parse", "enqueue", "write", "total", "staleness")
+    COUNTERS = ("telegrams", "crc_failures", "unknown_obis", "resyncs", "write_errors")
+
+    def __init__(self, interval: float = 60, measurement: str = "p1_stats") -> None:
+        self.interval = interval
+        self.measurement = measurement
+        self.last_publish = time.monotonic()
+        self.reset()
+
+    def reset(self) -> None:
+        self.histograms = {stage: Histogram() for stage in self.STAGES}
+        self.counters = dict.fromkeys(self.COUNTERS, 0)
+
+    def count(self, counter: str, n: int = 1) -> None:
+        self.counters[counter] += n
+
+    def telegram(self, received: float, parsed: float, enqueued: float, acknowledged: float,
+                 meter_time: Optional[datetime.datetime]) -> None:
+        h = self.histograms
+        h["parse"].add((parsed - received) * 1000)
+        h["enqueue"].add((enqueued - parsed) * 1000)
+        h["write"].add((acknowledged - enqueued) * 1000)
+        h["total"].add((acknowledged - received) * 1000)
+        if meter_time:
+            # Wall clock, the meter's time is all we have.
+            h["staleness"].add(max(0.0, time.time() - meter_time.timestamp()) * 1000)
+        self.counters["telegrams"] += 1
+
+    def publish(self, header: str, now: Optional[float] = None) -> List[dict]:
+        """
+        The stats point, if interval seconds passed since the last one. Starts a new interval.
+        """
+        now = time.monotonic() if now is None else now
+        if now - self.last_publish < self.interval:
+            return []
+        self.last_publish = now
+        fields = dict(self.counters)
+        for stage, histogram in self.histograms.items():
+            if histogram.count:
+                fields[stage + "_p50"] = histogram.percentile(0.5)
+                fields[stage + "_p99"] = histogram.percentile(0.99)
+                fields[stage + "_max"] = histogram.max
+        self.reset()
+        return [{
+            "measurement": self.measurement,
+            "time": datetime.datetime.now(datetime.timezone.utc),
+            "fields": fields,
+            "tags": {
+                "header": header,
+            },
+        }]
@@ -0,0 +1,67 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+"""
+
+import datetime
+import unittest
+
+from P1logger.capacity import CapacityTracker, QUARTER
+
+START = datetime.datetime(2021, 3, 1, 12, 0, tzinfo=datetime.timezone.utc)
+
+
+def feed(tracker: CapacityTracker, seconds, kw: float = 1.0) -> list:
+    """
+    A steady kw load, one telegram per second in seconds (since START).
+    """
+    points = []
+    for s in seconds:
+        energy = kw * s / 3600
+        fields = {"meter_t1_used": 1000.0 + energy, "meter_t2_used": 0.0, "power_used": kw}
+        points.extend(tracker.add(START + datetime.timedelta(seconds=s), "XMX5LGBBFG", fields))
+    return points
+
+
+def quarters(points: list) -> dict:
+    return {p["time"]: p["fields"]["quarter_demand"] for p in points if "quarter_demand" in p["fields"]}
+
+
+class CapacityTest(unittest.TestCase):
+    def test_steady_load(self):
+        tracker = CapacityTracker()
+        demand = quarters(feed(tracker, range(0, 3 * QUARTER + 1)))
+        self.assertEqual(len(demand), 3)
+        for value in demand.values():
+            self.assertAlmostEqual(value, 1.0, places=6)
+        self.assertAlmostEqual(tracker.month_peak, 1.0, places=6)
+
+    def test_gap_is_spread(self):
+        # 50 minutes without telegrams, in the second quarter.
+        tracker = CapacityTracker()
+        seconds = list(range(0, 20 * 60)) + list(range(70 * 60, 6 * QUARTER + 1))
+        demand = quarters(feed(tracker, seconds))
+        self.assertEqual(len(demand), 6)
+        for value in demand.values():
+            self.assertAlmostEqual(value, 1.0, places=6)
+        self.assertAlmostEqual(tracker.month_peak, 1.0, places=6)
+
+    def test_gap_starts_new_quarter_at_boundary(self):
+        tracker = CapacityTracker()
+        feed(tracker, list(range(0, 10 * 60)) + [50 * 60])
+        self.assertEqual(tracker.quarter_start, int(START.timestamp()) + 3 * QUARTER)
+        self.assertAlmostEqual(tracker.quarter_energy, 1000.0 + 45 / 60, places=6)
+
+    def test_month_peak_resets_with_first_telegram(self):
+        # Local midnight, the month boundary is in the timezone of the meter.
+        boundary = int((datetime.datetime(2021, 3, 1).astimezone() - START).total_seconds())
+        tracker = CapacityTracker()
+        points = feed(tracker, range(boundary - 2 * QUARTER, boundary + 1))
+        self.assertAlmostEqual(tracker.month_peak, 0.0, places=6)
+        self.assertAlmostEqual(points[-1]["fields"]["month_peak"], 0.0, places=6)
+        # The last quarter of February did count for February.
+        self.assertEqual(len(quarters(points)), 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,40 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+"""
+
+import unittest
+from unittest import mock
+
+from P1logger import P1logger
+from P1logger.bench import MockSerial
+from P1logger.tests.test_importer import telegram
+
+
+class ChangesOnlyTest(unittest.TestCase):
+    def setUp(self) -> None:
+        patcher = mock.patch("influxdb.client.InfluxDBClient.from_dsn")
+        self.influx = patcher.start().return_value
+        self.addCleanup(patcher.stop)
+        self.logger = P1logger(None, "influxdb://localhost/p1", measurements="p1_human", changes_only=True, stats=0)
+
+    def feed(self, *telegrams: bytes) -> None:
+        self.logger.serial = MockSerial([t.splitlines(keepends=True) for t in telegrams])
+
+    def test_failed_write_is_written_again(self):
+        self.feed(telegram(0, kw=1), telegram(1, kw=2), telegram(2, kw=2))
+        self.logger.read_packet()
+        # The telegram where the power changed doesn't make it to the database.
+        self.influx.write_points.side_effect = OSError("down")
+        with self.assertRaises(OSError):
+            self.logger.read_packet()
+        self.influx.write_points.side_effect = None
+        self.influx.write_points.reset_mock()
+        # Its line is unchanged in the next one, but it still has to be written.
+        self.logger.read_packet()
+        fields = self.influx.write_points.call_args.args[0][0]["fields"]
+        self.assertEqual(fields["power_used"], 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
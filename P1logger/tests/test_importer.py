@@ -0,0 +1,123 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+"""
+
+import datetime
+import json
+import os
+import tempfile
+import unittest
+from unittest import mock
+
+import crcmod.predefined
+
+from P1logger.importer import Importer
+
+START = datetime.datetime(2021, 3, 1, 12, 0)
+CRC16 = crcmod.predefined.mkPredefinedCrcFun("crc-16")
+
+
+def telegram(seconds: int, kw: float = 1.0) -> bytes:
+    """
+    A telegram at START + seconds, of a steady kw load since START.
+    """
+    time = START + datetime.timedelta(seconds=seconds)
+    lines = [
+        "/FLU5\\253770234_A",
+        "",
+        f"0-0:1.0.0({time:%y%m%d%H%M%S}W)",
+        f"1-0:1.8.1({1000 + kw * seconds / 3600:010.3f}*kWh)",
+        "1-0:1.8.2(000000.000*kWh)",
+        f"1-0:1.7.0({kw:06.3f}*kW)",
+        "1-0:2.7.0(00.000*kW)",
+    ]
+    data = "".join(line + "\r\n" for line in lines).encode("ascii")
+    return data + f"!{CRC16(data + b'!'):04X}\r\n".encode("ascii")
+
+
+class ImporterTest(unittest.TestCase):
+    def setUp(self) -> None:
+        self.dir = tempfile.TemporaryDirectory()
+        patcher = mock.patch("influxdb.client.InfluxDBClient.from_dsn")
+        self.influx = patcher.start().return_value
+        self.influx.query.return_value.get_points.return_value = []
+        self.addCleanup(patcher.stop)
+        self.addCleanup(self.dir.cleanup)
+
+    def capture(self, name: str, data: bytes) -> str:
+        path = os.path.join(self.dir.name, name)
+        with open(path, "wb") as f:
+            f.write(data)
+        return path
+
+    def written(self) -> list:
+        return [p for call in self.influx.write_points.call_args_list for p in call.args[0]]
+
+    def test_starts_mid_telegram(self):
+        first = telegram(0)
+        data = first[first.index(b"1-0:1.8.2"):] + b"".join(telegram(s) for s in range(1, 21))
+        importer = Importer([self.capture("mid.txt", data)], checkpoint="", influx="influxdb://localhost/p1",
+                            stats=60)
+        importer.run()
+        self.assertEqual(importer.import_stats["telegrams"], 20)
+        self.assertEqual(importer.import_stats["errors"], 0)
+        self.assertEqual(importer.import_stats["crc_errors"], 0)
+        self.assertEqual(importer.stats.counters["resyncs"], 1)
+        self.assertEqual(len([p for p in self.written() if p["measurement"] == "p1_human"]), 20)
+
+    def importer(self, *paths: str, **kwargs) -> Importer:
+        kwargs.setdefault("checkpoint", "")
+        return Importer(list(paths), influx="influxdb://localhost/p1", rollups="15m", capacity=True, **kwargs)
+
+    def quarters(self) -> dict:
+        """
+        (measurement, window start) -> energy of that quarter in kWh, from p1_15m and p1_capacity.
+        """
+        out = {}
+        for p in self.written():
+            if p["measurement"] == "p1_15m":
+                out[("p1_15m", p["time"])] = p["fields"]["meter_t1_used_delta"]
+            elif p["measurement"] == "p1_capacity" and "quarter_demand" in p["fields"]:
+                out[("p1_capacity", p["time"])] = p["fields"]["quarter_demand"] / 4
+        return out
+
+    def assertQuarters(self, quarters: dict, count: int) -> None:
+        self.assertEqual(len(quarters), count)
+        for value in quarters.values():
+            self.assertAlmostEqual(value, 0.25, places=3)
+
+    def test_existing_telegrams_still_roll_up(self):
+        # The first 20 minutes are in the database already.
+        self.influx.query.return_value.get_points.return_value = [
+            {"time": int((START + datetime.timedelta(seconds=s)).timestamp())} for s in range(0, 20 * 60)]
+        data = b"".join(telegram(s) for s in range(0, 45 * 60 + 1))
+        importer = self.importer(self.capture("existing.txt", data), batch=100000)
+        importer.run()
+        self.assertEqual(importer.import_stats["existing"], 20 * 60)
+        self.assertEqual(len([p for p in self.written() if p["measurement"] == "p1_human"]), 25 * 60 + 1)
+        self.assertQuarters(self.quarters(), 2 * 3)
+
+    def test_files_dont_share_rollups(self):
+        # Two recordings with 40 minutes between them: the quarter that was open at the end of the first one is
+        # incomplete, it must not be closed by the second.
+        a = self.capture("a.txt", b"".join(telegram(s) for s in range(0, 20 * 60 + 1)))
+        b = self.capture("b.txt", b"".join(telegram(s) for s in range(60 * 60, 90 * 60 + 1)))
+        self.importer(a, b).run()
+        self.assertQuarters(self.quarters(), 2 * 3)
+
+    def test_resume_rebuilds_open_windows(self):
+        path = self.capture("resume.txt", b"".join(telegram(s) for s in range(0, 30 * 60 + 1)))
+        checkpoint = os.path.join(self.dir.name, "checkpoint.json")
+        # Stopped after 10 minutes, in the middle of the first quarter.
+        offset = len(b"".join(telegram(s) for s in range(0, 10 * 60)))
+        with open(checkpoint, "w") as f:
+            json.dump({os.path.abspath(path): {"offset": offset, "done": False}}, f)
+        importer = self.importer(path, checkpoint=checkpoint)
+        importer.run()
+        self.assertEqual(importer.import_stats["telegrams"], 20 * 60 + 1)
+        self.assertQuarters(self.quarters(), 2 * 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
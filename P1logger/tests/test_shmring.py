@@ -0,0 +1,57 @@
+"""
+Copyright (c) 2020 Dries007
+This code is licensed under MIT license (see LICENSE.txt for details)
+"""
+
+import datetime
+import os
+import unittest
+
+from P1logger.shmring import ShmRingReader, ShmRingWriter
+
+START = datetime.datetime(2021, 3, 1, 12, 0)
+
+
+class ShmRingTest(unittest.TestCase):
+    def setUp(self) -> None:
+        self.name = f"/p1ring-test-{os.getpid()}"
+        self.addCleanup(lambda: os.path.exists("/dev/shm" + self.name) and os.unlink("/dev/shm" + self.name))
+
+    def publish(self, writer: ShmRingWriter, count: int) -> None:
+        for i in range(count):
+            writer.publish(START + datetime.timedelta(seconds=i), {"power_used": i / 1000}, True)
+
+    def test_writer_restart(self):
+        writer = ShmRingWriter(self.name, slots=8)
+        self.publish(writer, 5)
+        reader = ShmRingReader(self.name, all=True)
+        self.assertEqual([r["seq"] for r in reader.read()], [1, 2, 3, 4, 5])
+        writer.close()
+
+        # Fewer records than the reader has seen: they must not be skipped.
+        writer = ShmRingWriter(self.name, slots=8)
+        self.publish(writer, 3)
+        self.assertEqual([r["sum_power_delivered"] for r in reader.read()], [0, 1, 2])
+        self.assertEqual(reader.lost, 0)
+        reader.close()
+        writer.close()
+
+    def test_other_slots_replace_the_ring(self):
+        writer = ShmRingWriter(self.name, slots=8)
+        self.publish(writer, 5)
+        reader = ShmRingReader(self.name)
+        old = reader.mm
+        writer.close()
+
+        # The reader's mapping must keep its size (no SIGBUS), it opens the new ring by itself.
+        writer = ShmRingWriter(self.name, slots=16)
+        self.assertEqual(len(old), 64 + 8 * 144)
+        self.publish(writer, 3)
+        self.assertEqual([r["seq"] for r in reader.read()], [1, 2, 3])
+        self.assertEqual(reader.slots, 16)
+        reader.close()
+        writer.close()
+
+
+if __name__ == "__main__":
+    unittest.main()